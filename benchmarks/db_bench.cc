@@ -10,13 +10,15 @@
 #include <atomic>
 #include <cstdio>
 #include <cstdlib>
+#include <thread>
 
 #include "TimberSaw/cache.h"
-#include "db/table_cache.h"
+#include "memory_node/memory_node_keeper.h"
 #include "TimberSaw/comparator.h"
 #include "TimberSaw/db.h"
 #include "TimberSaw/env.h"
 #include "TimberSaw/filter_policy.h"
+#include "TimberSaw/statistics.h"
 #include "TimberSaw/write_batch.h"
 #include "port/port.h"
 #include "util/crc32c.h"
@@ -37,11 +39,14 @@
 //      readseq       -- read N times sequentially
 //      readreverse   -- read N times in reverse order
 //      readrandom    -- read N times in random order
+//      multireadrandom -- read N times in random order, 100 keys per MultiGet
 //      readmissing   -- read N missing keys in random order
 //      readhot       -- read N times in random order from 1% section of DB
 //      seekrandom    -- N random seeks
 //      seekordered   -- N ordered seeks
 //      open          -- cost of opening a DB
+//      walcost       -- fillrandom without and with the write-ahead log
+//      readrandomqd  -- readrandom at read queue depths 1, 2, 4, ..., 32
 //      crc32c        -- repeated crc32c of 4K of data
 //   Meta operations:
 //      compact     -- Compact the entire DB
@@ -86,6 +91,9 @@ static double FLAGS_compression_ratio = 0.5;
 // Print histogram of operation timings
 static bool FLAGS_histogram = false;
 
+// Collect DB statistics and print them after every benchmark
+static bool FLAGS_statistics = false;
+
 // Count the number of string comparisons performed
 static bool FLAGS_comparisons = false;
 
@@ -105,14 +113,33 @@ static int FLAGS_block_size = 0;
 // Negative means use default settings.
 static int FLAGS_cache_size = -1;
 
+// Number of bytes to use as a cache of point lookup results.
+// Negative means no row cache.
+static int FLAGS_row_cache_size = -1;
+
 // Maximum number of files to keep open at the same time (use default if == 0)
 static int FLAGS_open_files = 0;
 
+// Pin index and filter blocks of tables up to this level, see
+// Options::pin_metadata_max_level. Negative pins nothing.
+static int FLAGS_pin_metadata_max_level = -1;
+
+// Budget in bytes for pinned index and filter blocks.
+// Negative means use default settings.
+static int FLAGS_metadata_cache_size = -1;
+
 static int FLAGS_block_restart_interval = 16;
+// Target size of an index partition, 0 keeps the index in one block.
+static int FLAGS_index_partition_size = 0;
+// If true, build a hash index into every data block.
+static bool FLAGS_data_block_hash_index = false;
 // Bloom filter bits per key.
 // Negative means use default settings.
 static int FLAGS_bloom_bits = 10;
 
+// Filter format of new tables, see TimberSaw::FilterFormat.
+static int FLAGS_filter_format = TimberSaw::kLegacyBloomFilter;
+
 // Common key prefix length.
 static int FLAGS_key_prefix = 0;
 
@@ -125,6 +152,20 @@ static bool FLAGS_enable_numa = false;
 // If true, reuse existing log/MANIFEST files when re-opening a database.
 static bool FLAGS_reuse_logs = false;
 
+// If true, append every write to the write-ahead log.
+static bool FLAGS_wal = false;
+
+// Number of block reads each reader keeps outstanding. readrandom issues
+// that many keys per MultiGet and scans set ReadOptions::read_queue_depth.
+static int FLAGS_read_queue_depth = 1;
+
+// Readahead budget in bytes for scans, see ReadOptions::readahead_size.
+static int FLAGS_readahead_size = 0;
+
+// If true, run the memory node as a thread of this process and connect to it
+// through the in-process loopback RDMA device instead of a NIC.
+static bool FLAGS_loopback = false;
+
 // Use the db with the following name.
 static const char* FLAGS_db = nullptr;
 
@@ -313,6 +354,11 @@ class Stats {
 
   void AddBytes(int64_t n) { bytes_ += n; }
 
+  double OpsPerSecond() const {
+    double elapsed = (finish_ - start_) * 1e-6;
+    return elapsed > 0 ? done_ / elapsed : 0;
+  }
+
   void Report(const Slice& name) {
     // Pretend at least one op was done in case we are running a benchmark
     // that does not call FinishedSingleOp().
@@ -378,7 +424,9 @@ struct ThreadState {
 class Benchmark {
  private:
   Cache* cache_;
+  Cache* row_cache_;
   const FilterPolicy* filter_policy_;
+  Statistics* statistics_;
   DB* db_;
   int num_;
   int value_size_;
@@ -388,6 +436,10 @@ class Benchmark {
   int heap_counter_;
   CountComparator count_comparator_;
   int total_thread_count_;
+  bool enable_wal_;
+  int read_queue_depth_;
+  // Throughput of the last benchmark run by RunBenchmark.
+  double last_ops_per_sec_;
   std::vector<std::string> validation_keys;
 
   void PrintHeader() {
@@ -471,9 +523,13 @@ class Benchmark {
  public:
   Benchmark()
       : cache_(FLAGS_cache_size >= 0 ? NewLRUCache(FLAGS_cache_size) : nullptr),
+        row_cache_(FLAGS_row_cache_size >= 0
+                       ? NewLRUCache(FLAGS_row_cache_size)
+                       : nullptr),
         filter_policy_(FLAGS_bloom_bits >= 0
                            ? NewBloomFilterPolicy(FLAGS_bloom_bits)
                            : nullptr),
+        statistics_(FLAGS_statistics ? NewStatistics() : nullptr),
         db_(nullptr),
         num_(FLAGS_num),
         value_size_(FLAGS_value_size),
@@ -481,7 +537,10 @@ class Benchmark {
         reads_(FLAGS_reads < 0 ? FLAGS_num : FLAGS_reads),
         heap_counter_(0),
         count_comparator_(BytewiseComparator()),
-        total_thread_count_(0) {
+        total_thread_count_(0),
+        enable_wal_(FLAGS_wal),
+        read_queue_depth_(FLAGS_read_queue_depth),
+        last_ops_per_sec_(0) {
     std::vector<std::string> files;
     g_env->GetChildren(FLAGS_db, &files);
     for (size_t i = 0; i < files.size(); i++) {
@@ -497,7 +556,9 @@ class Benchmark {
   ~Benchmark() {
     delete db_;
     delete cache_;
+    delete row_cache_;
     delete filter_policy_;
+    delete statistics_;
   }
   Slice AllocateKey(std::unique_ptr<const char[]>* key_guard) {
     char* data = new char[FLAGS_key_size];
@@ -609,6 +670,9 @@ class Benchmark {
         method = &Benchmark::ReadReverse;
       } else if (name == Slice("readrandom")) {
         method = &Benchmark::ReadRandom;
+      } else if (name == Slice("multireadrandom")) {
+        entries_per_batch_ = 100;
+        method = &Benchmark::MultiReadRandom;
       } else if (name == Slice("readmissing")) {
         method = &Benchmark::ReadMissing;
       } else if (name == Slice("seekrandom")) {
@@ -635,6 +699,10 @@ class Benchmark {
         method = &Benchmark::SnappyCompress;
       } else if (name == Slice("snappyuncomp")) {
         method = &Benchmark::SnappyUncompress;
+      } else if (name == Slice("walcost")) {
+        WalCost(num_threads);
+      } else if (name == Slice("readrandomqd")) {
+        ReadRandomQueueDepth(num_threads);
       } else if (name == Slice("heapprofile")) {
         HeapProfile();
       } else if (name == Slice("stats")) {
@@ -663,12 +731,13 @@ class Benchmark {
       }
 
       if (method != nullptr) {
-        if (name == "readrandom"){
-          TableCache::CleanAll();
-        }
         DEBUG("The benchmark start.\n");
         RunBenchmark(num_threads, name, method);
         DEBUG("Benchmark finished\n");
+        if (statistics_ != nullptr) {
+          std::fprintf(stdout, "\n%s\n", statistics_->ToString().c_str());
+          statistics_->Reset();
+        }
 
       }
     }
@@ -769,6 +838,7 @@ class Benchmark {
       arg[0].thread->stats.Merge(arg[i].thread->stats);
     }
     arg[0].thread->stats.Report(name);
+    last_ops_per_sec_ = arg[0].thread->stats.OpsPerSecond();
     if (FLAGS_comparisons) {
       fprintf(stdout, "Comparisons: %zu\n", count_comparator_.comparisons());
       count_comparator_.reset();
@@ -783,6 +853,59 @@ class Benchmark {
       sleep(30); // wait for SSTable digestion
   }
 
+  // Run fillrandom on a fresh DB without the write-ahead log, with the log
+  // and with a synced log, then report the throughput lost to the log.
+  void WalCost(int num_threads) {
+    if (FLAGS_use_existing_db) {
+      std::fprintf(stdout, "%-12s : skipped (--use_existing_db is true)\n",
+                   "walcost");
+      return;
+    }
+    const bool saved_wal = enable_wal_;
+    const char* names[] = {"fillrandom_nowal", "fillrandom_wal",
+                           "fillrandom_walsync"};
+    double ops_per_sec[3];
+    for (int i = 0; i < 3; i++) {
+      enable_wal_ = (i > 0);
+      write_options_.sync = (i == 2);
+      delete db_;
+      db_ = nullptr;
+      DestroyDB(FLAGS_db, Options());
+      Open();
+      RunBenchmark(num_threads, names[i], &Benchmark::WriteRandom);
+      ops_per_sec[i] = last_ops_per_sec_;
+    }
+    enable_wal_ = saved_wal;
+    write_options_ = WriteOptions();
+    if (ops_per_sec[0] > 0) {
+      std::fprintf(stdout,
+                   "%-12s : wal costs %.1f%% throughput, synced wal costs "
+                   "%.1f%% throughput\n",
+                   "walcost", 100.0 * (1 - ops_per_sec[1] / ops_per_sec[0]),
+                   100.0 * (1 - ops_per_sec[2] / ops_per_sec[0]));
+    }
+  }
+
+  void ReadRandomQueueDepth(int num_threads) {
+    const int saved_depth = read_queue_depth_;
+    const int depths[] = {1, 2, 4, 8, 16, 32};
+    double ops_per_sec[6];
+    for (int i = 0; i < 6; i++) {
+      read_queue_depth_ = depths[i];
+      char name[32];
+      std::snprintf(name, sizeof(name), "readrandom_qd%d", depths[i]);
+      RunBenchmark(num_threads, name, &Benchmark::ReadRandom);
+      ops_per_sec[i] = last_ops_per_sec_;
+    }
+    read_queue_depth_ = saved_depth;
+    if (ops_per_sec[0] > 0) {
+      for (int i = 1; i < 6; i++) {
+        std::fprintf(stdout, "%-12s : queue depth %2d is %.2fx queue depth 1\n",
+                     "readrandomqd", depths[i], ops_per_sec[i] / ops_per_sec[0]);
+      }
+    }
+  }
+
   void Crc32c(ThreadState* thread) {
     // Checksum about 500MB of data total
     const int size = 4096;
@@ -855,17 +978,28 @@ class Benchmark {
     options.env = g_env;
     options.create_if_missing = !FLAGS_use_existing_db;
     options.block_cache = cache_;
+    options.row_cache = row_cache_;
     options.write_buffer_size = FLAGS_write_buffer_size;
     options.max_file_size = FLAGS_max_file_size;
     options.block_size = FLAGS_block_size;
     options.bloom_bits = FLAGS_bloom_bits;
+    options.filter_format =
+        static_cast<TimberSaw::FilterFormat>(FLAGS_filter_format);
     options.block_restart_interval = FLAGS_block_restart_interval;
+    options.index_partition_size = FLAGS_index_partition_size;
+    options.data_block_hash_index = FLAGS_data_block_hash_index;
     if (FLAGS_comparisons) {
       options.comparator = &count_comparator_;
     }
     options.max_open_files = FLAGS_open_files;
+    options.pin_metadata_max_level = FLAGS_pin_metadata_max_level;
+    if (FLAGS_metadata_cache_size >= 0) {
+      options.metadata_cache_size = FLAGS_metadata_cache_size;
+    }
     options.filter_policy = filter_policy_;
+    options.statistics = statistics_;
     options.reuse_logs = FLAGS_reuse_logs;
+    options.enable_wal = enable_wal_;
     Status s = DB::Open(options, FLAGS_db, &db_);
     if (!s.ok()) {
       std::fprintf(stderr, "open error: %s\n", s.ToString().c_str());
@@ -917,7 +1051,7 @@ class Benchmark {
 //    KeyBuffer key;
     std::unique_ptr<const char[]> key_guard;
     Slice key = AllocateKey(&key_guard);
-    for (int i = 0; i < 1000; i++) {
+    for (size_t i = 0; i < validation_keys.size(); i++) {
       key = validation_keys[i];
       if (db_->Get(options, key, &value).ok()) {
 
@@ -968,15 +1102,34 @@ class Benchmark {
   }
 
   void ReadSequential(ThreadState* thread) {
-    Iterator* iter = db_->NewIterator(ReadOptions());
+    ReadOptions options;
+    options.read_queue_depth = read_queue_depth_;
+    options.readahead_size = FLAGS_readahead_size;
+    Iterator* iter = db_->NewIterator(options);
     int i = 0;
+    int out_of_order = 0;
     int64_t bytes = 0;
+    std::string last_key;
     for (iter->SeekToFirst(); i < reads_ && iter->Valid(); iter->Next()) {
+      // The scan must return the keys in strictly increasing order.
+      if (i > 0 && iter->key().compare(last_key) <= 0) {
+        out_of_order++;
+      }
+      last_key = iter->key().ToString();
       bytes += iter->key().size() + iter->value().size();
       thread->stats.FinishedSingleOp();
       ++i;
     }
+    if (!iter->status().ok()) {
+      std::fprintf(stderr, "readseq error: %s\n",
+                   iter->status().ToString().c_str());
+      std::exit(1);
+    }
     delete iter;
+    char msg[100];
+    std::snprintf(msg, sizeof(msg), "(%d keys, %d out of order)", i,
+                  out_of_order);
+    thread->stats.AddMessage(msg);
     thread->stats.AddBytes(bytes);
   }
 
@@ -994,6 +1147,12 @@ class Benchmark {
   }
 
   void ReadRandom(ThreadState* thread) {
+    if (read_queue_depth_ > 1) {
+      // Get() blocks on each read, so keep the reads outstanding by asking
+      // for read_queue_depth_ keys at a time.
+      DoMultiRead(thread, read_queue_depth_);
+      return;
+    }
     ReadOptions options;
     //TODO(ruihong): specify the cache option.
     std::string value;
@@ -1020,6 +1179,38 @@ class Benchmark {
     thread->stats.AddMessage(msg);
   }
 
+  void MultiReadRandom(ThreadState* thread) {
+    DoMultiRead(thread, entries_per_batch_);
+  }
+
+  void DoMultiRead(ThreadState* thread, int batch) {
+    ReadOptions options;
+    int found = 0;
+    std::unique_ptr<const char[]> key_guard;
+    Slice key = AllocateKey(&key_guard);
+    std::vector<std::string> key_data(batch);
+    std::vector<Slice> keys(batch);
+    std::vector<std::string> values;
+    for (int i = 0; i < reads_; i += batch) {
+      for (int j = 0; j < batch; j++) {
+        const int k = thread->rand.Next()%(FLAGS_num*FLAGS_threads);
+        GenerateKeyFromInt(k, FLAGS_num, &key);
+        key_data[j] = key.ToString();
+        keys[j] = key_data[j];
+      }
+      std::vector<Status> statuses = db_->MultiGet(options, keys, &values);
+      for (int j = 0; j < batch; j++) {
+        if (statuses[j].ok()) {
+          found++;
+        }
+        thread->stats.FinishedSingleOp();
+      }
+    }
+    char msg[100];
+    std::snprintf(msg, sizeof(msg), "(%d of %d found)", found, num_);
+    thread->stats.AddMessage(msg);
+  }
+
   void ReadMissing(ThreadState* thread) {
     ReadOptions options;
     std::string value;
@@ -1175,6 +1366,25 @@ class Benchmark {
 }  // namespace TimberSaw
 
 int main(int argc, char** argv) {
+  // The memory node has to be listening before the first Options() below
+  // makes the default Env connect to it.
+  for (int i = 1; i < argc; i++) {
+    int n;
+    char junk;
+    if (sscanf(argv[i], "--loopback=%d%c", &n, &junk) == 1 &&
+        (n == 0 || n == 1)) {
+      FLAGS_loopback = n;
+    }
+  }
+  if (FLAGS_loopback) {
+    setenv("TIMBERSAW_RDMA_LOOPBACK", "1", 1);
+    std::thread([] {
+      auto* keeper = new TimberSaw::Memory_Node_Keeper(true);
+      keeper->SetBackgroundThreads(12,
+                                   TimberSaw::ThreadPoolType::CompactionThreadPool);
+      keeper->Server_to_Client_Communication();
+    }).detach();
+  }
   FLAGS_write_buffer_size = TimberSaw::Options().write_buffer_size;
   FLAGS_max_file_size = TimberSaw::Options().max_file_size;
   FLAGS_block_size = TimberSaw::Options().block_size;
@@ -1192,6 +1402,9 @@ int main(int argc, char** argv) {
     } else if (sscanf(argv[i], "--histogram=%d%c", &n, &junk) == 1 &&
                (n == 0 || n == 1)) {
       FLAGS_histogram = n;
+    } else if (sscanf(argv[i], "--statistics=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_statistics = n;
     } else if (sscanf(argv[i], "--comparisons=%d%c", &n, &junk) == 1 &&
                (n == 0 || n == 1)) {
       FLAGS_comparisons = n;
@@ -1201,6 +1414,15 @@ int main(int argc, char** argv) {
     } else if (sscanf(argv[i], "--reuse_logs=%d%c", &n, &junk) == 1 &&
                (n == 0 || n == 1)) {
       FLAGS_reuse_logs = n;
+    } else if (sscanf(argv[i], "--wal=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_wal = n;
+    } else if (sscanf(argv[i], "--read_queue_depth=%d%c", &n, &junk) == 1 &&
+               n >= 1) {
+      FLAGS_read_queue_depth = n;
+    } else if (sscanf(argv[i], "--readahead_size=%d%c", &n, &junk) == 1 &&
+               n >= 0) {
+      FLAGS_readahead_size = n;
     } else if (sscanf(argv[i], "--num=%d%c", &n, &junk) == 1) {
       FLAGS_num = n;
     } else if (sscanf(argv[i], "--reads=%d%c", &n, &junk) == 1) {
@@ -1221,14 +1443,35 @@ int main(int argc, char** argv) {
       FLAGS_key_prefix = n;
     } else if (sscanf(argv[i], "--cache_size=%d%c", &n, &junk) == 1) {
       FLAGS_cache_size = n;
+    } else if (sscanf(argv[i], "--row_cache_size=%d%c", &n, &junk) == 1) {
+      FLAGS_row_cache_size = n;
     } else if (sscanf(argv[i], "--bloom_bits=%d%c", &n, &junk) == 1) {
       FLAGS_bloom_bits = n;
+    } else if (sscanf(argv[i], "--filter_format=%d%c", &n, &junk) == 1 &&
+               (n == TimberSaw::kLegacyBloomFilter ||
+                n == TimberSaw::kFastLocalBloomFilter)) {
+      FLAGS_filter_format = n;
     } else if (sscanf(argv[i], "--open_files=%d%c", &n, &junk) == 1) {
       FLAGS_open_files = n;
+    } else if (sscanf(argv[i], "--pin_metadata_max_level=%d%c", &n, &junk) ==
+               1) {
+      FLAGS_pin_metadata_max_level = n;
+    } else if (sscanf(argv[i], "--metadata_cache_size=%d%c", &n, &junk) == 1) {
+      FLAGS_metadata_cache_size = n;
     } else if (sscanf(argv[i], "--numa_awared=%d%c", &n, &junk) == 1) {
       FLAGS_enable_numa = n;
     } else if (sscanf(argv[i], "--block_restart_interval=%d%c", &n, &junk) == 1) {
       FLAGS_block_restart_interval = n;
+    } else if (sscanf(argv[i], "--index_partition_size=%d%c", &n, &junk) ==
+               1) {
+      FLAGS_index_partition_size = n;
+    } else if (sscanf(argv[i], "--data_block_hash_index=%d%c", &n, &junk) ==
+                   1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_data_block_hash_index = n;
+    } else if (sscanf(argv[i], "--loopback=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      // Handled above.
     } else if (strncmp(argv[i], "--db=", 5) == 0) {
       FLAGS_db = argv[i] + 5;
     } else {
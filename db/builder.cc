@@ -34,6 +34,7 @@ Status BuildTable(const std::string& dbname, Env* env, const Options& options,
     builder->get_datablocks_map(meta->remote_data_mrs);
     builder->get_dataindexblocks_map(meta->remote_dataindex_mrs);
     builder->get_filter_map(meta->remote_filter_mrs);
+    meta->index_tail_size = builder->get_index_tail_size();
 
 
     meta->file_size = 0;
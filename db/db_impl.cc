@@ -21,6 +21,7 @@
 #include <cstdio>
 #include <set>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -37,6 +38,7 @@
 #include "util/coding.h"
 #include "util/logging.h"
 #include "util/mutexlock.h"
+#include "util/statistics.h"
 
 namespace TimberSaw {
 
@@ -44,6 +46,54 @@ namespace TimberSaw {
 int SuperVersion::dummy = 0;
 void* const SuperVersion::kSVInUse = &SuperVersion::dummy;
 void* const SuperVersion::kSVObsolete = nullptr;
+namespace {
+// Hazard pointers that let readers Ref() the current SuperVersion without
+// superversion_memlist_mtx.  A reader publishes the SuperVersion it is about
+// to Ref() in its slot, and InstallSuperVersion() waits for the slots to let
+// go of the SuperVersion it replaced before dropping its own reference, so
+// a published SuperVersion cannot be freed under the reader.
+constexpr int kSuperVersionHazardSlots = 256;
+struct alignas(64) SuperVersionHazardSlot {
+  std::atomic<SuperVersion*> sv{nullptr};
+  std::atomic<bool> claimed{false};
+};
+SuperVersionHazardSlot sv_hazard_slots[kSuperVersionHazardSlots];
+
+// The slot of a thread, claimed on first use and given back on thread exit.
+// Threads beyond kSuperVersionHazardSlots go without one.
+class SuperVersionHazard {
+ public:
+  SuperVersionHazard() {
+    for (auto& slot : sv_hazard_slots) {
+      bool expected = false;
+      if (slot.claimed.compare_exchange_strong(expected, true)) {
+        slot_ = &slot;
+        break;
+      }
+    }
+  }
+  ~SuperVersionHazard() {
+    if (slot_ != nullptr) {
+      slot_->claimed.store(false, std::memory_order_release);
+    }
+  }
+  SuperVersionHazardSlot* slot() const { return slot_; }
+
+ private:
+  SuperVersionHazardSlot* slot_ = nullptr;
+};
+thread_local SuperVersionHazard sv_hazard;
+
+// Wait until no reader is about to Ref() "sv".
+void WaitForSuperVersionHazards(SuperVersion* sv) {
+  for (auto& slot : sv_hazard_slots) {
+    while (slot.sv.load() == sv) {
+      std::this_thread::yield();
+    }
+  }
+}
+}  // namespace
+
 void SuperVersionUnrefHandle(void* ptr) {
   // UnrefHandle is called when a thread exists or a ThreadLocalPtr gets
   // destroyed. When former happens, the thread shouldn't see kSVInUse.
@@ -61,12 +111,14 @@ void SuperVersionUnrefHandle(void* ptr) {
 // Information kept for every waiting writer
 struct DBImpl::Writer {
   explicit Writer(port::Mutex* mu)
-      : batch(nullptr), sync(false), done(false), cv(mu) {}
+      : batch(nullptr), sync(false), done(false), sequence_assigned(false),
+        cv(mu) {}
 
   Status status;
   WriteBatch* batch;
   bool sync;
   bool done;
+  bool sequence_assigned;
   port::CondVar cv;
 };
 
@@ -84,6 +136,9 @@ Options SanitizeOptions(const std::string& dbname,
   ClipToRange(&result.write_buffer_size, 64 << 10, 1 << 30);
   ClipToRange(&result.max_file_size, 1 << 20, 1 << 30);
   ClipToRange(&result.block_size, 1 << 10, 4 << 20);
+  if (result.index_partition_size > result.block_size / 2) {
+    result.index_partition_size = result.block_size / 2;
+  }
   if (result.info_log == nullptr) {
     // Open a log file in the same directory as the db
     src.env->CreateDir(dbname);  // In case it does not exist
@@ -104,6 +159,58 @@ static int TableCacheSize(const Options& sanitized_options) {
   // Reserve ten files or so for other uses and give the rest to TableCache.
   return sanitized_options.max_open_files - kNumNonTableCacheFiles;
 }
+
+// A row cache entry is a tag byte followed by the value when it is found.
+static const char kRowAbsent = 0;
+static const char kRowFound = 1;
+
+static void DeleteCachedRow(const Slice& key, void* value) {
+  delete reinterpret_cast<std::string*>(value);
+}
+
+std::string DBImpl::RowCacheKey(const Version* v, const Slice& key) const {
+  std::string row_key;
+  PutFixed64(&row_key, row_cache_id_);
+  PutFixed64(&row_key, v->version_number());
+  row_key.append(key.data(), key.size());
+  return row_key;
+}
+
+bool DBImpl::LookupRowCache(const std::string& row_key, std::string* value,
+                            Status* s) {
+  Cache* row_cache = options_.row_cache;
+  Cache::Handle* row_handle = row_cache->Lookup(row_key);
+  if (row_handle == nullptr) {
+    RecordTick(options_.statistics, ROW_CACHE_MISS);
+    return false;
+  }
+  RecordTick(options_.statistics, ROW_CACHE_HIT);
+  const std::string* row =
+      reinterpret_cast<std::string*>(row_cache->Value(row_handle));
+  if ((*row)[0] == kRowFound) {
+    value->assign(row->data() + 1, row->size() - 1);
+    *s = Status::OK();
+  } else {
+    *s = Status::NotFound(Slice());
+  }
+  row_cache->Release(row_handle);
+  return true;
+}
+
+void DBImpl::InsertRowCache(const std::string& row_key, const Status& s,
+                            const std::string& value) {
+  if (!s.ok() && !s.IsNotFound()) {
+    return;
+  }
+  std::string* row = new std::string(1, s.ok() ? kRowFound : kRowAbsent);
+  if (s.ok()) {
+    row->append(value);
+  }
+  const size_t charge = row_key.size() + row->size() + sizeof(*row);
+  Cache* row_cache = options_.row_cache;
+  row_cache->Release(row_cache->Insert(row_key, row, charge, &DeleteCachedRow));
+}
+
 SuperVersion::~SuperVersion() {
   for (auto td : to_delete) {
     delete td;
@@ -162,18 +269,22 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname)
       shutting_down_(false),
 //      write_stall_cv(&write_stall_mutex_),
       mem_(nullptr),
+      avg_entry_size_(0),
       imm_(config::Immutable_FlushTrigger, config::Immutable_StopWritesTrigger,
            64 * 1024 * 1024 * config::Immutable_StopWritesTrigger),
       has_imm_(false),
       logfile_(nullptr),
       logfile_number_(0),
       log_(nullptr),
+      logfile_bytes_(0),
+      log_last_sequence_(0),
       seed_(0),
       tmp_batch_(new WriteBatch),
       background_compaction_scheduled_(false),
       manual_compaction_(nullptr),
       versions_(new VersionSet(dbname_, &options_, table_cache_,
                                &internal_comparator_, &versionset_mtx)),
+      has_bg_error_(false),
       super_version_number_(0),
       super_version(nullptr), local_sv_(new ThreadLocalPtr(&SuperVersionUnrefHandle))
 #ifdef PROCESSANALYSIS
@@ -186,7 +297,10 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname)
     std::shared_ptr<RDMA_Manager> rdma_mg = env_->rdma_mg;
     env_->SetBackgroundThreads(options_.max_background_flushes,ThreadPoolType::FlushThreadPool);
     env_->SetBackgroundThreads(options_.max_background_compactions,ThreadPoolType::CompactionThreadPool);
+    env_->SetBackgroundThreads(options_.MaxSubcompaction,ThreadPoolType::SubcompactionThreadPool);
     env_->rdma_mg->Mempool_initialize(std::string("DataBlock"), options_.block_size);
+    row_cache_id_ =
+        options_.row_cache != nullptr ? options_.row_cache->NewId() : 0;
 
     main_comm_threads.emplace_back(
     &DBImpl::client_message_polling_and_handling_thread, this, "main");
@@ -238,18 +352,15 @@ DBImpl::~DBImpl() {
 //  while (background_compaction_scheduled_) {
 //    env_->SleepForMicroseconds(10);
 //  }
-#ifdef PROCESSANALYSIS
-  if (RDMA_Manager::ReadCount.load() != 0)
-    printf("RDMA read operatoion average time duration: %zu\n", RDMA_Manager::RDMAReadTimeElapseSum.load()/RDMA_Manager::ReadCount.load());
-#endif
 //  undefine_mutex.Unlock();
 
   if (db_lock_ != nullptr) {
     env_->UnlockFile(db_lock_);
   }
   delete local_sv_;
-  if (super_version!= nullptr && super_version->Unref())
-    super_version->Cleanup();
+  SuperVersion* sv = super_version.load();
+  if (sv != nullptr && sv->Unref())
+    sv->Cleanup();
 //  if (local_sv_.get()->Get() != nullptr){
 //    CleanupSuperVersion(static_cast<SuperVersion*>(local_sv_.get()->Get()));
 //  }
@@ -325,7 +436,7 @@ void DBImpl::MaybeIgnoreError(Status* s) const {
 void DBImpl::RemoveObsoleteFiles() {
   undefine_mutex.AssertHeld();
 
-  if (!bg_error_.ok()) {
+  if (!BackgroundError().ok()) {
     // After a background error, we don't know whether a new version may
     // or may not have been committed, so we cannot safely garbage collect.
     return;
@@ -463,8 +574,7 @@ Status DBImpl::Recover(VersionEdit* edit, bool* save_manifest) {
   // Recover in the order in which the logs were generated
   std::sort(logs.begin(), logs.end());
   for (size_t i = 0; i < logs.size(); i++) {
-    s = RecoverLogFile(logs[i], (i == logs.size() - 1), save_manifest, edit,
-                       &max_sequence);
+    s = RecoverLogFile(logs[i], &max_sequence);
     if (!s.ok()) {
       return s;
     }
@@ -473,17 +583,23 @@ Status DBImpl::Recover(VersionEdit* edit, bool* save_manifest) {
     // records after allocating this log number.  So we manually
     // update the file number allocation counter in VersionSet.
     versions_->MarkFileNumberUsed(logs[i]);
+    recovered_logs_.push_back(logs[i]);
+  }
+  if (!recovered_records_.empty()) {
+    // The replayed records will be logged again in the new log file.
+    *save_manifest = true;
   }
 
-  if (versions_->LastSequence() < max_sequence) {
-    versions_->SetLastSequence(max_sequence);
+  // LastSequence is the next sequence number to be assigned.
+  if (!recovered_records_.empty() &&
+      versions_->LastSequence() <= max_sequence) {
+    versions_->SetLastSequence(max_sequence + 1);
   }
 
   return Status::OK();
 }
 
-Status DBImpl::RecoverLogFile(uint64_t log_number, bool last_log,
-                              bool* save_manifest, VersionEdit* edit,
+Status DBImpl::RecoverLogFile(uint64_t log_number,
                               SequenceNumber* max_sequence) {
   struct LogReporter : public log::Reader::Reporter {
     Env* env;
@@ -523,12 +639,13 @@ Status DBImpl::RecoverLogFile(uint64_t log_number, bool last_log,
   Log(options_.info_log, "Recovering log #%llu",
       (unsigned long long)log_number);
 
-  // Read all the records and add to a memtable
+  // Read all the records. The memtables of this DB own fixed sequence ranges
+  // which are not known yet, so the records are kept and re-applied by
+  // ReplayRecoveredLogs through the regular write path. The old log files are
+  // never reused for the same reason.
   std::string scratch;
   Slice record;
   WriteBatch batch;
-  int compactions = 0;
-  MemTable* mem = nullptr;
   while (reader.ReadRecord(&record, &scratch) && status.ok()) {
     if (record.size() < 12) {
       reporter.Corruption(record.size(),
@@ -536,70 +653,39 @@ Status DBImpl::RecoverLogFile(uint64_t log_number, bool last_log,
       continue;
     }
     WriteBatchInternal::SetContents(&batch, record);
-
-    if (mem == nullptr) {
-      mem = new MemTable(internal_comparator_);
-      mem->Ref();
-    }
-    status = WriteBatchInternal::InsertInto(&batch, mem);
-    MaybeIgnoreError(&status);
-    if (!status.ok()) {
-      break;
+    if (WriteBatchInternal::Count(&batch) == 0) {
+      continue;
     }
+    recovered_records_.push_back(record.ToString());
     const SequenceNumber last_seq = WriteBatchInternal::Sequence(&batch) +
                                     WriteBatchInternal::Count(&batch) - 1;
     if (last_seq > *max_sequence) {
       *max_sequence = last_seq;
     }
-
-    if (mem->ApproximateMemoryUsage() > options_.write_buffer_size) {
-      compactions++;
-      *save_manifest = true;
-      status = WriteLevel0Table(mem, edit, nullptr);
-      mem->Unref();
-      mem = nullptr;
-      if (!status.ok()) {
-        // Reflect errors immediately so that conditions like full
-        // file-systems cause the DB::Open() to fail.
-        break;
-      }
-    }
   }
 
   delete file;
+  return status;
+}
 
-  // See if we should keep reusing the last log file.
-  if (status.ok() && options_.reuse_logs && last_log && compactions == 0) {
-    assert(logfile_ == nullptr);
-    assert(log_ == nullptr);
-    assert(mem_ == nullptr);
-    uint64_t lfile_size;
-    if (env_->GetFileSize(fname, &lfile_size).ok() &&
-        env_->NewAppendableFile(fname, &logfile_).ok()) {
-      Log(options_.info_log, "Reusing old log %s \n", fname.c_str());
-      log_ = new log::Writer(logfile_, lfile_size);
-      logfile_number_ = log_number;
-      if (mem != nullptr) {
-        mem_.store(mem);
-        mem = nullptr;
-      } else {
-        // mem can be nullptr if lognum exists but was empty.
-        mem_.store(new MemTable(internal_comparator_));
-        mem_.load()->Ref();
-      }
+Status DBImpl::ReplayRecoveredLogs() {
+  Status s;
+  WriteBatch batch;
+  WriteOptions replay_options;
+  for (const std::string& record : recovered_records_) {
+    WriteBatchInternal::SetContents(&batch, record);
+    s = Write(replay_options, &batch);
+    if (!s.ok()) {
+      return s;
     }
   }
-
-  if (mem != nullptr) {
-    // mem did not get reused; compact it.
-    if (status.ok()) {
-      *save_manifest = true;
-      status = WriteLevel0Table(mem, edit, nullptr);
-    }
-    mem->Unref();
+  if (options_.enable_wal && !recovered_records_.empty()) {
+    // Make the replayed records durable before the old logs are dropped.
+    MutexLock l(&wal_mutex_);
+    s = logfile_->Sync();
   }
-
-  return status;
+  recovered_records_.clear();
+  return s;
 }
 
 Status DBImpl::WriteLevel0Table(FlushJob* job, VersionEdit* edit) {
@@ -914,11 +1000,27 @@ void DBImpl::TEST_CompactRange(int level, const Slice* begin,
 //}
 
 void DBImpl::RecordBackgroundError(const Status& s) {
-//  undefine_mutex.AssertHeld();
-  if (bg_error_.ok()) {
+  {
+    std::unique_lock<std::mutex> lck(bg_error_mtx_);
+    if (!bg_error_.ok()) {
+      return;
+    }
     bg_error_ = s;
-    write_stall_cv.notify_all();
+    has_bg_error_.store(true, std::memory_order_release);
   }
+  // Writers stalled in PickupTableToWrite() check for the error while
+  // holding superversion_memlist_mtx. Passing through it makes sure that
+  // none of them misses the wakeup.
+  { std::unique_lock<std::mutex> l(superversion_memlist_mtx); }
+  write_stall_cv.notify_all();
+}
+
+Status DBImpl::BackgroundError() {
+  if (!has_bg_error_.load(std::memory_order_acquire)) {
+    return Status::OK();
+  }
+  std::unique_lock<std::mutex> lck(bg_error_mtx_);
+  return bg_error_;
 }
 
 void DBImpl::MaybeScheduleFlushOrCompaction() {
@@ -928,7 +1030,7 @@ void DBImpl::MaybeScheduleFlushOrCompaction() {
  if (shutting_down_.load(std::memory_order_acquire)) {
     // DB is being deleted; no more background compactions
     return;
-  } else if (!bg_error_.ok()) {
+  } else if (!BackgroundError().ok()) {
     // Already got an error; no more changes
     return;
   }
@@ -942,7 +1044,11 @@ void DBImpl::MaybeScheduleFlushOrCompaction() {
       //If there has already be enough compaction scheduled, then drop this one
       return;
     }
-    env_->Schedule(BGWork_Flush, static_cast<void*>(thread_pool_args), type);
+    if (!env_->Schedule(BGWork_Flush, static_cast<void*>(thread_pool_args),
+                        type)) {
+      delete thread_pool_args;
+      return;
+    }
     DEBUG("Schedule a flushing !\n");
   }
 //  if (versions_->NeedsCompaction()) {
@@ -964,13 +1070,21 @@ void DBImpl::BGWork_Compaction(void* thread_arg) {
   ((DBImpl*)p->db)->BackgroundCompaction(p->func_args);
   delete static_cast<BGThreadMetadata*>(thread_arg);
 }
+void DBImpl::BGWork_Subcompaction(void* thread_arg) {
+  BGThreadMetadata* p = static_cast<BGThreadMetadata*>(thread_arg);
+  BGJobGroup* group = p->group;
+  ((DBImpl*)p->db)->ProcessKeyValueCompaction(
+      static_cast<SubcompactionState*>(p->func_args));
+  delete p;
+  group->JobDone();
+}
 void DBImpl::BackgroundCall() {
   //Tothink: why there is a Lock, which data structure is this mutex protecting
 //  undefine_mutex.Lock();
 //  assert(background_compaction_scheduled_);
   if (shutting_down_.load(std::memory_order_acquire)) {
     // No more background work when shutting down.
-  } else if (!bg_error_.ok()) {
+  } else if (!BackgroundError().ok()) {
     // No more background work after a background error.
   } else {
     void* dummay_p = nullptr;
@@ -990,7 +1104,7 @@ void DBImpl::BackgroundFlush(void* p) {
 //  assert(background_compaction_scheduled_);
   if (shutting_down_.load(std::memory_order_acquire)) {
     // No more background work when shutting down.
-  } else if (!bg_error_.ok()) {
+  } else if (!BackgroundError().ok()) {
     // No more background work after a background error.
   } else if (imm_.IsFlushPending()) {
 
@@ -1012,7 +1126,7 @@ void DBImpl::BackgroundCompaction(void* p) {
   assert(false);
   if (shutting_down_.load(std::memory_order_acquire)) {
     // No more background work when shutting down.
-  } else if (!bg_error_.ok()) {
+  } else if (!BackgroundError().ok()) {
     // No more background work after a background error.
   } else if (versions_->NeedsCompaction()) {
     Compaction* c;
@@ -1050,6 +1164,7 @@ void DBImpl::BackgroundCompaction(void* p) {
       std::shared_ptr<RemoteMemTableMetaData> f = c->input(0, 0);
       c->edit()->RemoveFile(c->level(), f->number, f->creator_node_id);
       c->edit()->AddFile(c->level() + 1, f);
+      f->level = f->level + 1;
       {
         std::unique_lock<std::mutex> l(superversion_memlist_mtx);
         c->ReleaseInputs();
@@ -1072,7 +1187,7 @@ void DBImpl::BackgroundCompaction(void* p) {
       auto start = std::chrono::high_resolution_clock::now();
 //      write_stall_mutex_.AssertNotHeld();
       // Only when there is enough input level files and output level files will the subcompaction triggered
-      if (options_.usesubcompaction && c->num_input_files(0)>=4 && c->num_input_files(1)>1){
+      if (options_.usesubcompaction && c->num_input_files(0)>=4){
         status = DoCompactionWorkWithSubcompaction(compact);
       }else{
         status = DoCompactionWork(compact);
@@ -1207,6 +1322,8 @@ Status DBImpl::FinishCompactionOutputFile(SubcompactionState* compact,
   compact->builder->get_datablocks_map(compact->current_output()->remote_data_mrs);
   compact->builder->get_dataindexblocks_map(compact->current_output()->remote_dataindex_mrs);
   compact->builder->get_filter_map(compact->current_output()->remote_filter_mrs);
+  compact->current_output()->index_tail_size =
+      compact->builder->get_index_tail_size();
 #ifndef NDEBUG
   uint64_t file_size = 0;
   for(auto iter : compact->current_output()->remote_data_mrs){
@@ -1267,6 +1384,8 @@ Status DBImpl::FinishCompactionOutputFile(CompactionState* compact,
   compact->builder->get_datablocks_map(compact->current_output()->remote_data_mrs);
   compact->builder->get_dataindexblocks_map(compact->current_output()->remote_dataindex_mrs);
   compact->builder->get_filter_map(compact->current_output()->remote_filter_mrs);
+  compact->current_output()->index_tail_size =
+      compact->builder->get_index_tail_size();
 #ifndef NDEBUG
   uint64_t file_size = 0;
   for(auto iter : compact->current_output()->remote_data_mrs){
@@ -1329,6 +1448,8 @@ Status DBImpl::InstallCompactionResults(CompactionState* compact,
       meta->remote_data_mrs = out.remote_data_mrs;
       meta->remote_dataindex_mrs = out.remote_dataindex_mrs;
       meta->remote_filter_mrs = out.remote_filter_mrs;
+      meta->index_tail_size = out.index_tail_size;
+      meta->level = level + 1;
       compact->compaction->edit()->AddFile(level + 1, meta);
       assert(!meta->UnderCompaction);
     }
@@ -1346,6 +1467,8 @@ Status DBImpl::InstallCompactionResults(CompactionState* compact,
         meta->remote_data_mrs = out.remote_data_mrs;
         meta->remote_dataindex_mrs = out.remote_dataindex_mrs;
         meta->remote_filter_mrs = out.remote_filter_mrs;
+        meta->index_tail_size = out.index_tail_size;
+        meta->level = level + 1;
         compact->compaction->edit()->AddFile(level + 1, meta);
         assert(!meta->UnderCompaction);
       }
@@ -1428,10 +1551,12 @@ Status DBImpl::TryInstallMemtableFlushResults(
   imm_.InstallNewVersion();
   size_t batch_count_for_fetch_sub = batch_count;
   MemTableListVersion* current = imm_.current_.load();
+  SequenceNumber flushed_seq = 0;
   while (batch_count-- > 0) {
     MemTable* m = current->memlist_.back();
 
     assert(m->sstable != nullptr);
+    flushed_seq = m->Getlargest_seq_supposed();
     autovector<MemTable*> dummy_to_delete = autovector<MemTable*>();
     current->Remove(m);
     imm_.UpdateCachedValuesFromMemTableListVersion();
@@ -1447,6 +1572,9 @@ Status DBImpl::TryInstallMemtableFlushResults(
     s = vset->LogAndApply(edit, 0);
     Edit_sync_to_remote(edit, &lck);
   }
+  if (s.ok()) {
+    RemoveObsoleteLogs(flushed_seq);
+  }
 
 #ifndef NDEBUG
 //  std::string temp_buf;
@@ -1537,12 +1665,8 @@ SuperVersion* DBImpl::GetThreadLocalSuperVersion() {
       // NOTE: underlying resources held by superversion (sst files) might
       // not be released until the next background job.
       sv->Cleanup();
-      sv = super_version->Ref();
-
-    } else {
-      std::unique_lock<std::mutex> lck(superversion_memlist_mtx);
-      sv = super_version->Ref();
     }
+    sv = RefCurrentSuperVersion();
 
 //    lck.unlock();
   }
@@ -1553,19 +1677,45 @@ SuperVersion* DBImpl::GetThreadLocalSuperVersion() {
 
 
 
+SuperVersion* DBImpl::RefCurrentSuperVersion() {
+  SuperVersionHazardSlot* slot = sv_hazard.slot();
+  if (slot == nullptr) {
+    std::unique_lock<std::mutex> lck(superversion_memlist_mtx);
+    return super_version.load()->Ref();
+  }
+  SuperVersion* sv = super_version.load();
+  while (true) {
+    slot->sv.store(sv);
+    // Still current after the slot was published: the installer that
+    // replaces it will see the slot before dropping its reference.
+    SuperVersion* current = super_version.load();
+    if (current == sv) {
+      break;
+    }
+    sv = current;
+  }
+  sv->Ref();
+  slot->sv.store(nullptr, std::memory_order_release);
+  return sv;
+}
+
 void DBImpl::InstallSuperVersion() {
-  SuperVersion* old_superversion = super_version;
-  super_version =
+  SuperVersion* old_superversion = super_version.load();
+  SuperVersion* new_superversion =
       new SuperVersion(mem_, imm_.current(), versions_->current(), &versionset_mtx);
-  super_version->Ref();
+  new_superversion->Ref();
+  new_superversion->version_number = super_version_number_.load() + 1;
+  // Publish the SuperVersion before its number, so that readers who see
+  // the new number also see it.
+  super_version.store(new_superversion);
   ++super_version_number_;
-  super_version->version_number = super_version_number_;
   if (old_superversion != nullptr) {
     // Reset SuperVersions cached in thread local storage.
     // This should be done before old_superversion->Unref(). That's to ensure
     // that local_sv_ never holds the last reference to SuperVersion, since
     // it has no means to safely do SuperVersion cleanup.
     ResetThreadLocalSuperVersions();
+    WaitForSuperVersionHazards(old_superversion);
 
     if (old_superversion->Unref()) {
       old_superversion->Cleanup();
@@ -1739,7 +1889,7 @@ void DBImpl::client_message_polling_and_handling_thread(std::string q_id) {
       }
 
       for(int i = 0; i<R_SIZE; i++) {
-        rdma_mg->post_receive<RDMA_Request>(&recv_mr[i], q_id);
+        rdma_mg->post_receive<RDMA_Message>(&recv_mr[i], q_id);
       }
       buffer_counter = 0;
       rdma_mg->comm_thread_recv_mrs.insert({q_id, recv_mr});
@@ -1755,15 +1905,27 @@ void DBImpl::client_message_polling_and_handling_thread(std::string q_id) {
     }
     write_stall_cv.notify_all();
     printf("client handling thread\n");
+    // This loop spins, so resolve the queue pair once up front.
+    RDMA_Channel channel = rdma_mg->Resolve_Channel(q_id);
     while (!shutting_down_.load()) {
-      if(rdma_mg->try_poll_this_thread_completions(wc, 1, q_id, false)>0){
+      if(rdma_mg->try_poll_this_thread_completions(wc, 1, channel, false)>0){
         memcpy(&receive_msg_buf, recv_mr[buffer_counter].addr, sizeof(RDMA_Request));
 //        printf("Buffer counter %d has been used!\n", buffer_counter);
         // copy the pointer of receive buf to a new place because
         // it is the same with send buff pointer.
-        if (receive_msg_buf.command == install_version_edit) {
+        if (receive_msg_buf.command == install_version_edit &&
+            receive_msg_buf.content.ive.payload_inline) {
+          // Take the edit out of the buffer before it is posted again.
+          std::string serialized_edit(
+              ((RDMA_Message*)recv_mr[buffer_counter].addr)->payload,
+              receive_msg_buf.content.ive.buffer_size);
           ((RDMA_Request*) recv_mr[buffer_counter].addr)->command = invalid_command_;
-          rdma_mg->post_receive<RDMA_Request>(&recv_mr[buffer_counter], "main");
+          rdma_mg->post_receive<RDMA_Message>(&recv_mr[buffer_counter], "main");
+          Apply_Version_Edit(serialized_edit,
+                             receive_msg_buf.content.ive.version_id);
+        } else if (receive_msg_buf.command == install_version_edit) {
+          ((RDMA_Request*) recv_mr[buffer_counter].addr)->command = invalid_command_;
+          rdma_mg->post_receive<RDMA_Message>(&recv_mr[buffer_counter], "main");
           install_version_edit_handler(receive_msg_buf, q_id);
         } else {
           printf("corrupt message from client.");
@@ -1797,18 +1959,36 @@ void DBImpl::Edit_sync_to_remote(VersionEdit* edit,
   ibv_mr send_mr_ve = {};
   ibv_mr receive_mr = {};
   rdma_mg->Allocate_Local_RDMA_Slot(send_mr, "message");
+  std::string serilized_ve;
+  edit->EncodeTo(&serilized_ve);
+  send_pointer = (RDMA_Request*)send_mr.addr;
+  send_pointer->command = install_version_edit;
+  send_pointer->content.ive = {};
+  send_pointer->content.ive.buffer_size = serilized_ve.size();
+  if (serilized_ve.size() <= sizeof(RDMA_Message::payload)) {
+    // A small edit (i.e. a flush) travels with the request, so the memory
+    // node can apply it from its receive buffer without a reply and an
+    // RDMA write.
+    send_pointer->content.ive.payload_inline = true;
+    memcpy(((RDMA_Message*)send_mr.addr)->payload, serilized_ve.data(),
+           serilized_ve.size());
+    rdma_mg->post_send(&send_mr, std::string("main"),
+                       sizeof(RDMA_Request) + serilized_ve.size());
+    version_mtx->unlock();
+    ibv_wc wc[2] = {};
+    if (rdma_mg->poll_completion(wc, 1, std::string("main"),true)){
+      fprintf(stderr, "failed to poll send for remote memory register\n");
+    }
+    rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr,"message");
+    return;
+  }
   rdma_mg->Allocate_Local_RDMA_Slot(send_mr_ve, "version_edit");
 
   rdma_mg->Allocate_Local_RDMA_Slot(receive_mr, "message");
-  std::string serilized_ve;
-  edit->EncodeTo(&serilized_ve);
   assert(serilized_ve.size() <= send_mr_ve.length);
   memcpy(send_mr_ve.addr, serilized_ve.c_str(), serilized_ve.size());
   memset((char*)send_mr_ve.addr + serilized_ve.size(), 1, 1);
 
-  send_pointer = (RDMA_Request*)send_mr.addr;
-  send_pointer->command = install_version_edit;
-  send_pointer->content.ive.buffer_size = serilized_ve.size();
   send_pointer->reply_buffer = receive_mr.addr;
   send_pointer->rkey = receive_mr.rkey;
   RDMA_Reply* receive_pointer;
@@ -1926,27 +2106,30 @@ void DBImpl::install_version_edit_handler(RDMA_Request request,
 #ifndef NDEBUG
     printf("Get the printed result after %zu iteration, received %d, checkbyte is %d\n", counter, send_pointer->received, check_byte);
 #endif
-    VersionEdit version_edit;
-    version_edit.DecodeFrom(
-        Slice((char*)edit_recv_mr.addr, request.content.ive.buffer_size), 0);
-//    printf("Marker 1\n");
-    std::unique_lock<std::mutex> lck(superversion_memlist_mtx);
-//    printf("Marker 2\n");
-    std::unique_lock<std::mutex> lck1(versionset_mtx);
-    versions_->LogAndApply(&version_edit, request.content.ive.version_id);
-    lck1.unlock();
-#ifndef NDEBUG
-    printf("version edit decoded level is %d file number is %zu\n", version_edit.compactlevel(), version_edit.GetNewFilesNum());
-#endif
-
-    InstallSuperVersion();
-    lck.unlock();
-    write_stall_cv.notify_all();
+    Apply_Version_Edit(
+        Slice((char*)edit_recv_mr.addr, request.content.ive.buffer_size),
+        request.content.ive.version_id);
     rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, "message");
     rdma_mg->Deallocate_Local_RDMA_Slot(edit_recv_mr.addr, "version_edit");
   }
 
 }
+void DBImpl::Apply_Version_Edit(const Slice& serialized_edit,
+                                size_t version_id) {
+  VersionEdit version_edit;
+  version_edit.DecodeFrom(serialized_edit, 0);
+  std::unique_lock<std::mutex> lck(superversion_memlist_mtx);
+  std::unique_lock<std::mutex> lck1(versionset_mtx);
+  versions_->LogAndApply(&version_edit, version_id);
+  lck1.unlock();
+#ifndef NDEBUG
+  printf("version edit decoded level is %d file number is %zu\n", version_edit.compactlevel(), version_edit.GetNewFilesNum());
+#endif
+
+  InstallSuperVersion();
+  lck.unlock();
+  write_stall_cv.notify_all();
+}
 void DBImpl::ResetThreadLocalSuperVersions() {
   autovector<void*> sv_ptrs;
   // If there the default pointer for local_sv_ s are nullptr
@@ -1983,7 +2166,7 @@ void DBImpl::ResetThreadLocalSuperVersions() {
 //}
 Status DBImpl::DoCompactionWorkWithSubcompaction(CompactionState* compact) {
   Compaction* c = compact->compaction;
-  c->GenSubcompactionBoundaries();
+  c->GenSubcompactionBoundaries(false);
   auto boundaries = c->GetBoundaries();
   auto sizes = c->GetSizes();
   assert(boundaries->size() == sizes->size() - 1);
@@ -2036,20 +2219,25 @@ Status DBImpl::DoCompactionWorkWithSubcompaction(CompactionState* compact) {
   assert(num_threads > 0);
   const uint64_t start_micros = env_->NowMicros();
 
-  // Launch a thread for each of subcompactions 1...num_threads-1
-  std::vector<port::Thread> thread_pool;
-  thread_pool.reserve(num_threads - 1);
+  // Hand subcompactions 1...num_threads-1 to the subcompaction pool, whose
+  // threads outlive the compaction and keep their RDMA queue pairs.
+  BGJobGroup group(num_threads - 1);
   for (size_t i = 1; i < compact->sub_compact_states.size(); i++) {
-    thread_pool.emplace_back(&DBImpl::ProcessKeyValueCompaction, this,
-                             &compact->sub_compact_states[i]);
+    BGThreadMetadata* thread_pool_args = new BGThreadMetadata{
+        .db = this, .func_args = &compact->sub_compact_states[i],
+        .group = &group};
+    if (!env_->Schedule(BGWork_Subcompaction,
+                        static_cast<void*>(thread_pool_args),
+                        ThreadPoolType::SubcompactionThreadPool)) {
+      // The pool is shutting down, nobody else would call JobDone().
+      BGWork_Subcompaction(thread_pool_args);
+    }
   }
 
   // Always schedule the first subcompaction (whether or not there are also
   // others) in the current thread to be efficient with resources
   ProcessKeyValueCompaction(&compact->sub_compact_states[0]);
-  for (auto& thread : thread_pool) {
-    thread.join();
-  }
+  group.WaitAll();
   CompactionStats stats;
   stats.micros = env_->NowMicros() - start_micros;
   for (int which = 0; which < 2; which++) {
@@ -2100,11 +2288,11 @@ void DBImpl::ProcessKeyValueCompaction(SubcompactionState* sub_compact){
   // Release mutex while we're actually doing the compaction work
 //  undefine_mutex.Unlock();
   if (start != nullptr) {
+    // The subcompaction range is [start, end): start from the newest entry
+    // of "start", right where the subcompaction before this one stopped.
     InternalKey start_internal(*start, kMaxSequenceNumber, kValueTypeForSeek);
     //tofix(ruihong): too much data copy for the seek here!
     input->Seek(start_internal.Encode());
-    // The sstable range is (start, end]
-    input->Next();
   } else {
     input->SeekToFirst();
   }
@@ -2120,20 +2308,17 @@ void DBImpl::ProcessKeyValueCompaction(SubcompactionState* sub_compact){
   bool has_current_user_key = false;
   SequenceNumber last_sequence_for_key = kMaxSequenceNumber;
   Slice key;
-  assert(input->Valid());
-#ifndef NDEBUG
-  printf("first key is %s", input->key().ToString().c_str());
-#endif
   while (input->Valid() && !shutting_down_.load(std::memory_order_acquire)) {
     key = input->key();
+    if (end != nullptr &&
+        user_comparator()->Compare(ExtractUserKey(key), *end) >= 0) {
+      break;
+    }
 
 //    assert(key.data()[0] == '0');
     //Check whether the output file have too much overlap with level n + 2
     if (sub_compact->compaction->ShouldStopBefore(key) &&
         sub_compact->builder != nullptr) {
-      //TODO: record the largest key as the last ikey, find a more efficient way to record
-      // the last key of SSTable.
-      sub_compact->current_output()->largest.SetFrom(ikey);
       status = FinishCompactionOutputFile(sub_compact, input);
       if (!status.ok()) {
         break;
@@ -2201,22 +2386,19 @@ void DBImpl::ProcessKeyValueCompaction(SubcompactionState* sub_compact){
       Not_drop_counter++;
 #endif
       sub_compact->builder->Add(key, input->value());
+      // The iterator may reuse the key's buffer, so keep a copy of the last
+      // key added for when the output is finished.
+      sub_compact->current_output()->largest.DecodeFrom(key);
 //      assert(key.data()[0] == '0');
       // Close output file if it is big enough
       if (sub_compact->builder->FileSize() >=
           sub_compact->compaction->MaxOutputFileSize()) {
-//        assert(key.data()[0] == '0');
-        sub_compact->current_output()->largest.DecodeFrom(key);
         status = FinishCompactionOutputFile(sub_compact, input);
         if (!status.ok()) {
           break;
         }
       }
     }
-    if (end != nullptr &&
-        user_comparator()->Compare(ExtractUserKey(key), *end) >= 0) {
-      break;
-    }
 //    assert(key.data()[0] == '0');
     input->Next();
     //NOTE(ruihong): When the level iterator is invalid it will be deleted and then the key will
@@ -2237,9 +2419,6 @@ void DBImpl::ProcessKeyValueCompaction(SubcompactionState* sub_compact){
     status = Status::IOError("Deleting DB during compaction");
   }
   if (status.ok() && sub_compact->builder != nullptr) {
-//    assert(key.data()[0] == '0');
-
-    sub_compact->current_output()->largest.DecodeFrom(key);// The SSTable for subcompaction range will be (start, end]
     status = FinishCompactionOutputFile(sub_compact, input);
   }
   if (status.ok()) {
@@ -2458,15 +2637,10 @@ static void CleanupIteratorState(void* arg1, void* arg2) {
 Iterator* DBImpl::NewInternalIterator(const ReadOptions& options,
                                       SequenceNumber* latest_snapshot,
                                       uint32_t* seed) {
-  SequenceNumber snapshot;
-  if (options.snapshot != nullptr) {
-    snapshot =
-        static_cast<const SnapshotImpl*>(options.snapshot)->sequence_number();
-  } else {
-    snapshot = versions_->LastSequence();
-  }
-
   auto sv = GetThreadLocalSuperVersion();
+  // Read the sequence after pinning the SuperVersion, every entry up to it is
+  // in the pinned tables.
+  *latest_snapshot = versions_->LastSequence();
 
   MemTable* mem = sv->mem;
   MemTableListVersion* imm = sv->imm;
@@ -2494,12 +2668,15 @@ Iterator* DBImpl::NewInternalIterator(const ReadOptions& options,
   mem->Ref();
 //  imm
   imm->AddIteratorsToList(&list);
-  versions_->current()->AddIterators(options, &list);
+  imm->Ref();
+  current->AddIterators(options, &list);
   Iterator* internal_iter =
       NewMergingIterator(&internal_comparator_, &list[0], list.size());
-  versions_->current()->Ref(0);
+  current->Ref(0);
 
-  IterState* cleanup = new IterState(&undefine_mutex, mem_, imm, versions_->current());
+  // Pin the tables of the SuperVersion, CleanupIteratorState() releases all
+  // three of them.
+  IterState* cleanup = new IterState(&undefine_mutex, mem, imm, current);
   internal_iter->RegisterCleanup(CleanupIteratorState, cleanup, nullptr);
 
   *seed = ++seed_;
@@ -2521,7 +2698,14 @@ int64_t DBImpl::TEST_MaxNextLevelOverlappingBytes() {
 
 Status DBImpl::Get(const ReadOptions& options, const Slice& key,
                    std::string* value) {
+  Statistics* statistics = options_.statistics;
+  StopWatch get_watch(statistics, DB_GET);
+  RecordTick(statistics, NUMBER_KEYS_READ);
   Status s;
+  // Pin the SuperVersion before reading the sequence.  Otherwise a flush could
+  // install a newer Version in between, and a row read at the older sequence
+  // would be cached under it.
+  auto sv = GetThreadLocalSuperVersion();
   SequenceNumber snapshot;
   if (options.snapshot != nullptr) {
     snapshot =
@@ -2530,8 +2714,6 @@ Status DBImpl::Get(const ReadOptions& options, const Slice& key,
     snapshot = versions_->LastSequence();
   }
 
-  auto sv = GetThreadLocalSuperVersion();
-
   MemTable* mem = sv->mem;
   MemTableListVersion* imm = sv->imm;
   Version* current = sv->current;
@@ -2561,14 +2743,35 @@ Status DBImpl::Get(const ReadOptions& options, const Slice& key,
 
     if (mem->Get(lkey, value, &s)) {
       // Done
+      RecordTick(statistics, MEMTABLE_HIT);
     } else if (imm != nullptr && imm->Get(lkey, value, &s)) {
       // Done
+      RecordTick(statistics, MEMTABLE_HIT);
     } else {
-      s = current->Get(options, lkey, value, &stats);
-      have_stat_update = true;
+      RecordTick(statistics, MEMTABLE_MISS);
+      // The table set of a Version never changes, so a row cached under its
+      // number stays valid for every read at the latest sequence that
+      // missed the memtables.
+      const bool use_row_cache =
+          options.snapshot == nullptr && options_.row_cache != nullptr;
+      std::string row_key;
+      if (use_row_cache) {
+        row_key = RowCacheKey(current, key);
+      }
+      if (!use_row_cache || !LookupRowCache(row_key, value, &s)) {
+        s = current->Get(options, lkey, value, &stats);
+        have_stat_update = true;
+        if (use_row_cache) {
+          InsertRowCache(row_key, s, *value);
+        }
+      }
     }
 //    undefine_mutex.Lock();
   }
+  if (s.ok()) {
+    RecordTick(statistics, NUMBER_KEYS_FOUND);
+    RecordTick(statistics, BYTES_READ, value->size());
+  }
 
   if (have_stat_update && current->UpdateStats(stats)) {
     MaybeScheduleFlushOrCompaction();
@@ -2578,6 +2781,99 @@ Status DBImpl::Get(const ReadOptions& options, const Slice& key,
   return s;
 }
 
+std::vector<Status> DBImpl::MultiGet(const ReadOptions& options,
+                                     const std::vector<Slice>& keys,
+                                     std::vector<std::string>* values) {
+  Statistics* statistics = options_.statistics;
+  StopWatch multiget_watch(statistics, DB_MULTIGET);
+  RecordTick(statistics, NUMBER_KEYS_READ, keys.size());
+  // One SuperVersion serves the whole batch.  It is pinned before the
+  // sequence is read, as in Get().
+  auto sv = GetThreadLocalSuperVersion();
+  SequenceNumber snapshot;
+  if (options.snapshot != nullptr) {
+    snapshot =
+        static_cast<const SnapshotImpl*>(options.snapshot)->sequence_number();
+  } else {
+    snapshot = versions_->LastSequence();
+  }
+  values->resize(keys.size());
+  std::vector<Status> statuses(keys.size());
+
+  MemTable* mem = sv->mem;
+  MemTableListVersion* imm = sv->imm;
+  Version* current = sv->current;
+
+  // The memtables are local, so probe them key by key and leave only the
+  // misses for the remote tables.
+  std::vector<size_t> pending;
+  for (size_t i = 0; i < keys.size(); i++) {
+    LookupKey lkey(keys[i], snapshot);
+    if (mem->Get(lkey, &(*values)[i], &statuses[i])) {
+      // Done
+      RecordTick(statistics, MEMTABLE_HIT);
+    } else if (imm != nullptr && imm->Get(lkey, &(*values)[i], &statuses[i])) {
+      // Done
+      RecordTick(statistics, MEMTABLE_HIT);
+    } else {
+      RecordTick(statistics, MEMTABLE_MISS);
+      pending.push_back(i);
+    }
+  }
+
+  // Serve what the row cache has, see Get().
+  const bool use_row_cache =
+      options.snapshot == nullptr && options_.row_cache != nullptr;
+  if (use_row_cache) {
+    size_t remaining = 0;
+    for (size_t i : pending) {
+      if (!LookupRowCache(RowCacheKey(current, keys[i]), &(*values)[i],
+                          &statuses[i])) {
+        pending[remaining++] = i;
+      }
+    }
+    pending.resize(remaining);
+  }
+
+  if (!pending.empty()) {
+    // Sort the misses so that keys sharing a table or a data block are
+    // adjacent and can be served by one probe.
+    const Comparator* ucmp = user_comparator();
+    std::sort(pending.begin(), pending.end(), [&](size_t a, size_t b) {
+      return ucmp->Compare(keys[a], keys[b]) < 0;
+    });
+    std::vector<Slice> sorted_keys;
+    std::vector<std::string*> sorted_values;
+    sorted_keys.reserve(pending.size());
+    sorted_values.reserve(pending.size());
+    for (size_t i : pending) {
+      sorted_keys.push_back(keys[i]);
+      sorted_values.push_back(&(*values)[i]);
+    }
+    std::vector<Status> sorted_statuses;
+    current->MultiGet(options, snapshot, sorted_keys, sorted_values,
+                      &sorted_statuses);
+    for (size_t j = 0; j < pending.size(); j++) {
+      statuses[pending[j]] = sorted_statuses[j];
+      if (use_row_cache) {
+        InsertRowCache(RowCacheKey(current, keys[pending[j]]),
+                       statuses[pending[j]], (*values)[pending[j]]);
+      }
+    }
+  }
+
+  ReturnAndCleanupSuperVersion(sv);
+  if (statistics != nullptr) {
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (statuses[i].ok()) {
+        statistics->RecordTick(NUMBER_KEYS_FOUND);
+        statistics->RecordTick(BYTES_READ, (*values)[i].size());
+      }
+    }
+  }
+  return statuses;
+}
+
 Iterator* DBImpl::NewIterator(const ReadOptions& options) {
   SequenceNumber latest_snapshot;
   uint32_t seed;
@@ -2615,145 +2911,231 @@ Status DBImpl::Put(const WriteOptions& o, const Slice& key, const Slice& val) {
 Status DBImpl::Delete(const WriteOptions& options, const Slice& key) {
   return DB::Delete(options, key);
 }
-//
-//Status DBImpl::Write(const WriteOptions& options, WriteBatch* updates) {
-//  Writer w(&undefine_mutex);
-//  w.batch = updates;
-//  w.sync = options.sync;
-//  w.done = false;
-//
-//  MutexLock l(&undefine_mutex);
-//  writers_.push_back(&w);
-//  while (!w.done && &w != writers_.front()) {
-//    w.cv.Wait();
-//  }
-//  if (w.done) {
-//    return w.status;
-//  }
-//
-//  // May temporarily Unlock and wait.
-//  Status status = MakeRoomForWrite(updates == nullptr);
-//  uint64_t last_sequence = versions_->LastSequence();
-//  Writer* last_writer = &w;
-//  if (status.ok() && updates != nullptr) {  // nullptr batch is for compactions
-//    // TODO: Remove all the Lock, use fettch and add to atomically increase the
-//    // TODO: sequence num. Use concurrent write in the Rocks DB to write
-//    // TODO:  skiplist concurrently. NO log is needed as well.
-//    WriteBatch* write_batch = BuildBatchGroup(&last_writer);
-//    WriteBatchInternal::SetSequence(write_batch, last_sequence + 1);
-//    last_sequence += WriteBatchInternal::Count(write_batch);
-//
-//    // Add to log and apply to memtable.  We can release the Lock
-//    // during this phase since &w is currently responsible for logging
-//    // and protects against concurrent loggers and concurrent writes
-//    // into mem_.
-//    {
-//      undefine_mutex.Unlock();
-//      status = log_->AddRecord(WriteBatchInternal::Contents(write_batch));
-//      bool sync_error = false;
-//      if (status.ok() && options.sync) {
-//        status = logfile_->Sync();
-//        if (!status.ok()) {
-//          sync_error = true;
-//        }
-//      }
-//      if (status.ok()) {
-//        status = WriteBatchInternal::InsertInto(write_batch, mem_);
-//      }
-//      undefine_mutex.Lock();
-//      if (sync_error) {
-//        // The state of the log file is indeterminate: the log record we
-//        // just added may or may not show up when the DB is re-opened.
-//        // So we force the DB into a mode where all future writes fail.
-//        RecordBackgroundError(status);
-//      }
-//    }
-//    if (write_batch == tmp_batch_) tmp_batch_->Clear();
-//
-//    versions_->SetLastSequence(last_sequence);
-//  }
-//
-//  while (true) {
-//    Writer* ready = writers_.front();
-//    writers_.pop_front();
-//    if (ready != &w) {
-//      ready->status = status;
-//      ready->done = true;
-//      ready->cv.Signal();
-//    }
-//    if (ready == last_writer) break;
-//  }
-//
-//  // Notify new head of write queue
-//  if (!writers_.empty()) {
-//    writers_.front()->cv.Signal();
-//  }
-//
-//  return status;
-//}
+
 Status DBImpl::Write(const WriteOptions& options, WriteBatch* updates) {
-//  Writer w(&undefine_mutex);
-//  w.batch = updates;
-//  w.sync = options.sync;
-//  w.done = false;
+  assert(updates != nullptr);
+  size_t kv_num = WriteBatchInternal::Count(updates);
+  if (kv_num == 0) {
+    return Status::OK();
+  }
+  Statistics* statistics = options_.statistics;
+  StopWatch write_watch(statistics, DB_WRITE);
+  RecordTick(statistics, NUMBER_KEYS_WRITTEN, kv_num);
+  RecordTick(statistics, BYTES_WRITTEN, WriteBatchInternal::ByteSize(updates));
+  // After a failed log sync we do not know what made it to the log, so
+  // every later write fails with that error.
+  Status status = BackgroundError();
+  if (!status.ok()) {
+    return status;
+  }
+  if (options_.enable_wal) {
+    // The leader of the commit group assigns the sequence numbers.
+    bool sequence_assigned = false;
+    status = WriteToLog(options, updates, &sequence_assigned);
+    if (!status.ok()) {
+      // The batch is not applied, but its sequence range is reserved and
+      // must still be counted, so that the memtables owning the range can
+      // become full.
+      if (sequence_assigned) {
+        InsertIntoMemTables(updates, true);
+      }
+      return status;
+    }
+  } else {
+    // Reserve the whole sequence range of the batch with one fetch-add.
+    WriteBatchInternal::SetSequence(updates,
+                                    versions_->AssignSequnceNumbers(kv_num));
+  }
+  return InsertIntoMemTables(updates);
+}
+
+Status DBImpl::WriteToLog(const WriteOptions& options, WriteBatch* updates,
+                          bool* sequence_assigned) {
+  Writer w(&wal_mutex_);
+  w.batch = updates;
+  w.sync = options.sync;
+  w.done = false;
+
+  MutexLock l(&wal_mutex_);
+  writers_.push_back(&w);
+  while (!w.done && &w != writers_.front()) {
+    w.cv.Wait();
+  }
+  if (w.done) {
+    *sequence_assigned = w.sequence_assigned;
+    return w.status;
+  }
+
+  // An earlier group may have failed to sync the log, do not append to it.
+  Status status = BackgroundError();
+  if (!status.ok()) {
+    writers_.pop_front();
+    if (!writers_.empty()) {
+      writers_.front()->cv.Signal();
+    }
+    *sequence_assigned = false;
+    return status;
+  }
 
+  // This writer leads a group of the writers queued behind it. The whole
+  // group gets one consecutive sequence range, so that the merged batch is
+  // a valid log record, and every member learns its own part of the range.
+  Writer* last_writer = &w;
+  WriteBatch* write_batch = BuildBatchGroup(&last_writer);
+  SequenceNumber sequence =
+      versions_->AssignSequnceNumbers(WriteBatchInternal::Count(write_batch));
+  WriteBatchInternal::SetSequence(write_batch, sequence);
+  for (Writer* member : writers_) {
+    WriteBatchInternal::SetSequence(member->batch, sequence);
+    sequence += WriteBatchInternal::Count(member->batch);
+    member->sequence_assigned = true;
+    if (member == last_writer) break;
+  }
+  *sequence_assigned = true;
+
+  // Append to the log. We can release the lock during this phase since &w
+  // is the only writer touching log_, the others wait in the queue.
+  {
+    wal_mutex_.Unlock();
+    status = log_->AddRecord(WriteBatchInternal::Contents(write_batch));
+    bool sync_error = false;
+    if (status.ok() && options.sync) {
+      status = logfile_->Sync();
+      if (!status.ok()) {
+        sync_error = true;
+      }
+    }
+    if (sync_error) {
+      // The state of the log file is indeterminate: the log record we
+      // just added may or may not show up when the DB is re-opened.
+      // Recorded before wal_mutex_ is taken again, because flush
+      // installation takes wal_mutex_ under superversion_memlist_mtx.
+      RecordBackgroundError(status);
+    }
+    wal_mutex_.Lock();
+  }
+  logfile_bytes_ += WriteBatchInternal::ByteSize(write_batch);
+  log_last_sequence_ = sequence - 1;
+  if (write_batch == tmp_batch_) tmp_batch_->Clear();
+  if (status.ok() && logfile_bytes_ >= options_.write_buffer_size) {
+    Status roll_status = RollLogFile();
+    if (!roll_status.ok()) {
+      // Keep appending to the current log.
+      Log(options_.info_log, "Log file switch failed: %s\n",
+          roll_status.ToString().c_str());
+    }
+  }
+
+  while (true) {
+    Writer* ready = writers_.front();
+    writers_.pop_front();
+    if (ready != &w) {
+      ready->status = status;
+      ready->done = true;
+      ready->cv.Signal();
+    }
+    if (ready == last_writer) break;
+  }
 
+  // Notify new head of write queue
+  if (!writers_.empty()) {
+    writers_.front()->cv.Signal();
+  }
+
+  return status;
+}
 
-  // May temporarily Unlock and wait.
-//  Status status = Status::OK();
+Status DBImpl::RollLogFile() {
+  wal_mutex_.AssertHeld();
+  uint64_t new_log_number = versions_->NewFileNumber();
+  WritableFile* lfile = nullptr;
+  Status s = env_->NewWritableFile(LogFileName(dbname_, new_log_number),
+                                   &lfile);
+  if (!s.ok()) {
+    return s;
+  }
+  // The old log is needed until every sequence number it holds is flushed.
+  retired_logs_.emplace_back(logfile_number_, log_last_sequence_);
+  logfile_->Close();
+  delete log_;
+  delete logfile_;
+  logfile_ = lfile;
+  logfile_number_ = new_log_number;
+  log_ = new log::Writer(lfile);
+  logfile_bytes_ = 0;
+  return s;
+}
+
+void DBImpl::RemoveObsoleteLogs(SequenceNumber flushed_seq) {
+  std::vector<uint64_t> obsolete;
+  {
+    MutexLock l(&wal_mutex_);
+    while (!retired_logs_.empty() &&
+           retired_logs_.front().second <= flushed_seq) {
+      obsolete.push_back(retired_logs_.front().first);
+      retired_logs_.pop_front();
+    }
+  }
+  for (uint64_t number : obsolete) {
+    Log(options_.info_log, "Delete obsolete log #%llu\n",
+        (unsigned long long)number);
+    env_->RemoveFile(LogFileName(dbname_, number));
+  }
+}
+
+Status DBImpl::InsertIntoMemTables(WriteBatch* updates, bool consume_only) {
 #ifdef TIMEPRINT
   auto start = std::chrono::high_resolution_clock::now();
   auto total_start = std::chrono::high_resolution_clock::now();
 #endif
   size_t kv_num = WriteBatchInternal::Count(updates);
-  assert(kv_num == 1);
-  uint64_t sequence = versions_->AssignSequnceNumbers(kv_num);
-  //todo: remove
-//  kv_counter0.fetch_add(1);
+  uint64_t sequence = WriteBatchInternal::Sequence(updates);
+  uint64_t last_sequence = sequence + kv_num - 1;
   MemTable* mem;
-  Status status = PickupTableToWrite(updates == nullptr, sequence, mem);
+  Status status = PickupTableToWrite(false, sequence, mem);
 #ifdef TIMEPRINT
   auto stop = std::chrono::high_resolution_clock::now();
   auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
   std::printf("preprocessing, time elapse is %zu\n",  duration.count());
 #endif
-//    size_t seq_count = 1;
-//  spin_mutex.Lock();
-//  uint64_t sequence = versions_->LastSequence_nonatomic();
-//  versions_->SetLastSequence_nonatomic(sequence+seq_count);
-//  spin_mutex.Unlock();
-//  uint64_t sequence = 10;
   //TOTHINK: what if a write with a higher seq first go outside MakeRoomForwrite,
   // and it is supposed to write to the new memtable which has not been created yet.
   // hint how about set the metable barrier as seq_num rather than memory size?
 #ifdef TIMEPRINT
   start = std::chrono::high_resolution_clock::now();
 #endif
-  if (status.ok()) {  // nullptr batch is for compactions
-    assert(updates != nullptr);
-    WriteBatchInternal::SetSequence(updates, sequence);
-
-//    if (sequence >= mem_.load()->GetFirstseq()) {
-//      status = WriteBatchInternal::InsertInto(updates, mem_);
-//    }else{
-//      // TODO: some write may have write to immtable, the immutable need to be notified
-//      // when all the outgoing write on this table have finished and flush to storage
-//      status = WriteBatchInternal::InsertInto(updates, imm_);
-//    }
+  if (status.ok()) {
     assert(sequence <= mem->Getlargest_seq_supposed() && sequence >= mem->GetFirstseq());
-    status = WriteBatchInternal::InsertInto(updates, mem);
-    mem->increase_seq_count(kv_num);
-  }else{
-    printf("Weird status not OK");
-    assert(0==1);
-  }
-//  kv_counter1.fetch_add(1);
-//  if (mem_switching){}
-//  thread_ready_num++;
-//  printf("thread ready %d\n", thread_ready_num);
-//  if (thread_ready_num >= thread_num) {
-//    cv.notify_all();
-//  }
+    if (last_sequence <= mem->Getlargest_seq_supposed()) {
+      // Common case: the whole batch fits into one memtable.
+      if (!consume_only) {
+        status = WriteBatchInternal::InsertInto(updates, mem);
+      }
+      mem->increase_seq_count(kv_num);
+    } else {
+      // The batch crosses the border of the memtable, insert it segment by
+      // segment. Every memtable gets exactly the part of the sequence range
+      // it owns, so that its seq_count can still reach its capacity.
+      uint64_t seg_start = sequence;
+      while (true) {
+        uint64_t seg_end =
+            std::min(last_sequence, (uint64_t)mem->Getlargest_seq_supposed());
+        if (!consume_only) {
+          status = WriteBatchInternal::InsertInto(updates, mem, seg_start,
+                                                  seg_end);
+        }
+        mem->increase_seq_count(seg_end - seg_start + 1);
+        if (!status.ok() || seg_end == last_sequence) {
+          break;
+        }
+        seg_start = seg_end + 1;
+        status = PickupTableToWrite(false, seg_start, mem);
+        if (!status.ok()) {
+          break;
+        }
+      }
+    }
+  }
 #ifdef TIMEPRINT
   stop = std::chrono::high_resolution_clock::now();
   duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
@@ -2761,7 +3143,6 @@ Status DBImpl::Write(const WriteOptions& options, WriteBatch* updates) {
   std::printf("Real insert to memtable, time elapse is %zu\n",  duration.count());
   std::printf("total time, time elapse is %zu\n",  total_duration.count());
 #endif
-//  printf("A value has been inserted\n");
   return status;
 }
 
@@ -2794,7 +3175,8 @@ Status DBImpl::PickupTableToWrite(bool force, uint64_t seq_num, MemTable*& mem_r
       Log(options_.info_log, "Current memtable full; waiting...\n");
       mem_r = mem_.load();
       while ((imm_.current_memtable_num() >= config::Immutable_StopWritesTrigger || versions_->NumLevelFiles(0) >=
-             config::kL0_StopWritesTrigger) && seq_num > mem_r->Getlargest_seq_supposed()) {
+             config::kL0_StopWritesTrigger) && seq_num > mem_r->Getlargest_seq_supposed() &&
+             !has_bg_error_.load(std::memory_order_acquire)) {
         assert(seq_num > mem_r->GetFirstseq());
 //        std::cout << "Writer is going to wait current immutable number " << (imm_.current_memtable_num()) << " Level 0 file number "
 //                  << (versions_->NumLevelFiles(0)) <<std::endl;
@@ -2802,6 +3184,12 @@ Status DBImpl::PickupTableToWrite(bool force, uint64_t seq_num, MemTable*& mem_r
 //        printf("thread was waked up\n");
         mem_r = mem_.load();
       }
+      // The flushes that would make room have stopped.
+      if (seq_num > mem_r->Getlargest_seq_supposed() &&
+          has_bg_error_.load(std::memory_order_acquire)) {
+        lck.unlock();
+        return BackgroundError();
+      }
 //      imm_mtx.unlock();
     } else if(level0_filenum > config::kL0_SlowdownWritesTrigger && !delayed){
       env_->SleepForMicroseconds(5);
@@ -2828,7 +3216,7 @@ Status DBImpl::PickupTableToWrite(bool force, uint64_t seq_num, MemTable*& mem_r
         temp_mem->SetFirstSeq(last_mem_seq+1);
         // starting from this sequenctial number, the data should write the the new memtable
         // set the immutable as seq_num - 1
-        temp_mem->SetLargestSeq(last_mem_seq + MEMTABLE_SEQ_SIZE);
+        temp_mem->SetLargestSeq(last_mem_seq + NextMemtableSeqRange(mem_r));
         temp_mem->Ref();
         mem_r->SetFlushState(MemTable::FLUSH_REQUESTED);
         mem_.store(temp_mem);
@@ -2845,7 +3233,14 @@ Status DBImpl::PickupTableToWrite(bool force, uint64_t seq_num, MemTable*& mem_r
 #ifndef NDEBUG
         locked = false;
 #endif
-        return s;
+        if (seq_num <= temp_mem->Getlargest_seq_supposed()) {
+          return s;
+        }
+        // seq_num is beyond the new table as well, e.g. when large batches
+        // were handed out sequences before any of them switched the table.
+        // Keep switching; the writers of the skipped ranges find their tables
+        // in imm_.
+        continue;
       }
 #ifndef NDEBUG
       locked = false;
@@ -2873,6 +3268,31 @@ Status DBImpl::PickupTableToWrite(bool force, uint64_t seq_num, MemTable*& mem_r
     }
   }
 }
+uint64_t DBImpl::NextMemtableSeqRange(MemTable* full_mem) {
+  // The full table may still have in-flight writers, estimate the entry size
+  // from what has been inserted so far.
+  size_t entries = full_mem->Get_seq_count();
+  if (entries >= MEMTABLE_SEQ_SIZE_MIN) {
+    double sample =
+        static_cast<double>(full_mem->ApproximateMemoryUsage()) / entries;
+    // Exponential moving average, so that a change of the value size
+    // converges within a few memtables.
+    avg_entry_size_ = avg_entry_size_ == 0
+                          ? sample
+                          : 0.5 * avg_entry_size_ + 0.5 * sample;
+  }
+  if (avg_entry_size_ == 0) {
+    return full_mem->Get_seq_capacity();
+  }
+  return MemtableSeqRange(avg_entry_size_);
+}
+uint64_t DBImpl::MemtableSeqRange(double entry_size) const {
+  uint64_t range =
+      static_cast<uint64_t>(options_.write_buffer_size / entry_size);
+  if (range < MEMTABLE_SEQ_SIZE_MIN) range = MEMTABLE_SEQ_SIZE_MIN;
+  if (range > MEMTABLE_SEQ_SIZE_MAX) range = MEMTABLE_SEQ_SIZE_MAX;
+  return range;
+}
 // TOTHINK The write batch should not too large. other wise the wait function may
 // memtable could overflow even before the actual write.
 // ---------------Lock free----------------
@@ -3074,7 +3494,7 @@ Status DBImpl::PickupTableToWrite(bool force, uint64_t seq_num, MemTable*& mem_r
 // REQUIRES: Writer list must be non-empty
 // REQUIRES: First writer must have a non-null batch
 WriteBatch* DBImpl::BuildBatchGroup(Writer** last_writer) {
-//  undefine_mutex.AssertHeld();
+  wal_mutex_.AssertHeld();
   assert(!writers_.empty());
   Writer* first = writers_.front();
   WriteBatch* result = first->batch;
@@ -3165,12 +3585,36 @@ bool DBImpl::GetProperty(const Slice& property, std::string* value) {
         value->append(buf);
       }
     }
+    if (options_.statistics != nullptr) {
+      value->append("\n");
+      value->append(options_.statistics->ToString());
+    }
     return true;
   } else if (in == "sstables") {
     *value = versions_->current()->DebugString();
     return true;
+  } else if (in == "metadata-cache-usage") {
+    char buf[50];
+    std::snprintf(buf, sizeof(buf), "%llu",
+                  static_cast<unsigned long long>(
+                      table_cache_->MetadataCacheUsage()));
+    value->append(buf);
+    return true;
+  } else if (in == "row-cache-usage") {
+    char buf[50];
+    std::snprintf(buf, sizeof(buf), "%llu",
+                  static_cast<unsigned long long>(
+                      options_.row_cache != nullptr
+                          ? options_.row_cache->TotalCharge()
+                          : 0));
+    value->append(buf);
+    return true;
   } else if (in == "approximate-memory-usage") {
     size_t total_usage = options_.block_cache->TotalCharge();
+    total_usage += table_cache_->MetadataCacheUsage();
+    if (options_.row_cache != nullptr) {
+      total_usage += options_.row_cache->TotalCharge();
+    }
     if (mem) {
       total_usage += mem->ApproximateMemoryUsage();
     }
@@ -3219,6 +3663,17 @@ Status DB::Delete(const WriteOptions& opt, const Slice& key) {
   return Write(opt, &batch);
 }
 
+std::vector<Status> DB::MultiGet(const ReadOptions& options,
+                                 const std::vector<Slice>& keys,
+                                 std::vector<std::string>* values) {
+  values->resize(keys.size());
+  std::vector<Status> statuses(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    statuses[i] = Get(options, keys[i], &(*values)[i]);
+  }
+  return statuses;
+}
+
 DB::~DB() = default;
 
 Status DB::Open(const Options& options, const std::string& dbname, DB** dbptr) {
@@ -3242,17 +3697,49 @@ Status DB::Open(const Options& options, const std::string& dbname, DB** dbptr) {
       impl->logfile_number_ = new_log_number;
       impl->log_ = new log::Writer(lfile);
       impl->mem_ = new MemTable(impl->internal_comparator_);
-      impl->mem_.load()->SetFirstSeq(0);
-      impl->mem_.load()->SetLargestSeq(MEMTABLE_SEQ_SIZE-1);
+      uint64_t first_seq = impl->versions_->LastSequence();
+      impl->mem_.load()->SetFirstSeq(first_seq);
+      impl->mem_.load()->SetLargestSeq(
+          first_seq + impl->MemtableSeqRange(MEMTABLE_ENTRY_SIZE_ESTIMATE) -
+          1);
       impl->mem_.load()->Ref();
     }
   }
+  // Without the WAL the replayed records are not logged again, so until a
+  // flush covers them the recovered logs are their only durable copy.
+  const bool keep_recovered_logs =
+      !options.enable_wal && !impl->recovered_records_.empty();
+  if (s.ok()) {
+    s = impl->ReplayRecoveredLogs();
+  }
   if (s.ok() && save_manifest) {
     edit.SetPrevLogNumber(0);  // No older logs needed after recovery.
-    edit.SetLogNumber(impl->logfile_number_);
+    edit.SetLogNumber(keep_recovered_logs ? impl->recovered_logs_.front()
+                                          : impl->logfile_number_);
     std::unique_lock<std::mutex> lck(impl->versionset_mtx);
     s = impl->versions_->LogAndApply(&edit, 0);
   }
+  if (s.ok() && keep_recovered_logs) {
+    // Retire them like rolled logs, RemoveObsoleteLogs() deletes them once
+    // the last replayed sequence is flushed.
+    MutexLock l(&impl->wal_mutex_);
+    const SequenceNumber replayed_seq = impl->versions_->LastSequence() - 1;
+    for (uint64_t number : impl->recovered_logs_) {
+      impl->retired_logs_.emplace_back(number, replayed_seq);
+    }
+    impl->recovered_logs_.clear();
+  } else if (s.ok()) {
+    // The recovered logs are older than the log number in the manifest now.
+    for (uint64_t number : impl->recovered_logs_) {
+      options.env->RemoveFile(LogFileName(dbname, number));
+    }
+    impl->recovered_logs_.clear();
+  }
+  if (s.ok() && impl->super_version.load() == nullptr) {
+    // A fresh database has not switched a memtable yet, so nothing has
+    // installed a SuperVersion for readers to pick up.
+    impl->InstallSuperVersion();
+  }
   if (s.ok()) {
 //    impl->RemoveObsoleteFiles();
   impl->MaybeScheduleFlushOrCompaction();
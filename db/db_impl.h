@@ -94,6 +94,9 @@ class DBImpl : public DB {
   Status Write(const WriteOptions& options, WriteBatch* updates) override;
   Status Get(const ReadOptions& options, const Slice& key,
              std::string* value) override;
+  std::vector<Status> MultiGet(const ReadOptions& options,
+                               const std::vector<Slice>& keys,
+                               std::vector<std::string>* values) override;
   Iterator* NewIterator(const ReadOptions&) override;
   const Snapshot* GetSnapshot() override;
   void ReleaseSnapshot(const Snapshot* snapshot) override;
@@ -162,9 +165,11 @@ class DBImpl : public DB {
   // Errors are recorded in bg_error_.
   void CompactMemTable() EXCLUSIVE_LOCKS_REQUIRED(undefine_mutex);
 
-  Status RecoverLogFile(uint64_t log_number, bool last_log, bool* save_manifest,
-                        VersionEdit* edit, SequenceNumber* max_sequence)
+  Status RecoverLogFile(uint64_t log_number, SequenceNumber* max_sequence)
       EXCLUSIVE_LOCKS_REQUIRED(undefine_mutex);
+  // Re-apply the records collected by RecoverLogFile through the regular
+  // write path and drop the replayed log files.
+  Status ReplayRecoveredLogs();
 
   Status WriteLevel0Table(FlushJob* job, VersionEdit* edit)
       EXCLUSIVE_LOCKS_REQUIRED(undefine_mutex);
@@ -172,14 +177,37 @@ class DBImpl : public DB {
   EXCLUSIVE_LOCKS_REQUIRED(undefine_mutex);
   Status PickupTableToWrite(bool force, uint64_t seq_num, MemTable*& mem_r)
       EXCLUSIVE_LOCKS_REQUIRED(undefine_mutex);
+  // Size of the sequence range for the memtable replacing full_mem, so that
+  // the arena of the new table stays close to options_.write_buffer_size.
+  // Called with superversion_memlist_mtx held.
+  uint64_t NextMemtableSeqRange(MemTable* full_mem);
+  // Sequence range that fills options_.write_buffer_size with entries of
+  // "entry_size" bytes, within [MEMTABLE_SEQ_SIZE_MIN, MEMTABLE_SEQ_SIZE_MAX].
+  uint64_t MemtableSeqRange(double entry_size) const;
   WriteBatch* BuildBatchGroup(Writer** last_writer)
-      EXCLUSIVE_LOCKS_REQUIRED(undefine_mutex);
+      EXCLUSIVE_LOCKS_REQUIRED(wal_mutex_);
+  // Append updates to the write-ahead log as part of a group commit and
+  // assign its sequence numbers. *sequence_assigned tells whether updates got
+  // a sequence range, which then has to reach the memtables even if the
+  // append failed.
+  Status WriteToLog(const WriteOptions& options, WriteBatch* updates,
+                    bool* sequence_assigned);
+  // Insert a batch with assigned sequence numbers into the memtables. With
+  // consume_only the range is only counted as used and nothing is inserted.
+  Status InsertIntoMemTables(WriteBatch* updates, bool consume_only = false);
+  // Switch to a new log file once the current one is large enough.
+  Status RollLogFile() EXCLUSIVE_LOCKS_REQUIRED(wal_mutex_);
+  // Delete the log files whose records are all covered by flushed tables.
+  void RemoveObsoleteLogs(SequenceNumber flushed_seq);
 
   void RecordBackgroundError(const Status& s);
+  // The first background error, or OK if there was none.
+  Status BackgroundError();
 
   void MaybeScheduleFlushOrCompaction() EXCLUSIVE_LOCKS_REQUIRED(undefine_mutex);
   static void BGWork_Flush(void* thread_args);
   static void BGWork_Compaction(void* thread_args);
+  static void BGWork_Subcompaction(void* thread_args);
   void BackgroundCall();
   void BackgroundFlush(void* p);
   void BackgroundCompaction(void* p) EXCLUSIVE_LOCKS_REQUIRED(undefine_mutex);
@@ -204,6 +232,9 @@ class DBImpl : public DB {
   void CleanupSuperVersion(SuperVersion* sv);
   void ReturnAndCleanupSuperVersion(SuperVersion* sv);
   SuperVersion* GetThreadLocalSuperVersion();
+  // Ref() and return the current SuperVersion without taking
+  // superversion_memlist_mtx.
+  SuperVersion* RefCurrentSuperVersion();
   bool ReturnThreadLocalSuperVersion(SuperVersion* sv);
   void ResetThreadLocalSuperVersions();
   void InstallSuperVersion();
@@ -217,6 +248,8 @@ class DBImpl : public DB {
   void remote_qp_reset(std::string& q_id);
   void client_message_polling_and_handling_thread(std::string q_id);
   void install_version_edit_handler(RDMA_Request request, std::string client_ip);
+  // Decode a version edit sent by the memory node and install it.
+  void Apply_Version_Edit(const Slice& serialized_edit, size_t version_id);
 
   // Constant after construction
   Env* const env_;
@@ -230,6 +263,18 @@ class DBImpl : public DB {
   // table_cache_ provides its own synchronization
   TableCache* const table_cache_;
 
+  // Prefix that keeps this DB's entries apart in a shared options_.row_cache.
+  uint64_t row_cache_id_;
+  // Row cache key of "key" as read from the tables of version "v".
+  std::string RowCacheKey(const Version* v, const Slice& key) const;
+  // Returns true and fills *value and *s if options_.row_cache holds
+  // "row_key".
+  bool LookupRowCache(const std::string& row_key, std::string* value,
+                      Status* s);
+  // Cache the outcome of a table lookup, if it is a found or not found.
+  void InsertRowCache(const std::string& row_key, const Status& s,
+                      const std::string& value);
+
   // Lock over the persistent DB state.  Non-null iff successfully acquired.
   FileLock* db_lock_;
   std::atomic<bool> mem_switching;
@@ -249,17 +294,34 @@ class DBImpl : public DB {
   bool check_and_clear_pending_recvWR = false;
 //  SpinMutex LSMv_mtx;
   std::atomic<MemTable*> mem_;
+  // Running average of the arena bytes per memtable entry, guarded by
+  // superversion_memlist_mtx. Zero until the first memtable switch.
+  double avg_entry_size_;
 //  std::atomic<MemTable*> imm_;  // Memtable being compacted
   MemTableList imm_;
   std::atomic<bool> has_imm_;         // So bg thread can detect non-null imm_
+  // State below is protected by wal_mutex_, the group commit leader owns
+  // log_ and logfile_ while it appends outside of the mutex.
+  port::Mutex wal_mutex_;
   WritableFile* logfile_;
   uint64_t logfile_number_;
   log::Writer* log_;
+  // Bytes appended to the current log file.
+  uint64_t logfile_bytes_ GUARDED_BY(wal_mutex_);
+  // Largest sequence number appended to the current log file.
+  SequenceNumber log_last_sequence_ GUARDED_BY(wal_mutex_);
+  // Retired log files and the largest sequence number each of them holds,
+  // oldest first.
+  std::deque<std::pair<uint64_t, SequenceNumber>> retired_logs_
+      GUARDED_BY(wal_mutex_);
+  // Log records found by Recover, replayed once the memtable is created.
+  std::vector<std::string> recovered_records_;
+  std::vector<uint64_t> recovered_logs_;
   uint32_t seed_;  // For sampling.
 
   // Queue of writers.
-  std::deque<Writer*> writers_;
-  WriteBatch* tmp_batch_;
+  std::deque<Writer*> writers_ GUARDED_BY(wal_mutex_);
+  WriteBatch* tmp_batch_ GUARDED_BY(wal_mutex_);
 
   SnapshotList snapshots_;
 
@@ -274,15 +336,20 @@ class DBImpl : public DB {
 
   VersionSet* const versions_;
 
-  // Have we encountered a background error in paranoid mode?
-  Status bg_error_;
+  // Have we encountered a background error in paranoid mode? Set once, by
+  // RecordBackgroundError, read through BackgroundError().
+  std::mutex bg_error_mtx_;
+  Status bg_error_ GUARDED_BY(bg_error_mtx_);
+  std::atomic<bool> has_bg_error_;
 
   CompactionStats stats_[config::kNumLevels];
 //  std::atomic<size_t> memtable_counter = 0;
 //  std::atomic<size_t> kv_counter0 = 0;
 //  std::atomic<size_t> kv_counter1 = 0;
   std::atomic<uint64_t> super_version_number_;
-  SuperVersion* super_version;
+  // Written under superversion_memlist_mtx, read without it, see
+  // RefCurrentSuperVersion().
+  std::atomic<SuperVersion*> super_version;
 //  std::unique_ptr<ThreadLocalPtr> local_sv_;
   ThreadLocalPtr* local_sv_;
   std::vector<std::thread> main_comm_threads;
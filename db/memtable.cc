@@ -11,11 +11,6 @@
 #include "util/coding.h"
 
 namespace TimberSaw {
-#ifdef PROCESSANALYSIS
-std::atomic<uint64_t> MemTable::GetTimeElapseSum = 0;
-std::atomic<uint64_t> MemTable::GetNum = 0;
-std::atomic<uint64_t> MemTable::foundNum = 0;
-#endif
 //
 //static Slice GetLengthPrefixedSlice(const char* data) {
 //  uint32_t len;
@@ -120,9 +115,6 @@ Iterator* MemTable::NewIterator() { return new MemTableIterator(&table_); }
 }
 
 bool MemTable::Get(const LookupKey& key, std::string* value, Status* s) {
-#ifdef PROCESSANALYSIS
-  auto start = std::chrono::high_resolution_clock::now();
-#endif
   Slice memkey = key.memtable_key();
   Table::Iterator iter(&table_);
   iter.Seek(memkey.data());
@@ -147,9 +139,6 @@ bool MemTable::Get(const LookupKey& key, std::string* value, Status* s) {
         case kTypeValue: {
           Slice v = GetLengthPrefixedSlice(key_ptr + key_length);
           value->assign(v.data(), v.size());
-#ifdef PROCESSANALYSIS
-          foundNum.fetch_add(1);
-#endif
           return true;
         }
         case kTypeDeletion:
@@ -158,13 +147,6 @@ bool MemTable::Get(const LookupKey& key, std::string* value, Status* s) {
       }
     }
   }
-#ifdef PROCESSANALYSIS
-  auto stop = std::chrono::high_resolution_clock::now();
-  auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
-//  std::printf("Get from memtable (not found) time elapse is %zu\n",  duration.count());
-  GetTimeElapseSum.fetch_add(duration.count());
-  GetNum.fetch_add(1);
-#endif
   return false;
 }
 
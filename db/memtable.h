@@ -4,8 +4,16 @@
 
 #ifndef STORAGE_TimberSaw_DB_MEMTABLE_H_
 #define STORAGE_TimberSaw_DB_MEMTABLE_H_
-#define MEMTABLE_SEQ_SIZE 153846 //Make the in memory buffer close to 64MB
-// #define MEMTABLE_SEQ_SIZE 610081
+// The sequence range of a memtable is derived from
+// Options::write_buffer_size and the average entry size, observed from the
+// earlier memtables, see DBImpl::NextMemtableSeqRange. The first memtable
+// assumes MEMTABLE_ENTRY_SIZE_ESTIMATE bytes per entry (400 byte values).
+#define MEMTABLE_ENTRY_SIZE_ESTIMATE 436
+// Close to 64MB of 400 byte values.
+#define MEMTABLE_SEQ_SIZE 153846
+// Bounds of the sequence range of a memtable.
+#define MEMTABLE_SEQ_SIZE_MIN 1024
+#define MEMTABLE_SEQ_SIZE_MAX (16 * MEMTABLE_SEQ_SIZE)
 #include "db/dbformat.h"
 #include "db/inlineskiplist.h"
 #include <string>
@@ -44,11 +52,6 @@ class MemTable {
   std::atomic<bool> able_to_flush = false;
   std::shared_ptr<RemoteMemTableMetaData> sstable;
   const KeyComparator comparator;
-#ifdef PROCESSANALYSIS
-  static std::atomic<uint64_t> GetTimeElapseSum;
-  static std::atomic<uint64_t> GetNum;
-  static std::atomic<uint64_t> foundNum;
-#endif
   explicit MemTable(const InternalKeyComparator& cmp);
   MemTable(const MemTable&) = delete;
   MemTable& operator=(const MemTable&) = delete;
@@ -67,7 +70,7 @@ class MemTable {
     assert(refs_ >= 0);
     if (refs_ <= 0) {
       // TODO: THis assertion may changed in the future
-      assert(seq_count.load() == MEMTABLE_SEQ_SIZE);
+      assert(seq_count.load() == Get_seq_capacity());
       delete this;
     }
   }
@@ -131,19 +134,24 @@ class MemTable {
   uint64_t GetFirstseq() const{
     return first_seq;
   }
+  // Account for num sequence numbers that have been inserted into this table.
+  // A write batch crossing the border of this table only reports the part of
+  // its sequence range that falls into [first_seq, largest_seq_supposed].
   void increase_seq_count(size_t num){
-    seq_count.fetch_add(num);
-    assert(num == 1);
-    assert(seq_count <= MEMTABLE_SEQ_SIZE);
-    //TODO; For a write batch you the write may cross the boder, we need to modify
-    // the boder of the next table
-    if (seq_count >= MEMTABLE_SEQ_SIZE){
+    size_t new_count = seq_count.fetch_add(num) + num;
+    assert(new_count <= Get_seq_capacity());
+    if (new_count >= Get_seq_capacity()){
       able_to_flush.store(true);
     }
   }
   size_t Get_seq_count(){
     return seq_count;
   }
+  // The number of sequence numbers this table owns, the table is full once
+  // seq_count reaches it.
+  size_t Get_seq_capacity() const{
+    return largest_seq_supposed - first_seq + 1;
+  }
  private:
   friend class MemTableIterator;
   friend class MemTableBackwardIterator;
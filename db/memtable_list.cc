@@ -90,13 +90,6 @@ void MemTableListVersion::Unref(autovector<MemTable*>* to_delete) {
   }
 }
 MemTableList::~MemTableList(){
-#ifdef PROCESSANALYSIS
-  if (MemTable::GetNum.load() >0)
-    printf("Memtable GET time statics is %zu, %zu, %zu, Memtable found Num %zu\n",
-           MemTable::GetTimeElapseSum.load(), MemTable::GetNum.load(),
-           MemTable::GetTimeElapseSum.load()/MemTable::GetNum.load(),
-           MemTable::foundNum.load());
-#endif
 }
 int MemTableList::NumNotFlushed() const {
   int size = static_cast<int>(current_.load()->memlist_.size());
@@ -876,6 +869,7 @@ Status FlushJob::BuildTable(const std::string& dbname, Env* env,
     builder->get_datablocks_map(meta->remote_data_mrs);
     builder->get_dataindexblocks_map(meta->remote_dataindex_mrs);
     builder->get_filter_map(meta->remote_filter_mrs);
+    meta->index_tail_size = builder->get_index_tail_size();
 
 
     meta->file_size = 0;
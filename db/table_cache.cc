@@ -12,23 +12,9 @@
 #include "TimberSaw/table.h"
 
 #include "util/coding.h"
+#include "util/statistics.h"
 
 namespace TimberSaw {
-#ifdef PROCESSANALYSIS
-std::atomic<uint64_t> TableCache::GetTimeElapseSum = 0;
-std::atomic<uint64_t> TableCache::GetNum = 0;
-std::atomic<uint64_t> TableCache::filtered = 0;
-std::atomic<uint64_t> TableCache::not_filtered = 0;
-std::atomic<uint64_t> TableCache::DataBinarySearchTimeElapseSum = 0;
-std::atomic<uint64_t> TableCache::IndexBinarySearchTimeElapseSum = 0;
-std::atomic<uint64_t> TableCache::DataBlockFetchBeforeCacheElapseSum = 0;
-std::atomic<uint64_t> TableCache::foundNum = 0;
-
-std::atomic<uint64_t> TableCache::cache_hit_look_up_time = 0;
-std::atomic<uint64_t> TableCache::cache_miss_block_fetch_time = 0;
-std::atomic<uint64_t> TableCache::cache_hit = 0;
-std::atomic<uint64_t> TableCache::cache_miss = 0;
-#endif
 union SSTable {
 //  RandomAccessFile* file;
 //  std::weak_ptr<RemoteMemTableMetaData> remote_table;
@@ -59,43 +45,95 @@ TableCache::TableCache(const std::string& dbname, const Options& options,
     : env_(options.env),
       dbname_(dbname),
       options_(options),
-      cache_(NewLRUCache(entries)) {}
+      cache_(NewLRUCache(entries)),
+      metadata_cache_(options.pin_metadata_max_level >= 0
+                          ? NewLRUCache(options.metadata_cache_size)
+                          : nullptr) {}
 
 TableCache::~TableCache() {
-#ifdef PROCESSANALYSIS
-  if (TableCache::GetNum.load() >0)
-    printf("Cache Get time statics is %zu, %zu, %zu, need binary search: "
-           "%zu, filtered %zu, foundNum is %zu\n",
-           TableCache::GetTimeElapseSum.load(), TableCache::GetNum.load(),
-           TableCache::GetTimeElapseSum.load()/TableCache::GetNum.load(),
-           TableCache::not_filtered.load(), TableCache::filtered.load(),
-           TableCache::foundNum.load());
-  if (TableCache::not_filtered.load() > 0){
-    printf("Average time elapse for Data binary search is %zu, "
-           "Average time elapse for Index binary search is %zu,"
-           " Average time elapse for data block fetch before cache is %zu\n",
-           TableCache::DataBinarySearchTimeElapseSum.load()/TableCache::not_filtered.load(),
-           TableCache::IndexBinarySearchTimeElapseSum.load()/TableCache::not_filtered.load(),
-           TableCache::DataBlockFetchBeforeCacheElapseSum.load()/TableCache::not_filtered.load());
-  }
-  if (TableCache::cache_miss>0&&TableCache::cache_hit>0){
-    printf("Cache hit Num %zu, average look up time %zu, Cache miss %zu, average Block Fetch time %zu\n",
-           TableCache::cache_hit.load(),TableCache::cache_hit_look_up_time.load()/TableCache::cache_hit.load(),
-           TableCache::cache_miss.load(),TableCache::cache_miss_block_fetch_time.load()/TableCache::cache_miss.load());
+  if (metadata_cache_ != nullptr) {
+    for (auto& pin : pinned_) {
+      metadata_cache_->Release(pin.handle);
+    }
+    delete metadata_cache_;
   }
-#endif
   delete cache_;
 }
 
+void TableCache::ReleaseObsoletePins() {
+  size_t live = 0;
+  for (size_t i = 0; i < pinned_.size(); i++) {
+    if (pinned_[i].remote_table.expired()) {
+      // Erase too, the cache keeps unreferenced entries up to its capacity.
+      metadata_cache_->Release(pinned_[i].handle);
+      metadata_cache_->Erase(pinned_[i].key);
+    } else {
+      pinned_[live++] = pinned_[i];
+    }
+  }
+  pinned_.resize(live);
+}
+
+void TableCache::InsertTable(
+    const Slice& key,
+    const std::shared_ptr<RemoteMemTableMetaData>& remote_table, Table* table,
+    Cache** cache, Cache::Handle** handle) {
+  SSTable* tf = new SSTable;
+  tf->table_compute = table;
+  assert(table->rep_ != nullptr);
+  if (metadata_cache_ != nullptr &&
+      remote_table->level <=
+          static_cast<uint64_t>(options_.pin_metadata_max_level)) {
+    size_t charge = table->ApproximateMetadataMemoryUsage();
+    std::lock_guard<std::mutex> lck(pin_mutex_);
+    // Another reader may have opened and pinned the table meanwhile.
+    *handle = metadata_cache_->Lookup(key);
+    if (*handle != nullptr) {
+      DeleteEntry_Compute(key, tf);
+      *cache = metadata_cache_;
+      return;
+    }
+    ReleaseObsoletePins();
+    if (metadata_cache_->TotalCharge() + charge <=
+        options_.metadata_cache_size) {
+      *handle = metadata_cache_->Insert(key, tf, charge, &DeleteEntry_Compute);
+      pinned_.push_back(PinnedTable{remote_table, remote_table->number,
+                                    key.ToString(),
+                                    metadata_cache_->Lookup(key)});
+      *cache = metadata_cache_;
+      return;
+    }
+  }
+  *handle = cache_->Insert(key, tf, 1, &DeleteEntry_Compute);
+  *cache = cache_;
+}
+
+size_t TableCache::MetadataCacheUsage() {
+  if (metadata_cache_ == nullptr) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> lck(pin_mutex_);
+  ReleaseObsoletePins();
+  return metadata_cache_->TotalCharge();
+}
+
 Status TableCache::FindTable(
     std::shared_ptr<RemoteMemTableMetaData> Remote_memtable_meta,
-    Cache::Handle** handle) {
+    Cache** cache, Cache::Handle** handle) {
   Status s;
   char buf[sizeof(Remote_memtable_meta->number) + sizeof(Remote_memtable_meta->creator_node_id)];
   EncodeFixed64(buf, Remote_memtable_meta->number);
   memcpy(buf + sizeof(Remote_memtable_meta->number), &Remote_memtable_meta->creator_node_id,
          sizeof(Remote_memtable_meta->creator_node_id));
   Slice key(buf, sizeof(buf));
+  if (metadata_cache_ != nullptr) {
+    *handle = metadata_cache_->Lookup(key);
+    if (*handle != nullptr) {
+      *cache = metadata_cache_;
+      return s;
+    }
+  }
+  *cache = cache_;
   *handle = cache_->Lookup(key);
   if (*handle == nullptr) {
     Table* table = nullptr;
@@ -110,12 +148,7 @@ Status TableCache::FindTable(
       // We do not cache error results so that if the error is transient,
       // or somebody repairs the file, we recover automatically.
     } else {
-      SSTable* tf = new SSTable;
-//      tf->file = file;
-//      tf->remote_table = Remote_memtable_meta;
-      tf->table_compute = table;
-      assert(table->rep_ != nullptr);
-      *handle = cache_->Insert(key, tf, 1, &DeleteEntry_Compute);
+      InsertTable(key, Remote_memtable_meta, table, cache, handle);
     }
   }
   return s;
@@ -161,15 +194,16 @@ Iterator* TableCache::NewIterator(
     *tableptr = nullptr;
   }
 
+  Cache* cache = nullptr;
   Cache::Handle* handle = nullptr;
-  Status s = FindTable(std::move(remote_table), &handle);
+  Status s = FindTable(std::move(remote_table), &cache, &handle);
   if (!s.ok()) {
     return NewErrorIterator(s);
   }
 
-  Table* table = reinterpret_cast<SSTable*>(cache_->Value(handle))->table_compute;
+  Table* table = reinterpret_cast<SSTable*>(cache->Value(handle))->table_compute;
   Iterator* result = table->NewIterator(options);
-  result->RegisterCleanup(&UnrefEntry, cache_, handle);
+  result->RegisterCleanup(&UnrefEntry, cache, handle);
   if (tableptr != nullptr) {
     *tableptr = table;
   }
@@ -209,23 +243,59 @@ Status TableCache::Get(const ReadOptions& options,
                        const Slice& k, void* arg,
                        void (*handle_result)(void*, const Slice&,
                                              const Slice&)) {
-#ifdef PROCESSANALYSIS
-  auto start = std::chrono::high_resolution_clock::now();
-#endif
+  StopWatch table_get(options_.statistics, TABLE_GET);
+  Cache* cache = nullptr;
   Cache::Handle* handle = nullptr;
-  Status s = FindTable(f, &handle);
+  Status s = FindTable(f, &cache, &handle);
   if (s.ok()) {
-    Table* t = reinterpret_cast<SSTable*>(cache_->Value(handle))->table_compute;
+    Table* t = reinterpret_cast<SSTable*>(cache->Value(handle))->table_compute;
     s = t->InternalGet(options, k, arg, handle_result);
+    cache->Release(handle);
+  }
+  return s;
+}
+
+Status TableCache::GetDataBlockSizes(
+    std::shared_ptr<RemoteMemTableMetaData> f,
+    std::vector<std::pair<std::string, uint64_t>>* blocks) {
+  Cache* cache = nullptr;
+  Cache::Handle* handle = nullptr;
+  Status s = FindTable(std::move(f), &cache, &handle);
+  if (s.ok()) {
+    Table* t = reinterpret_cast<SSTable*>(cache->Value(handle))->table_compute;
+    t->GetDataBlockSizes(blocks);
+    cache->Release(handle);
+  }
+  return s;
+}
+
+Status TableCache::GetDataBlockSizes_MemorySide(
+    std::shared_ptr<RemoteMemTableMetaData> f,
+    std::vector<std::pair<std::string, uint64_t>>* blocks) {
+  Cache::Handle* handle = nullptr;
+  Status s = FindTable_MemorySide(std::move(f), &handle);
+  if (s.ok()) {
+    Table_Memory_Side* t =
+        reinterpret_cast<SSTable*>(cache_->Value(handle))->table_memory;
+    t->GetDataBlockSizes(blocks);
     cache_->Release(handle);
   }
-#ifdef PROCESSANALYSIS
-  auto stop = std::chrono::high_resolution_clock::now();
-  auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
-//    std::printf("Get from SSTables (not found) time elapse is %zu\n",  duration.count());
-  TableCache::GetTimeElapseSum.fetch_add(duration.count());
-  TableCache::GetNum.fetch_add(1);
-#endif
+  return s;
+}
+
+Status TableCache::MultiGet(const ReadOptions& options,
+                            std::shared_ptr<RemoteMemTableMetaData> f,
+                            size_t num, const Slice* keys, void** args,
+                            void (*handle_result)(void*, const Slice&,
+                                                  const Slice&)) {
+  Cache* cache = nullptr;
+  Cache::Handle* handle = nullptr;
+  Status s = FindTable(f, &cache, &handle);
+  if (s.ok()) {
+    Table* t = reinterpret_cast<SSTable*>(cache->Value(handle))->table_compute;
+    s = t->InternalMultiGet(options, num, keys, args, handle_result);
+    cache->Release(handle);
+  }
   return s;
 }
 
@@ -233,6 +303,19 @@ void TableCache::Evict(uint64_t file_number) {
   char buf[sizeof(file_number)];
   EncodeFixed64(buf, file_number);
   cache_->Erase(Slice(buf, sizeof(buf)));
+  if (metadata_cache_ != nullptr) {
+    std::lock_guard<std::mutex> lck(pin_mutex_);
+    size_t live = 0;
+    for (size_t i = 0; i < pinned_.size(); i++) {
+      if (pinned_[i].number == file_number) {
+        metadata_cache_->Release(pinned_[i].handle);
+        metadata_cache_->Erase(pinned_[i].key);
+      } else {
+        pinned_[live++] = pinned_[i];
+      }
+    }
+    pinned_.resize(live);
+  }
 }
 
 }  // namespace TimberSaw
@@ -10,7 +10,9 @@
 #include "db/dbformat.h"
 #include "db/version_edit.h"
 #include <cstdint>
+#include <mutex>
 #include <string>
+#include <vector>
 //#include <table/table_memoryside.h>
 
 #include "TimberSaw/cache.h"
@@ -26,22 +28,6 @@ class TableCache {
  public:
   TableCache(const std::string& dbname, const Options& options, int entries);
   ~TableCache();
-#ifdef PROCESSANALYSIS
-  static std::atomic<uint64_t> GetTimeElapseSum;
-  static std::atomic<uint64_t> GetNum;
-  static std::atomic<uint64_t> not_filtered;
-  static std::atomic<uint64_t> DataBinarySearchTimeElapseSum;
-  static std::atomic<uint64_t> IndexBinarySearchTimeElapseSum;
-  static std::atomic<uint64_t> DataBlockFetchBeforeCacheElapseSum;
-  static std::atomic<uint64_t> filtered;
-  static std::atomic<uint64_t> foundNum;
-
-  static std::atomic<uint64_t> cache_hit_look_up_time;
-  static std::atomic<uint64_t> cache_miss_block_fetch_time;
-  static std::atomic<uint64_t> cache_hit;
-  static std::atomic<uint64_t> cache_miss;
-
-#endif
   // Return an iterator for the specified file number (the corresponding
   // file length must be exactly "file_size" bytes).  If "tableptr" is
   // non-null, also sets "*tableptr" to point to the Table object
@@ -55,21 +41,6 @@ class TableCache {
   Iterator* NewIterator_MemorySide(const ReadOptions& options,
                         std::shared_ptr<RemoteMemTableMetaData> remote_table,
       Table_Memory_Side** tableptr = nullptr);
-  static void CleanAll(){
-    GetTimeElapseSum = 0;
-    GetNum = 0;
-    filtered = 0;
-    not_filtered = 0;
-    DataBinarySearchTimeElapseSum = 0;
-    IndexBinarySearchTimeElapseSum = 0;
-    DataBlockFetchBeforeCacheElapseSum = 0;
-    foundNum = 0;
-
-    cache_hit_look_up_time = 0;
-    cache_miss_block_fetch_time = 0;
-    cache_hit = 0;
-    cache_miss = 0;
-  }
   // If a seek to internal key "k" in specified file finds an entry,
   // call (*handle_result)(arg, found_key, found_value).
   Status Get(const ReadOptions& options,
@@ -77,18 +48,61 @@ class TableCache {
              void* arg,
              void (*handle_result)(void*, const Slice&, const Slice&));
 
+  // Batched Get(): for every keys[i] that finds an entry in "f", call
+  // (*handle_result)(args[i], found_key, found_value). "keys" must be sorted.
+  Status MultiGet(const ReadOptions& options,
+                  std::shared_ptr<RemoteMemTableMetaData> f, size_t num,
+                  const Slice* keys, void** args,
+                  void (*handle_result)(void*, const Slice&, const Slice&));
+
+  // Append the index key and size of every data block of "f", in key
+  // order, to *blocks.
+  Status GetDataBlockSizes(
+      std::shared_ptr<RemoteMemTableMetaData> f,
+      std::vector<std::pair<std::string, uint64_t>>* blocks);
+  Status GetDataBlockSizes_MemorySide(
+      std::shared_ptr<RemoteMemTableMetaData> f,
+      std::vector<std::pair<std::string, uint64_t>>* blocks);
+
   // Evict any entry for the specified file number
   void Evict(uint64_t file_number);
 
+  // Bytes of index and filter blocks pinned in the metadata cache.
+  size_t MetadataCacheUsage();
+
  private:
+  // A table whose metadata is pinned: "handle" holds a reference on its
+  // metadata cache entry until the table is no longer live.
+  struct PinnedTable {
+    std::weak_ptr<RemoteMemTableMetaData> remote_table;
+    uint64_t number;
+    std::string key;
+    Cache::Handle* handle;
+  };
+
+  // Look the table up in the metadata cache, then in the table cache, and
+  // open it on a miss.  Sets *cache to the cache that owns *handle.
   Status FindTable(std::shared_ptr<RemoteMemTableMetaData> Remote_memtable_meta,
-                   Cache::Handle** handle);
+                   Cache** cache, Cache::Handle** handle);
+  // Insert an opened compute-side table, pinning it if its level is pinned
+  // and the budget allows.  Takes ownership of "table".
+  void InsertTable(const Slice& key,
+                   const std::shared_ptr<RemoteMemTableMetaData>& remote_table,
+                   Table* table, Cache** cache, Cache::Handle** handle);
+  // Drop the pins of tables that are no longer live.
+  // REQUIRES: pin_mutex_ held.
+  void ReleaseObsoletePins();
+
   Status FindTable_MemorySide(std::shared_ptr<RemoteMemTableMetaData> Remote_memtable_meta,
                    Cache::Handle** handle);
   Env* const env_;
   const std::string dbname_;
   const Options& options_;
   Cache* cache_;
+  // Null unless options.pin_metadata_max_level >= 0.
+  Cache* metadata_cache_;
+  std::mutex pin_mutex_;
+  std::vector<PinnedTable> pinned_;
 };
 
 }  // namespace TimberSaw
@@ -15,7 +15,7 @@ namespace TimberSaw {
 //  node_id = rdma_mg->node_id;
 //}
 RemoteMemTableMetaData::RemoteMemTableMetaData(int side)
-    : this_machine_type(side), allowed_seeks(1 << 30) {
+    : this_machine_type(side), level(0), allowed_seeks(1 << 30) {
   if (side ==0){
     rdma_mg = Env::Default()->rdma_mg;
     creator_node_id = rdma_mg->node_id;
@@ -42,6 +42,7 @@ void RemoteMemTableMetaData::EncodeTo(std::string* dst) const {
   PutFixed64(dst, remote_data_chunk_num);
   PutFixed64(dst, remote_dataindex_chunk_num);
   PutFixed64(dst, remote_filter_chunk_num);
+  PutFixed32(dst, index_tail_size);
   //Here we suppose all the remote memory chuck for the same table have similar infomation  below,
   // the only difference is the addr and lenght
 //#ifndef NDEBUG
@@ -98,6 +99,7 @@ Status RemoteMemTableMetaData::DecodeFrom(Slice& src) {
   GetFixed64(&src, &remote_data_chunk_num);
   GetFixed64(&src, &remote_dataindex_chunk_num);
   GetFixed64(&src, &remote_filter_chunk_num);
+  GetFixed32(&src, &index_tail_size);
   uint64_t context_temp;
   uint64_t pd_temp;
   uint32_t handle_temp;
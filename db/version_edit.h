@@ -89,6 +89,9 @@ struct RemoteMemTableMetaData {
   std::map<uint32_t , ibv_mr*> remote_data_mrs;
   std::map<uint32_t, ibv_mr*> remote_dataindex_mrs;
   std::map<uint32_t, ibv_mr*> remote_filter_mrs;
+  // Bytes to fetch from the end of the index region when the table is
+  // opened, 0 if unknown.
+  uint32_t index_tail_size = 0;
   //std::vector<ibv_mr*> remote_data_mrs
   uint64_t file_size;    // File size in bytes
   size_t num_entries;
@@ -21,10 +21,6 @@
 #include "util/logging.h"
 
 namespace TimberSaw {
-#ifdef PROCESSANALYSIS
-std::atomic<uint64_t> VersionSet::GetTimeElapseSum = 0;
-std::atomic<uint64_t> VersionSet::GetNum = 0;
-#endif
 //std::mutex VersionSet::version_set_mtx;
 
 static size_t TargetFileSize(const Options* options) {
@@ -226,27 +222,108 @@ static bool NewestFirst(std::shared_ptr<RemoteMemTableMetaData> a, std::shared_p
   return a->number > b->number;
 }
 
+void Version::BuildLevel0Index() {
+  assert(!level0_index_built_);
+  const Comparator* ucmp = vset_->icmp_.user_comparator();
+  auto fence_less = [ucmp](const Slice& a, const Slice& b) {
+    return ucmp->Compare(a, b) < 0;
+  };
+
+  level0_newest_first_ = levels_[0];
+  std::sort(level0_newest_first_.begin(), level0_newest_first_.end(),
+            NewestFirst);
+
+  // The slices point into the file metadata, which this version keeps alive.
+  level0_fences_.clear();
+  level0_fences_.reserve(2 * level0_newest_first_.size());
+  for (const auto& f : level0_newest_first_) {
+    level0_fences_.push_back(f->smallest.user_key());
+    level0_fences_.push_back(f->largest.user_key());
+  }
+  std::sort(level0_fences_.begin(), level0_fences_.end(), fence_less);
+  level0_fences_.erase(
+      std::unique(level0_fences_.begin(), level0_fences_.end(),
+                  [ucmp](const Slice& a, const Slice& b) {
+                    return ucmp->Compare(a, b) == 0;
+                  }),
+      level0_fences_.end());
+
+  // File i covers segments [first[i], last[i]]: from its smallest fence to
+  // its largest one, including the gaps in between.
+  const size_t num_segments =
+      level0_fences_.empty() ? 0 : 2 * level0_fences_.size() - 1;
+  std::vector<uint32_t> first(level0_newest_first_.size());
+  std::vector<uint32_t> last(level0_newest_first_.size());
+  level0_segment_offsets_.assign(num_segments + 1, 0);
+  for (size_t i = 0; i < level0_newest_first_.size(); i++) {
+    const auto& f = level0_newest_first_[i];
+    first[i] = 2 * (std::lower_bound(level0_fences_.begin(),
+                                     level0_fences_.end(),
+                                     f->smallest.user_key(), fence_less) -
+                    level0_fences_.begin());
+    last[i] = 2 * (std::lower_bound(level0_fences_.begin(),
+                                    level0_fences_.end(),
+                                    f->largest.user_key(), fence_less) -
+                   level0_fences_.begin());
+    for (uint32_t seg = first[i]; seg <= last[i]; seg++) {
+      level0_segment_offsets_[seg + 1]++;
+    }
+  }
+  for (size_t seg = 0; seg < num_segments; seg++) {
+    level0_segment_offsets_[seg + 1] += level0_segment_offsets_[seg];
+  }
+
+  // Filling in newest-first file order keeps every segment newest first.
+  level0_segment_files_.resize(level0_segment_offsets_[num_segments]);
+  std::vector<uint32_t> fill(level0_segment_offsets_.begin(),
+                             level0_segment_offsets_.end() - 1);
+  for (uint32_t i = 0; i < level0_newest_first_.size(); i++) {
+    for (uint32_t seg = first[i]; seg <= last[i]; seg++) {
+      level0_segment_files_[fill[seg]++] = i;
+    }
+  }
+  level0_index_built_ = true;
+}
+
+void Version::Level0Candidates(const Slice& user_key, const uint32_t** begin,
+                               const uint32_t** end) const {
+  *begin = *end = level0_segment_files_.data();
+  if (level0_fences_.empty()) {
+    return;
+  }
+  const Comparator* ucmp = vset_->icmp_.user_comparator();
+  size_t index = std::lower_bound(level0_fences_.begin(), level0_fences_.end(),
+                                  user_key,
+                                  [ucmp](const Slice& a, const Slice& b) {
+                                    return ucmp->Compare(a, b) < 0;
+                                  }) -
+                 level0_fences_.begin();
+  size_t seg;
+  if (index == level0_fences_.size()) {
+    return;  // Past the largest key of every level-0 file.
+  } else if (ucmp->Compare(level0_fences_[index], user_key) == 0) {
+    seg = 2 * index;
+  } else if (index == 0) {
+    return;  // Before the smallest key of every level-0 file.
+  } else {
+    seg = 2 * index - 1;
+  }
+  *begin = level0_segment_files_.data() + level0_segment_offsets_[seg];
+  *end = level0_segment_files_.data() + level0_segment_offsets_[seg + 1];
+}
+
 void Version::ForEachOverlapping(Slice user_key, Slice internal_key, void* arg,
                                  bool (*func)(void*, int,
                                               std::shared_ptr<RemoteMemTableMetaData>)) {
   const Comparator* ucmp = vset_->icmp_.user_comparator();
 
   // Search level-0 in order from newest to oldest.
-  std::vector<std::shared_ptr<RemoteMemTableMetaData>> tmp;
-  tmp.reserve(levels_[0].size());
-  for (uint32_t i = 0; i < levels_[0].size(); i++) {
-    std::shared_ptr<RemoteMemTableMetaData> f = levels_[0][i];
-    if (ucmp->Compare(user_key, f->smallest.user_key()) >= 0 &&
-        ucmp->Compare(user_key, f->largest.user_key()) <= 0) {
-      tmp.push_back(f);
-    }
-  }
-  if (!tmp.empty()) {
-    std::sort(tmp.begin(), tmp.end(), NewestFirst);
-    for (uint32_t i = 0; i < tmp.size(); i++) {
-      if (!(*func)(arg, 0, tmp[i])) {
-        return;
-      }
+  const uint32_t* candidate;
+  const uint32_t* candidates_end;
+  Level0Candidates(user_key, &candidate, &candidates_end);
+  for (; candidate != candidates_end; ++candidate) {
+    if (!(*func)(arg, 0, level0_newest_first_[*candidate])) {
+      return;
     }
   }
 
@@ -272,9 +349,6 @@ void Version::ForEachOverlapping(Slice user_key, Slice internal_key, void* arg,
 
 Status Version::Get(const ReadOptions& options, const LookupKey& k,
                     std::string* value, GetStats* stats) {
-#ifdef PROCESSANALYSIS
-  auto start = std::chrono::high_resolution_clock::now();
-#endif
   stats->seek_file = nullptr;
   stats->seek_file_level = -1;
 
@@ -346,17 +420,111 @@ Status Version::Get(const ReadOptions& options, const LookupKey& k,
   state.saver.value = value;
 
   ForEachOverlapping(state.saver.user_key, state.ikey, &state, &State::Match);
-#ifdef PROCESSANALYSIS
-  if (!state.found){
-    auto stop = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
-//    std::printf("Get from SSTables (not found) time elapse is %zu\n",  duration.count());
-    VersionSet::GetTimeElapseSum.fetch_add(duration.count());
-    VersionSet::GetNum.fetch_add(1);
+  return state.found ? state.s : Status::NotFound(Slice());
+}
+
+void Version::MultiGet(const ReadOptions& options, SequenceNumber snapshot,
+                       const std::vector<Slice>& user_keys,
+                       const std::vector<std::string*>& values,
+                       std::vector<Status>* statuses) {
+  const size_t num = user_keys.size();
+  const Comparator* ucmp = vset_->icmp_.user_comparator();
+  std::vector<std::string> ikeys(num);
+  std::vector<Saver> savers(num);
+  std::vector<bool> done(num, false);
+  statuses->assign(num, Status::NotFound(Slice()));
+  for (size_t i = 0; i < num; i++) {
+    AppendInternalKey(&ikeys[i], ParsedInternalKey(user_keys[i], snapshot,
+                                                   kValueTypeForSeek));
+    savers[i].state = kNotFound;
+    savers[i].ucmp = ucmp;
+    savers[i].user_key = user_keys[i];
+    savers[i].value = values[i];
+  }
+
+  // Probe one table with the pending keys in "batch" and retire the keys
+  // that table settles, the same way State::Match does in Get().
+  std::vector<Slice> batch_keys;
+  std::vector<void*> batch_args;
+  auto search = [&](const std::shared_ptr<RemoteMemTableMetaData>& f,
+                    const std::vector<size_t>& batch) {
+    batch_keys.clear();
+    batch_args.clear();
+    for (size_t i : batch) {
+      batch_keys.emplace_back(ikeys[i]);
+      batch_args.push_back(&savers[i]);
+    }
+    Status s = vset_->table_cache_->MultiGet(options, f, batch.size(),
+                                             batch_keys.data(),
+                                             batch_args.data(), SaveValue);
+    for (size_t i : batch) {
+      if (!s.ok()) {
+        (*statuses)[i] = s;
+        done[i] = true;
+        continue;
+      }
+      switch (savers[i].state) {
+        case kNotFound:
+          break;
+        case kFound:
+          (*statuses)[i] = Status::OK();
+          done[i] = true;
+          break;
+        case kDeleted:
+          done[i] = true;
+          break;
+        case kCorrupt:
+          (*statuses)[i] =
+              Status::Corruption("corrupted key for ", savers[i].user_key);
+          done[i] = true;
+          break;
+      }
+    }
+  };
+
+  // Level-0 files may overlap, so visit them from newest to oldest and hand
+  // each one every pending key inside its range.
+  std::vector<size_t> batch;
+  for (auto& f : level0_newest_first_) {
+    batch.clear();
+    for (size_t i = 0; i < num; i++) {
+      if (!done[i] &&
+          ucmp->Compare(user_keys[i], f->smallest.user_key()) >= 0 &&
+          ucmp->Compare(user_keys[i], f->largest.user_key()) <= 0) {
+        batch.push_back(i);
+      }
+    }
+    if (!batch.empty()) {
+      search(f, batch);
+    }
   }
 
-#endif
-  return state.found ? state.s : Status::NotFound(Slice());
+  // In the other levels a key maps to at most one file, and since the keys
+  // are sorted the keys of one file are adjacent.
+  for (int level = 1; level < config::kNumLevels; level++) {
+    size_t num_files = levels_[level].size();
+    if (num_files == 0) continue;
+    batch.clear();
+    uint32_t batch_file = 0;
+    for (size_t i = 0; i < num; i++) {
+      if (done[i]) continue;
+      uint32_t index = FindFile(vset_->icmp_, levels_[level], ikeys[i]);
+      if (index >= num_files ||
+          ucmp->Compare(user_keys[i],
+                        levels_[level][index]->smallest.user_key()) < 0) {
+        continue;
+      }
+      if (!batch.empty() && index != batch_file) {
+        search(levels_[level][batch_file], batch);
+        batch.clear();
+      }
+      batch_file = index;
+      batch.push_back(i);
+    }
+    if (!batch.empty()) {
+      search(levels_[level][batch_file], batch);
+    }
+  }
 }
 
 bool Version::UpdateStats(const GetStats& stats) {
@@ -797,7 +965,9 @@ VersionSet::VersionSet(const std::string& dbname, const Options* options,
       dummy_versions_(this, std::shared_ptr<Subversion>()),
       current_(nullptr),
       version_set_mtx(mtx){
-  AppendVersion(new Version(this, std::shared_ptr<Subversion>()));
+  Version* v = new Version(this, std::shared_ptr<Subversion>());
+  v->BuildLevel0Index();
+  AppendVersion(v);
 
 }
 
@@ -806,12 +976,6 @@ VersionSet::~VersionSet() {
   assert(dummy_versions_.next_ == &dummy_versions_);  // List must be empty
   delete descriptor_log_;
   delete descriptor_file_;
-#ifdef PROCESSANALYSIS
-  if (VersionSet::GetNum.load() >0)
-    printf("LSM Version GET time statistics is %zu, %zu, %zu\n",
-           VersionSet::GetTimeElapseSum.load(), VersionSet::GetNum.load(),
-           VersionSet::GetTimeElapseSum.load()/VersionSet::GetNum.load());
-#endif
 }
 
 void VersionSet::AppendVersion(Version* v) {
@@ -821,6 +985,7 @@ void VersionSet::AppendVersion(Version* v) {
   if (current_ != nullptr) {
     current_->Unref(1);
   }
+  v->version_number_ = ++last_version_number_;
   current_ = v;
   v->Ref(1);
 #ifndef NDEBUG
@@ -1119,6 +1284,12 @@ void VersionSet::MarkFileNumberUsed(uint64_t number) {
 }
 
 void VersionSet::Finalize(Version* v) {
+  // Finalize() runs again on the current version to rotate compaction
+  // scores; its level-0 index is already built and in use by readers.
+  if (!v->level0_index_built_) {
+    v->BuildLevel0Index();
+  }
+
   // Precomputed best level for next compaction
 //  int best_level = -1;
 //  double best_score = -1;
@@ -1173,6 +1344,18 @@ void VersionSet::Finalize(Version* v) {
       }
     }
   }
+  // Writers are slowed down from kL0_SlowdownWritesTrigger level-0 files on
+  // and stopped at kL0_StopWritesTrigger, so past that point level-0 goes
+  // first however far the deeper levels are over their size targets.
+  if (v->levels_[0].size() - v->in_progress[0].size() >=
+      static_cast<size_t>(config::kL0_SlowdownWritesTrigger)) {
+    for (int i = config::kNumLevels - 2; i > 0; i--) {
+      if (v->compaction_level_[i] == 0) {
+        std::swap(v->compaction_level_[i], v->compaction_level_[i - 1]);
+        std::swap(v->compaction_score_[i], v->compaction_score_[i - 1]);
+      }
+    }
+  }
   if (v->levels_[0].size() == 0){
     DEBUG("level 0 file equals 0 marker\n");
   }
@@ -1943,11 +2126,22 @@ void Compaction::ReleaseInputs() {
     input_version_ = nullptr;
   }
 }
-void Compaction::GenSubcompactionBoundaries() {
+void Compaction::GenSubcompactionBoundaries(bool memory_side) {
   std::vector<Slice>& bounds = boundaries_;
   std::vector<uint64_t>& sizes = sizes_;
-  //TODO: for the first time level 0 compaction, we do not have level 1 files, so
-  // we could use the data block index to find out the boundaries.
+  // The smallest keys of a few output level files (or of none, for the first
+  // L0->L1 compactions) cannot split the work evenly, so sample the data
+  // block index of every input table instead.
+  const size_t max_subcompactions =
+      input_version_->vset_->options_->MaxSubcompaction;
+  if (inputs_[1].size() < max_subcompactions &&
+      SampleSubcompactionBoundaries(memory_side, max_subcompactions)) {
+    return;
+  }
+  if (inputs_[1].empty()) {
+    sizes.push_back(FirstLevelSize());
+    return;
+  }
 
 //  //insert base level
 //  {
@@ -1999,6 +2193,62 @@ void Compaction::GenSubcompactionBoundaries() {
 //                  }),
 //      bounds.end());
 }
+bool Compaction::SampleSubcompactionBoundaries(bool memory_side,
+                                               size_t max_subcompactions) {
+  const VersionSet* vset = input_version_->vset_;
+  std::vector<std::pair<std::string, uint64_t>> blocks;
+  for (int which = 0; which < 2; which++) {
+    for (const auto& f : inputs_[which]) {
+      Status s =
+          memory_side
+              ? vset->table_cache_->GetDataBlockSizes_MemorySide(f, &blocks)
+              : vset->table_cache_->GetDataBlockSizes(f, &blocks);
+      if (!s.ok()) {
+        return false;
+      }
+    }
+  }
+  if (blocks.empty()) {
+    return false;
+  }
+  const Comparator* ucmp = vset->icmp_.user_comparator();
+  std::sort(blocks.begin(), blocks.end(),
+            [ucmp](const std::pair<std::string, uint64_t>& a,
+                   const std::pair<std::string, uint64_t>& b) {
+              return ucmp->Compare(ExtractUserKey(a.first),
+                                   ExtractUserKey(b.first)) < 0;
+            });
+  uint64_t total_size = 0;
+  for (const auto& block : blocks) {
+    total_size += block.second;
+  }
+  const uint64_t target_size = total_size / max_subcompactions + 1;
+
+  // A block's index key is >= all of its keys, so cutting right after it
+  // keeps the block in one range.  Boundaries are user keys and must be
+  // strictly increasing.
+  sampled_boundaries_.clear();
+  uint64_t range_size = 0;
+  for (size_t i = 0; i < blocks.size(); i++) {
+    range_size += blocks[i].second;
+    if (range_size < target_size || i + 1 == blocks.size() ||
+        sampled_boundaries_.size() + 1 >= max_subcompactions) {
+      continue;
+    }
+    Slice user_key = ExtractUserKey(blocks[i].first);
+    if (sampled_boundaries_.empty() ||
+        ucmp->Compare(user_key, sampled_boundaries_.back()) > 0) {
+      sampled_boundaries_.push_back(user_key.ToString());
+      sizes_.push_back(range_size);
+      range_size = 0;
+    }
+  }
+  sizes_.push_back(range_size);
+  for (const std::string& key : sampled_boundaries_) {
+    boundaries_.emplace_back(key);
+  }
+  return true;
+}
 std::vector<Slice>* Compaction::GetBoundaries(){
   return &boundaries_;
 }
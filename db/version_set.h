@@ -126,6 +126,16 @@ class Version {
   Status Get(const ReadOptions&, const LookupKey& key, std::string* val,
              GetStats* stats);
 
+  // Batched Get() of "user_keys" as of "snapshot".  "user_keys" must be
+  // sorted by the user comparator.  Every table is probed once with all the
+  // keys that may live in it; (*statuses)[i] and *values[i] are filled as
+  // Get() would.  Seek statistics are not charged for batched reads.
+  // REQUIRES: lock is not held
+  void MultiGet(const ReadOptions&, SequenceNumber snapshot,
+                const std::vector<Slice>& user_keys,
+                const std::vector<std::string*>& values,
+                std::vector<Status>* statuses);
+
   // Adds "stats" into the current state.  Returns true if a new
   // compaction may need to be triggered, false otherwise.
   // REQUIRES: lock is held
@@ -222,6 +232,9 @@ class Version {
   };
   double CompactionScore(int i);
   int CompactionLevel(int i);
+  // Unique among the versions of a VersionSet, assigned when the version is
+  // installed. The table set of a version never changes.
+  uint64_t version_number() const { return version_number_; }
   std::shared_ptr<RemoteMemTableMetaData> FindFileByNumber(int level, uint64_t file_number, uint8_t node_id);
  private:
   friend class Compaction;
@@ -253,10 +266,20 @@ class Version {
   void ForEachOverlapping(Slice user_key, Slice internal_key, void* arg,
                           bool (*func)(void*, int, std::shared_ptr<RemoteMemTableMetaData>));
 
+  // Build the level-0 lookup index.  Called once by VersionSet::Finalize(),
+  // before the version is visible to readers.
+  void BuildLevel0Index();
+
+  // Store in [*begin, *end) the positions in level0_newest_first_ of the
+  // level-0 files whose key range contains user_key, newest first.
+  void Level0Candidates(const Slice& user_key, const uint32_t** begin,
+                        const uint32_t** end) const;
+
   VersionSet* vset_;  // VersionSet to which this Version belongs
   Version* next_;     // Next version in linked list
   Version* prev_;     // Previous version in linked list
   int refs_;          // Number of live refs to this version
+  uint64_t version_number_ = 0;
 
   // List of files per level
   std::vector<std::shared_ptr<RemoteMemTableMetaData>> levels_[config::kNumLevels];
@@ -274,6 +297,17 @@ class Version {
   std::vector<int> ref_mark_collection;
   std::vector<int> unref_mark_collection;
 
+  // Level-0 lookup index, see BuildLevel0Index().  The distinct user-key
+  // endpoints of the level-0 files ("fences") cut the key space into
+  // segments: segment 2*i is the fence i itself and segment 2*i+1 the gap
+  // between fences i and i+1.  Every segment lists the files covering it,
+  // newest first, so a point lookup is one binary search over the fences.
+  std::vector<std::shared_ptr<RemoteMemTableMetaData>> level0_newest_first_;
+  std::vector<Slice> level0_fences_;
+  std::vector<uint32_t> level0_segment_offsets_;
+  std::vector<uint32_t> level0_segment_files_;
+  bool level0_index_built_ = false;
+
 
 };
 
@@ -289,11 +323,6 @@ class VersionSet {
 #ifndef NDEBUG
   int version_remain;
   int version_all;
-#endif
-#ifdef PROCESSANALYSIS
-  static std::atomic<uint64_t> GetTimeElapseSum;
-  static std::atomic<uint64_t> GetNum;
-
 #endif
   // Apply *edit to the current version to form a new descriptor that
   // is both saved to persistent state and installed as the new
@@ -333,8 +362,10 @@ class VersionSet {
   // Return the last sequence number.
   uint64_t LastSequence() const { return last_sequence_.load(); }
   uint64_t LastSequence_nonatomic() const { return last_sequence_; }
+  // Reserve n consecutive sequence numbers with a single atomic operation
+  // and return the first one of the range.
   uint64_t AssignSequnceNumbers(size_t n){
-    assert(n == 1);
+    assert(n >= 1);
     return last_sequence_.fetch_add(n);
   }
 
@@ -450,6 +481,7 @@ class VersionSet {
   WritableFile* descriptor_file_;
   log::Writer* descriptor_log_;
   Version dummy_versions_;  // Head of circular doubly-linked list of versions.
+  uint64_t last_version_number_ = 0;
   //TODO: make current_ an atomic variable.
 //  std::atomic<Version*> current_;        // == dummy_versions_.prev_
   Version* current_;
@@ -508,7 +540,10 @@ class Compaction {
   // Release the mem_vec version for the compaction, once the compaction
   // is successful.
   void ReleaseInputs();
-  void GenSubcompactionBoundaries();
+  // Split the key range of the compaction into up to
+  // options.MaxSubcompaction subcompactions.  "memory_side" selects how the
+  // input tables are opened.
+  void GenSubcompactionBoundaries(bool memory_side);
 
   std::vector<std::shared_ptr<RemoteMemTableMetaData>> inputs_[2];  // The two sets of mem_vec
   std::vector<Slice>* GetBoundaries();
@@ -520,6 +555,13 @@ class Compaction {
 
   Compaction(const Options* options, int level);
 
+  // Cut the input key range into up to "max_subcompactions" ranges of
+  // about equal size, using the data block index keys of all input tables
+  // weighted by block size.  Returns false, leaving the boundaries empty,
+  // if an input table could not be opened.
+  bool SampleSubcompactionBoundaries(bool memory_side,
+                                     size_t max_subcompactions);
+
   int level_;
   uint64_t max_output_file_size_;
   Version* input_version_;
@@ -544,6 +586,8 @@ class Compaction {
   size_t level_ptrs_[config::kNumLevels];
   // Stores the Slices that designate the boundaries for each subcompaction
   std::vector<Slice> boundaries_;
+  // Backing storage for boundaries_ sampled from the input tables.
+  std::vector<std::string> sampled_boundaries_;
   // Stores the approx size of keys covered in the range of each subcompaction
   std::vector<uint64_t> sizes_;
 };
@@ -554,6 +598,7 @@ struct CompactionOutput {
   std::map<uint32_t , ibv_mr*> remote_data_mrs;
   std::map<uint32_t , ibv_mr*> remote_dataindex_mrs;
   std::map<uint32_t , ibv_mr*> remote_filter_mrs;
+  uint32_t index_tail_size = 0;
 };
 struct SubcompactionState {
   Compaction* const compaction;
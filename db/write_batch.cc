@@ -129,12 +129,49 @@ class MemTableInserter : public WriteBatch::Handler {
     sequence_++;
   }
 };
+// Only insert the records whose sequence numbers are within [first_, last_],
+// the rest of the batch belongs to other memtables.
+class RangeMemTableInserter : public WriteBatch::Handler {
+ public:
+  SequenceNumber sequence_;
+  SequenceNumber first_;
+  SequenceNumber last_;
+  MemTable* mem_;
+
+  void Put(const Slice& key, const Slice& value) override {
+    if (sequence_ >= first_ && sequence_ <= last_) {
+      mem_->Add(sequence_, kTypeValue, key, value);
+    }
+    sequence_++;
+  }
+  void Delete(const Slice& key) override {
+    if (sequence_ >= first_ && sequence_ <= last_) {
+      mem_->Add(sequence_, kTypeDeletion, key, Slice());
+    }
+    sequence_++;
+  }
+};
 }  // namespace
 
 Status WriteBatchInternal::InsertInto(const WriteBatch* b, MemTable* memtable) {
   MemTableInserter inserter;
-  assert(!memtable->CheckFlushInProcess());
+  // A flush may already have picked the table, but it waits in
+  // Waitforpendingwriter() until every sequence of the table is counted.
+  assert(!memtable->able_to_flush.load());
+  inserter.sequence_ = WriteBatchInternal::Sequence(b);
+  inserter.mem_ = memtable;
+  return b->Iterate(&inserter);
+}
+
+Status WriteBatchInternal::InsertInto(const WriteBatch* b, MemTable* memtable,
+                                      SequenceNumber first_seq,
+                                      SequenceNumber last_seq) {
+  RangeMemTableInserter inserter;
+  assert(!memtable->able_to_flush.load());
+  assert(first_seq <= last_seq);
   inserter.sequence_ = WriteBatchInternal::Sequence(b);
+  inserter.first_ = first_seq;
+  inserter.last_ = last_seq;
   inserter.mem_ = memtable;
   return b->Iterate(&inserter);
 }
@@ -37,6 +37,11 @@ class WriteBatchInternal {
 
   static Status InsertInto(const WriteBatch* batch, MemTable* memtable);
 
+  // Insert only the entries of "batch" whose sequence numbers fall into
+  // [first_seq, last_seq]. Used when a batch crosses a memtable border.
+  static Status InsertInto(const WriteBatch* batch, MemTable* memtable,
+                           SequenceNumber first_seq, SequenceNumber last_seq);
+
   static void Append(WriteBatch* dst, const WriteBatch* src);
 };
 
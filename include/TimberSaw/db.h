@@ -7,6 +7,7 @@
 
 #include <cstdint>
 #include <cstdio>
+#include <vector>
 
 #include "TimberSaw/export.h"
 #include "TimberSaw/iterator.h"
@@ -87,6 +88,14 @@ class TimberSaw_EXPORT DB {
   virtual Status Get(const ReadOptions& options, const Slice& key,
                      std::string* value) = 0;
 
+  // Look up every key in "keys" as Get() would and return one status per
+  // key; on success (*values)[i] holds the value for keys[i].  All the keys
+  // are read from the same snapshot.  The default implementation simply
+  // calls Get() for each key.
+  virtual std::vector<Status> MultiGet(const ReadOptions& options,
+                                       const std::vector<Slice>& keys,
+                                       std::vector<std::string>* values);
+
   // Return a heap-allocated iterator over the contents of the database.
   // The result of NewIterator() is initially invalid (caller must
   // call one of the Seek methods on the iterator before using it).
@@ -119,6 +128,10 @@ class TimberSaw_EXPORT DB {
   //     about the internal operation of the DB.
   //  "TimberSaw.sstables" - returns a multi-line string that describes all
   //     of the sstables that make up the db contents.
+  //  "TimberSaw.metadata-cache-usage" - returns the number of bytes of
+  //     index and filter blocks pinned by Options::pin_metadata_max_level.
+  //  "TimberSaw.row-cache-usage" - returns the number of bytes held by
+  //     Options::row_cache.
   //  "TimberSaw.approximate-memory-usage" - returns the approximate number of
   //     bytes of memory in use by the DB.
   virtual bool GetProperty(const Slice& property, std::string* value) = 0;
@@ -198,7 +198,10 @@ class TimberSaw_EXPORT Env {
   // I.e., the caller may not assume that background work items are
   // serialized.
   virtual void Schedule(void (*function)(void* arg), void* arg) = 0;
-  virtual void Schedule(void (*function)(void* arg), void* arg, ThreadPoolType type) = 0;
+  // Same as above, on the thread pool of "type". Returns false if the job was
+  // not queued (the pool is shutting down or already has a long queue), in
+  // which case "function" is never called.
+  virtual bool Schedule(void (*function)(void* arg), void* arg, ThreadPoolType type) = 0;
   virtual unsigned int Queue_Length_Quiry(ThreadPoolType type);
   virtual void JoinAllThreads(bool wait_for_jobs_to_complete) = 0;
   // Start a new thread, invoking "function(arg)" within the new thread.
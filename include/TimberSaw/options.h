@@ -17,6 +17,7 @@ class Env;
 class FilterPolicy;
 class Logger;
 class Snapshot;
+class Statistics;
 // The size for one SStable chunk
 //static size_t RDMA_WRITE_BLOCK = 2*1024*1024;
 static size_t RDMA_WRITE_BLOCK = 1*1024*1024;
@@ -38,6 +39,16 @@ enum CompressionType {
   kSnappyCompression = 0x1
 };
 
+// Format of the filter block of a table.  The format is recorded in the
+// block, so tables of different formats can be read side by side.
+enum FilterFormat {
+  // Cache-local bloom with double hashing (LegacyLocalityBloomImpl).
+  kLegacyBloomFilter = 0x0,
+  // Cache-line-blocked bloom (FastLocalBloomImpl).  At 10 bits per key it
+  // has about 0.96% false positives against 1.14% for kLegacyBloomFilter.
+  kFastLocalBloomFilter = 0x1
+};
+
 // Options to control the behavior of a database (passed to DB::Open)
 // The options now do not support dynamically change.
 struct TimberSaw_EXPORT Options {
@@ -111,6 +122,24 @@ struct TimberSaw_EXPORT Options {
   // If null, TimberSaw will automatically create and use an 8MB internal cache.
   Cache* block_cache = nullptr;
 
+  // If non-null, cache the results of point lookups (Get and MultiGet) that
+  // miss the memtables, keyed by user key and table Version, so that hot
+  // keys are served without probing the remote tables.  Entries of an old
+  // Version are never hit again and age out of the LRU.  Reads at an
+  // explicit snapshot bypass it.
+  Cache* row_cache = nullptr;
+
+  // Keep the index and filter blocks of every live table at a level <=
+  // pin_metadata_max_level pinned in a dedicated metadata cache, so that
+  // lookups never re-read them from the memory node after the table cache
+  // evicts the table.  -1 pins nothing, 1 pins L0 and L1, and
+  // config::kNumLevels - 1 pins all levels.
+  int pin_metadata_max_level = -1;
+
+  // Budget in bytes for pinned index and filter blocks.  Tables opened once
+  // the budget is used up are cached, and evictable, as usual.
+  size_t metadata_cache_size = 64 * 1024 * 1024;
+
   // Approximate size of user data packed per block.  Note that the
   // block size specified here corresponds to uncompressed data.  The
   // actual size of the unit read from disk may be smaller if
@@ -124,6 +153,17 @@ struct TimberSaw_EXPORT Options {
   // leave this parameter alone.
   int block_restart_interval = 1;
 
+  // If non-zero, tables built on this node split their index into
+  // partitions of about this many bytes behind a small top-level index.
+  // Opening a table then fetches only the top level, and partitions are
+  // fetched on demand through the block cache.  Limited to block_size / 2.
+  size_t index_partition_size = 0;
+
+  // If true, data blocks carry a small hash index from user keys to their
+  // restart points, so that point lookups can skip the binary search.
+  // Blocks with too many restart points to index go without one.
+  bool data_block_hash_index = false;
+
   // TimberSaw will write up to this amount of bytes to a file before
   // switching to a new one.
   // Most clients should leave this parameter alone.  However if your
@@ -156,11 +196,28 @@ struct TimberSaw_EXPORT Options {
   // Default: currently false, but may become true later.
   bool reuse_logs = false;
 
+  // If true, every write is appended to a write-ahead log on the compute node
+  // before it is inserted into the memtable, so that a crash does not lose
+  // the memtables which have not been flushed yet. Concurrent writers are
+  // group committed into one log record. The log is replayed on open.
+  //
+  // Default: false, a crash of the compute node loses the unflushed writes.
+  bool enable_wal = false;
+
   // If non-null, use the specified filter policy to reduce disk reads.
   // Many applications will benefit from passing the result of
   // NewBloomFilterPolicy() here.
   const FilterPolicy* filter_policy = nullptr;
   int bloom_bits = 10;
+
+  // Format of the filters of new tables.  Every false positive costs a
+  // remote read of a data block.
+  FilterFormat filter_format = kLegacyBloomFilter;
+
+  // If non-null, tickers and latency histograms of the read and write paths
+  // are recorded here, see NewStatistics() and the "TimberSaw.stats"
+  // property. The caller owns the object.
+  Statistics* statistics = nullptr;
 };
 
 // Options that control read operations
@@ -180,6 +237,22 @@ struct TimberSaw_EXPORT ReadOptions {
   // not have been released).  If "snapshot" is null, use an implicit
   // snapshot of the state at the beginning of this read operation.
   const Snapshot* snapshot = nullptr;
+
+  // Number of data block reads an iterator keeps outstanding while it moves
+  // forward through a table: the block it is positioned on plus up to
+  // read_queue_depth - 1 blocks after it.  1 disables pipelining.  An
+  // iterator created with read_queue_depth > 1 must be used and destroyed on
+  // the thread that created it, because its reads complete on that thread's
+  // queue pair.
+  int read_queue_depth = 1;
+
+  // Bytes of data blocks a forward scan reads ahead of its position once it
+  // has moved through two blocks of a table in order. The window starts at
+  // 8KB and doubles with every further block up to this size, so short
+  // scans do not pay for reads they will not use. 0 disables readahead.
+  // Ignored if read_queue_depth > 1, and has the same restriction on the
+  // thread using the iterator.
+  size_t readahead_size = 0;
 };
 
 // Options that control write operations
@@ -200,6 +273,8 @@ struct TimberSaw_EXPORT WriteOptions {
   // crash semantics as the "write()" system call.  A DB write
   // with sync==true has similar crash semantics to a "write()"
   // system call followed by "fsync()".
+  //
+  // Only takes effect when Options::enable_wal is true.
   bool sync = false;
 };
 
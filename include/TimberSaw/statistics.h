@@ -0,0 +1,91 @@
+// Copyright (c) 2011 The TimberSaw Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A Statistics object collects counters ("tickers") and latency histograms
+// from the read and write paths of a DB.  Plug one into Options::statistics
+// and read it back through DB::GetProperty("TimberSaw.stats") or ToString().
+//
+// The builtin implementation keeps one copy of every counter per CPU core,
+// so recording is a core-local atomic add (tickers) or an uncontended lock
+// (histograms) and is cheap enough to leave enabled in production.
+
+#ifndef STORAGE_TimberSaw_INCLUDE_STATISTICS_H_
+#define STORAGE_TimberSaw_INCLUDE_STATISTICS_H_
+
+#include <cstdint>
+#include <string>
+
+#include "TimberSaw/export.h"
+
+namespace TimberSaw {
+
+enum Tickers : uint32_t {
+  // Data block lookups in the block cache.
+  BLOCK_CACHE_HIT = 0,
+  BLOCK_CACHE_MISS,
+  // Table probes the filter ruled out, and probes that got past it.
+  BLOOM_FILTER_USEFUL,
+  BLOOM_FILTER_CHECKED,
+  // Point lookups answered by the mutable or an immutable memtable, and
+  // lookups that had to go to the tables.
+  MEMTABLE_HIT,
+  MEMTABLE_MISS,
+  // Memtable misses answered by the row cache, and those that were not.
+  ROW_CACHE_HIT,
+  ROW_CACHE_MISS,
+  NUMBER_KEYS_WRITTEN,
+  NUMBER_KEYS_READ,
+  NUMBER_KEYS_FOUND,
+  BYTES_WRITTEN,
+  BYTES_READ,
+  // Data blocks fetched from the memory node, and their size.
+  RDMA_BLOCK_READS,
+  RDMA_BLOCK_READ_BYTES,
+  TICKER_ENUM_MAX
+};
+
+// All histograms are in nanoseconds.
+enum Histograms : uint32_t {
+  DB_GET = 0,
+  DB_WRITE,
+  DB_MULTIGET,
+  // One table probed by a point lookup, from the table cache lookup on.
+  TABLE_GET,
+  // Binary searches in the index block and in the data block.
+  INDEX_SEEK,
+  DATA_BLOCK_SEEK,
+  // A data block fetched from the memory node on a cache miss.
+  RDMA_BLOCK_READ,
+  HISTOGRAM_ENUM_MAX
+};
+
+class TimberSaw_EXPORT Statistics {
+ public:
+  Statistics() = default;
+
+  Statistics(const Statistics&) = delete;
+  Statistics& operator=(const Statistics&) = delete;
+
+  virtual ~Statistics();
+
+  virtual void RecordTick(uint32_t ticker_type, uint64_t count = 1) = 0;
+  virtual void MeasureTime(uint32_t histogram_type, uint64_t nanos) = 0;
+
+  virtual uint64_t GetTickerCount(uint32_t ticker_type) const = 0;
+  // Human readable summary of one histogram.
+  virtual std::string GetHistogramString(uint32_t histogram_type) const = 0;
+
+  // Zero every ticker and histogram.
+  virtual void Reset() = 0;
+
+  // Every ticker and histogram, one per line.
+  virtual std::string ToString() const = 0;
+};
+
+// Create a new Statistics object that aggregates per-core counters.
+TimberSaw_EXPORT Statistics* NewStatistics();
+
+}  // namespace TimberSaw
+
+#endif  // STORAGE_TimberSaw_INCLUDE_STATISTICS_H_
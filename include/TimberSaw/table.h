@@ -7,6 +7,9 @@
 
 #include <cstdint>
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "TimberSaw/export.h"
 #include "TimberSaw/iterator.h"
@@ -60,11 +63,34 @@ class TimberSaw_EXPORT Table {
   // be close to the file length.
   uint64_t ApproximateOffsetOf(const Slice& key) const;
 
+  // Bytes held by the index and filter blocks of this table.
+  size_t ApproximateMetadataMemoryUsage() const;
+
+  // Append the index key and size of every data block, in key order, to
+  // *blocks.  A block's index key is >= every key in the block.
+  void GetDataBlockSizes(
+      std::vector<std::pair<std::string, uint64_t>>* blocks) const;
+
  private:
   friend class TableCache;
   struct Rep;
 
   static Iterator* BlockReader(void*, const ReadOptions&, const Slice&);
+  // BlockReader() for the partitions of a partitioned index.
+  static Iterator* IndexPartitionReader(void*, const ReadOptions&,
+                                        const Slice&);
+  // Read the block named by "index_value" from "remote_blocks" through the
+  // block cache, keyed by "cache_id" and the block offset.
+  static Iterator* ReadBlock(Table* table, const ReadOptions& options,
+                             const Slice& index_value,
+                             std::map<uint32_t, ibv_mr*>* remote_blocks,
+                             uint64_t cache_id);
+  // Split-phase BlockReader() used to keep several block reads in flight.
+  static void* StartBlockRead(void*, const ReadOptions&, const Slice&);
+  static Iterator* FinishBlockRead(void*, const ReadOptions&, void* token);
+  static void DiscardBlockRead(void*, void* token);
+  // NewIndexIterator() for the readahead of a table iterator.
+  static Iterator* LookaheadIndexIterator(void*, const ReadOptions&);
 
   explicit Table(Rep* rep) : rep_(rep) {}
 
@@ -75,6 +101,19 @@ class TimberSaw_EXPORT Table {
                      void (*handle_result)(void* arg, const Slice& k,
                                            const Slice& v));
 
+  // Batched InternalGet() for "num" internal keys sorted by the table
+  // comparator.  Calls (*handle_result)(args[i], ...) for keys[i] like
+  // InternalGet() does; keys that share a data block are resolved against a
+  // single copy of it and all uncached blocks are fetched in one batch.
+  Status InternalMultiGet(const ReadOptions&, size_t num, const Slice* keys,
+                          void** args,
+                          void (*handle_result)(void* arg, const Slice& k,
+                                                const Slice& v));
+
+  // Iterator over the data block handles of the table, from the index block
+  // or, for a partitioned index, through its top level.
+  Iterator* NewIndexIterator(const ReadOptions&) const;
+
   void ReadMeta(const Footer& footer);
   void ReadFilter();
 
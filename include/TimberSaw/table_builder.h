@@ -94,6 +94,10 @@ class TimberSaw_EXPORT TableBuilder {
   virtual void get_dataindexblocks_map(std::map<uint32_t, ibv_mr*>& map)=0;
   virtual void get_filter_map(std::map<uint32_t, ibv_mr*>& map)=0;
   virtual size_t get_numentries()=0;
+  // Bytes at the end of the index region a reader has to fetch to get the
+  // top level of the index (or the whole index if it is not partitioned).
+  // REQUIRES: Finish() has been called
+  virtual uint32_t get_index_tail_size()=0;
  protected:
 
 
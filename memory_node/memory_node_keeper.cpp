@@ -4,6 +4,7 @@
 #include "memory_node/memory_node_keeper.h"
 
 #include "db/table_cache.h"
+#include <algorithm>
 #include <list>
 
 #include "table/table_builder_memoryside.h"
@@ -35,6 +36,7 @@ versions_(new VersionSet("home_node", opts.get(), table_cache_, &internal_compar
 //    ClipToRange(&opts->max_file_size, 1 << 20, 1 << 30);
 //    ClipToRange(&opts->block_size, 1 << 10, 4 << 20);
     Compactor_pool_.SetBackgroundThreads(opts->max_background_compactions);
+    Subcompactor_pool_.SetBackgroundThreads(opts->MaxSubcompaction);
     Message_handler_pool_.SetBackgroundThreads(2);
   }
 
@@ -48,31 +50,86 @@ versions_(new VersionSet("home_node", opts.get(), table_cache_, &internal_compar
 //    message_handler_pool_.Schedule(background_work_function, background_work_arg);
 //  }
   void Memory_Node_Keeper::SetBackgroundThreads(int num, ThreadPoolType type) {
-    Compactor_pool_.SetBackgroundThreads(num);
+    if (type == SubcompactionThreadPool) {
+      Subcompactor_pool_.SetBackgroundThreads(num);
+    } else {
+      Compactor_pool_.SetBackgroundThreads(num);
+    }
   }
   void Memory_Node_Keeper::MaybeScheduleCompaction(std::string& client_ip) {
     if (versions_->NeedsCompaction()) {
-      //    background_compaction_scheduled_ = true;
-      printf("Need a compaction.\n");
-      void* function_args = new std::string(client_ip);
-      BGThreadMetadata* thread_pool_args = new BGThreadMetadata{.db = this, .func_args = function_args};
-      if (Compactor_pool_.queue_len_.load()>256){
-        //If there has already be enough compaction scheduled, then drop this one
-        printf("queue length has been too long %d elements in the queue\n", Compactor_pool_.queue_len_.load());
-        return;
+      std::unique_lock<std::mutex> lck(compaction_mtx_);
+      if (std::find(compaction_clients_.begin(), compaction_clients_.end(),
+                    client_ip) == compaction_clients_.end()) {
+        compaction_clients_.push_back(client_ip);
+      }
+      if (bg_compaction_scheduled_ == 0) {
+        StartCompactionWorker();
+      }
+    }
+  }
+  void Memory_Node_Keeper::StartCompactionWorker() {
+    if (bg_compaction_scheduled_ < opts->max_background_compactions) {
+      BGThreadMetadata* thread_pool_args =
+          new BGThreadMetadata{.db = this, .func_args = nullptr};
+      if (Compactor_pool_.Schedule(BGWork_Compaction,
+                                   static_cast<void*>(thread_pool_args))) {
+        bg_compaction_scheduled_++;
+      } else {
+        delete thread_pool_args;
+      }
+    }
+  }
+  // Runs compactions until nothing more can be picked. All the clients share
+  // versions_, so what gets compacted is always the globally most urgent
+  // level (see PickCompaction), and compaction_clients_ only decides which
+  // client the resulting edit is sent to. PickCompaction never gives two
+  // workers overlapping inputs, so while there is more work another worker
+  // is started to run next to this one.
+  void Memory_Node_Keeper::CompactionWorker() {
+    std::unique_lock<std::mutex> lck(compaction_mtx_);
+    while (!compaction_clients_.empty()) {
+      std::string client_ip = compaction_clients_.front();
+      compaction_clients_.pop_front();
+      lck.unlock();
+      bool picked = BackgroundCompaction(client_ip);
+      bool more = versions_->NeedsCompaction();
+      lck.lock();
+      if (more && std::find(compaction_clients_.begin(),
+                            compaction_clients_.end(),
+                            client_ip) == compaction_clients_.end()) {
+        // Requests are never dropped: the client stays queued until there
+        // is nothing left to compact.
+        compaction_clients_.push_back(client_ip);
+      }
+      if (!picked) {
+        // What is left overlaps the running compactions, or can not be
+        // picked at all. The queue is kept: the running workers come back
+        // to it, and with none left the next MaybeScheduleCompaction starts
+        // a new worker.
+        break;
+      }
+      if (more) {
+        StartCompactionWorker();
       }
-      Compactor_pool_.Schedule(BGWork_Compaction, static_cast<void*>(thread_pool_args));
-      printf("Schedule a Compaction !\n");
     }
+    bg_compaction_scheduled_--;
   }
   void Memory_Node_Keeper::BGWork_Compaction(void* thread_arg) {
     BGThreadMetadata* p = static_cast<BGThreadMetadata*>(thread_arg);
-    ((Memory_Node_Keeper*)p->db)->BackgroundCompaction(p->func_args);
+    ((Memory_Node_Keeper*)p->db)->CompactionWorker();
     delete static_cast<BGThreadMetadata*>(thread_arg);
   }
-  void Memory_Node_Keeper::BackgroundCompaction(void* p) {
+  void Memory_Node_Keeper::BGWork_Subcompaction(void* thread_arg) {
+    BGThreadMetadata* p = static_cast<BGThreadMetadata*>(thread_arg);
+    BGJobGroup* group = p->group;
+    ((Memory_Node_Keeper*)p->db)->ProcessKeyValueCompaction(
+        static_cast<SubcompactionState*>(p->func_args));
+    delete p;
+    group->JobDone();
+  }
+  bool Memory_Node_Keeper::BackgroundCompaction(std::string& client_ip) {
   //  write_stall_mutex_.AssertNotHeld();
-  std::string* client_ip = static_cast<std::string*>(p);
   if (versions_->NeedsCompaction()) {
     Compaction* c;
 //    bool is_manual = (manual_compaction_ != nullptr);
@@ -95,7 +152,7 @@ versions_(new VersionSet("home_node", opts.get(), table_cache_, &internal_compar
       if (c== nullptr){
         DEBUG("compaction task executed but not found doable task.\n");
         delete c;
-        return;
+        return false;
       }
 
 //    }
@@ -117,7 +174,7 @@ versions_(new VersionSet("home_node", opts.get(), table_cache_, &internal_compar
           std::unique_lock<std::mutex> lck(versionset_mtx);
           status = versions_->LogAndApply(c->edit(), 0);
           versions_->Pin_Version_For_Compute();
-          Edit_sync_to_remote(c->edit(), *client_ip, &lck);
+          Edit_sync_to_remote(c->edit(), client_ip, &lck);
         }
 //        InstallSuperVersion();
       }
@@ -133,11 +190,11 @@ versions_(new VersionSet("home_node", opts.get(), table_cache_, &internal_compar
       auto start = std::chrono::high_resolution_clock::now();
       //      write_stall_mutex_.AssertNotHeld();
       // Only when there is enough input level files and output level files will the subcompaction triggered
-      if (usesubcompaction && c->num_input_files(0)>=4 && c->num_input_files(1)>1){
-        status = DoCompactionWorkWithSubcompaction(compact, *client_ip);
-//        status = DoCompactionWork(compact, *client_ip);
+      if (usesubcompaction && c->num_input_files(0)>=4){
+        status = DoCompactionWorkWithSubcompaction(compact, client_ip);
+//        status = DoCompactionWork(compact, client_ip);
       }else{
-        status = DoCompactionWork(compact, *client_ip);
+        status = DoCompactionWork(compact, client_ip);
       }
 
       auto stop = std::chrono::high_resolution_clock::now();
@@ -178,10 +235,9 @@ versions_(new VersionSet("home_node", opts.get(), table_cache_, &internal_compar
 //      }
 //      manual_compaction_ = nullptr;
 //    }
+    return true;
   }
-  MaybeScheduleCompaction(*client_ip);
-  delete client_ip;
-
+  return false;
 }
 void Memory_Node_Keeper::CleanupCompaction(CompactionState* compact) {
   //  undefine_mutex.AssertHeld();
@@ -367,7 +423,7 @@ printf("For compaction, Total number of key touched is %d, KV left is %d\n", num
 Status Memory_Node_Keeper::DoCompactionWorkWithSubcompaction(
     CompactionState* compact, std::string& client_ip) {
   Compaction* c = compact->compaction;
-  c->GenSubcompactionBoundaries();
+  c->GenSubcompactionBoundaries(true);
   auto boundaries = c->GetBoundaries();
   auto sizes = c->GetSizes();
   assert(boundaries->size() == sizes->size() - 1);
@@ -420,20 +476,24 @@ Status Memory_Node_Keeper::DoCompactionWorkWithSubcompaction(
   assert(num_threads > 0);
 //  const uint64_t start_micros = env_->NowMicros();
 
-  // Launch a thread for each of subcompactions 1...num_threads-1
-  std::vector<port::Thread> thread_pool;
-  thread_pool.reserve(num_threads - 1);
+  // Hand subcompactions 1...num_threads-1 to Subcompactor_pool_, whose
+  // threads outlive the compaction and keep their RDMA queue pairs.
+  BGJobGroup group(num_threads - 1);
   for (size_t i = 1; i < compact->sub_compact_states.size(); i++) {
-    thread_pool.emplace_back(&Memory_Node_Keeper::ProcessKeyValueCompaction, this,
-                             &compact->sub_compact_states[i]);
+    BGThreadMetadata* thread_pool_args = new BGThreadMetadata{
+        .db = this, .func_args = &compact->sub_compact_states[i],
+        .group = &group};
+    if (!Subcompactor_pool_.Schedule(BGWork_Subcompaction,
+                                     static_cast<void*>(thread_pool_args))) {
+      // The pool is shutting down, nobody else would call JobDone().
+      BGWork_Subcompaction(thread_pool_args);
+    }
   }
 
   // Always schedule the first subcompaction (whether or not there are also
   // others) in the current thread to be efficient with resources
   ProcessKeyValueCompaction(&compact->sub_compact_states[0]);
-  for (auto& thread : thread_pool) {
-    thread.join();
-  }
+  group.WaitAll();
 //  CompactionStats stats;
 ////  stats.micros = env_->NowMicros() - start_micros;
 //  for (int which = 0; which < 2; which++) {
@@ -483,12 +543,11 @@ void Memory_Node_Keeper::ProcessKeyValueCompaction(SubcompactionState* sub_compa
   // Release mutex while we're actually doing the compaction work
   //  undefine_mutex.Unlock();
   if (start != nullptr) {
-    //The compaction range is (start, end]. so we set 0 as look up key sequence.
-    InternalKey start_internal(*start, 0, kValueTypeForSeek);
+    // The subcompaction range is [start, end): start from the newest entry
+    // of "start", right where the subcompaction before this one stopped.
+    InternalKey start_internal(*start, kMaxSequenceNumber, kValueTypeForSeek);
     //tofix(ruihong): too much data copy for the seek here!
     input->Seek(start_internal.Encode());
-    // The first key larger or equal to start_internal was covered in the subtask before it.
-    input->Next();
   } else {
     input->SeekToFirst();
   }
@@ -505,27 +564,23 @@ void Memory_Node_Keeper::ProcessKeyValueCompaction(SubcompactionState* sub_compa
   bool has_current_user_key = false;
   SequenceNumber last_sequence_for_key = kMaxSequenceNumber;
   Slice key;
-  assert(input->Valid());
 #ifndef NDEBUG
   std::string last_internal_key;
-  printf("first key is %s", input->key().ToString().c_str());
 #endif
   while (input->Valid()) {
 
     key = input->key();
     assert(key.ToString() != last_internal_key);
-#ifndef NDEBUG
-    if (start){
-      assert(internal_comparator_.Compare(key, *start) > 0);
+    assert(start == nullptr ||
+           user_comparator()->Compare(ExtractUserKey(key), *start) >= 0);
+    if (end != nullptr &&
+        user_comparator()->Compare(ExtractUserKey(key), *end) >= 0) {
+      break;
     }
-#endif
     //    assert(key.data()[0] == '0');
     //Check whether the output file have too much overlap with level n + 2
     if (sub_compact->compaction->ShouldStopBefore(key) &&
     sub_compact->builder != nullptr) {
-      //TODO: record the largest key as the last ikey, find a more efficient way to record
-      // the last key of SSTable.
-      sub_compact->current_output()->largest.SetFrom(ikey);
       status = FinishCompactionOutputFile(sub_compact, input);
       if (!status.ok()) {
         DEBUG("Should stop status not OK\n");
@@ -586,12 +641,13 @@ void Memory_Node_Keeper::ProcessKeyValueCompaction(SubcompactionState* sub_compa
       Not_drop_counter++;
 #endif
       sub_compact->builder->Add(key, input->value());
+      // The iterator may reuse the key's buffer, so keep a copy of the last
+      // key added for when the output is finished.
+      sub_compact->current_output()->largest.DecodeFrom(key);
       //      assert(key.data()[0] == '0');
       // Close output file if it is big enough
       if (sub_compact->builder->FileSize() >=
       sub_compact->compaction->MaxOutputFileSize()) {
-//        assert(key.data()[0] == '\000');
-        sub_compact->current_output()->largest.DecodeFrom(key);
         assert(!sub_compact->current_output()->largest.Encode().ToString().empty());
 
         assert(internal_comparator_.Compare(sub_compact->current_output()->largest,
@@ -603,11 +659,6 @@ void Memory_Node_Keeper::ProcessKeyValueCompaction(SubcompactionState* sub_compa
         }
       }
     }
-    if (end != nullptr &&
-    user_comparator()->Compare(ExtractUserKey(key), *end) >= 0) {
-      assert(user_comparator()->Compare(ExtractUserKey(key), *end) == 0);
-      break;
-    }
     //    assert(key.data()[0] == '0');
     input->Next();
     //NOTE(ruihong): When the level iterator is invalid it will be deleted and then the key will
@@ -624,9 +675,6 @@ printf("For compaction, Total number of key touched is %d, KV left is %d\n", num
        Not_drop_counter);
 #endif
   if (status.ok() && sub_compact->builder != nullptr) {
-//    assert(key.size()>0);
-//    assert(key.data()[0] == '\000');
-    sub_compact->current_output()->largest.DecodeFrom(key);// The SSTable for subcompaction range will be (start, end]
     assert(!sub_compact->current_output()->largest.Encode().ToString().empty());
     status = FinishCompactionOutputFile(sub_compact, input);
   }
@@ -718,6 +766,8 @@ Status Memory_Node_Keeper::FinishCompactionOutputFile(SubcompactionState* compac
   compact->builder->get_datablocks_map(compact->current_output()->remote_data_mrs);
   compact->builder->get_dataindexblocks_map(compact->current_output()->remote_dataindex_mrs);
   compact->builder->get_filter_map(compact->current_output()->remote_filter_mrs);
+  compact->current_output()->index_tail_size =
+      compact->builder->get_index_tail_size();
 #ifndef NDEBUG
   uint64_t file_size = 0;
   for(auto iter : compact->current_output()->remote_data_mrs){
@@ -772,6 +822,8 @@ Status Memory_Node_Keeper::FinishCompactionOutputFile(CompactionState* compact,
   compact->builder->get_datablocks_map(compact->current_output()->remote_data_mrs);
   compact->builder->get_dataindexblocks_map(compact->current_output()->remote_dataindex_mrs);
   compact->builder->get_filter_map(compact->current_output()->remote_filter_mrs);
+  compact->current_output()->index_tail_size =
+      compact->builder->get_index_tail_size();
   assert(compact->current_output()->remote_data_mrs.size()>0);
   assert(compact->current_output()->remote_dataindex_mrs.size()>0);
 #ifndef NDEBUG
@@ -836,6 +888,7 @@ compact->compaction->AddInputDeletions(compact->compaction->edit());
       meta->remote_data_mrs = out.remote_data_mrs;
       meta->remote_dataindex_mrs = out.remote_dataindex_mrs;
       meta->remote_filter_mrs = out.remote_filter_mrs;
+      meta->index_tail_size = out.index_tail_size;
       compact->compaction->edit()->AddFile(level + 1, meta);
       assert(!meta->UnderCompaction);
 #ifndef NDEBUG
@@ -867,6 +920,7 @@ compact->compaction->AddInputDeletions(compact->compaction->edit());
         meta->remote_data_mrs = out.remote_data_mrs;
         meta->remote_dataindex_mrs = out.remote_dataindex_mrs;
         meta->remote_filter_mrs = out.remote_filter_mrs;
+        meta->index_tail_size = out.index_tail_size;
         compact->compaction->edit()->AddFile(level + 1, meta);
         assert(!meta->UnderCompaction);
       }
@@ -883,40 +937,23 @@ compact->compaction->AddInputDeletions(compact->compaction->edit());
 
   return s;
 }
-  void Memory_Node_Keeper::server_communication_thread(std::string client_ip,
-                                                 int socket_fd) {
-    printf("A new shared memory thread start\n");
-    printf("checkpoint1");
+  void Memory_Node_Keeper::Register_Client(std::string client_ip,
+                                           int socket_fd) {
+    printf("A new compute node connected\n");
     char temp_receive[2];
     char temp_send[] = "Q";
-    int rc = 0;
     rdma_mg->ConnectQPThroughSocket(client_ip, socket_fd);
-    //TODO: use Local_Memory_Allocation to bulk allocate, and assign within this function.
-//    ibv_mr send_mr[32] = {};
-//    for(int i = 0; i<32; i++){
-//      rdma_mg->Allocate_Local_RDMA_Slot(send_mr[i], "message");
-//    }
-
-//    char* send_buff;
-//    if (!rdma_mg_->Local_Memory_Register(&send_buff, &send_mr, 1000, std::string())) {
-//      fprintf(stderr, "memory registering failed by size of 0x%x\n", 1000);
-//    }
-//    int buffer_number = 32;
-    ibv_mr recv_mr[R_SIZE] = {};
+    auto client = std::make_shared<Client_Connection>();
+    client->client_ip = client_ip;
+    client->socket_fd = socket_fd;
+    // Resolve the client's queue pair once instead of on every message.
+    client->channel = rdma_mg->Resolve_Channel(client_ip);
     for(int i = 0; i<R_SIZE; i++){
-      rdma_mg->Allocate_Local_RDMA_Slot(recv_mr[i], "message");
+      rdma_mg->Allocate_Local_RDMA_Slot(client->recv_mr[i], "message");
     }
-
-
-//    char* recv_buff;
-//    if (!rdma_mg_->Local_Memory_Register(&recv_buff, &recv_mr, 1000, std::string())) {
-//      fprintf(stderr, "memory registering failed by size of 0x%x\n", 1000);
-//    }
-    //  post_receive<int>(recv_mr, client_ip);
     for(int i = 0; i<R_SIZE; i++) {
-      rdma_mg->post_receive<RDMA_Request>(&recv_mr[i], client_ip);
+      rdma_mg->post_receive<RDMA_Message>(&client->recv_mr[i], client->channel);
     }
-//    rdma_mg_->post_receive(recv_mr, client_ip, sizeof(Computing_to_memory_msg));
     // sync after send & recv buffer creation and receive request posting.
     rdma_mg->local_mem_pool.reserve(100);
     {
@@ -927,74 +964,169 @@ compact->compaction->AddInputDeletions(compact->compaction->edit());
                        temp_receive)) /* just send a dummy char back and forth */
       {
       fprintf(stderr, "sync error after QPs are were moved to RTS\n");
-      rc = 1;
       }
-//      shutdown(socket_fd, 2);
-//    close(socket_fd);
-    //  post_send<int>(res->mr_send, client_ip);
-    ibv_wc wc[3] = {};
-    //  if(poll_completion(wc, 2, client_ip))
-    //    printf("The main qp not create correctly");
-    //  else
-    //    printf("The main qp not create correctly");
-    // Computing node and share memory connection succeed.
-    // Now is the communication through rdma.
-    RDMA_Request receive_msg_buf;
-
-    //  receive_msg_buf = (computing_to_memory_msg*)recv_buff;
-    //  receive_msg_buf->command = ntohl(receive_msg_buf->command);
-    //  receive_msg_buf->content.qp_config.qp_num = ntohl(receive_msg_buf->content.qp_config.qp_num);
-    //  receive_msg_buf->content.qp_config.lid = ntohs(receive_msg_buf->content.qp_config.lid);
-    //  ibv_wc wc[3] = {};
-    // TODO: implement a heart beat mechanism.
-    int buffer_counter = 0;
+    std::unique_lock<std::mutex> lck(clients_mtx_);
+    clients_.push_back(std::move(client));
+    clients_changed_.store(true, std::memory_order_release);
+  }
+  // Polls the receive queues of all the clients and hands every message to
+  // Message_handler_pool_. Nothing is handled on this thread, so one client
+  // waiting on a long request does not hold up the others.
+  // TODO: implement a heart beat mechanism.
+  void Memory_Node_Keeper::message_dispatch_thread() {
+    std::vector<std::shared_ptr<Client_Connection>> clients;
     while (true) {
-      rdma_mg->poll_completion(wc, 1, client_ip, false);
-      memcpy(&receive_msg_buf, recv_mr[buffer_counter].addr, sizeof(RDMA_Request));
-
-      // copy the pointer of receive buf to a new place because
-      // it is the same with send buff pointer.
+      if (clients_changed_.exchange(false, std::memory_order_acquire)) {
+        std::unique_lock<std::mutex> lck(clients_mtx_);
+        clients = clients_;
+      }
+      bool found = false;
+      for (size_t i = 0; i < clients.size(); i++) {
+        // Take at most a handful per client so that a busy client can not
+        // starve the rest.
+        for (int j = 0; j < 8 && Dispatch_Message(clients[i]); j++) {
+          found = true;
+        }
+        if (Poll_Body_Transfer(clients[i])) {
+          found = true;
+        }
+      }
+      if (!found) {
+        std::this_thread::yield();
+      }
+    }
+  }
+  // Take one message (if any) out of the client's receive queue. Returns
+  // false if there was none.
+  bool Memory_Node_Keeper::Dispatch_Message(
+      const std::shared_ptr<Client_Connection>& client) {
+    // The queue pair is being reset, its receive buffers are reposted once
+    // the reset is done.
+    if (client->resetting.load(std::memory_order_acquire)) {
+      return false;
+    }
+    ibv_wc wc[1] = {};
+    if (rdma_mg->try_poll_this_thread_completions(wc, 1, client->channel,
+                                                  false) <= 0) {
+      return false;
+    }
+    ibv_mr* recv_mr = &client->recv_mr[client->buffer_counter];
+    // increase the buffer index
+    if (client->buffer_counter== R_SIZE-1 ){
+      client->buffer_counter = 0;
+    } else{
+      client->buffer_counter++;
+    }
+    if (wc[0].status != IBV_WC_SUCCESS) {
+      // A flushed or failed receive, the buffer holds no message.
+      fprintf(stderr, "receive from %s failed, status %s\n",
+              client->client_ip.c_str(), ibv_wc_status_str(wc[0].status));
+      return true;
+    }
+    RDMA_Request receive_msg_buf;
+    memcpy(&receive_msg_buf, recv_mr->addr, sizeof(RDMA_Request));
+    std::string payload;
+    switch (receive_msg_buf.command) {
+      case create_mr_:
+      case create_qp_:
+      case version_unpin_:
+      case sync_option:
+        break;
+      case qp_reset_:
+        // Stop polling the queue pair until qp_reset_handler is done with it.
+        client->resetting.store(true, std::memory_order_release);
+        break;
+      case install_version_edit:
+        // Take the edit out of the buffer before it is posted again.
+        if (receive_msg_buf.content.ive.payload_inline) {
+          payload.assign(((RDMA_Message*)recv_mr->addr)->payload,
+                         receive_msg_buf.content.ive.buffer_size);
+        }
+        break;
+      default:
+        printf("corrupt message from client.");
+        // Stop listening to this client.
+        std::unique_lock<std::mutex> lck(clients_mtx_);
+        clients_.erase(std::find(clients_.begin(), clients_.end(), client));
+        clients_changed_.store(true, std::memory_order_release);
+        return false;
+    }
+    if (receive_msg_buf.command != qp_reset_) {
+      rdma_mg->post_receive<RDMA_Message>(recv_mr, client->channel);
+    }
+    std::unique_lock<std::mutex> lck(client->mtx);
+    client->pending.emplace_back(receive_msg_buf, std::move(payload));
+    if (!client->handling && !client->awaiting_transfer.load()) {
+      client->handling = true;
+      Message_handler_pool_.Schedule(
+          [this, client](void*) { Handle_Client_Messages(client); }, nullptr);
+    }
+    return true;
+  }
+  // Check whether the client has finished writing the body the handler is
+  // waiting for. If so, queue the request again in front of the client's
+  // other messages so that its handler can finish it.
+  bool Memory_Node_Keeper::Poll_Body_Transfer(
+      const std::shared_ptr<Client_Connection>& client) {
+    if (!client->awaiting_transfer.load(std::memory_order_acquire)) {
+      return false;
+    }
+    volatile char* polling_byte = (char*)client->transfer_mr.addr +
+                                  client->transfer_request.content.ive.buffer_size;
+    _mm_clflush(polling_byte);
+    asm volatile ("sfence\n" : : );
+    asm volatile ("lfence\n" : : );
+    asm volatile ("mfence\n" : : );
+    if (*(unsigned char*)polling_byte == 0) {
+      return false;
+    }
+    std::unique_lock<std::mutex> lck(client->mtx);
+    client->awaiting_transfer.store(false);
+    client->transfer_done = true;
+    client->pending.emplace_front(client->transfer_request, std::string());
+    if (!client->handling) {
+      client->handling = true;
+      Message_handler_pool_.Schedule(
+          [this, client](void*) { Handle_Client_Messages(client); }, nullptr);
+    }
+    return true;
+  }
+  // Handles the client's messages in the order they arrived. At most one of
+  // these runs per client at a time. It stops early when a handler waits for
+  // the client to write a request body, Poll_Body_Transfer() schedules it
+  // again once the body is there.
+  void Memory_Node_Keeper::Handle_Client_Messages(
+      const std::shared_ptr<Client_Connection>& client) {
+    std::string& client_ip = client->client_ip;
+    std::unique_lock<std::mutex> lck(client->mtx);
+    while (!client->pending.empty() && !client->awaiting_transfer.load()) {
+      std::pair<RDMA_Request, std::string> message =
+          std::move(client->pending.front());
+      client->pending.pop_front();
+      lck.unlock();
+      RDMA_Request& receive_msg_buf = message.first;
       if (receive_msg_buf.command == create_mr_) {
-        rdma_mg->post_receive<RDMA_Request>(&recv_mr[buffer_counter], client_ip);
-
         create_mr_handler(receive_msg_buf, client_ip);
-//        rdma_mg_->post_send<ibv_mr>(send_mr,client_ip);  // note here should be the mr point to the send buffer.
-//        rdma_mg_->poll_completion(wc, 1, client_ip, true);
       } else if (receive_msg_buf.command == create_qp_) {
-        rdma_mg->post_receive<RDMA_Request>(&recv_mr[buffer_counter], client_ip);
         create_qp_handler(receive_msg_buf, client_ip);
-        //        rdma_mg_->post_send<registered_qp_config>(send_mr, client_ip);
-//        rdma_mg_->poll_completion(wc, 1, client_ip, true);
+      } else if (receive_msg_buf.command == install_version_edit &&
+                 receive_msg_buf.content.ive.payload_inline) {
+        Apply_Version_Edit(message.second, client_ip);
       } else if (receive_msg_buf.command == install_version_edit) {
-        rdma_mg->post_receive<RDMA_Request>(&recv_mr[buffer_counter], client_ip);
-        install_version_edit_handler(receive_msg_buf, client_ip);
-//TODO: add a handle function for the option value
+        install_version_edit_handler(receive_msg_buf, *client);
       } else if (receive_msg_buf.command == version_unpin_) {
-        rdma_mg->post_receive<RDMA_Request>(&recv_mr[buffer_counter], client_ip);
         version_unpin_handler(receive_msg_buf, client_ip);
       } else if (receive_msg_buf.command == sync_option) {
-        rdma_mg->post_receive<RDMA_Request>(&recv_mr[buffer_counter], client_ip);
-        sync_option_handler(receive_msg_buf, client_ip);
+        sync_option_handler(receive_msg_buf, *client);
       } else if (receive_msg_buf.command == qp_reset_) {
-        //THis should not be called because the recevei mr will be reset and the buffer
-        // counter will be reset as 0
-        rdma_mg->post_receive<RDMA_Request>(&recv_mr[buffer_counter], client_ip);
-        qp_reset_handler(receive_msg_buf, client_ip, socket_fd);
+        qp_reset_handler(receive_msg_buf, *client);
         DEBUG("QP has been reconnect from the memory node side\n");
         //TODO: Pause all the background tasks because the remote qp is not ready.
         // stop sending back messasges. The compute node may not reconnect its qp yet!
-      } else {
-        printf("corrupt message from client.");
-        break;
-      }
-      // increase the buffer index
-      if (buffer_counter== R_SIZE-1 ){
-        buffer_counter = 0;
-      } else{
-        buffer_counter++;
       }
+      lck.lock();
     }
-    // TODO: Build up a exit method for shared memory side, don't forget to destroy all the RDMA resourses.
+    client->handling = false;
   }
   void Memory_Node_Keeper::Server_to_Client_Communication() {
   if (rdma_mg->resources_create()) {
@@ -1013,6 +1145,9 @@ compact->compaction->AddInputDeletions(compact->compaction->edit());
     }
   } else
     memset(&(rdma_mg->res->my_gid), 0, sizeof rdma_mg->res->my_gid);
+  // No detach!! we don't want the thread keep running after we exit the
+  // main thread.
+  main_comm_threads.emplace_back([this]() { message_dispatch_thread(); });
   server_sock_connect(rdma_mg->rdma_config.server_name,
                       rdma_mg->rdma_config.tcp_port);
 }
@@ -1062,14 +1197,9 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
           fprintf(stderr, "Connection accept error, erron: %d\n", errno);
           break;
         }
-        main_comm_threads.emplace_back(
-            [this](std::string client_ip, int socketfd) {
-              this->server_communication_thread(client_ip, socketfd);
-              },
-              std::string(address.sa_data), sockfd);
-        // No detach!! we don't want the thread keep running after we exit the
-        // main thread.
-//        main_comm_threads.back().detach();
+        // Connections are rare, so set the client up right here; from then
+        // on its messages are picked up by the dispatcher thread.
+        Register_Client(std::string(address.sa_data), sockfd);
       }
     }
   }
@@ -1089,6 +1219,8 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
 }
   void Memory_Node_Keeper::JoinAllThreads(bool wait_for_jobs_to_complete) {
     Compactor_pool_.JoinThreads(wait_for_jobs_to_complete);
+    Subcompactor_pool_.JoinThreads(wait_for_jobs_to_complete);
+    Message_handler_pool_.JoinThreads(wait_for_jobs_to_complete);
   }
   void Memory_Node_Keeper::create_mr_handler(RDMA_Request request,
                                              std::string& client_ip) {
@@ -1176,115 +1308,101 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
                        &send_mr, sizeof(RDMA_Reply),client_ip, IBV_SEND_SIGNALED,1);
   rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, "message");
   }
-  void Memory_Node_Keeper::install_version_edit_handler(RDMA_Request request,
-                                                        std::string& client_ip) {
-  printf("install version\n");
+  // Hand the client a buffer for the body of "request" and return without
+  // waiting for it, see Poll_Body_Transfer().
+  void Memory_Node_Keeper::Start_Body_Transfer(RDMA_Request request,
+                                               Client_Connection& client) {
   ibv_mr send_mr;
   rdma_mg->Allocate_Local_RDMA_Slot(send_mr, "message");
   RDMA_Reply* send_pointer = (RDMA_Reply*)send_mr.addr;
   send_pointer->content.ive = {};
-  ibv_mr edit_recv_mr;
-  rdma_mg->Allocate_Local_RDMA_Slot(edit_recv_mr, "version_edit");
-  send_pointer->reply_buffer = edit_recv_mr.addr;
-  send_pointer->rkey = edit_recv_mr.rkey;
-  assert(request.content.ive.buffer_size < edit_recv_mr.length);
+  rdma_mg->Allocate_Local_RDMA_Slot(client.transfer_mr, "version_edit");
+  send_pointer->reply_buffer = client.transfer_mr.addr;
+  send_pointer->rkey = client.transfer_mr.rkey;
+  assert(request.content.ive.buffer_size < client.transfer_mr.length);
   send_pointer->received = true;
   //TODO: how to check whether the version edit message is ready, we need to know the size of the
   // version edit in the first REQUEST from compute node.
-  volatile char* polling_byte = (char*)edit_recv_mr.addr + request.content.ive.buffer_size;
+  volatile char* polling_byte =
+      (char*)client.transfer_mr.addr + request.content.ive.buffer_size;
   memset((void*)polling_byte, 0, 1);
   asm volatile ("sfence\n" : : );
   asm volatile ("lfence\n" : : );
   asm volatile ("mfence\n" : : );
+  client.transfer_request = request;
+  client.awaiting_transfer.store(true, std::memory_order_release);
   rdma_mg->RDMA_Write(request.reply_buffer, request.rkey,
-                       &send_mr, sizeof(RDMA_Reply),client_ip, IBV_SEND_SIGNALED,1);
-  size_t counter = 0;
-  while (*(unsigned char*)polling_byte == 0){
-    _mm_clflush(polling_byte);
-    asm volatile ("sfence\n" : : );
-    asm volatile ("lfence\n" : : );
-    asm volatile ("mfence\n" : : );
-    if (counter == 1000){
-      std::fprintf(stderr, "Polling install version handler\r");
-      std::fflush(stderr);
-      counter = 0;
-    }
-
-    counter++;
+                       &send_mr, sizeof(RDMA_Reply), client.client_ip,
+                       IBV_SEND_SIGNALED,1);
+  rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, "message");
+  }
+  void Memory_Node_Keeper::install_version_edit_handler(
+      RDMA_Request request, Client_Connection& client) {
+  if (!client.transfer_done) {
+    printf("install version\n");
+    Start_Body_Transfer(request, client);
+    return;
   }
+  Apply_Version_Edit(
+      Slice((char*)client.transfer_mr.addr, request.content.ive.buffer_size),
+      client.client_ip);
+  client.transfer_done = false;
+  rdma_mg->Deallocate_Local_RDMA_Slot(client.transfer_mr.addr, "version_edit");
+  }
+  void Memory_Node_Keeper::Apply_Version_Edit(const Slice& serialized_edit,
+                                              std::string& client_ip) {
   VersionEdit version_edit;
-  version_edit.DecodeFrom(
-      Slice((char*)edit_recv_mr.addr, request.content.ive.buffer_size), 1);
+  version_edit.DecodeFrom(serialized_edit, 1);
   DEBUG_arg("Version edit decoded, new file number is %zu", version_edit.GetNewFilesNum());
   std::unique_lock<std::mutex> lck(versionset_mtx);
   versions_->LogAndApply(&version_edit, 0);
   lck.unlock();
   MaybeScheduleCompaction(client_ip);
-
-  rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, "message");
-  rdma_mg->Deallocate_Local_RDMA_Slot(edit_recv_mr.addr, "version_edit");
   }
+  // Runs while the dispatcher stops polling "client" (see Dispatch_Message).
   void Memory_Node_Keeper::qp_reset_handler(RDMA_Request request,
-                                            std::string& client_ip,
-                                            int socket_fd) {
-    ibv_mr send_mr;
+                                            Client_Connection& client) {
     char temp_receive[2];
     char temp_send[] = "Q";
-//    rdma_mg->Allocate_Local_RDMA_Slot(send_mr, "message");
-//    RDMA_Reply* send_pointer = (RDMA_Reply*)send_mr.addr;
     //reset the qp state.
-    ibv_qp* qp = rdma_mg->res->qp_map.at(client_ip);
+    ibv_qp* qp = rdma_mg->res->qp_map.at(client.client_ip);
     printf("qp number before reset is %d\n", qp->qp_num);
 
 
     rdma_mg->modify_qp_to_reset(qp);
-    rdma_mg->connect_qp(qp, client_ip);
+    rdma_mg->connect_qp(qp, client.client_ip);
     printf("qp number after reset is %d\n", qp->qp_num);
-    //NOte: This is not correct because we did not recycle the receive mr, so we also
-    //  need to repost the receive wr and start from mr #1
-//    send_pointer->received = true;
-//    rdma_mg->RDMA_Write(request.reply_buffer, request.rkey,
-//                        &send_mr, sizeof(RDMA_Reply),client_ip, IBV_SEND_SIGNALED,1);
-    rdma_mg->sock_sync_data(socket_fd, 1, temp_send,
+    // The reset dropped the posted receives. Throw away whatever completions
+    // are left over and post all the receive buffers again, starting from
+    // the first one, before the client is told that the qp is ready.
+    ibv_wc wc[1] = {};
+    while (rdma_mg->try_poll_this_thread_completions(wc, 1, client.channel,
+                                                     false) > 0) {
+    }
+    for(int i = 0; i<R_SIZE; i++) {
+      rdma_mg->post_receive<RDMA_Message>(&client.recv_mr[i], client.channel);
+    }
+    client.buffer_counter = 0;
+    rdma_mg->sock_sync_data(client.socket_fd, 1, temp_send,
                             temp_receive);
-//    rdma_mg->Deallocate_Local_RDMA_Slot(send_mr.addr, "message");
+    client.resetting.store(false, std::memory_order_release);
   }
   void Memory_Node_Keeper::sync_option_handler(RDMA_Request request,
-                                               std::string& client_ip) {
-    DEBUG("SYNC option \n");
-    ibv_mr send_mr;
-    rdma_mg->Allocate_Local_RDMA_Slot(send_mr, "message");
-    RDMA_Reply* send_pointer = (RDMA_Reply*)send_mr.addr;
-    send_pointer->content.ive = {};
-    ibv_mr edit_recv_mr;
-    rdma_mg->Allocate_Local_RDMA_Slot(edit_recv_mr, "version_edit");
-    send_pointer->reply_buffer = edit_recv_mr.addr;
-    send_pointer->rkey = edit_recv_mr.rkey;
-    assert(request.content.ive.buffer_size < edit_recv_mr.length);
-    send_pointer->received = true;
-    //TODO: how to check whether the version edit message is ready, we need to know the size of the
-    // version edit in the first REQUEST from compute node.
-    volatile char* polling_byte = (char*)edit_recv_mr.addr + request.content.ive.buffer_size;
-    memset((void*)polling_byte, 0, 1);
-    asm volatile ("sfence\n" : : );
-    asm volatile ("lfence\n" : : );
-    asm volatile ("mfence\n" : : );
-    rdma_mg->RDMA_Write(request.reply_buffer, request.rkey,
-                        &send_mr, sizeof(RDMA_Reply),client_ip, IBV_SEND_SIGNALED,1);
-
-    while (*(unsigned char*)polling_byte == 0){
-      _mm_clflush(polling_byte);
-      asm volatile ("sfence\n" : : );
-      asm volatile ("lfence\n" : : );
-      asm volatile ("mfence\n" : : );
-      std::fprintf(stderr, "Polling sync option handler\n");
-      std::fflush(stderr);
+                                               Client_Connection& client) {
+    if (!client.transfer_done) {
+      DEBUG("SYNC option \n");
+      Start_Body_Transfer(request, client);
+      return;
     }
-    *opts = *static_cast<Options*>(edit_recv_mr.addr);
+    *opts = *static_cast<Options*>(client.transfer_mr.addr);
+    client.transfer_done = false;
+    rdma_mg->Deallocate_Local_RDMA_Slot(client.transfer_mr.addr,
+                                        "version_edit");
     opts->env = nullptr;
     opts->filter_policy = new InternalFilterPolicy(NewBloomFilterPolicy(opts->bloom_bits));
     opts->comparator = &internal_comparator_;
     Compactor_pool_.SetBackgroundThreads(opts->max_background_compactions);
+    Subcompactor_pool_.SetBackgroundThreads(opts->MaxSubcompaction);
     printf("Option sync finished\n");
   }
   void Memory_Node_Keeper::version_unpin_handler(RDMA_Request request,
@@ -1305,9 +1423,14 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
   ibv_mr receive_mr = {};
   rdma_mg->Allocate_Local_RDMA_Slot(send_mr, "message");
 
+  std::string serilized_ve;
+  if (!edit->IsTrival()) {
+    edit->EncodeTo(&serilized_ve);
+  }
+  send_pointer = (RDMA_Request*)send_mr.addr;
+  send_pointer->command = install_version_edit;
+  send_pointer->content.ive = {};
   if (edit->IsTrival()){
-    send_pointer = (RDMA_Request*)send_mr.addr;
-    send_pointer->command = install_version_edit;
     send_pointer->content.ive.trival = true;
 //    send_pointer->content.ive.buffer_size = serilized_ve.size();
     int level;
@@ -1326,12 +1449,26 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
       fprintf(stderr, "failed to poll send for remote memory register\n");
       return;
     }
+  }else if (serilized_ve.size() <= sizeof(RDMA_Message::payload)){
+    // Small edits travel with the request; the compute node applies them from
+    // its receive buffer without a reply and an RDMA write.
+    send_pointer->content.ive.payload_inline = true;
+    send_pointer->content.ive.buffer_size = serilized_ve.size();
+    send_pointer->content.ive.version_id = versions_->version_id;
+    memcpy(((RDMA_Message*)send_mr.addr)->payload, serilized_ve.data(),
+           serilized_ve.size());
+    rdma_mg->post_send(&send_mr, client_ip,
+                       sizeof(RDMA_Request) + serilized_ve.size());
+    version_mtx->unlock();
+    ibv_wc wc[2] = {};
+    if (rdma_mg->poll_completion(wc, 1, client_ip,true)){
+      fprintf(stderr, "failed to poll send for remote memory register\n");
+      return;
+    }
   }else{
     rdma_mg->Allocate_Local_RDMA_Slot(send_mr_ve, "version_edit");
 
     rdma_mg->Allocate_Local_RDMA_Slot(receive_mr, "message");
-    std::string serilized_ve;
-    edit->EncodeTo(&serilized_ve);
     assert(serilized_ve.size() <= send_mr_ve.length-1);
     uint8_t check_byte = 0;
     while (check_byte == 0){
@@ -1341,8 +1478,6 @@ int Memory_Node_Keeper::server_sock_connect(const char* servername, int port) {
     memcpy(send_mr_ve.addr, serilized_ve.c_str(), serilized_ve.size());
     memset((char*)send_mr_ve.addr + serilized_ve.size(), check_byte, 1);
 
-    send_pointer = (RDMA_Request*)send_mr.addr;
-    send_pointer->command = install_version_edit;
     send_pointer->content.ive.trival = false;
     send_pointer->content.ive.buffer_size = serilized_ve.size();
     send_pointer->content.ive.version_id = versions_->version_id;
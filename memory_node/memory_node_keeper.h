@@ -6,6 +6,9 @@
 #define TimberSaw_HOME_NODE_KEEPER_H
 
 
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <queue>
 #include "util/rdma.h"
 #include "util/ThreadPool.h"
@@ -27,7 +30,11 @@ class Memory_Node_Keeper {
   void SetBackgroundThreads(int num,  ThreadPoolType type);
   void MaybeScheduleCompaction(std::string& client_ip);
   static void BGWork_Compaction(void* thread_args);
-  void BackgroundCompaction(void* p);
+  static void BGWork_Subcompaction(void* thread_args);
+  void CompactionWorker();
+  // Run one compaction and send the result to "client_ip". Returns false if
+  // there was nothing that could be picked.
+  bool BackgroundCompaction(std::string& client_ip);
   void CleanupCompaction(CompactionState* compact);
   Status DoCompactionWork(CompactionState* compact, std::string& client_ip);
   void ProcessKeyValueCompaction(SubcompactionState* sub_compact);
@@ -47,24 +54,71 @@ class Memory_Node_Keeper {
   TableCache* const table_cache_;
   std::vector<std::thread> main_comm_threads;
   ThreadPool Compactor_pool_;
+  // Runs the subcompactions of Compactor_pool_'s jobs.
+  ThreadPool Subcompactor_pool_;
   ThreadPool Message_handler_pool_;
   std::mutex versionset_mtx;
   VersionSet* versions_;
+  // Clients to send the results of the next compactions to, in order, and
+  // the number of CompactionWorker jobs queued or running on
+  // Compactor_pool_.
+  std::mutex compaction_mtx_;
+  std::deque<std::string> compaction_clients_;
+  int bg_compaction_scheduled_ = 0;
+  // A connected compute node. Its messages are picked up by the dispatcher
+  // thread and handled one at a time, in arrival order, on
+  // Message_handler_pool_, so a slow request only delays its own client.
+  struct Client_Connection {
+    std::string client_ip;
+    int socket_fd;
+    RDMA_Channel channel;
+    ibv_mr recv_mr[R_SIZE];
+    int buffer_counter = 0;
+    std::mutex mtx;
+    // Received requests (with their inline payloads) not yet handled.
+    std::deque<std::pair<RDMA_Request, std::string>> pending;
+    // True while a drain job for this client is queued or running.
+    bool handling = false;
+    // Set by the dispatcher on qp_reset_, cleared by qp_reset_handler. The
+    // dispatcher does not poll the client (nor touch buffer_counter) while
+    // it is set.
+    std::atomic<bool> resetting{false};
+    // A request whose body the client is writing into transfer_mr. While
+    // awaiting_transfer is set no other message of the client is handled,
+    // the dispatcher polls the byte after the body instead. It then sets
+    // transfer_done and queues transfer_request again.
+    std::atomic<bool> awaiting_transfer{false};
+    bool transfer_done = false;
+    RDMA_Request transfer_request;
+    ibv_mr transfer_mr;
+  };
+  std::mutex clients_mtx_;
+  std::vector<std::shared_ptr<Client_Connection>> clients_;
+  std::atomic<bool> clients_changed_{false};
 
 
+  // REQUIRES: compaction_mtx_ is held.
+  void StartCompactionWorker();
   Status InstallCompactionResults(CompactionState* compact,
                                   std::string& client_ip);
   int server_sock_connect(const char* servername, int port);
-  void server_communication_thread(std::string client_ip, int socket_fd);
+  void Register_Client(std::string client_ip, int socket_fd);
+  void message_dispatch_thread();
+  bool Dispatch_Message(const std::shared_ptr<Client_Connection>& client);
+  bool Poll_Body_Transfer(const std::shared_ptr<Client_Connection>& client);
+  void Handle_Client_Messages(const std::shared_ptr<Client_Connection>& client);
   void create_mr_handler(RDMA_Request request, std::string& client_ip);
   void create_qp_handler(RDMA_Request request, std::string& client_ip);
   const Comparator* user_comparator() const {
     return internal_comparator_.user_comparator();
   }
-  void install_version_edit_handler(RDMA_Request request, std::string& client_ip);
-  void qp_reset_handler(RDMA_Request request, std::string& client_ip,
-                        int socket_fd);
-  void sync_option_handler(RDMA_Request request, std::string& client_ip);
+  void Start_Body_Transfer(RDMA_Request request, Client_Connection& client);
+  void install_version_edit_handler(RDMA_Request request,
+                                    Client_Connection& client);
+  // Decode a version edit sent by "client_ip" and install it.
+  void Apply_Version_Edit(const Slice& serialized_edit, std::string& client_ip);
+  void qp_reset_handler(RDMA_Request request, Client_Connection& client);
+  void sync_option_handler(RDMA_Request request, Client_Connection& client);
   void version_unpin_handler(RDMA_Request request, std::string& client_ip);
   void Edit_sync_to_remote(VersionEdit* edit, std::string& client_ip,
                            std::unique_lock<std::mutex>* version_mtx);
@@ -160,10 +160,10 @@ void RWMutex::ReadUnlock() { PthreadCall("read unlock", pthread_rwlock_unlock(&m
 void RWMutex::WriteUnlock() { PthreadCall("write unlock", pthread_rwlock_unlock(&mu_)); }
 
 int PhysicalCoreID() {
-#if defined(ROCKSDB_SCHED_GETCPU_PRESENT) && defined(__x86_64__) && \
-    (__GNUC__ > 2 || (__GNUC__ == 2 && __GNUC_MINOR__ >= 22))
-  // sched_getcpu uses VDSO getcpu() syscall since 2.22. I believe Linux offers VDSO
-  // support only on x86_64. This is the fastest/preferred method if available.
+#if defined(__linux__)
+  // sched_getcpu uses VDSO getcpu() syscall since glibc 2.22. This is the
+  // fastest/preferred method; cpuid below is serializing and traps to the
+  // hypervisor on virtual machines.
   int cpuno = sched_getcpu();
   if (cpuno < 0) {
     return -1;
@@ -12,7 +12,8 @@ namespace TimberSaw {
 
 inline uint32_t Block::NumRestarts() const {
   assert(size_ >= sizeof(uint32_t));
-  return DecodeFixed32(data_ + size_ - sizeof(uint32_t));
+  return DecodeFixed32(data_ + size_ - sizeof(uint32_t)) &
+         ~kDataBlockHashIndexFlag;
 }
 
 Block::Block(const BlockContents& contents, BlockType type)
@@ -23,12 +24,29 @@ Block::Block(const BlockContents& contents, BlockType type)
   if (size_ < sizeof(uint32_t)) {
     size_ = 0;  // Error marker
   } else {
-    size_t max_restarts_allowed = (size_ - sizeof(uint32_t)) / sizeof(uint32_t);
-    if (NumRestarts() > max_restarts_allowed) {
+    // End of the restart array: the hash index, if any, sits behind it.
+    size_t restarts_end = size_ - sizeof(uint32_t);
+    if (DecodeFixed32(data_ + restarts_end) & kDataBlockHashIndexFlag) {
+      if (restarts_end < sizeof(uint16_t)) {
+        restarts_end = 0;
+        size_ = 0;
+      } else {
+        restarts_end -= sizeof(uint16_t);
+        num_buckets_ = DecodeFixed16(data_ + restarts_end);
+        if (num_buckets_ == 0 || num_buckets_ > restarts_end) {
+          size_ = 0;
+        } else {
+          restarts_end -= num_buckets_;
+          hash_buckets_ = reinterpret_cast<const uint8_t*>(data_) + restarts_end;
+        }
+      }
+    }
+    size_t max_restarts_allowed = restarts_end / sizeof(uint32_t);
+    if (size_ == 0 || NumRestarts() > max_restarts_allowed) {
       // The size is too small for NumRestarts()
       size_ = 0;
     } else {
-      restart_offset_ = size_ - (1 + NumRestarts()) * sizeof(uint32_t);
+      restart_offset_ = restarts_end - NumRestarts() * sizeof(uint32_t);
     }
   }
   if (type == Block_On_Memory_Side){
@@ -58,6 +76,10 @@ Block::~Block() {
     if (type_ == Block_On_Memory_Side){
       return;
     }
+    if (type_ == Block_On_Heap) {
+      delete[] data_;
+      return;
+    }
     DEBUG("Not found in the RDMA mem pool");
   }
 }
@@ -72,8 +94,24 @@ Iterator* Block::NewIterator(const Comparator* comparator) {
   if (num_restarts == 0) {
     return NewEmptyIterator();
   } else {
-    return new Iter(comparator, data_, restart_offset_, num_restarts);
+    return new Iter(comparator, data_, restart_offset_, num_restarts,
+                    hash_buckets_, num_buckets_);
+  }
+}
+
+Iterator* Block::NewSeekForGetIterator(const Comparator* comparator,
+                                       const Slice& target) {
+  if (size_ < sizeof(uint32_t)) {
+    return NewErrorIterator(Status::Corruption("bad block contents"));
+  }
+  const uint32_t num_restarts = NumRestarts();
+  if (num_restarts == 0) {
+    return NewEmptyIterator();
   }
+  Iter* iter = new Iter(comparator, data_, restart_offset_, num_restarts,
+                        hash_buckets_, num_buckets_);
+  iter->SeekForGet(target);
+  return iter;
 }
 
 }  // namespace TimberSaw
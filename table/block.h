@@ -16,6 +16,7 @@
 
 #include "table/format.h"
 #include "util/coding.h"
+#include "util/hash.h"
 #include "util/logging.h"
 #include "util/rdma.h"
 namespace TimberSaw {
@@ -23,7 +24,26 @@ namespace TimberSaw {
 struct BlockContents;
 class Comparator;
 //class IterKey;
-enum BlockType {DataBlock, IndexBlock, FilterBlock, Block_On_Memory_Side};
+// Block_On_Heap blocks own a new[] allocated buffer instead of an RDMA slot.
+enum BlockType {DataBlock, IndexBlock, FilterBlock, Block_On_Memory_Side,
+                Block_On_Heap};
+
+// Optional hash index of a data block, see block_builder.cc.  It maps the
+// hash of a user key to the restart point whose interval holds the key.
+// Set in the num_restarts word of blocks that have one.
+static const uint32_t kDataBlockHashIndexFlag = 1u << 31;
+// Buckets are one byte, so only blocks with at most this many restart
+// points are indexed.
+static const uint32_t kDataBlockHashIndexMaxRestarts = 253;
+static const uint8_t kDataBlockHashIndexCollision = 254;
+static const uint8_t kDataBlockHashIndexNoEntry = 255;
+// Indexed keys per bucket: lower means fewer collisions and a bigger index.
+static const double kDataBlockHashIndexUtilRatio = 0.5;
+
+inline uint32_t DataBlockHashIndexHash(const Slice& user_key) {
+  return Hash(user_key.data(), user_key.size(), 0x8e5b4f37);
+}
+
 class Block {
  public:
   // Initialize the block with the specified contents.
@@ -36,6 +56,12 @@ class Block {
 
   size_t size() const { return size_; }
   Iterator* NewIterator(const Comparator* comparator);
+  // Returns an iterator positioned for a point lookup of the internal key
+  // "target": at the first entry >= "target", like Seek().  The hash index
+  // of the block is used when there is one, and the iterator is left
+  // invalid if it shows that the user key of "target" is not in the block.
+  Iterator* NewSeekForGetIterator(const Comparator* comparator,
+                                  const Slice& target);
 
   class Iter;
 
@@ -45,6 +71,8 @@ class Block {
   const char* data_;
   size_t size_;
   uint32_t restart_offset_;  // Offset in data_ of restart array
+  const uint8_t* hash_buckets_ = nullptr;  // Hash index, or nullptr if none
+  uint32_t num_buckets_ = 0;
   bool owned_;               // Block owns data_[]
   bool RDMA_Regiested;
   BlockType type_;
@@ -90,6 +118,8 @@ class Block::Iter : public Iterator {
   const char* const data_;       // underlying block contents
   uint32_t const restarts_;      // Offset of restart array (list of fixed32), should be the end of content.
   uint32_t const num_restarts_;  // Number of uint32_t entries in restart array
+  const uint8_t* const hash_buckets_;  // Hash index of the block, if any
+  uint32_t const num_buckets_;
 
   // current_ is offset in data_ of current entry.  >= restarts_ if !Valid
   uint32_t current_;
@@ -135,11 +165,14 @@ class Block::Iter : public Iterator {
 
  public:
   Iter(const Comparator* comparator, const char* data, uint32_t restarts,
-       uint32_t num_restarts)
+       uint32_t num_restarts, const uint8_t* hash_buckets = nullptr,
+       uint32_t num_buckets = 0)
       : comparator_(comparator),
         data_(data),
         restarts_(restarts),
         num_restarts_(num_restarts),
+        hash_buckets_(hash_buckets),
+        num_buckets_(num_buckets),
         current_(restarts_),
         restart_index_(num_restarts_){
     assert(num_restarts_ > 0);
@@ -267,6 +300,33 @@ class Block::Iter : public Iterator {
     }
   }
 
+  // Seek() for a point lookup, see Block::NewSeekForGetIterator().
+  void SeekForGet(const Slice& target) {
+    if (hash_buckets_ == nullptr) {
+      Seek(target);
+      return;
+    }
+    uint8_t entry = hash_buckets_[DataBlockHashIndexHash(
+        ExtractUserKey(target)) % num_buckets_];
+    if (entry == kDataBlockHashIndexNoEntry) {
+      current_ = restarts_;
+      restart_index_ = num_restarts_;
+      return;
+    }
+    if (entry == kDataBlockHashIndexCollision || entry >= num_restarts_) {
+      Seek(target);
+      return;
+    }
+    // Every key before the restart interval of the user key is smaller than
+    // "target", so a linear search from there finds what Seek() would.
+    SeekToRestartPoint(entry);
+    while (ParseNextKey()) {
+      if (Compare(key_.GetKey(), target) >= 0) {
+        return;
+      }
+    }
+  }
+
   void SeekToFirst() override {
     SeekToRestartPoint(0);
     ParseNextKey();
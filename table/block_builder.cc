@@ -25,6 +25,15 @@
 //     restarts: uint32[num_restarts]
 //     num_restarts: uint32
 // restarts[i] contains the offset within the block of the ith restart point.
+//
+// If options.data_block_hash_index is set, data blocks with no more than
+// kDataBlockHashIndexMaxRestarts restart points also get a hash index from
+// user keys to restart points between the restart array and num_restarts:
+//     buckets: uint8[num_buckets]
+//     num_buckets: uint16
+// and kDataBlockHashIndexFlag is set in num_restarts.  A bucket holds the
+// restart index of the user keys hashed to it, kDataBlockHashIndexNoEntry
+// if there are none, or kDataBlockHashIndexCollision if they disagree.
 
 #include "table/block_builder.h"
 
@@ -33,6 +42,7 @@
 
 #include "TimberSaw/comparator.h"
 #include "TimberSaw/options.h"
+#include "table/block.h"
 #include "util/coding.h"
 
 namespace TimberSaw {
@@ -52,13 +62,28 @@ void BlockBuilder::Reset_Forward() {
   counter_ = 0;
   finished_ = false;
   last_key_.clear();
+  hash_entries_.clear();
+}
+
+// Number of hash buckets for "num_keys" keys.
+static uint32_t HashIndexBuckets(size_t num_keys) {
+  size_t num_buckets =
+      static_cast<size_t>(num_keys / kDataBlockHashIndexUtilRatio) + 1;
+  return static_cast<uint32_t>(std::min<size_t>(num_buckets, 0xffff));
 }
+
 void BlockBuilder::Move_buffer(const char* p) { buffer.Reset(p,0);
 }
 size_t BlockBuilder::CurrentSizeEstimate() const {
-  return (buffer.size() +                       // Raw data buffer
-          restarts_.size() * sizeof(uint32_t) +  // Restart array
-          sizeof(uint32_t));                     // Restart array length
+  size_t estimate = buffer.size() +                       // Raw data buffer
+                    restarts_.size() * sizeof(uint32_t) +  // Restart array
+                    sizeof(uint32_t);                     // Restart array length
+  if (options_->data_block_hash_index) {
+    // Leave room for the buckets of one more key, as callers check the
+    // estimate before adding it.
+    estimate += HashIndexBuckets(hash_entries_.size() + 1) + sizeof(uint16_t);
+  }
+  return estimate;
 }
 
 Slice BlockBuilder::Finish() {
@@ -67,7 +92,26 @@ Slice BlockBuilder::Finish() {
     PutFixed32(&buffer, restarts_[i]);
   }
 //  assert(restarts_.size() > 1);
-  PutFixed32(&buffer, restarts_.size());
+  uint32_t num_restarts = restarts_.size();
+  if (options_->data_block_hash_index && !hash_entries_.empty() &&
+      num_restarts <= kDataBlockHashIndexMaxRestarts) {
+    const uint32_t num_buckets = HashIndexBuckets(hash_entries_.size());
+    std::string buckets(num_buckets,
+                        static_cast<char>(kDataBlockHashIndexNoEntry));
+    for (const auto& entry : hash_entries_) {
+      uint8_t& bucket =
+          reinterpret_cast<uint8_t&>(buckets[entry.first % num_buckets]);
+      if (bucket == kDataBlockHashIndexNoEntry) {
+        bucket = static_cast<uint8_t>(entry.second);
+      } else if (bucket != entry.second) {
+        bucket = kDataBlockHashIndexCollision;
+      }
+    }
+    buffer.append(buckets.data(), buckets.size());
+    PutFixed16(&buffer, static_cast<uint16_t>(num_buckets));
+    num_restarts |= kDataBlockHashIndexFlag;
+  }
+  PutFixed32(&buffer, num_restarts);
   finished_ = true;
   return Slice(buffer);
 }
@@ -106,6 +150,11 @@ void BlockBuilder::Add(const Slice& key, const Slice& value) {
   buffer.append(key.data() + shared, non_shared);
   buffer.append(value.data(), value.size());
 
+  if (options_->data_block_hash_index) {
+    hash_entries_.emplace_back(DataBlockHashIndexHash(ExtractUserKey(key)),
+                               restarts_.size() - 1);
+  }
+
   // Update state
   last_key_.resize(shared);
   last_key_.append(key.data() + shared, non_shared);
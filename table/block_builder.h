@@ -6,6 +6,7 @@
 #define STORAGE_TimberSaw_TABLE_BLOCK_BUILDER_H_
 
 #include <cstdint>
+#include <utility>
 #include <vector>
 
 #include "TimberSaw/slice.h"
@@ -49,6 +50,9 @@ class BlockBuilder {
   int counter_;                     // Number of entries emitted since restart
   bool finished_;                   // Has Finish() been called?
   std::string last_key_;
+  // (hash of the user key, restart index) of every key added, only kept
+  // when options_->data_block_hash_index is set.
+  std::vector<std::pair<uint32_t, uint32_t>> hash_entries_;
 };
 
 }  // namespace TimberSaw
@@ -4,6 +4,8 @@
 
 #include "table/format.h"
 
+#include <algorithm>
+
 #include "TimberSaw/env.h"
 #include "port/port.h"
 #include "table/block.h"
@@ -101,113 +103,50 @@ void Find_Remote_mr(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
 // the same as data index block and filter block.
 Status ReadDataBlock(std::map<uint32_t, ibv_mr*>* remote_data_blocks, const ReadOptions& options,
                  const BlockHandle& handle, BlockContents* result) {
-//#ifdef GETANALYSIS
-//  auto start = std::chrono::high_resolution_clock::now();
-//#endif
-  result->data = Slice();
-//  result->cachable = false;
-//  result->heap_allocated = false;
-  // Read the block contents as well as the type/crc footer.
-  // See table_builder.cc for the code that built this structure.
-  Status s = Status::OK();
+  PendingBlockRead pending;
+  StartReadDataBlock(remote_data_blocks, handle, &pending);
+  return FinishReadDataBlock(options, &pending, result);
+}
 
+void StartReadDataBlock(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
+                        const BlockHandle& handle, PendingBlockRead* pending) {
   std::shared_ptr<RDMA_Manager> rdma_mg = Env::Default()->rdma_mg;
-
   size_t n = static_cast<size_t>(handle.size());
   assert(n + kBlockTrailerSize <= rdma_mg->name_to_size["DataBlock"]);
-  ibv_mr contents = {};
   ibv_mr remote_mr = {};
-//#ifndef NDEBUG
-//  ibv_wc wc;
-//  int check_poll_number =
-//      rdma_mg->try_poll_this_thread_completions(&wc, 1, "read_local");
-//  assert( check_poll_number == 0);
-//#endif
-
-//  if (){
-
+  pending->handle = handle;
+  pending->contents = {};
+  Find_Remote_mr(remote_data_blocks, handle, &remote_mr);
+  rdma_mg->Allocate_Local_RDMA_Slot(pending->contents, "DataBlock");
+  pending->wr_id = rdma_mg->RDMA_Read_Async(&remote_mr, &pending->contents,
+                                            n + kBlockTrailerSize);
+}
 
-    Find_Remote_mr(remote_data_blocks, handle, &remote_mr);
-//#ifdef GETANALYSIS
-//  auto stop = std::chrono::high_resolution_clock::now();
-//  auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
-//  printf("Find mr time elapse is %zu\n",  duration.count());
-//#endif
-//#ifdef GETANALYSIS
-//  auto start = std::chrono::high_resolution_clock::now();
-//#endif
-    rdma_mg->Allocate_Local_RDMA_Slot(contents, "DataBlock");
-//#ifdef GETANALYSIS
-//  auto stop = std::chrono::high_resolution_clock::now();
-//  auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
-//  printf("Local memory allocation time elapse is %zu\n",  duration.count());
-//#endif
-#ifdef PROCESSANALYSIS
-  auto start = std::chrono::high_resolution_clock::now();
-#endif
-    rdma_mg->RDMA_Read(&remote_mr, &contents, n + kBlockTrailerSize,
-                     "read_local", IBV_SEND_SIGNALED, 1);
-#ifdef PROCESSANALYSIS
-    auto stop = std::chrono::high_resolution_clock::now();
-  auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
-  if (n + kBlockTrailerSize <= 8192){
-    RDMA_Manager::RDMAReadTimeElapseSum.fetch_add(duration.count());
-    RDMA_Manager::ReadCount.fetch_add(1);
-  }
-#endif
-    //
-//  }else{
-//    s = Status::Corruption("Remote memtable out of buffer");
-//  }
-//#ifndef NDEBUG
-//  usleep(100);
-//  check_poll_number = rdma_mg->try_poll_this_thread_completions(&wc,1);
-//  assert( check_poll_number == 0);
-//#endif
+Status FinishReadDataBlock(const ReadOptions& options,
+                           PendingBlockRead* pending, BlockContents* result) {
+  result->data = Slice();
+  std::shared_ptr<RDMA_Manager> rdma_mg = Env::Default()->rdma_mg;
+  size_t n = static_cast<size_t>(pending->handle.size());
+  // Read the block contents as well as the type/crc footer.
+  // See table_builder.cc for the code that built this structure.
+  rdma_mg->Wait_RDMA_Read(pending->wr_id);
   // Check the crc of the type and the block contents
-//#ifdef GETANALYSIS
-//  auto start = std::chrono::high_resolution_clock::now();
-//#endif
-  const char* data = static_cast<char*>(contents.addr);  // Pointer to where Read put the data
+  const char* data = static_cast<char*>(pending->contents.addr);  // Pointer to where Read put the data
   if (options.verify_checksums) {
     const uint32_t crc = crc32c::Unmask(DecodeFixed32(data + n + 1));
     const uint32_t actual = crc32c::Value(data, n + 1);
     if (actual != crc) {
-//      delete[] buf;
       DEBUG("Data block Checksum mismatch\n");
       assert(false);
-      s = Status::Corruption("block checksum mismatch");
-      return s;
+      rdma_mg->Deallocate_Local_RDMA_Slot(static_cast<void*>(const_cast<char *>(data)), "DataBlock");
+      return Status::Corruption("block checksum mismatch");
     }
   }
-//  printf("data[n] is %c\n", data[n]);
   switch (data[n]) {
     case kNoCompression:
         result->data = Slice(data, n);
-//        result->heap_allocated = false;
-//        result->cachable = false;  // Do not double-cache
-
-
       // Ok
         break;
-//    case kSnappyCompression: {
-//      size_t ulength = 0;
-//      if (!port::Snappy_GetUncompressedLength(data, n, &ulength)) {
-//        rdma_mg->Deallocate_Local_RDMA_Slot(data, "DataBlock")
-//        return Status::Corruption("corrupted compressed block contents");
-//      }
-//      char* ubuf = new char[ulength];
-//      if (!port::Snappy_Uncompress(data, n, ubuf)) {
-//        delete[] buf;
-////        delete[] ubuf;
-//        return Status::Corruption("corrupted compressed block contents");
-//      }
-//      delete[] buf;
-//      result->data = Slice(ubuf, ulength);
-//      result->heap_allocated = true;
-//      result->cachable = true;
-//      break;
-//    }
     default:
       assert(data[n] != kNoCompression);
       assert(false);
@@ -215,14 +154,72 @@ Status ReadDataBlock(std::map<uint32_t, ibv_mr*>* remote_data_blocks, const Read
       DEBUG("Data block illegal compression type\n");
       return Status::Corruption("bad block type");
   }
-//#ifdef GETANALYSIS
-//  auto stop = std::chrono::high_resolution_clock::now();
-//  auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
-//  printf("CRC check elapse is %zu\n",  duration.count());
-//#endif
   return Status::OK();
 }
 
+void DiscardReadDataBlock(PendingBlockRead* pending) {
+  std::shared_ptr<RDMA_Manager> rdma_mg = Env::Default()->rdma_mg;
+  // The NIC may still be writing into the buffer, so it can only go back to
+  // the pool once the read has completed.
+  rdma_mg->Wait_RDMA_Read(pending->wr_id);
+  rdma_mg->Deallocate_Local_RDMA_Slot(pending->contents.addr, "DataBlock");
+}
+
+Status ReadDataBlocks(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
+                      const ReadOptions& options,
+                      const std::vector<BlockHandle>& handles,
+                      std::vector<BlockContents>* results) {
+  results->assign(handles.size(), BlockContents());
+  if (handles.empty()) {
+    return Status::OK();
+  }
+  std::shared_ptr<RDMA_Manager> rdma_mg = Env::Default()->rdma_mg;
+  std::vector<ibv_mr> remote_mrs(handles.size());
+  std::vector<ibv_mr> contents(handles.size());
+  std::vector<size_t> sizes(handles.size());
+  for (size_t i = 0; i < handles.size(); i++) {
+    sizes[i] = static_cast<size_t>(handles[i].size()) + kBlockTrailerSize;
+    assert(sizes[i] <= rdma_mg->name_to_size["DataBlock"]);
+    memset(&remote_mrs[i], 0, sizeof(ibv_mr));
+    memset(&contents[i], 0, sizeof(ibv_mr));
+    Find_Remote_mr(remote_data_blocks, handles[i], &remote_mrs[i]);
+    rdma_mg->Allocate_Local_RDMA_Slot(contents[i], "DataBlock");
+  }
+  Status s;
+  if (rdma_mg->RDMA_Read_Batch(remote_mrs.data(), contents.data(),
+                               sizes.data(), handles.size(), kReadLocal) != 0) {
+    s = Status::IOError("RDMA read of data blocks failed");
+  }
+  for (size_t i = 0; i < handles.size() && s.ok(); i++) {
+    size_t n = static_cast<size_t>(handles[i].size());
+    const char* data = static_cast<char*>(contents[i].addr);
+    if (options.verify_checksums) {
+      const uint32_t crc = crc32c::Unmask(DecodeFixed32(data + n + 1));
+      const uint32_t actual = crc32c::Value(data, n + 1);
+      if (actual != crc) {
+        DEBUG("Data block Checksum mismatch\n");
+        s = Status::Corruption("block checksum mismatch");
+        break;
+      }
+    }
+    if (data[n] != kNoCompression) {
+      DEBUG("Data block illegal compression type\n");
+      s = Status::Corruption("bad block type");
+      break;
+    }
+    (*results)[i].data = Slice(data, n);
+  }
+  if (!s.ok()) {
+    // The caller discards the whole batch on error, so hand every buffer
+    // back to the pool instead of leaking the ones that were fine.
+    for (size_t i = 0; i < handles.size(); i++) {
+      rdma_mg->Deallocate_Local_RDMA_Slot(contents[i].addr, "DataBlock");
+    }
+    results->clear();
+  }
+  return s;
+}
+
 Status ReadDataIndexBlock(ibv_mr* remote_mr, const ReadOptions& options,
                           BlockContents* result) {
   result->data = Slice();
@@ -237,7 +234,7 @@ Status ReadDataIndexBlock(ibv_mr* remote_mr, const ReadOptions& options,
   assert(n + kBlockTrailerSize < rdma_mg->name_to_size["DataIndexBlock"]);
   ibv_mr contents = {};
   rdma_mg->Allocate_Local_RDMA_Slot(contents, "DataIndexBlock");
-  rdma_mg->RDMA_Read(remote_mr, &contents, n + kBlockTrailerSize, "read_local", IBV_SEND_SIGNALED, 1);
+  rdma_mg->RDMA_Read(remote_mr, &contents, n + kBlockTrailerSize, kReadLocal, IBV_SEND_SIGNALED, 1);
 
   // Check the crc of the type and the block contents
   const char* data = static_cast<char*>(contents.addr);  // Pointer to where Read put the data
@@ -306,7 +303,7 @@ Status ReadFilterBlock(ibv_mr* remote_mr,
   assert(n + kBlockTrailerSize < rdma_mg->name_to_size["FilterBlock"]);
   ibv_mr contents = {};
   rdma_mg->Allocate_Local_RDMA_Slot(contents, "FilterBlock");
-  rdma_mg->RDMA_Read(remote_mr, &contents, n + kBlockTrailerSize, "read_local", IBV_SEND_SIGNALED, 1);
+  rdma_mg->RDMA_Read(remote_mr, &contents, n + kBlockTrailerSize, kReadLocal, IBV_SEND_SIGNALED, 1);
 
   // Check the crc of the type and the block contents
   const char* data = static_cast<char*>(contents.addr);  // Pointer to where Read put the data
@@ -357,4 +354,86 @@ Status ReadFilterBlock(ibv_mr* remote_mr,
   assert(result->data.size() != 0);
   return Status::OK();
 }
+
+bool DecodePartitionedIndexFooter(const Slice& region, uint32_t* top_size) {
+  if (region.size() < kPartitionedIndexFooterSize) {
+    return false;
+  }
+  const char* footer =
+      region.data() + region.size() - kPartitionedIndexFooterSize;
+  if (DecodeFixed64(footer + 4) != kPartitionedIndexMagic) {
+    return false;
+  }
+  *top_size = DecodeFixed32(footer);
+  return true;
+}
+
+// Copy the block at [data, data + n) plus trailer out of an RDMA buffer.
+static Status CopyIndexBlock(const char* data, size_t n,
+                             const ReadOptions& options,
+                             BlockContents* result) {
+  if (options.verify_checksums) {
+    const uint32_t crc = crc32c::Unmask(DecodeFixed32(data + n + 1));
+    const uint32_t actual = crc32c::Value(data, n + 1);
+    if (actual != crc) {
+      DEBUG("Index block Checksum mismatch\n");
+      return Status::Corruption("block checksum mismatch");
+    }
+  }
+  if (data[n] != kNoCompression) {
+    DEBUG("index block illegal compression type\n");
+    return Status::Corruption("bad block type");
+  }
+  char* buf = new char[n];
+  memcpy(buf, data, n);
+  result->data = Slice(buf, n);
+  return Status::OK();
+}
+
+Status ReadIndexTail(ibv_mr* remote_mr, size_t tail_size,
+                     const ReadOptions& options, BlockContents* result,
+                     bool* partitioned) {
+  // Large enough for the top level of the index of a max-sized table, used
+  // when the metadata does not tell how much to fetch.
+  static const size_t kIndexTailReadSize = 16 * 1024;
+  result->data = Slice();
+  *partitioned = false;
+  std::shared_ptr<RDMA_Manager> rdma_mg = Env::Default()->rdma_mg;
+  const size_t region_size = remote_mr->length;
+  tail_size = std::min(region_size,
+                       tail_size > 0 ? tail_size : kIndexTailReadSize);
+  assert(tail_size <= rdma_mg->name_to_size["DataIndexBlock"]);
+  ibv_mr contents = {};
+  rdma_mg->Allocate_Local_RDMA_Slot(contents, "DataIndexBlock");
+  ibv_mr remote_tail = *remote_mr;
+  remote_tail.addr = static_cast<char*>(remote_mr->addr) + region_size -
+                     tail_size;
+  rdma_mg->RDMA_Read(&remote_tail, &contents, tail_size, kReadLocal,
+                     IBV_SEND_SIGNALED, 1);
+  const char* tail = static_cast<char*>(contents.addr);
+
+  Status s;
+  uint32_t top_size;
+  if (DecodePartitionedIndexFooter(Slice(tail, tail_size), &top_size)) {
+    *partitioned = true;
+    const size_t top_extent = top_size + kBlockTrailerSize;
+    if (top_extent + kPartitionedIndexFooterSize > tail_size) {
+      // The top level did not fit in the tail, fetch exactly it.
+      assert(top_extent <= rdma_mg->name_to_size["DataIndexBlock"]);
+      remote_tail.addr = static_cast<char*>(remote_mr->addr) + region_size -
+                         kPartitionedIndexFooterSize - top_extent;
+      rdma_mg->RDMA_Read(&remote_tail, &contents, top_extent, kReadLocal,
+                         IBV_SEND_SIGNALED, 1);
+      tail_size = top_extent + kPartitionedIndexFooterSize;
+    }
+    s = CopyIndexBlock(
+        tail + tail_size - kPartitionedIndexFooterSize - top_extent,
+        top_size, options, result);
+  } else if (tail_size == region_size) {
+    s = CopyIndexBlock(tail, region_size - kBlockTrailerSize, options,
+                       result);
+  }
+  rdma_mg->Deallocate_Local_RDMA_Slot(contents.addr, "DataIndexBlock");
+  return s;
+}
 }  // namespace TimberSaw
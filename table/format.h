@@ -11,6 +11,7 @@
 #include "TimberSaw/slice.h"
 #include "TimberSaw/status.h"
 #include <map>
+#include <vector>
 #include "util/rdma.h"
 //#include "TimberSaw/table_builder.h"
 
@@ -80,6 +81,13 @@ static const uint64_t kTableMagicNumber = 0xdb4775248b80fb57ull;
 // 1-byte type + 32-bit crc
 static const size_t kBlockTrailerSize = 5;
 
+// A partitioned index region holds the index partitions and then a
+// top-level index block whose values are the handles of the partitions
+// within the region.  It ends with a footer: the size of the top-level
+// block without its trailer (fixed32) and kPartitionedIndexMagic (fixed64).
+static const uint64_t kPartitionedIndexMagic = 0x8f3c1e6b2d57a941ull;
+static const size_t kPartitionedIndexFooterSize = 4 + 8;
+
 struct BlockContents {
   Slice data;           // Actual contents of data
 //  bool cachable;        // True iff data can be cached
@@ -91,10 +99,47 @@ void Find_Remote_mr(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
 // return non-OK.  On success fill *result and return OK.
 Status ReadDataBlock(std::map<uint32_t, ibv_mr*>* remote_data_blocks, const ReadOptions& options,
                  const BlockHandle& handle, BlockContents* result);
+// A data block read that has been posted on this thread's read queue pair
+// but not yet waited for. Several may be outstanding at once; each must be
+// completed with FinishReadDataBlock() or DiscardReadDataBlock() on the
+// thread that started it.
+struct PendingBlockRead {
+  BlockHandle handle;
+  ibv_mr contents;
+  uint64_t wr_id;
+};
+void StartReadDataBlock(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
+                        const BlockHandle& handle, PendingBlockRead* pending);
+// Wait for "pending" and fill *result the same way ReadDataBlock() does.
+Status FinishReadDataBlock(const ReadOptions& options,
+                           PendingBlockRead* pending, BlockContents* result);
+// Wait for "pending" and release its buffer without using the contents.
+void DiscardReadDataBlock(PendingBlockRead* pending);
+// Read all the blocks in "handles" with one batch of RDMA reads. On success
+// (*results)[i] holds the contents of handles[i]; on failure no contents are
+// returned and every local buffer has been released.
+Status ReadDataBlocks(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
+                      const ReadOptions& options,
+                      const std::vector<BlockHandle>& handles,
+                      std::vector<BlockContents>* results);
 Status ReadDataIndexBlock(ibv_mr* remote_mr, const ReadOptions& options,
                           BlockContents* result);
 Status ReadFilterBlock(ibv_mr* remote_mr,
                        const ReadOptions& options, BlockContents* result);
+// Read the index region in "remote_mr" the cheap way: only its tail is
+// fetched, and if the region is partitioned *partitioned is set and
+// *result holds the top-level index block.  If not, *result holds the
+// whole index block when the tail covered it, or is left empty and the
+// caller has to fall back to ReadDataIndexBlock().  "tail_size" is the
+// tail extent recorded in the table metadata; when it is known (non-zero)
+// the first read fetches exactly that much.  The contents are heap
+// allocated and owned by the caller.
+Status ReadIndexTail(ibv_mr* remote_mr, size_t tail_size,
+                     const ReadOptions& options, BlockContents* result,
+                     bool* partitioned);
+// Returns true and sets *top_size if "region" (or the tail of it) ends with
+// the footer of a partitioned index.
+bool DecodePartitionedIndexFooter(const Slice& region, uint32_t* top_size);
 // Implementation details follow.  Clients should ignore,
 
 inline BlockHandle::BlockHandle()
@@ -2,8 +2,15 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
+#if defined(__x86_64__) && defined(__GNUC__)
+// Ahead of util/rdma.h, whose _mm_clflush macro breaks this header.
+#include <immintrin.h>
+#define TimberSaw_BLOOM_AVX2 1
+#endif
+
 #include "table/full_filter_block.h"
 
+#include <algorithm>
 #include <utility>
 
 #include "TimberSaw/filter_policy.h"
@@ -11,12 +18,52 @@
 
 namespace TimberSaw {
 
+#ifdef TimberSaw_BLOOM_AVX2
+// LegacyBloomImpl::HashMayMatchPrepared() for 64 byte cache lines and up
+// to 8 probes, all of which are tested at once.
+__attribute__((target("avx2"))) static bool HashMayMatchAVX2(
+    uint32_t h, int num_probes, const char* data_at_offset) {
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const uint32_t delta = (h >> 17) | (h << 15);
+  // Probe i tests bit (h + i * delta) % 512 of the cache line.
+  __m256i bitpos = _mm256_and_si256(
+      _mm256_add_epi32(_mm256_set1_epi32(h),
+                       _mm256_mullo_epi32(_mm256_set1_epi32(delta), lanes)),
+      _mm256_set1_epi32(511));
+  __m256i words = _mm256_i32gather_epi32(
+      reinterpret_cast<const int*>(data_at_offset),
+      _mm256_srli_epi32(bitpos, 5), 4);
+  __m256i bits = _mm256_sllv_epi32(
+      _mm256_set1_epi32(1), _mm256_and_si256(bitpos, _mm256_set1_epi32(31)));
+  __m256i missing =
+      _mm256_cmpeq_epi32(_mm256_and_si256(words, bits), _mm256_setzero_si256());
+  __m256i active = _mm256_cmpgt_epi32(_mm256_set1_epi32(num_probes), lanes);
+  return _mm256_testz_si256(missing, active);
+}
+
+static bool CanUseAVX2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+#endif
+
 // See doc/table_format.md for an explanation of the filter block format.
 
+// Filters of kFastLocalBloomFilter tables get the 32-bit bloom hash of the
+// key as their first hash, and this remix of it as the second one.
+static inline uint32_t FastLocalBloomHash2(uint32_t h1) {
+  return h1 * uint32_t{0x9e3779b9};
+}
+
 FullFilterBlockBuilder::FullFilterBlockBuilder(ibv_mr* mr,
-                                               int bloombits_per_key)
-    : local_mr(mr), bits_per_key_(bloombits_per_key),
-      num_probes_(LegacyNoLocalityBloomImpl::ChooseNumProbes(bits_per_key_)),
+                                               int bloombits_per_key,
+                                               FilterFormat format)
+    : local_mr(mr), bits_per_key_(bloombits_per_key), format_(format),
+      num_probes_(format == kFastLocalBloomFilter
+                      ? FastLocalBloomImpl::ChooseNumProbes(bits_per_key_ *
+                                                            1000)
+                      : LegacyNoLocalityBloomImpl::ChooseNumProbes(
+                            bits_per_key_)),
       result((char*)mr->addr,0) {
 //  filter_bits_builder_ = std::make_unique<LegacyBloomImpl>();
 }
@@ -75,7 +122,13 @@ uint32_t FullFilterBlockBuilder::CalculateSpace(const int num_entry,
   if (num_entry != 0) {
     uint32_t total_bits_tmp = static_cast<uint32_t>(num_entry * bits_per_key_);
 
-    *total_bits = GetTotalBitsForLocality(total_bits_tmp);
+    if (format_ == kFastLocalBloomFilter) {
+      // Whole cache lines, any number of them.
+      *total_bits = (total_bits_tmp + CACHE_LINE_SIZE * 8 - 1) /
+                    (CACHE_LINE_SIZE * 8) * (CACHE_LINE_SIZE * 8);
+    } else {
+      *total_bits = GetTotalBitsForLocality(total_bits_tmp);
+    }
     *num_lines = *total_bits / (CACHE_LINE_SIZE * 8);
     assert(*total_bits > 0 && *total_bits % 8 == 0);
   } else {
@@ -100,7 +153,12 @@ void FullFilterBlockBuilder::Finish() {
 //  result.Reset(result.data(), total_bits/8);
   assert(data);
   assert(total_bits/8 + 5 <= local_mr->length);
-  if (total_bits != 0 && num_lines != 0) {
+  if (total_bits != 0 && num_lines != 0 && format_ == kFastLocalBloomFilter) {
+    for (auto h : hash_entries_) {
+      FastLocalBloomImpl::AddHash(h, FastLocalBloomHash2(h), total_bits / 8,
+                                  num_probes_, data);
+    }
+  } else if (total_bits != 0 && num_lines != 0) {
     for (auto h : hash_entries_) {
 //      int log2_cache_line_bytes = std::log2(CACHE_LINE_SIZE);
       AddHash(h, data, num_lines, total_bits);
@@ -130,8 +188,18 @@ void FullFilterBlockBuilder::Finish() {
     }
   }
   // See BloomFilterPolicy::GetFilterBitsReader for metadata
-  data[total_bits / 8] = static_cast<char>(num_probes_);
-  EncodeFixed32(data + total_bits / 8 + 1, static_cast<uint32_t>(num_lines));
+  if (format_ == kFastLocalBloomFilter) {
+    // Marker for newer implementations, sub-implementation 0 for
+    // FastLocalBloomImpl, num_probes, and two reserved bytes.
+    data[total_bits / 8] = static_cast<char>(-1);
+    data[total_bits / 8 + 1] = 0;
+    data[total_bits / 8 + 2] = static_cast<char>(num_probes_);
+    data[total_bits / 8 + 3] = 0;
+    data[total_bits / 8 + 4] = 0;
+  } else {
+    data[total_bits / 8] = static_cast<char>(num_probes_);
+    EncodeFixed32(data + total_bits / 8 + 1, static_cast<uint32_t>(num_lines));
+  }
 
   const char* const_data = data;
   hash_entries_.clear();
@@ -217,9 +285,21 @@ FullFilterBlockReader::FullFilterBlockReader(
     // (or reserved for future use)
     if (num_probes_ == -1) {
       // Marker for newer Bloom implementations
-      std::cerr << "corrupt bloom filter" << std::endl;
-      exit(1);
-
+      uint32_t len = len_with_meta - 5;
+      if (contents.data()[len + 1] != 0 || len == 0 ||
+          len % CACHE_LINE_SIZE != 0) {
+        // Unknown sub-implementation or a broken FastLocalBloomImpl.
+        std::cerr << "corrupt bloom filter" << std::endl;
+        exit(1);
+      }
+      format_ = kFastLocalBloomFilter;
+      num_probes_ = static_cast<int>(contents.data()[len + 2]);
+      len_bytes_ = len;
+      if (num_probes_ < 1) {
+        std::cerr << "corrupt bloom filter" << std::endl;
+        exit(1);
+      }
+      return;
     }
     // otherwise
     // Treat as zero probes (always FP) for now.
@@ -235,6 +315,7 @@ FullFilterBlockReader::FullFilterBlockReader(
   uint32_t len = len_with_meta - 5;
   assert(len > 0);
 
+  len_bytes_ = len;
   num_lines_ = DecodeFixed32(contents.data() + len_with_meta - 4);
 //  uint32_t log2_cache_line_size;
   if (num_lines_ * CACHE_LINE_SIZE == len) {
@@ -263,15 +344,57 @@ FullFilterBlockReader::FullFilterBlockReader(
 //  }
 //  return true;  // Errors are treated as potential matches
 //}
+void FullFilterBlockReader::PrepareHash(uint32_t hash,
+                                        uint32_t* byte_offset) const {
+  if (format_ == kFastLocalBloomFilter) {
+    FastLocalBloomImpl::PrepareHash(hash, len_bytes_, data_, byte_offset);
+  } else {
+    LegacyBloomImpl::PrepareHashMayMatch(hash, num_lines_, data_, byte_offset,
+                                         log2_cache_line_size_);
+  }
+}
+
+bool FullFilterBlockReader::HashMayMatchPrepared(uint32_t hash,
+                                                 uint32_t byte_offset) const {
+  if (format_ == kFastLocalBloomFilter) {
+    return FastLocalBloomImpl::HashMayMatchPrepared(
+        FastLocalBloomHash2(hash), num_probes_, data_ + byte_offset);
+  }
+#ifdef TimberSaw_BLOOM_AVX2
+  static const bool use_avx2 = CanUseAVX2();
+  if (use_avx2 && log2_cache_line_size_ == 6 && num_probes_ <= 8) {
+    return HashMayMatchAVX2(hash, num_probes_, data_ + byte_offset);
+  }
+#endif
+  return LegacyBloomImpl::HashMayMatchPrepared(
+      hash, num_probes_, data_ + byte_offset, log2_cache_line_size_);
+}
+
 bool FullFilterBlockReader::KeyMayMatch(const Slice& key) {
 
   uint32_t hash = BloomHash(key);
   uint32_t byte_offset;
-  LegacyBloomImpl::PrepareHashMayMatch(
-      hash, num_lines_, data_, /*out*/ &byte_offset, log2_cache_line_size_);
-  return LegacyBloomImpl::HashMayMatchPrepared(
-      hash, num_probes_, data_ + byte_offset, log2_cache_line_size_);
+  PrepareHash(hash, /*out*/ &byte_offset);
+  return HashMayMatchPrepared(hash, byte_offset);
+
+}
 
+void FullFilterBlockReader::KeysMayMatch(size_t num, const Slice* keys,
+                                         bool* may_match) {
+  // Bounded so that the prefetched lines are still cached when probed.
+  static const size_t kBatch = 16;
+  uint32_t hashes[kBatch];
+  uint32_t byte_offsets[kBatch];
+  for (size_t start = 0; start < num; start += kBatch) {
+    const size_t n = std::min(kBatch, num - start);
+    for (size_t i = 0; i < n; i++) {
+      hashes[i] = BloomHash(keys[start + i]);
+      PrepareHash(hashes[i], /*out*/ &byte_offsets[i]);
+    }
+    for (size_t i = 0; i < n; i++) {
+      may_match[start + i] = HashMayMatchPrepared(hashes[i], byte_offsets[i]);
+    }
+  }
 }
 FullFilterBlockReader::~FullFilterBlockReader() {
   if (filter_side == Compute){
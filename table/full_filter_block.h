@@ -32,7 +32,8 @@ enum FilterSide { Compute, Memory};
 //      (StartBlock AddKey*)* Finish
 class FullFilterBlockBuilder {
  public:
-  explicit FullFilterBlockBuilder(ibv_mr* mr, int bloombits_per_key);
+  explicit FullFilterBlockBuilder(ibv_mr* mr, int bloombits_per_key,
+                                  FilterFormat format = kLegacyBloomFilter);
   FullFilterBlockBuilder(const FullFilterBlockBuilder&) = delete;
   FullFilterBlockBuilder& operator=(const FullFilterBlockBuilder&) = delete;
 
@@ -58,6 +59,7 @@ class FullFilterBlockBuilder {
 //  std::map<uint32_t, ibv_mr*>* remote_mrs_;
 //  std::unique_ptr<LegacyBloomImpl> filter_bits_builder_;
   int bits_per_key_;
+  FilterFormat format_;
   int num_probes_;
   std::vector<uint32_t> hash_entries_;
 //  std::string keys_;             // Flattened key contents
@@ -75,14 +77,24 @@ class FullFilterBlockReader {
                         std::shared_ptr<RDMA_Manager> rdma_mg, FilterSide side);
   ~FullFilterBlockReader();
   bool KeyMayMatch(const Slice& key); // full filter.
+  // KeyMayMatch() for a batch: the cache lines of all keys are prefetched
+  // before any is probed, so their memory latencies overlap.  Sets
+  // may_match[i] for keys[i].
+  void KeysMayMatch(size_t num, const Slice* keys, bool* may_match);
+  size_t size() const { return filter_content.size(); }
  private:
+  void PrepareHash(uint32_t hash, uint32_t* byte_offset) const;
+  bool HashMayMatchPrepared(uint32_t hash, uint32_t byte_offset) const;
+
 //  const FilterPolicy* policy_;
 //  std::unique_ptr<FilterBitsReader> filter_bits_reader_;
 
   Slice filter_content;
   const char* data_;
+  FilterFormat format_ = kLegacyBloomFilter;
   int num_probes_ = 0;
   uint32_t num_lines_ = 0;
+  uint32_t len_bytes_ = 0;  // Size of the filter bits
   uint32_t log2_cache_line_size_ = 0;
 
 //  const char* data_;    // Pointer to filter data (at block-start)
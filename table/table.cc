@@ -17,6 +17,7 @@
 #include "table/format.h"
 #include "table/two_level_iterator.h"
 #include "util/coding.h"
+#include "util/statistics.h"
 
 #include "full_filter_block.h"
 
@@ -42,7 +43,14 @@ struct Table::Rep {
 //  const char* filter_data;
 
   BlockHandle metaindex_handle;  // Handle to metaindex_block: saved from footer
+  // For a partitioned index this is the top level, whose entries point at
+  // index partitions inside "index_mr".
   Block* index_block;
+  bool index_partitioned = false;
+  uint64_t index_cache_id = 0;
+  ibv_mr index_mr;
+  // "index_mr" keyed by its end offset, the shape ReadDataBlock() expects.
+  std::map<uint32_t, ibv_mr*> index_region;
 };
 
 Status Table::Open(const Options& options, Table** table,
@@ -57,13 +65,25 @@ Status Table::Open(const Options& options, Table** table,
   if (options.paranoid_checks) {
     opt.verify_checksums = true;
   }
-  s = ReadDataIndexBlock(Remote_table_meta->remote_dataindex_mrs.begin()->second,
-                         opt, &index_block_contents);
+  ibv_mr* index_mr = Remote_table_meta->remote_dataindex_mrs.begin()->second;
+  bool partitioned = false;
+  BlockType index_type = Block_On_Heap;
+  // Whether the index is partitioned is up to the writer of the table, not
+  // to the current options, so always look at the footer. Only the top
+  // level of a partitioned index sits at the tail of the region, so there is
+  // no need to fetch the partitions here. The builder recorded how long that
+  // tail is, so a single read is enough in either case.
+  s = ReadIndexTail(index_mr, Remote_table_meta->index_tail_size, opt,
+                    &index_block_contents, &partitioned);
+  if (s.ok() && index_block_contents.data.empty()) {
+    index_type = IndexBlock;
+    s = ReadDataIndexBlock(index_mr, opt, &index_block_contents);
+  }
 
   if (s.ok()) {
     // We've successfully read the footer and the index block: we're
     // ready to serve requests.
-    Block* index_block = new Block(index_block_contents, IndexBlock);
+    Block* index_block = new Block(index_block_contents, index_type);
     Rep* rep = new Table::Rep(options);
 //    rep->options = options;
 //    rep->file = file;
@@ -72,6 +92,13 @@ Status Table::Open(const Options& options, Table** table,
     rep->index_block = index_block;
     assert(rep->index_block->size() > 0);
     rep->cache_id = (options.block_cache ? options.block_cache->NewId() : 0);
+    rep->index_partitioned = partitioned;
+    if (partitioned) {
+      rep->index_mr = *index_mr;
+      rep->index_region[index_mr->length] = &rep->index_mr;
+      rep->index_cache_id =
+          (options.block_cache ? options.block_cache->NewId() : 0);
+    }
 //    rep->filter_data = nullptr;
     rep->filter = nullptr;
     *table = new Table(rep);
@@ -107,6 +134,14 @@ void Table::ReadFilter() {
 
 Table::~Table() { delete rep_; }
 
+size_t Table::ApproximateMetadataMemoryUsage() const {
+  size_t usage = rep_->index_block->size();
+  if (rep_->filter != nullptr) {
+    usage += rep_->filter->size();
+  }
+  return usage;
+}
+
 static void DeleteBlock(void* arg, void* ignored) {
   delete reinterpret_cast<Block*>(arg);
 }
@@ -122,14 +157,56 @@ static void ReleaseBlock(void* arg, void* h) {
   cache->Release(handle);
 }
 
-// Convert an index iterator value (i.e., an encoded BlockHandle)
-// into an iterator over the contents of the corresponding block.
-Iterator* Table::BlockReader(void* arg, const ReadOptions& options,
-                             const Slice& index_value) {
-  Table* table = reinterpret_cast<Table*>(arg);
-  Cache* block_cache = table->rep_->options.block_cache;
-  Block* block = nullptr;
-  Cache::Handle* cache_handle = nullptr;
+// Make "iter" over "block" release the block when it is done with it.
+static void RegisterBlockCleanup(Iterator* iter, Cache* block_cache,
+                                 Block* block, Cache::Handle* cache_handle) {
+  if (cache_handle == nullptr) {
+    iter->RegisterCleanup(&DeleteBlock, block, nullptr);
+  } else {
+    iter->RegisterCleanup(&ReleaseBlock, block_cache, cache_handle);
+  }
+}
+
+// Wrap "block" (or the error "s" when there is no block) in an iterator
+// that releases the block when it is done with it.
+static Iterator* NewBlockIterator(const Comparator* comparator,
+                                  Cache* block_cache, Block* block,
+                                  Cache::Handle* cache_handle,
+                                  const Status& s) {
+  Iterator* iter;
+  if (block != nullptr) {
+    iter = block->NewIterator(comparator);
+    RegisterBlockCleanup(iter, block_cache, block, cache_handle);
+  } else {
+    iter = NewErrorIterator(s);
+  }
+  iter->SeekToFirst();
+//  DEBUG_arg("First key after the block create %s", iter->key().ToString().c_str());
+  return iter;
+}
+
+// ReadDataBlock() that also accounts the fetch in "statistics".
+static Status ReadRemoteBlock(std::map<uint32_t, ibv_mr*>* remote_data_blocks,
+                              Statistics* statistics,
+                              const ReadOptions& options,
+                              const BlockHandle& handle,
+                              BlockContents* contents) {
+  StopWatch rdma_read(statistics, RDMA_BLOCK_READ);
+  RecordTick(statistics, RDMA_BLOCK_READS);
+  RecordTick(statistics, RDMA_BLOCK_READ_BYTES, handle.size());
+  return ReadDataBlock(remote_data_blocks, options, handle, contents);
+}
+
+// Look up the block named by "index_value" in the block cache, or read it
+// from "remote_blocks" and cache it.  On success *block is set, and pinned
+// by *cache_handle unless the caller owns it (*cache_handle == nullptr).
+static Status LoadBlock(Cache* block_cache, Statistics* statistics,
+                        const ReadOptions& options, const Slice& index_value,
+                        std::map<uint32_t, ibv_mr*>* remote_blocks,
+                        uint64_t cache_id, Block** block,
+                        Cache::Handle** cache_handle) {
+  *block = nullptr;
+  *cache_handle = nullptr;
 
   BlockHandle handle;
   Slice input = index_value;
@@ -141,76 +218,172 @@ Iterator* Table::BlockReader(void* arg, const ReadOptions& options,
     BlockContents contents;
     if (block_cache != nullptr) {
       char cache_key_buffer[16];
-      EncodeFixed64(cache_key_buffer, table->rep_->cache_id);
+      EncodeFixed64(cache_key_buffer, cache_id);
       EncodeFixed64(cache_key_buffer + 8, handle.offset());
       Slice key(cache_key_buffer, sizeof(cache_key_buffer));
-#ifdef PROCESSANALYSIS
-      auto start = std::chrono::high_resolution_clock::now();
-#endif
-      cache_handle = block_cache->Lookup(key);
-#ifdef PROCESSANALYSIS
-      auto stop = std::chrono::high_resolution_clock::now();
-      auto lookup_duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
-#endif
-      if (cache_handle != nullptr) {
-        block = reinterpret_cast<Block*>(block_cache->Value(cache_handle));
+      *cache_handle = block_cache->Lookup(key);
+      if (*cache_handle != nullptr) {
+        *block = reinterpret_cast<Block*>(block_cache->Value(*cache_handle));
 //        DEBUG("Cache hit\n");
-#ifdef PROCESSANALYSIS
-        TableCache::cache_hit.fetch_add(1);
-        TableCache::cache_hit_look_up_time.fetch_add(lookup_duration.count());
-#endif
+        RecordTick(statistics, BLOCK_CACHE_HIT);
       } else {
-#ifdef PROCESSANALYSIS
-        TableCache::cache_miss.fetch_add(1);
-//        if(TableCache::cache_miss < TableCache::not_filtered){
-//          printf("warning\n");
-//        };
-        start = std::chrono::high_resolution_clock::now();
-
-#endif
-        s = ReadDataBlock(&table->rep_->remote_table.lock()->remote_data_mrs, options, handle, &contents);
-#ifdef PROCESSANALYSIS
-        stop = std::chrono::high_resolution_clock::now();
-        auto blockfetch_duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
-        TableCache::cache_miss_block_fetch_time.fetch_add(blockfetch_duration.count());
-#endif
+        RecordTick(statistics, BLOCK_CACHE_MISS);
+        s = ReadRemoteBlock(remote_blocks, statistics, options, handle,
+                            &contents);
 
         if (s.ok()) {
-          block = new Block(contents, DataBlock);
+          *block = new Block(contents, DataBlock);
           if (options.fill_cache) {
-            cache_handle = block_cache->Insert(key, block, block->size(),
-                                               &DeleteCachedBlock);
+            *cache_handle = block_cache->Insert(key, *block, (*block)->size(),
+                                                &DeleteCachedBlock);
           }
         }
       }
     } else {
-      s = ReadDataBlock(&table->rep_->remote_table.lock()->remote_data_mrs, options, handle, &contents);
+      s = ReadRemoteBlock(remote_blocks, statistics, options, handle,
+                          &contents);
       if (s.ok()) {
-        block = new Block(contents, DataBlock);
+        *block = new Block(contents, DataBlock);
       }
     }
   }
+  return s;
+}
 
-  Iterator* iter;
-  if (block != nullptr) {
-    iter = block->NewIterator(table->rep_->options.comparator);
-    if (cache_handle == nullptr) {
-      iter->RegisterCleanup(&DeleteBlock, block, nullptr);
-    } else {
-      iter->RegisterCleanup(&ReleaseBlock, block_cache, cache_handle);
+Iterator* Table::ReadBlock(Table* table, const ReadOptions& options,
+                           const Slice& index_value,
+                           std::map<uint32_t, ibv_mr*>* remote_blocks,
+                           uint64_t cache_id) {
+  Cache* block_cache = table->rep_->options.block_cache;
+  Block* block;
+  Cache::Handle* cache_handle;
+  Status s = LoadBlock(block_cache, table->rep_->options.statistics, options,
+                       index_value, remote_blocks, cache_id, &block,
+                       &cache_handle);
+  return NewBlockIterator(table->rep_->options.comparator, block_cache, block,
+                          cache_handle, s);
+}
+
+// Convert an index iterator value (i.e., an encoded BlockHandle)
+// into an iterator over the contents of the corresponding block.
+Iterator* Table::BlockReader(void* arg, const ReadOptions& options,
+                             const Slice& index_value) {
+  Table* table = reinterpret_cast<Table*>(arg);
+  return ReadBlock(table, options, index_value,
+                   &table->rep_->remote_table.lock()->remote_data_mrs,
+                   table->rep_->cache_id);
+}
+
+// Index partitions are read like data blocks, only from the index region.
+Iterator* Table::IndexPartitionReader(void* arg, const ReadOptions& options,
+                                      const Slice& index_value) {
+  Table* table = reinterpret_cast<Table*>(arg);
+  return ReadBlock(table, options, index_value, &table->rep_->index_region,
+                   table->rep_->index_cache_id);
+}
+
+namespace {
+// State of a block read started by Table::StartBlockRead().  Either the
+// block was already cached ("cache_handle" pins it) or a read is in flight.
+struct BlockReadToken {
+  Status status;
+  Cache::Handle* cache_handle = nullptr;
+  bool posted = false;
+  char cache_key[16];
+  PendingBlockRead read;
+};
+}  // namespace
+
+void* Table::StartBlockRead(void* arg, const ReadOptions& options,
+                            const Slice& index_value) {
+  Table* table = reinterpret_cast<Table*>(arg);
+  Cache* block_cache = table->rep_->options.block_cache;
+  Statistics* statistics = table->rep_->options.statistics;
+  BlockReadToken* token = new BlockReadToken;
+  BlockHandle handle;
+  Slice input = index_value;
+  token->status = handle.DecodeFrom(&input);
+  if (!token->status.ok()) {
+    return token;
+  }
+  if (block_cache != nullptr) {
+    EncodeFixed64(token->cache_key, table->rep_->cache_id);
+    EncodeFixed64(token->cache_key + 8, handle.offset());
+    token->cache_handle = block_cache->Lookup(
+        Slice(token->cache_key, sizeof(token->cache_key)));
+    if (token->cache_handle != nullptr) {
+      RecordTick(statistics, BLOCK_CACHE_HIT);
+      return token;
     }
-  } else {
-    iter = NewErrorIterator(s);
+    RecordTick(statistics, BLOCK_CACHE_MISS);
   }
-  iter->SeekToFirst();
-//  DEBUG_arg("First key after the block create %s", iter->key().ToString().c_str());
-  return iter;
+  RecordTick(statistics, RDMA_BLOCK_READS);
+  RecordTick(statistics, RDMA_BLOCK_READ_BYTES, handle.size());
+  StartReadDataBlock(&table->rep_->remote_table.lock()->remote_data_mrs,
+                     handle, &token->read);
+  token->posted = true;
+  return token;
+}
+
+Iterator* Table::FinishBlockRead(void* arg, const ReadOptions& options,
+                                 void* t) {
+  Table* table = reinterpret_cast<Table*>(arg);
+  Cache* block_cache = table->rep_->options.block_cache;
+  BlockReadToken* token = reinterpret_cast<BlockReadToken*>(t);
+  Status s = token->status;
+  Block* block = nullptr;
+  Cache::Handle* cache_handle = token->cache_handle;
+  if (cache_handle != nullptr) {
+    block = reinterpret_cast<Block*>(block_cache->Value(cache_handle));
+  } else if (token->posted) {
+    BlockContents contents;
+    s = FinishReadDataBlock(options, &token->read, &contents);
+    if (s.ok()) {
+      block = new Block(contents, DataBlock);
+      if (block_cache != nullptr && options.fill_cache) {
+        cache_handle = block_cache->Insert(
+            Slice(token->cache_key, sizeof(token->cache_key)), block,
+            block->size(), &DeleteCachedBlock);
+      }
+    }
+  }
+  delete token;
+  return NewBlockIterator(table->rep_->options.comparator, block_cache, block,
+                          cache_handle, s);
+}
+
+void Table::DiscardBlockRead(void* arg, void* t) {
+  Table* table = reinterpret_cast<Table*>(arg);
+  BlockReadToken* token = reinterpret_cast<BlockReadToken*>(t);
+  if (token->cache_handle != nullptr) {
+    table->rep_->options.block_cache->Release(token->cache_handle);
+  } else if (token->posted) {
+    DiscardReadDataBlock(&token->read);
+  }
+  delete token;
+}
+
+Iterator* Table::NewIndexIterator(const ReadOptions& options) const {
+  Iterator* top = rep_->index_block->NewIterator(rep_->options.comparator);
+  if (!rep_->index_partitioned) {
+    return top;
+  }
+  return NewTwoLevelIterator(top, &Table::IndexPartitionReader,
+                             const_cast<Table*>(this), options, nullptr);
+}
+
+Iterator* Table::LookaheadIndexIterator(void* arg,
+                                        const ReadOptions& options) {
+  return reinterpret_cast<Table*>(arg)->NewIndexIterator(options);
 }
 
 Iterator* Table::NewIterator(const ReadOptions& options) const {
+  static const BlockPrefetcher prefetcher = {
+      &Table::StartBlockRead, &Table::FinishBlockRead,
+      &Table::DiscardBlockRead, &Table::LookaheadIndexIterator};
   return NewTwoLevelIterator(
-      rep_->index_block->NewIterator(rep_->options.comparator),
-      &Table::BlockReader, const_cast<Table*>(this), options);
+      NewIndexIterator(options), &Table::BlockReader,
+      const_cast<Table*>(this), options, &prefetcher);
 }
 
 Status Table::InternalGet(const ReadOptions& options, const Slice& k, void* arg,
@@ -218,15 +391,13 @@ Status Table::InternalGet(const ReadOptions& options, const Slice& k, void* arg,
                                                 const Slice&)) {
   Status s;
   FullFilterBlockReader* filter = rep_->filter;
+  Statistics* statistics = rep_->options.statistics;
   if (filter != nullptr && !filter->KeyMayMatch(ExtractUserKey(k))) {
     // Not found
-#ifdef PROCESSANALYSIS
-    int dummy = 0;
-    TableCache::filtered.fetch_add(1);
-#endif
+    RecordTick(statistics, BLOOM_FILTER_USEFUL);
 #ifdef BLOOMANALYSIS
     //assert that bloom filter is correct
-    Iterator* iiter = rep_->index_block->NewIterator(rep_->options.comparator);
+    Iterator* iiter = NewIndexIterator(options);
 
     iiter->Seek(k);//binary search for block index
     if (iiter->Valid()) {
@@ -254,56 +425,42 @@ Status Table::InternalGet(const ReadOptions& options, const Slice& k, void* arg,
 #endif
   } else {
 
-    Iterator* iiter = rep_->index_block->NewIterator(rep_->options.comparator);
-#ifdef PROCESSANALYSIS
-    auto start = std::chrono::high_resolution_clock::now();
-#endif
+    Iterator* iiter = NewIndexIterator(options);
+    if (filter != nullptr) {
+      RecordTick(statistics, BLOOM_FILTER_CHECKED);
+    }
+    StopWatch index_seek(statistics, INDEX_SEEK);
     iiter->Seek(k);//binary search for block index
-#ifdef PROCESSANALYSIS
-    auto stop = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
-//    std::printf("Block Reader time elapse is %zu\n",  duration.count());
-    TableCache::IndexBinarySearchTimeElapseSum.fetch_add(duration.count());
-#endif
+    index_seek.Stop();
     if (iiter->Valid()) {
 
       Slice handle_value = iiter->value();
 
-      BlockHandle handle;
-#ifdef PROCESSANALYSIS
-      TableCache::not_filtered.fetch_add(1);
-
-      start = std::chrono::high_resolution_clock::now();
-#endif
-      Iterator* block_iter = BlockReader(this, options, iiter->value());
-#ifdef PROCESSANALYSIS
-      stop = std::chrono::high_resolution_clock::now();
-      duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
-//    std::printf("Block Reader time elapse is %zu\n",  duration.count());
-      TableCache::DataBlockFetchBeforeCacheElapseSum.fetch_add(duration.count());
-#endif
-#ifdef PROCESSANALYSIS
-      start = std::chrono::high_resolution_clock::now();
-#endif
-      block_iter->Seek(k);
-#ifdef PROCESSANALYSIS
-      stop = std::chrono::high_resolution_clock::now();
-      duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
-//    std::printf("Block Reader time elapse is %zu\n",  duration.count());
-      TableCache::DataBinarySearchTimeElapseSum.fetch_add(duration.count());
-#endif
+      Block* block;
+      Cache::Handle* cache_handle;
+      Cache* block_cache = rep_->options.block_cache;
+      s = LoadBlock(block_cache, statistics, options, handle_value,
+                    &rep_->remote_table.lock()->remote_data_mrs,
+                    rep_->cache_id, &block, &cache_handle);
+      if (!s.ok()) {
+        delete iiter;
+        return s;
+      }
+      StopWatch data_block_seek(statistics, DATA_BLOCK_SEEK);
+      // Point lookup, so the hash index of the block can stand in for the
+      // binary search.
+      Iterator* block_iter =
+          block->NewSeekForGetIterator(rep_->options.comparator, k);
+      data_block_seek.Stop();
+      RegisterBlockCleanup(block_iter, block_cache, block, cache_handle);
       if (block_iter->Valid()) {
         (*handle_result)(arg, block_iter->key(), block_iter->value());
       }
       s = block_iter->status();
       delete block_iter;
-
-#ifdef PROCESSANALYSIS
-      Saver* saver = reinterpret_cast<Saver*>(arg);
-      if(saver->state == kFound){
-        TableCache::foundNum.fetch_add(1);
-      }
-#endif
+    } else if (!iiter->status().ok()) {
+      // Reading an index partition failed.
+      s = iiter->status();
     }else{
       printf("block iterator invalid\n");
       exit(1);
@@ -315,9 +472,143 @@ Status Table::InternalGet(const ReadOptions& options, const Slice& k, void* arg,
   return s;
 }
 
+Status Table::InternalMultiGet(const ReadOptions& options, size_t num,
+                               const Slice* keys, void** args,
+                               void (*handle_result)(void*, const Slice&,
+                                                     const Slice&)) {
+  // One entry per distinct data block touched by the batch. Keys arrive
+  // sorted, so keys that share a block are adjacent.
+  struct BlockGroup {
+    BlockHandle handle;
+    std::vector<size_t> key_indexes;
+    Block* block = nullptr;
+    Cache::Handle* cache_handle = nullptr;
+  };
+  std::vector<BlockGroup> groups;
+  Status s;
+  Statistics* statistics = rep_->options.statistics;
+  FullFilterBlockReader* filter = rep_->filter;
+  // Probe the filter for the whole batch first; most keys of a batch are
+  // usually absent, and batching hides the latency of the filter lines.
+  std::unique_ptr<bool[]> may_match;
+  if (filter != nullptr) {
+    std::vector<Slice> user_keys(num);
+    for (size_t i = 0; i < num; i++) {
+      user_keys[i] = ExtractUserKey(keys[i]);
+    }
+    may_match.reset(new bool[num]);
+    filter->KeysMayMatch(num, user_keys.data(), may_match.get());
+  }
+  Iterator* iiter = NewIndexIterator(options);
+  for (size_t i = 0; i < num; i++) {
+    if (filter != nullptr && !may_match[i]) {
+      RecordTick(statistics, BLOOM_FILTER_USEFUL);
+      continue;
+    }
+    if (filter != nullptr) {
+      RecordTick(statistics, BLOOM_FILTER_CHECKED);
+    }
+    iiter->Seek(keys[i]);
+    if (!iiter->Valid()) {
+      // Past the last key of the table.
+      continue;
+    }
+    BlockHandle handle;
+    Slice input = iiter->value();
+    s = handle.DecodeFrom(&input);
+    if (!s.ok()) {
+      break;
+    }
+    if (groups.empty() || groups.back().handle.offset() != handle.offset()) {
+      groups.emplace_back();
+      groups.back().handle = handle;
+    }
+    groups.back().key_indexes.push_back(i);
+  }
+  if (s.ok()) {
+    s = iiter->status();
+  }
+  delete iiter;
+  if (!s.ok() || groups.empty()) {
+    return s;
+  }
+
+  // Serve what we can from the block cache and collect the rest.
+  Cache* block_cache = rep_->options.block_cache;
+  std::vector<BlockHandle> missing_handles;
+  std::vector<size_t> missing_groups;
+  std::vector<std::string> cache_keys(groups.size());
+  for (size_t g = 0; g < groups.size(); g++) {
+    if (block_cache != nullptr) {
+      char cache_key_buffer[16];
+      EncodeFixed64(cache_key_buffer, rep_->cache_id);
+      EncodeFixed64(cache_key_buffer + 8, groups[g].handle.offset());
+      cache_keys[g].assign(cache_key_buffer, sizeof(cache_key_buffer));
+      groups[g].cache_handle = block_cache->Lookup(cache_keys[g]);
+      if (groups[g].cache_handle != nullptr) {
+        groups[g].block =
+            reinterpret_cast<Block*>(block_cache->Value(groups[g].cache_handle));
+        RecordTick(statistics, BLOCK_CACHE_HIT);
+        continue;
+      }
+      RecordTick(statistics, BLOCK_CACHE_MISS);
+    }
+    missing_handles.push_back(groups[g].handle);
+    missing_groups.push_back(g);
+  }
+
+  if (!missing_handles.empty()) {
+    std::vector<BlockContents> contents;
+    StopWatch rdma_read(statistics, RDMA_BLOCK_READ);
+    s = ReadDataBlocks(&rep_->remote_table.lock()->remote_data_mrs, options,
+                       missing_handles, &contents);
+    rdma_read.Stop();
+    if (statistics != nullptr) {
+      statistics->RecordTick(RDMA_BLOCK_READS, missing_handles.size());
+      for (const BlockHandle& handle : missing_handles) {
+        statistics->RecordTick(RDMA_BLOCK_READ_BYTES, handle.size());
+      }
+    }
+    if (s.ok()) {
+      for (size_t m = 0; m < missing_groups.size(); m++) {
+        BlockGroup& group = groups[missing_groups[m]];
+        group.block = new Block(contents[m], DataBlock);
+        if (block_cache != nullptr && options.fill_cache) {
+          group.cache_handle =
+              block_cache->Insert(cache_keys[missing_groups[m]], group.block,
+                                  group.block->size(), &DeleteCachedBlock);
+        }
+      }
+    }
+  }
+
+  for (auto& group : groups) {
+    if (group.block == nullptr) {
+      continue;
+    }
+    if (s.ok()) {
+      Iterator* block_iter =
+          group.block->NewIterator(rep_->options.comparator);
+      for (size_t i : group.key_indexes) {
+        block_iter->Seek(keys[i]);
+        if (block_iter->Valid()) {
+          (*handle_result)(args[i], block_iter->key(), block_iter->value());
+        }
+      }
+      s = block_iter->status();
+      delete block_iter;
+    }
+    if (group.cache_handle != nullptr) {
+      block_cache->Release(group.cache_handle);
+    } else {
+      delete group.block;
+    }
+  }
+  return s;
+}
+
 uint64_t Table::ApproximateOffsetOf(const Slice& key) const {
-  Iterator* index_iter =
-      rep_->index_block->NewIterator(rep_->options.comparator);
+  Iterator* index_iter = NewIndexIterator(ReadOptions());
   index_iter->Seek(key);
   uint64_t result;
   if (index_iter->Valid()) {
@@ -342,5 +633,18 @@ uint64_t Table::ApproximateOffsetOf(const Slice& key) const {
   return result;
 }
 
+void Table::GetDataBlockSizes(
+    std::vector<std::pair<std::string, uint64_t>>* blocks) const {
+  Iterator* index_iter = NewIndexIterator(ReadOptions());
+  for (index_iter->SeekToFirst(); index_iter->Valid(); index_iter->Next()) {
+    BlockHandle handle;
+    Slice input = index_iter->value();
+    if (handle.DecodeFrom(&input).ok()) {
+      blocks->emplace_back(index_iter->key().ToString(), handle.size());
+    }
+  }
+  delete index_iter;
+}
+
 
 }  // namespace TimberSaw
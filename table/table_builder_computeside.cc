@@ -25,6 +25,7 @@ struct TableBuilder_ComputeSide::Rep {
     //TOTHINK: why the block restart interval is 1 by default?
     // This is only for index block, is it the same for rocks DB?
     index_block_options.block_restart_interval = 1;
+    index_block_options.data_block_hash_index = false;
     std::shared_ptr<RDMA_Manager> rdma_mg = options.env->rdma_mg;
     ibv_mr* temp_data_mr = new ibv_mr();
     ibv_mr* temp_index_mr = new ibv_mr();
@@ -53,15 +54,16 @@ struct TableBuilder_ComputeSide::Rep {
     data_block = new BlockBuilder(&options, local_data_mr[0]);
     index_block = new BlockBuilder(&index_block_options, local_index_mr[0]);
     if (type_ == IO_type::Compact){
-      type_string_ = "write_local_compact";
+      channel_ = kWriteLocalCompact;
     }else if(type_ == IO_type::Flush){
-      type_string_ = "write_local_flush";
+      channel_ = kWriteLocalFlush;
     }else{
       assert(false);
     }
     filter_block = (opt.filter_policy == nullptr
         ? nullptr
-        : new FullFilterBlockBuilder(local_filter_mr[0], opt.bloom_bits));
+        : new FullFilterBlockBuilder(local_filter_mr[0], opt.bloom_bits,
+                                     opt.filter_format));
 
     status = Status::OK();
   }
@@ -69,7 +71,7 @@ struct TableBuilder_ComputeSide::Rep {
   const Options& options;
   Options index_block_options;
   IO_type type_;
-  std::string type_string_;
+  RDMA_Channel channel_;
   //  WritableFile* file;
   std::vector<ibv_mr*> local_data_mr;
   // the start index of the in use buffer
@@ -109,7 +111,50 @@ struct TableBuilder_ComputeSide::Rep {
   bool pending_index_filter_entry;
   BlockHandle pending_data_handle;  // Handle to add to index block
 
+  // Partitioned index only (options.index_partition_size > 0): the index
+  // partitions are laid out back to back in local_index_mr[0], and the
+  // top-level entries, the last key of each partition and its handle
+  // within the index region, are added behind them by Finish().
+  uint64_t index_offset = 0;
+  // Upper bound of the size of the top-level entries queued so far.
+  uint64_t index_top_size = 0;
+  std::string last_index_key;
+  std::vector<std::pair<std::string, std::string>> index_partitions;
+  // Set by Finish(), see TableBuilder::get_index_tail_size().
+  uint32_t index_tail_size = 0;
+
   std::string compressed_output;
+
+  // While batch_writes is set, Write() queues the writes here instead of
+  // posting them, and PostPendingWrites() sends them as one chain.
+  bool batch_writes = false;
+  std::vector<ibv_mr> pending_remote_mrs;
+  std::vector<ibv_mr> pending_local_mrs;
+  std::vector<size_t> pending_sizes;
+
+  void Write(ibv_mr* remote_mr, ibv_mr* local_mr, size_t msg_size) {
+    if (batch_writes) {
+      pending_remote_mrs.push_back(*remote_mr);
+      pending_local_mrs.push_back(*local_mr);
+      pending_sizes.push_back(msg_size);
+    } else {
+      options.env->rdma_mg->RDMA_Write(remote_mr, local_mr, msg_size, channel_,
+                                       IBV_SEND_SIGNALED, 0);
+    }
+  }
+  // Returns the number of completions the posted chain will generate.
+  int PostPendingWrites() {
+    size_t num = pending_sizes.size();
+    batch_writes = false;
+    if (num == 0) return 0;
+    options.env->rdma_mg->RDMA_Write_Batch(
+        pending_remote_mrs.data(), pending_local_mrs.data(),
+        pending_sizes.data(), num, channel_, IBV_SEND_SIGNALED, 0);
+    pending_remote_mrs.clear();
+    pending_local_mrs.clear();
+    pending_sizes.clear();
+    return static_cast<int>((num + 63) / 64);
+  }
 };
 TableBuilder_ComputeSide::TableBuilder_ComputeSide(const Options& options, IO_type type)
     : rep_(new Rep(options, type)) {
@@ -195,14 +240,28 @@ void TableBuilder_ComputeSide::Add(const Slice& key, const Slice& value) {
     std::string handle_encoding;
     //Note that the handle block size does not contain CRC!
     r->pending_data_handle.EncodeTo(&handle_encoding);
-    if (r->index_block->CurrentSizeEstimate()+ r->last_key.size() + handle_encoding.size() +
-        sizeof (uint32_t) + kBlockTrailerSize > r->local_index_mr[0]->length){
+    const size_t entry_size =
+        r->last_key.size() + handle_encoding.size() + sizeof(uint32_t);
+    if (r->options.index_partition_size > 0) {
+      if (!r->index_block->empty() &&
+          r->index_block->CurrentSizeEstimate() + entry_size >=
+              r->options.index_partition_size) {
+        FinishIndexPartition();
+      }
+      if (!IndexRegionFits(entry_size)) {
+        r->status = Status::NotSupported(
+            "partitioned index exceeds the index write buffer");
+        return;
+      }
+    } else if (r->index_block->CurrentSizeEstimate() + entry_size +
+                   kBlockTrailerSize > r->local_index_mr[0]->length){
       BlockHandle dummy_handle;
       size_t msg_size;
       FinishDataIndexBlock(r->index_block, &dummy_handle, r->options.compression, msg_size);
       FlushDataIndex(msg_size);
     }
     r->index_block->Add(r->last_key, Slice(handle_encoding));
+    r->last_index_key = r->last_key;
     if (r->filter_block != nullptr) {
 //      if (r->filter_block->CurrentSizeEstimate() + kBlockTrailerSize > r->local_filter_mr[0]->length){
 //        // Tofix: Finish itself contain Reset and Flush, Modify the filter block make
@@ -417,6 +476,36 @@ void TableBuilder_ComputeSide::FinishFilterBlock(FullFilterBlockBuilder* block,
   block_size = block_contents->size();
   block->Reset();
 }
+void TableBuilder_ComputeSide::FinishIndexPartition() {
+  Rep* r = rep_;
+  BlockHandle handle;
+  size_t block_size;
+  FinishDataIndexBlock(r->index_block, &handle, kNoCompression, block_size);
+  handle.set_offset(r->index_offset);
+  r->index_offset += block_size;
+  // Add() refuses entries that would not fit, see IndexRegionFits().
+  assert(r->index_offset < r->local_index_mr[0]->length);
+  std::string handle_encoding;
+  handle.EncodeTo(&handle_encoding);
+  r->index_top_size += r->last_index_key.size() + handle_encoding.size() +
+                       3 * 5 + sizeof(uint32_t);
+  r->index_partitions.emplace_back(r->last_index_key, handle_encoding);
+}
+bool TableBuilder_ComputeSide::IndexRegionFits(size_t entry_size) const {
+  Rep* r = rep_;
+  // Every top-level entry has a restart point and at most three varint32
+  // lengths besides its key and handle. The current partition gets its
+  // top-level entry in the end too.
+  const size_t top_entry_overhead = 3 * 5 + sizeof(uint32_t);
+  const size_t partition =
+      r->index_block->CurrentSizeEstimate() + entry_size + kBlockTrailerSize;
+  const size_t top_level = r->index_top_size + r->last_key.size() +
+                           BlockHandle::kMaxEncodedLength +
+                           top_entry_overhead + sizeof(uint32_t) +
+                           kBlockTrailerSize;
+  return r->index_offset + partition + top_level +
+             kPartitionedIndexFooterSize <= r->local_index_mr[0]->length;
+}
 //TODO make flushing flush the data to the remote memory flushing to remote memory
 void TableBuilder_ComputeSide::FlushData(){
   Rep* r = rep_;
@@ -436,7 +525,7 @@ void TableBuilder_ComputeSide::FlushData(){
   if (r->data_inuse_start == -1){
     // first time flush
     assert(r->data_inuse_end == -1 && r->local_data_mr.size() == 2);
-    rdma_mg->RDMA_Write(remote_mr, r->local_data_mr[0], msg_size, r->type_string_,IBV_SEND_SIGNALED, 0);
+    r->Write(remote_mr, r->local_data_mr[0], msg_size);
     r->data_inuse_end = 0;
     r->data_inuse_start = 0;
     r->data_inuse_empty = false;
@@ -450,7 +539,7 @@ void TableBuilder_ComputeSide::FlushData(){
     auto* wc = new ibv_wc[maximum_poll_number];
     int poll_num = 0;
     poll_num = rdma_mg->try_poll_this_thread_completions(
-        wc, maximum_poll_number, r->type_string_, true);
+        wc, maximum_poll_number, r->channel_, true);
     // move the start index
     r->data_inuse_start += poll_num;
     if(r->data_inuse_start >= r->local_data_mr.size()){
@@ -460,7 +549,7 @@ void TableBuilder_ComputeSide::FlushData(){
 
     //move forward the end of the outstanding buffer
     r->data_inuse_end = r->data_inuse_end == r->local_data_mr.size()-1 ? 0:r->data_inuse_end+1;
-    rdma_mg->RDMA_Write(remote_mr, r->local_data_mr[r->data_inuse_end], msg_size, r->type_string_,IBV_SEND_SIGNALED, 0);
+    r->Write(remote_mr, r->local_data_mr[r->data_inuse_end], msg_size);
     //Check whether there is available buffer to serialize the memtable onto,
     // if not allocate a new one and insert it to the vector
     if (r->data_inuse_start - r->data_inuse_end == 1 ||
@@ -519,7 +608,7 @@ void TableBuilder_ComputeSide::FlushDataIndex(size_t msg_size) {
   ibv_mr* remote_mr = new ibv_mr();
   std::shared_ptr<RDMA_Manager> rdma_mg =  r->options.env->rdma_mg;
   rdma_mg->Allocate_Remote_RDMA_Slot(*remote_mr);
-  rdma_mg->RDMA_Write(remote_mr, r->local_index_mr[0], msg_size, r->type_string_,IBV_SEND_SIGNALED, 0);
+  r->Write(remote_mr, r->local_index_mr[0], msg_size);
   remote_mr->length = msg_size;
   if(r->remote_dataindex_mrs.empty()){
     r->remote_dataindex_mrs.insert({0, remote_mr});
@@ -537,7 +626,7 @@ void TableBuilder_ComputeSide::FlushFilter(size_t& msg_size) {
   ibv_mr* remote_mr = new ibv_mr();
   std::shared_ptr<RDMA_Manager> rdma_mg =  r->options.env->rdma_mg;
   rdma_mg->Allocate_Remote_RDMA_Slot(*remote_mr);
-  rdma_mg->RDMA_Write(remote_mr, r->local_filter_mr[0], msg_size, r->type_string_,IBV_SEND_SIGNALED, 0);
+  r->Write(remote_mr, r->local_filter_mr[0], msg_size);
   remote_mr->length = msg_size;
   if(r->remote_filter_mrs.empty()){
     r->remote_filter_mrs.insert({0, remote_mr});
@@ -555,6 +644,9 @@ Status TableBuilder_ComputeSide::status() const { return rep_->status; }
 Status TableBuilder_ComputeSide::Finish() {
   Rep* r = rep_;
   UpdateFunctionBLock();
+  // The last data chunk, the filter block and the index block are chained
+  // into a single post with one completion instead of three.
+  r->batch_writes = true;
   FlushData();
   assert(!r->closed);
   r->closed = true;
@@ -600,11 +692,32 @@ Status TableBuilder_ComputeSide::Finish() {
       std::string handle_encoding;
       r->pending_data_handle.EncodeTo(&handle_encoding);
       r->index_block->Add(r->last_key, Slice(handle_encoding));
+      r->last_index_key = r->last_key;
       r->pending_index_filter_entry = false;
     }
     size_t msg_size;
-    FinishDataIndexBlock(r->index_block, &index_block_handle,
-                    r->options.compression, msg_size);
+    if (r->options.index_partition_size > 0) {
+      if (!r->index_block->empty()) {
+        FinishIndexPartition();
+      }
+      for (const auto& entry : r->index_partitions) {
+        r->index_block->Add(entry.first, entry.second);
+      }
+      size_t top_size;
+      FinishDataIndexBlock(r->index_block, &index_block_handle,
+                           kNoCompression, top_size);
+      char* footer = static_cast<char*>(r->local_index_mr[0]->addr) +
+                     r->index_offset + top_size;
+      EncodeFixed32(footer, static_cast<uint32_t>(top_size - kBlockTrailerSize));
+      EncodeFixed64(footer + 4, kPartitionedIndexMagic);
+      msg_size = r->index_offset + top_size + kPartitionedIndexFooterSize;
+      assert(msg_size <= r->local_index_mr[0]->length);
+      r->index_tail_size = top_size + kPartitionedIndexFooterSize;
+    } else {
+      FinishDataIndexBlock(r->index_block, &index_block_handle,
+                      r->options.compression, msg_size);
+      r->index_tail_size = msg_size;
+    }
     FlushDataIndex(msg_size);
   }
 //  DEBUG_arg("for a sst the remote data chunks number %zu\n", r->remote_data_mrs.size());
@@ -612,20 +725,17 @@ Status TableBuilder_ComputeSide::Finish() {
   int num_of_poll = r->data_inuse_end - r->data_inuse_start + 1 >= 0 ?
                     r->data_inuse_end - r->data_inuse_start + 1:
                     (int)(r->local_data_mr.size()) - r->data_inuse_start + r->data_inuse_end +1;
-  // add one more for the index block,if have filter block add 2
-  if (r->filter_block != nullptr){
-    num_of_poll = num_of_poll + 2;
-  }else{
-    num_of_poll = num_of_poll + 1;
-  }
+  // The last data chunk is counted above but was posted unsignaled as part
+  // of the final chain, which brings its own completions.
+  num_of_poll = num_of_poll - 1 + r->PostPendingWrites();
   ibv_wc wc[num_of_poll];
-  r->options.env->rdma_mg->poll_completion(wc, num_of_poll, r->type_string_,
+  r->options.env->rdma_mg->poll_completion(wc, num_of_poll, r->channel_,
                                            true); //it does not matter whether it is true or false
 #ifndef NDEBUG
   usleep(10);
   int check_poll_number =
       r->options.env->rdma_mg->try_poll_this_thread_completions(
-          wc, 1, r->type_string_, true);
+          wc, 1, r->channel_, true);
   assert( check_poll_number == 0);
 #endif
 //  printf("A table finsihed flushing\n");
@@ -665,6 +775,9 @@ void TableBuilder_ComputeSide::get_filter_map(std::map<uint32_t, ibv_mr*>& map)
 size_t TableBuilder_ComputeSide::get_numentries() {
   return rep_->num_entries;
 }
+uint32_t TableBuilder_ComputeSide::get_index_tail_size() {
+  return rep_->index_tail_size;
+}
 
 
 }  // namespace TimberSaw
@@ -105,8 +105,14 @@ class TimberSaw_EXPORT TableBuilder_ComputeSide : public TableBuilder{
   void get_dataindexblocks_map(std::map<uint32_t, ibv_mr*>& map) override;
   void get_filter_map(std::map<uint32_t, ibv_mr*>& map) override;
   size_t get_numentries() override;
+  uint32_t get_index_tail_size() override;
  protected:
-
+  // Close the current index partition and queue its top-level entry.
+  void FinishIndexPartition();
+  // Whether the index region, with an index entry of "entry_size" bytes
+  // added to the current partition, still fits in the index write buffer
+  // once the top level and the footer are appended.
+  bool IndexRegionFits(size_t entry_size) const;
 
   struct Rep;
 
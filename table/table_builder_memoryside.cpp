@@ -22,6 +22,7 @@ struct TableBuilder_Memoryside::Rep {
     //TOTHINK: why the block restart interval is 1 by default?
     // This is only for index block, is it the same for rocks DB?
     index_block_options.block_restart_interval = 1;
+    index_block_options.data_block_hash_index = false;
     rdma_mg = rdma;
     local_data_mr = new ibv_mr();
     local_index_mr = new ibv_mr();
@@ -56,7 +57,8 @@ struct TableBuilder_Memoryside::Rep {
     }
     filter_block = (opt.filter_policy == nullptr
         ? nullptr
-        : new FullFilterBlockBuilder(local_filter_mr, opt.bloom_bits));
+        : new FullFilterBlockBuilder(local_filter_mr, opt.bloom_bits,
+                                     opt.filter_format));
 
     status = Status::OK();
   }
@@ -106,6 +108,8 @@ struct TableBuilder_Memoryside::Rep {
   // Invariant: r->pending_index_filter_entry is true only if data_block is empty.
   bool pending_index_filter_entry;
   BlockHandle pending_data_handle;  // Handle to add to index block
+  // Set by Finish(), see TableBuilder::get_index_tail_size().
+  uint32_t index_tail_size = 0;
 
   std::string compressed_output;
 };
@@ -509,6 +513,7 @@ Status TableBuilder_Memoryside::Finish() {
     size_t msg_size;
     FinishDataIndexBlock(r->index_block, &index_block_handle,
                          r->options.compression, msg_size);
+    r->index_tail_size = msg_size;
     FlushDataIndex(msg_size);
   }
 
@@ -536,4 +541,7 @@ void TableBuilder_Memoryside::get_filter_map(std::map<uint32_t, ibv_mr*>& map) {
 size_t TableBuilder_Memoryside::get_numentries() {
   return rep_->num_entries;
 }
+uint32_t TableBuilder_Memoryside::get_index_tail_size() {
+  return rep_->index_tail_size;
+}
 }
\ No newline at end of file
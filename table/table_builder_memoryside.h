@@ -74,6 +74,7 @@ class TimberSaw_EXPORT TableBuilder_Memoryside : public TableBuilder {
   void get_dataindexblocks_map(std::map<uint32_t, ibv_mr*>& map) override;
   void get_filter_map(std::map<uint32_t, ibv_mr*>& map) override;
   size_t get_numentries() override;
+  uint32_t get_index_tail_size() override;
 
   bool ok() const override { return status().ok(); }
   void FinishDataBlock(BlockBuilder* block, BlockHandle* handle,
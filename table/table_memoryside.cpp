@@ -42,6 +42,8 @@ struct Table_Memory_Side::Rep {
 
   BlockHandle metaindex_handle;  // Handle to metaindex_block: saved from footer
   Block* index_block;
+  // Set if index_block is the top level of a partitioned index.
+  bool index_partitioned = false;
 };
 
 Status Table_Memory_Side::Open(const Options& options, Table_Memory_Side** table,
@@ -56,6 +58,17 @@ Status Table_Memory_Side::Open(const Options& options, Table_Memory_Side** table
   char* data = (char*)Remote_table_meta->remote_dataindex_mrs.begin()->second->addr;
   size_t size = Remote_table_meta->remote_dataindex_mrs.begin()->second->length;
   size_t n = size - kBlockTrailerSize;
+  uint32_t top_size;
+  bool partitioned = DecodePartitionedIndexFooter(Slice(data, size), &top_size);
+  if (partitioned) {
+    if (static_cast<size_t>(top_size) + kBlockTrailerSize +
+            kPartitionedIndexFooterSize > size) {
+      return Status::Corruption("bad partitioned index footer");
+    }
+    // Point at the top level, the partitions are read on demand.
+    n = top_size;
+    data += size - kPartitionedIndexFooterSize - kBlockTrailerSize - n;
+  }
 
 //  ReadOptions opt;
   {
@@ -90,6 +103,7 @@ Status Table_Memory_Side::Open(const Options& options, Table_Memory_Side** table
     rep->remote_table = Remote_table_meta;
     //    rep->metaindex_handle = footer.metaindex_handle();
     rep->index_block = index_block;
+    rep->index_partitioned = partitioned;
     assert(rep->index_block->size() > 0);
     //    rep->cache_id = NewId();
     //    rep->filter_data = nullptr;
@@ -186,9 +200,48 @@ Iterator* Table_Memory_Side::BlockReader(void* arg, const ReadOptions& options,
   return iter;
 }
 
+static void DeleteBlock(void* arg, void* ignored) {
+  delete reinterpret_cast<Block*>(arg);
+}
+
+// The index region is local on the memory node, so a partition is just a
+// view of it.
+Iterator* Table_Memory_Side::IndexPartitionReader(void* arg,
+                                                  const ReadOptions& options,
+                                                  const Slice& index_value) {
+  Table_Memory_Side* table = reinterpret_cast<Table_Memory_Side*>(arg);
+  BlockHandle handle;
+  Slice input = index_value;
+  Status s = handle.DecodeFrom(&input);
+  if (!s.ok()) {
+    return NewErrorIterator(s);
+  }
+  ibv_mr* index_mr =
+      table->rep_->remote_table.lock()->remote_dataindex_mrs.begin()->second;
+  assert(handle.offset() + handle.size() + kBlockTrailerSize <=
+         index_mr->length);
+  BlockContents contents;
+  contents.data = Slice(static_cast<char*>(index_mr->addr) + handle.offset(),
+                        handle.size());
+  Block* block = new Block(contents, Block_On_Memory_Side);
+  Iterator* iter = block->NewIterator(table->rep_->options.comparator);
+  iter->RegisterCleanup(&DeleteBlock, block, nullptr);
+  return iter;
+}
+
+Iterator* Table_Memory_Side::NewIndexIterator(
+    const ReadOptions& options) const {
+  Iterator* top = rep_->index_block->NewIterator(rep_->options.comparator);
+  if (!rep_->index_partitioned) {
+    return top;
+  }
+  return NewTwoLevelIterator(top, &Table_Memory_Side::IndexPartitionReader,
+                             const_cast<Table_Memory_Side*>(this), options);
+}
+
 Iterator* Table_Memory_Side::NewIterator(const ReadOptions& options) const {
   return NewTwoLevelIterator(
-      rep_->index_block->NewIterator(rep_->options.comparator),
+      NewIndexIterator(options),
       &Table_Memory_Side::BlockReader, const_cast<Table_Memory_Side*>(this), options);
 }
 
@@ -199,13 +252,9 @@ Status Table_Memory_Side::InternalGet(const ReadOptions& options, const Slice& k
   FullFilterBlockReader* filter = rep_->filter;
   if (filter != nullptr && !filter->KeyMayMatch(ExtractUserKey(k))) {
     // Not found
-#ifdef PROCESSANALYSIS
-    int dummy = 0;
-TableCache::filtered.fetch_add(1);
-#endif
 #ifdef BLOOMANALYSIS
 //assert that bloom filter is correct
-Iterator* iiter = rep_->index_block->NewIterator(rep_->options.comparator);
+Iterator* iiter = NewIndexIterator(options);
 
 iiter->Seek(k);//binary search for block index
 if (iiter->Valid()) {
@@ -233,56 +282,21 @@ if (iiter->Valid()) {
 #endif
   } else {
 
-    Iterator* iiter = rep_->index_block->NewIterator(rep_->options.comparator);
-#ifdef PROCESSANALYSIS
-    auto start = std::chrono::high_resolution_clock::now();
-#endif
+    Iterator* iiter = NewIndexIterator(options);
     iiter->Seek(k);//binary search for block index
-#ifdef PROCESSANALYSIS
-    auto stop = std::chrono::high_resolution_clock::now();
-auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
-//    std::printf("Block Reader time elapse is %zu\n",  duration.count());
-TableCache::IndexBinarySearchTimeElapseSum.fetch_add(duration.count());
-#endif
 if (iiter->Valid()) {
 
   Slice handle_value = iiter->value();
 
   BlockHandle handle;
-#ifdef PROCESSANALYSIS
-  TableCache::not_filtered.fetch_add(1);
-
-  start = std::chrono::high_resolution_clock::now();
-#endif
   Iterator* block_iter = BlockReader(this, options, iiter->value());
-#ifdef PROCESSANALYSIS
-  stop = std::chrono::high_resolution_clock::now();
-  duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
-  //    std::printf("Block Reader time elapse is %zu\n",  duration.count());
-  TableCache::DataBlockFetchBeforeCacheElapseSum.fetch_add(duration.count());
-#endif
-#ifdef PROCESSANALYSIS
-  start = std::chrono::high_resolution_clock::now();
-#endif
   block_iter->Seek(k);
-#ifdef PROCESSANALYSIS
-  stop = std::chrono::high_resolution_clock::now();
-  duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
-  //    std::printf("Block Reader time elapse is %zu\n",  duration.count());
-  TableCache::DataBinarySearchTimeElapseSum.fetch_add(duration.count());
-#endif
   if (block_iter->Valid()) {
     (*handle_result)(arg, block_iter->key(), block_iter->value());
   }
   s = block_iter->status();
   delete block_iter;
 
-#ifdef PROCESSANALYSIS
-  Saver* saver = reinterpret_cast<Saver*>(arg);
-  if(saver->state == kFound){
-    TableCache::foundNum.fetch_add(1);
-  }
-#endif
 }else{
   printf("block iterator invalid\n");
   exit(1);
@@ -295,8 +309,7 @@ delete iiter;
 }
 
 uint64_t Table_Memory_Side::ApproximateOffsetOf(const Slice& key) const {
-  Iterator* index_iter =
-      rep_->index_block->NewIterator(rep_->options.comparator);
+  Iterator* index_iter = NewIndexIterator(ReadOptions());
   index_iter->Seek(key);
   uint64_t result;
   if (index_iter->Valid()) {
@@ -320,6 +333,19 @@ uint64_t Table_Memory_Side::ApproximateOffsetOf(const Slice& key) const {
   delete index_iter;
   return result;
 }
+
+void Table_Memory_Side::GetDataBlockSizes(
+    std::vector<std::pair<std::string, uint64_t>>* blocks) const {
+  Iterator* index_iter = NewIndexIterator(ReadOptions());
+  for (index_iter->SeekToFirst(); index_iter->Valid(); index_iter->Next()) {
+    BlockHandle handle;
+    Slice input = index_iter->value();
+    if (handle.DecodeFrom(&input).ok()) {
+      blocks->emplace_back(index_iter->key().ToString(), handle.size());
+    }
+  }
+  delete index_iter;
+}
 void* Table_Memory_Side::Get_rdma() {
     return static_cast<void*>(rep_->remote_table.lock().get());
 }
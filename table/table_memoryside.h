@@ -6,6 +6,9 @@
 #define TimberSaw_TABLE_MEMORYSIDE_H
 #include <cstdint>
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "TimberSaw/export.h"
 #include "TimberSaw/iterator.h"
@@ -53,11 +56,18 @@ class TimberSaw_EXPORT Table_Memory_Side {
   // be close to the file length.
   uint64_t ApproximateOffsetOf(const Slice& key) const;
 
+  // Append the index key and size of every data block, in key order, to
+  // *blocks.  A block's index key is >= every key in the block.
+  void GetDataBlockSizes(
+      std::vector<std::pair<std::string, uint64_t>>* blocks) const;
+
  private:
   friend class TableCache;
   struct Rep;
 
   static Iterator* BlockReader(void*, const ReadOptions&, const Slice&);
+  static Iterator* IndexPartitionReader(void*, const ReadOptions&,
+                                        const Slice&);
 
   explicit Table_Memory_Side(Rep* rep) : rep_(rep) {}
 
@@ -67,6 +77,9 @@ class TimberSaw_EXPORT Table_Memory_Side {
   Status InternalGet(const ReadOptions&, const Slice& key, void* arg,
                      void (*handle_result)(void* arg, const Slice& k,
                          const Slice& v));
+  // Iterator over the data block handles, through the top level of the
+  // index when it is partitioned.
+  Iterator* NewIndexIterator(const ReadOptions&) const;
   //
   //  void ReadMeta(const Footer& footer);
   void ReadFilter();
@@ -4,29 +4,52 @@
 
 #include "table/two_level_iterator.h"
 
-
+#include <algorithm>
+#include <cstdint>
 
 namespace TimberSaw {
 
-
-
+namespace {
+// Blocks a scan has to cross in order before readahead starts, the first
+// readahead window, and a cap on the reads it keeps in flight.
+const int kReadaheadTrigger = 2;
+const uint64_t kInitialReadaheadSize = 8 * 1024;
+const size_t kMaxReadaheadBlocks = 64;
+
+uint64_t BlockSizeOf(const Slice& index_value) {
+  Slice input = index_value;
+  BlockHandle handle;
+  return handle.DecodeFrom(&input).ok() ? handle.size() + kBlockTrailerSize
+                                         : 0;
+}
+}  // namespace
 
 TwoLevelIterator::TwoLevelIterator(Iterator* index_iter,
                                    BlockFunction block_function, void* arg,
-                                   const ReadOptions& options)
+                                   const ReadOptions& options,
+                                   const BlockPrefetcher* prefetcher)
     : block_function_(block_function),
       arg_(arg),
       options_(options),
+      prefetcher_(options.read_queue_depth > 1 || options.readahead_size > 0
+                      ? prefetcher
+                      : nullptr),
       index_iter_(index_iter),
-      data_iter_(nullptr), valid_(false) {}
+      data_iter_(nullptr),
+      sequential_blocks_(0),
+      readahead_window_(0),
+      valid_(false) {}
 
 TwoLevelIterator::~TwoLevelIterator() {
 //  DEBUG_arg("TWOLevelIterator destructing, this pointer is %p\n", this);
+  DiscardPrefetched();
 };
 
 void TwoLevelIterator::Seek(const Slice& target) {
+  ResetReadahead();
   index_iter_.Seek(target);
   InitDataBlock();
+  PrefetchAhead();
   if (data_iter_.iter() != nullptr) {
     data_iter_.Seek(target);
     valid_ = true;
@@ -35,8 +58,10 @@ void TwoLevelIterator::Seek(const Slice& target) {
 }
 
 void TwoLevelIterator::SeekToFirst() {
+  ResetReadahead();
   index_iter_.SeekToFirst();
   InitDataBlock();
+  PrefetchAhead();
   if (data_iter_.iter() != nullptr) {
     data_iter_.SeekToFirst();
     valid_ = true;
@@ -48,6 +73,7 @@ void TwoLevelIterator::SeekToFirst() {
 }
 
 void TwoLevelIterator::SeekToLast() {
+  ResetReadahead();
   index_iter_.SeekToLast();
   InitDataBlock();
   if (data_iter_.iter() != nullptr){
@@ -93,7 +119,9 @@ void TwoLevelIterator::SkipEmptyDataBlocksForward() {
 
     index_iter_.Next();
 //    printf("Move to next block\n");
+    GrowReadahead();
     InitDataBlock();
+    PrefetchAhead();
     if (valid_) data_iter_.SeekToFirst();
   }
 //  printf("Move to next data, key is %s", data_iter_.key().ToString().c_str());
@@ -108,6 +136,7 @@ void TwoLevelIterator::SkipEmptyDataBlocksBackward() {
       valid_ = false;
       return;
     }
+    ResetReadahead();
     index_iter_.Prev();
     InitDataBlock();
     if (valid_) data_iter_.SeekToLast();
@@ -138,13 +167,96 @@ void TwoLevelIterator::InitDataBlock() {
       // data_iter_ is already constructed with this iterator, so
       // no need to change anything
     } else {
-      Iterator* iter = (*block_function_)(arg_, options_, handle);
+      // Reads for blocks we have moved past are of no use any more.
+      while (!prefetched_.empty() &&
+             handle.compare(prefetched_.front().first) != 0) {
+        (*prefetcher_->discard)(arg_, prefetched_.front().second);
+        prefetched_.pop_front();
+      }
+      Iterator* iter;
+      if (!prefetched_.empty()) {
+        iter = (*prefetcher_->finish)(arg_, options_,
+                                      prefetched_.front().second);
+        prefetched_.pop_front();
+      } else {
+        iter = (*block_function_)(arg_, options_, handle);
+      }
       data_block_handle_.assign(handle.data(), handle.size());
       SetDataIterator(iter);
     }
   }
 }
 
+void TwoLevelIterator::PrefetchAhead() {
+  if (prefetcher_ == nullptr || !index_iter_.Valid()) {
+    return;
+  }
+  size_t ahead;
+  uint64_t budget;
+  if (options_.read_queue_depth > 1) {
+    ahead = options_.read_queue_depth - 1;
+    budget = UINT64_MAX;
+  } else {
+    if (readahead_window_ == 0) {
+      return;
+    }
+    ahead = kMaxReadaheadBlocks;
+    budget = readahead_window_;
+  }
+  if (prefetched_.size() >= ahead) {
+    return;
+  }
+  const std::string& last =
+      prefetched_.empty() ? data_block_handle_ : prefetched_.back().first;
+  if (lookahead_.iter() == nullptr || lookahead_after_ != last) {
+    // The scan was repositioned.  Use a fresh iterator rather than seeking the
+    // old one backwards, index block iterators expect to move forward only.
+    assert(prefetched_.empty());
+    lookahead_.Set((*prefetcher_->new_index_iterator)(arg_, options_));
+    lookahead_.Seek(index_iter_.key());
+    if (lookahead_.Valid()) {
+      lookahead_.Next();
+    }
+    lookahead_after_ = data_block_handle_;
+  }
+  uint64_t bytes = 0;
+  for (const auto& entry : prefetched_) {
+    bytes += BlockSizeOf(entry.first);
+  }
+  while (prefetched_.size() < ahead && lookahead_.Valid()) {
+    Slice handle = lookahead_.value();
+    bytes += BlockSizeOf(handle);
+    // The next block is always worth reading, even if it alone exceeds the
+    // window.
+    if (!prefetched_.empty() && bytes > budget) {
+      break;
+    }
+    prefetched_.emplace_back(handle.ToString(),
+                             (*prefetcher_->start)(arg_, options_, handle));
+    lookahead_after_ = prefetched_.back().first;
+    lookahead_.Next();
+  }
+}
+
+void TwoLevelIterator::GrowReadahead() {
+  if (options_.read_queue_depth > 1 || options_.readahead_size == 0) {
+    return;
+  }
+  if (++sequential_blocks_ < kReadaheadTrigger) {
+    return;
+  }
+  readahead_window_ = std::min<uint64_t>(
+      readahead_window_ == 0 ? kInitialReadaheadSize : readahead_window_ * 2,
+      options_.readahead_size);
+}
+
+void TwoLevelIterator::DiscardPrefetched() {
+  for (auto& entry : prefetched_) {
+    (*prefetcher_->discard)(arg_, entry.second);
+  }
+  prefetched_.clear();
+}
+
   // namespace
 
 
@@ -266,8 +378,10 @@ void TwoLevelFileIterator::InitDataBlock() {
 }  // namespace
 Iterator* NewTwoLevelIterator(Iterator* index_iter,
                               BlockFunction block_function, void* arg,
-                              const ReadOptions& options) {
-  return new TwoLevelIterator(index_iter, block_function, arg, options);
+                              const ReadOptions& options,
+                              const BlockPrefetcher* prefetcher) {
+  return new TwoLevelIterator(index_iter, block_function, arg, options,
+                              prefetcher);
 }
 Iterator* NewTwoLevelFileIterator(Version::LevelFileNumIterator* index_iter,
                                   FileFunction file_function, void* arg,
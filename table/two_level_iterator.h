@@ -6,6 +6,7 @@
 #define STORAGE_TimberSaw_TABLE_TWO_LEVEL_ITERATOR_H_
 
 #include <db/version_edit.h>
+#include <deque>
 
 #include "TimberSaw/iterator.h"
 #include "db/version_set.h"
@@ -98,11 +99,25 @@ class FileIteratorWrapper {
 // Uses a supplied function to convert an index_iter value into
 // an iterator over the contents of the corresponding block.
 typedef Iterator* (*BlockFunction)(void*, const ReadOptions&, const Slice&);
+// Optional hooks that let a two-level iterator keep several block reads in
+// flight.  "start" posts the read of the block named by an index value and
+// returns an opaque token, "finish" turns a token into an iterator over the
+// block (waiting for the read if needed) and "discard" drops a token that
+// will not be used.  "new_index_iterator" returns another iterator over the
+// same index, which walks ahead of the scan to find the blocks to read.
+struct BlockPrefetcher {
+  void* (*start)(void* arg, const ReadOptions& options,
+                 const Slice& index_value);
+  Iterator* (*finish)(void* arg, const ReadOptions& options, void* token);
+  void (*discard)(void* arg, void* token);
+  Iterator* (*new_index_iterator)(void* arg, const ReadOptions& options);
+};
 typedef Iterator* (*FileFunction)(void*, const ReadOptions&, std::shared_ptr<RemoteMemTableMetaData> remote_table);
 class TwoLevelIterator : public Iterator {
  public:
   TwoLevelIterator(Iterator* index_iter, BlockFunction block_function,
-                   void* arg, const ReadOptions& options);
+                   void* arg, const ReadOptions& options,
+                   const BlockPrefetcher* prefetcher = nullptr);
 
   ~TwoLevelIterator() override;
 
@@ -142,16 +157,40 @@ class TwoLevelIterator : public Iterator {
   void SkipEmptyDataBlocksBackward();
   void SetDataIterator(Iterator* data_iter);
   void InitDataBlock();
+  // Top up the reads in flight so that the read_queue_depth - 1 blocks
+  // following the current one, or the readahead window, are being fetched.
+  void PrefetchAhead();
+  void DiscardPrefetched();
+  // Called when a forward scan crosses into the next block; opens or widens
+  // the readahead window once the scan looks sequential.
+  void GrowReadahead();
+  void ResetReadahead() {
+    sequential_blocks_ = 0;
+    readahead_window_ = 0;
+  }
 
   BlockFunction block_function_;
   void* arg_;
   const ReadOptions options_;
+  const BlockPrefetcher* prefetcher_;
   Status status_;
   IteratorWrapper index_iter_;
   IteratorWrapper data_iter_;  // May be nullptr
   // If data_iter_ is non-null, then "data_block_handle_" holds the
   // "index_value" passed to block_function_ to create the data_iter_.
   std::string data_block_handle_;
+  // Reads posted for the blocks after the current one, in index order, keyed
+  // by their index value.
+  std::deque<std::pair<std::string, void*>> prefetched_;
+  // Index iterator on the first block not yet in prefetched_, and the index
+  // value of the block right before it.  It only moves forward, so index_iter_
+  // never has to leave the current block.
+  IteratorWrapper lookahead_;  // May be nullptr
+  std::string lookahead_after_;
+  // Blocks crossed in order since the last seek, and the bytes currently
+  // allowed in flight because of it.
+  int sequential_blocks_;
+  uint64_t readahead_window_;
 #ifndef NDEBUG
   std::string last_key;
   int64_t num_entries=0;
@@ -216,7 +255,8 @@ Iterator* NewTwoLevelIterator(
     Iterator* index_iter,
     Iterator* (*block_function)(void* arg, const ReadOptions& options,
                                 const Slice& index_value),
-    void* arg, const ReadOptions& options);
+    void* arg, const ReadOptions& options,
+    const BlockPrefetcher* prefetcher = nullptr);
 
 Iterator* NewTwoLevelFileIterator(
     Version::LevelFileNumIterator* index_iter,
@@ -21,9 +21,31 @@ struct BGItem {
   void* args;
   //  std::function<void()> unschedFunction;
 };
+// A batch of jobs that one thread hands to a pool and then waits for.
+class BGJobGroup {
+ public:
+  explicit BGJobGroup(int num_jobs) : pending_(num_jobs) {}
+  void JobDone() {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (--pending_ == 0) {
+      done_.notify_all();
+    }
+  }
+  void WaitAll() {
+    std::unique_lock<std::mutex> lock(mu_);
+    done_.wait(lock, [this] { return pending_ == 0; });
+  }
+
+ private:
+  std::mutex mu_;
+  std::condition_variable done_;
+  int pending_;
+};
 struct BGThreadMetadata {
   void* db;
   void* func_args;
+  // If set, signalled once the job has finished.
+  BGJobGroup* group = nullptr;
 };
 class ThreadPool{
  public:
@@ -78,11 +100,12 @@ class ThreadPool{
       bgthreads_.push_back(std::move(p_t));
     }
   }
-  void Schedule(std::function<void(void* args)>&& func, void* args){
+  // Returns false, without running "func", if the pool is being joined.
+  bool Schedule(std::function<void(void* args)>&& func, void* args){
 
     std::lock_guard<std::mutex> lock(mu_);
     if (exit_all_threads_) {
-      return;
+      return false;
     }
 //    printf("schedule a work request!\n");
     StartBGThreads();
@@ -106,6 +129,7 @@ class ThreadPool{
     //      WakeUpAllThreads();
     //    }
     WakeUpAllThreads();
+    return true;
   }
   void JoinThreads(bool wait_for_jobs_to_complete) {
 
@@ -132,6 +156,7 @@ class ThreadPool{
     wait_for_jobs_to_complete_ = false;
   }
   void SetBackgroundThreads(int num){
+    std::lock_guard<std::mutex> lock(mu_);
     total_threads_limit_ = num;
   }
   //  void Schedule(std::function<void(void* args)>&& schedule, void* args);
@@ -5,7 +5,9 @@
 
 #pragma once
 
+#include <cassert>
 #include <cstddef>
+#include <memory>
 #include <thread>
 #include <utility>
 #include <vector>
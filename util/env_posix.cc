@@ -669,7 +669,7 @@ class PosixEnv : public Env {
 
   void Schedule(void (*background_work_function)(void* background_work_arg),
                 void* background_work_arg) override;
-  void Schedule(
+  bool Schedule(
       void (*background_work_function)(void* background_work_arg),
       void* background_work_arg, ThreadPoolType type) override;
   unsigned int Queue_Length_Quiry(ThreadPoolType type) override;
@@ -854,7 +854,7 @@ void PosixEnv::Schedule(
   background_work_queue_.emplace(background_work_function, background_work_arg);
   background_work_mutex_.Unlock();
 }
-void PosixEnv::Schedule(
+bool PosixEnv::Schedule(
     void (*background_work_function)(void* background_work_arg),
     void* background_work_arg, ThreadPoolType type) {
   switch (type) {
@@ -862,24 +862,26 @@ void PosixEnv::Schedule(
       if (flushing.queue_len_.load()>256){
         //If there has already be enough compaction scheduled, then drop this one
         printf("queue length has been too long %d elements in the queue\n", flushing.queue_len_.load());
-        return;
+        return false;
       }
       DEBUG_arg("flushing thread pool task queue length %zu\n", flushing.queue_.size());
-      flushing.Schedule(background_work_function, background_work_arg);
-      break;
+      return flushing.Schedule(background_work_function, background_work_arg);
     case CompactionThreadPool:
       if (compaction.queue_len_.load()>256){
         //If there has already be enough compaction scheduled, then drop this one
         printf("queue length has been too long %d elements in the queue\n", compaction.queue_len_.load());
-        return;
+        return false;
       }
       DEBUG_arg("compaction thread pool task queue length %zu\n", compaction.queue_.size());
-      compaction.Schedule(background_work_function, background_work_arg);
-      break;
-//    case SubcompactionThreadPool:
-//      subcompaction.Schedule(background_work_function, background_work_arg);
-//      break;
+      return compaction.Schedule(background_work_function,
+                                 background_work_arg);
+    case SubcompactionThreadPool:
+      // Never dropped for length: the compaction that scheduled it waits
+      // for it.
+      return subcompaction.Schedule(background_work_function,
+                                    background_work_arg);
   }
+  return false;
 }
 unsigned int PosixEnv::Queue_Length_Quiry(ThreadPoolType type){
   switch (type) {
@@ -1,15 +1,35 @@
 #include <util/rdma.h>
 
+#include "util/rdma_loopback.h"
+
 namespace TimberSaw {
-#ifdef PROCESSANALYSIS
-std::atomic<uint64_t> RDMA_Manager::RDMAReadTimeElapseSum = 0;
-std::atomic<uint64_t> RDMA_Manager::ReadCount = 0;
-#endif
 //#define R_SIZE 32
 void UnrefHandle_rdma(void* ptr) { delete static_cast<std::string*>(ptr); }
+// Control-path verbs that also have to work on the loopback device.
+static int Destroy_QP(ibv_qp* qp) {
+  if (Loopback_Device::Is_Loopback(qp->context)) {
+    Loopback_Device::Destroy_QP(qp);
+    return 0;
+  }
+  return ibv_destroy_qp(qp);
+}
+static int Destroy_CQ(ibv_cq* cq) {
+  if (Loopback_Device::Is_Loopback(cq->context)) {
+    Loopback_Device::Destroy_CQ(cq);
+    return 0;
+  }
+  return ibv_destroy_cq(cq);
+}
+static int Deregister_MR(ibv_mr* mr) {
+  if (Loopback_Device::Is_Loopback(mr->context)) {
+    Loopback_Device::Dereg_MR(mr);
+    return 0;
+  }
+  return ibv_dereg_mr(mr);
+}
 void UnrefHandle_qp(void* ptr) {
   if (ptr == nullptr) return;
-  if (ibv_destroy_qp(static_cast<ibv_qp*>(ptr))) {
+  if (Destroy_QP(static_cast<ibv_qp*>(ptr))) {
     fprintf(stderr, "Thread local qp failed to destroy QP\n");
   } else {
     printf("thread local qp destroy successfully!");
@@ -17,7 +37,7 @@ void UnrefHandle_qp(void* ptr) {
 }
 void UnrefHandle_cq(void* ptr) {
   if (ptr == nullptr) return;
-  if (ibv_destroy_cq(static_cast<ibv_cq*>(ptr))) {
+  if (Destroy_CQ(static_cast<ibv_cq*>(ptr))) {
     fprintf(stderr, "Thread local cq failed to destroy QP\n");
   } else {
     printf("thread local cq destroy successfully!");
@@ -52,6 +72,8 @@ RDMA_Manager::RDMA_Manager(config_t config, size_t remote_block_size,
       qp_local_read(new ThreadLocalPtr(&UnrefHandle_qp)),
       cq_local_read(new ThreadLocalPtr(&UnrefHandle_cq)),
       local_read_qp_info(new ThreadLocalPtr(&General_Destroy<registered_qp_config*>)),
+      local_read_async_state(new ThreadLocalPtr(&General_Destroy<Async_Read_State*>)),
+      local_slot_cache(new ThreadLocalPtr(&General_Destroy<Local_Slot_Cache*>)),
       node_id(nodeid),
       rdma_config(config)
 //      db_name_(db_name),
@@ -67,9 +89,11 @@ RDMA_Manager::RDMA_Manager(config_t config, size_t remote_block_size,
 //  inet_pton(AF_INET, config.server_name, &inaddr);
 //  node_id = static_cast<uint8_t>(inaddr.s_addr);
   Remote_Mem_Bitmap = new std::map<void*, In_Use_Array>;
+  // The loopback device has no GID table; address queue pairs by number only.
+  if (Loopback_Device::Enabled()) rdma_config.gid_idx = -1;
 
   //Initialize a message memory pool
-  Mempool_initialize(std::string("message"), std::max(sizeof(RDMA_Request),sizeof(RDMA_Reply)));
+  Mempool_initialize(std::string("message"), std::max(sizeof(RDMA_Message),sizeof(RDMA_Reply)));
   Mempool_initialize(std::string("version_edit"), 1024*1024);
 }
 /******************************************************************************
@@ -84,18 +108,20 @@ RDMA_Manager::RDMA_Manager(config_t config, size_t remote_block_size,
 * Cleanup and deallocate all resources used for RDMA
 ******************************************************************************/
 RDMA_Manager::~RDMA_Manager() {
+  bool loopback = Loopback_Device::Is_Loopback(res->ib_ctx);
   if (!res->qp_map.empty())
     for (auto it = res->qp_map.begin(); it != res->qp_map.end(); it++) {
-      if (ibv_destroy_qp(it->second)) {
+      if (Destroy_QP(it->second)) {
         fprintf(stderr, "failed to destroy QP\n");
       }
     }
   printf("RDMA Manager get destroyed\n");
   if (!local_mem_pool.empty()) {
     for (ibv_mr* p : local_mem_pool) {
-      ibv_dereg_mr(p);
+      char* addr = (char*)p->addr;
+      Deregister_MR(p);
       //       local buffer is registered on this machine need deregistering.
-      delete (char*)p->addr;
+      delete addr;
     }
     //    local_mem_pool.clear();
   }
@@ -107,22 +133,22 @@ RDMA_Manager::~RDMA_Manager() {
   }
   if (!res->cq_map.empty())
     for (auto it = res->cq_map.begin(); it != res->cq_map.end(); it++) {
-      if (ibv_destroy_cq(it->second.first)) {
+      if (Destroy_CQ(it->second.first)) {
         fprintf(stderr, "failed to destroy CQ\n");
-      }else{
+      }else if (!loopback){
         delete it->second.first;
       }
-      if (it->second.second!= nullptr && ibv_destroy_cq(it->second.second)){
+      if (it->second.second!= nullptr && Destroy_CQ(it->second.second)){
         fprintf(stderr, "failed to destroy CQ\n");
-      }else{
+      }else if (!loopback){
         delete it->second.second;
       }
     }
   if (!res->qp_map.empty())
     for (auto it = res->qp_map.begin(); it != res->qp_map.end(); it++) {
-      if (ibv_destroy_qp(it->second)) {
+      if (Destroy_QP(it->second)) {
         fprintf(stderr, "failed to destroy QP\n");
-      }else{
+      }else if (!loopback){
         delete it->second;
       }
 
@@ -132,12 +158,14 @@ RDMA_Manager::~RDMA_Manager() {
       delete it->second;
     }
   }
-  if (res->pd)
+  if (loopback) {
+    Loopback_Device::Dealloc_PD(res->pd);
+  } else if (res->pd)
     if (ibv_dealloc_pd(res->pd)) {
       fprintf(stderr, "failed to deallocate PD\n");
     }
 
-  if (res->ib_ctx)
+  if (res->ib_ctx && !loopback)
     if (ibv_close_device(res->ib_ctx)) {
       fprintf(stderr, "failed to close device context\n");
     }
@@ -158,6 +186,10 @@ RDMA_Manager::~RDMA_Manager() {
   delete qp_local_read;
   delete cq_local_read;
   delete local_read_qp_info;
+  delete local_read_async_state;
+  // Hands the slots cached by every thread back to their In_Use_Arrays,
+  // which live in name_to_mem_pool until the members are destroyed.
+  delete local_slot_cache;
 }
 bool RDMA_Manager::poll_reply_buffer(RDMA_Reply* rdma_reply) {
   volatile bool* check_byte = &(rdma_reply->received);
@@ -569,13 +601,19 @@ bool RDMA_Manager::Local_Memory_Register(char** p2buffpointer,
       fprintf(stderr, "failed to malloc bytes to memory buffer\n");
       return false;
     }
-    memset(*p2buffpointer, 0, size);
+    // Loopback regions are never pinned, so leave the pages untouched until
+    // they are used instead of faulting in the whole region.
+    if (!Loopback_Device::Is_Loopback(res->ib_ctx))
+      memset(*p2buffpointer, 0, size);
 
     /* register the memory buffer */
     mr_flags =
         IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
     //  auto start = std::chrono::high_resolution_clock::now();
-    *p2mrpointer = ibv_reg_mr(res->pd, *p2buffpointer, size, mr_flags);
+    if (Loopback_Device::Is_Loopback(res->ib_ctx))
+      *p2mrpointer = Loopback_Device::Reg_MR(res->pd, *p2buffpointer, size, mr_flags);
+    else
+      *p2mrpointer = ibv_reg_mr(res->pd, *p2buffpointer, size, mr_flags);
     //  auto stop = std::chrono::high_resolution_clock::now();
     //  auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start); std::printf("Memory registeration size: %zu time elapse (%ld) us\n", size, duration.count());
     local_mem_pool.push_back(*p2mrpointer);
@@ -619,6 +657,9 @@ bool RDMA_Manager::Local_Memory_Register(char** p2buffpointer,
 bool RDMA_Manager::Preregister_Memory(int gb_number) {
   int mr_flags = 0;
   size_t size = 1024*1024*1024;
+  // Loopback registration is free, so let Local_Memory_Register allocate on
+  // demand instead of pinning gb_number GB up front.
+  if (Loopback_Device::Is_Loopback(res->ib_ctx)) return true;
 
   for (int i = 0; i < gb_number; ++i) {
     total_registered_size = total_registered_size + size;
@@ -669,13 +710,26 @@ void RDMA_Manager::Client_Set_Up_Resources() {
   // int trans_times;
   char temp_char;
   std::string ip_add;
-  std::cout << "please insert the ip address for the remote memory" << std::endl;
-  std::cin >> ip_add;
+  bool loopback = Loopback_Device::Enabled();
+  if (loopback) {
+    // The memory node is a thread of this process.
+    ip_add = "127.0.0.1";
+  } else {
+    std::cout << "please insert the ip address for the remote memory" << std::endl;
+    std::cin >> ip_add;
+  }
   rdma_config.server_name = ip_add.c_str();
   /* if client side */
   printf("Mark: valgrind socket info1\n");
   res->sock_map["main"] =
       client_sock_connect(rdma_config.server_name, rdma_config.tcp_port);
+  // In loopback mode the memory node thread may still be starting up.
+  for (int retry = 0; loopback && res->sock_map["main"] < 0 && retry < 100;
+       retry++) {
+    usleep(100000);
+    res->sock_map["main"] =
+        client_sock_connect(rdma_config.server_name, rdma_config.tcp_port);
+  }
 
   if (res->sock_map["main"] < 0) {
     fprintf(stderr,
@@ -717,6 +771,17 @@ int RDMA_Manager::resources_create() {
   int rc = 0;
   //        ibv_device_attr *device_attr;
 
+  if (Loopback_Device::Enabled()) {
+    fprintf(stdout, "using the in-process loopback RDMA device\n");
+    res->ib_ctx = Loopback_Device::Open();
+    Loopback_Device::Query_Port(&res->port_attr);
+    res->pd = Loopback_Device::Alloc_PD(res->ib_ctx);
+    Loopback_Device::Query_Device(&res->device_attr);
+    Local_Memory_Register(&(res->send_buf), &(res->mr_send), 2500*4096, std::string("message"));
+    Local_Memory_Register(&(res->receive_buf), &(res->mr_receive), 2500*4096,
+                          std::string("message"));
+    return 0;
+  }
   fprintf(stdout, "searching for IB devices in host\n");
   /* get device names in the system */
   dev_list = ibv_get_device_list(&num_devices);
@@ -882,10 +947,13 @@ ibv_qp* RDMA_Manager::create_qp(std::string& id, bool seperated_cq) {
    */
   int cq_size = 2500;
   // cq1 send queue, cq2 receive queue
-  ibv_cq* cq1 = ibv_create_cq(res->ib_ctx, cq_size, NULL, NULL, 0);
+  bool loopback = Loopback_Device::Is_Loopback(res->ib_ctx);
+  ibv_cq* cq1 = loopback ? Loopback_Device::Create_CQ(res->ib_ctx, cq_size)
+                         : ibv_create_cq(res->ib_ctx, cq_size, NULL, NULL, 0);
   ibv_cq* cq2;
   if (seperated_cq)
-    cq2 = ibv_create_cq(res->ib_ctx, cq_size, NULL, NULL, 0);
+    cq2 = loopback ? Loopback_Device::Create_CQ(res->ib_ctx, cq_size)
+                   : ibv_create_cq(res->ib_ctx, cq_size, NULL, NULL, 0);
 
   if (!cq1) {
     fprintf(stderr, "failed to create CQ with %u entries\n", cq_size);
@@ -916,7 +984,8 @@ ibv_qp* RDMA_Manager::create_qp(std::string& id, bool seperated_cq) {
   qp_init_attr.cap.max_send_sge = 30;
   qp_init_attr.cap.max_recv_sge = 30;
   //  qp_init_attr.cap.max_inline_data = -1;
-  ibv_qp* qp = ibv_create_qp(res->pd, &qp_init_attr);
+  ibv_qp* qp = loopback ? Loopback_Device::Create_QP(res->pd, &qp_init_attr)
+                        : ibv_create_qp(res->pd, &qp_init_attr);
   if (!qp) {
     fprintf(stderr, "failed to create QP\n");
   }
@@ -1071,6 +1140,8 @@ int RDMA_Manager::modify_qp_to_reset(ibv_qp* qp) {
   memset(&attr, 0, sizeof(attr));
   attr.qp_state = IBV_QPS_RESET;
   flags = IBV_QP_STATE;
+  if (Loopback_Device::Is_Loopback(qp->context))
+    return Loopback_Device::Reset_QP(qp);
   rc = ibv_modify_qp(qp, &attr, flags);
   if (rc) fprintf(stderr, "failed to modify QP state to RESET\n");
   return rc;
@@ -1101,6 +1172,7 @@ int RDMA_Manager::modify_qp_to_init(struct ibv_qp* qp) {
   attr.qp_access_flags =
       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
   flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
+  if (Loopback_Device::Is_Loopback(qp->context)) return 0;
   rc = ibv_modify_qp(qp, &attr, flags);
   if (rc) fprintf(stderr, "failed to modify QP state to INIT\n");
   return rc;
@@ -1151,6 +1223,8 @@ int RDMA_Manager::modify_qp_to_rtr(struct ibv_qp* qp, uint32_t remote_qpn,
   }
   flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
           IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
+  if (Loopback_Device::Is_Loopback(qp->context))
+    return Loopback_Device::Connect_QP(qp, remote_qpn);
   rc = ibv_modify_qp(qp, &attr, flags);
   if (rc) fprintf(stderr, "failed to modify QP state to RTR\n");
   return rc;
@@ -1183,6 +1257,7 @@ int RDMA_Manager::modify_qp_to_rts(struct ibv_qp* qp) {
   attr.max_rd_atomic = 1;
   flags = IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY |
           IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC;
+  if (Loopback_Device::Is_Loopback(qp->context)) return 0;
   rc = ibv_modify_qp(qp, &attr, flags);
   if (rc) fprintf(stderr, "failed to modify QP state to RTS\n");
   return rc;
@@ -1240,13 +1315,128 @@ int RDMA_Manager::sock_sync_data(int sock, int xfer_size, char* local_data,
 End of socket operations
 ******************************************************************************/
 
+RDMA_Channel RDMA_Manager::Resolve_Channel(const std::string& q_id) {
+  if (q_id == "read_local") {
+    return kReadLocal;
+  } else if (q_id == "write_local_flush") {
+    return kWriteLocalFlush;
+  } else if (q_id == "write_local_compact") {
+    return kWriteLocalCompact;
+  }
+  std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
+  auto cqs = res->cq_map.at(q_id);
+  return RDMA_Channel{Named_Channel, res->qp_map.at(q_id), cqs.first,
+                      cqs.second};
+}
+ibv_qp* RDMA_Manager::Channel_QP(const RDMA_Channel& channel) {
+  ThreadLocalPtr* local_qp;
+  switch (channel.type) {
+    case Read_Local:
+      local_qp = qp_local_read;
+      break;
+    case Write_Local_Flush:
+      local_qp = qp_local_write_flush;
+      break;
+    case Write_Local_Compact:
+      local_qp = qp_local_write_compact;
+      break;
+    default:
+      return channel.qp;
+  }
+  ibv_qp* qp = static_cast<ibv_qp*>(local_qp->Get());
+  if (qp == NULL) {
+    // First verb of this thread on this channel: connect its queue pair.
+    std::string q_id = channel.type == Read_Local        ? "read_local"
+                       : channel.type == Write_Local_Flush ? "write_local_flush"
+                                                          : "write_local_compact";
+    Remote_Query_Pair_Connection(q_id);
+    qp = static_cast<ibv_qp*>(local_qp->Get());
+  }
+  return qp;
+}
+ibv_cq* RDMA_Manager::Channel_CQ(const RDMA_Channel& channel, bool send_cq) {
+  ibv_cq* cq;
+  switch (channel.type) {
+    case Read_Local:
+      cq = static_cast<ibv_cq*>(cq_local_read->Get());
+      break;
+    case Write_Local_Flush:
+      cq = static_cast<ibv_cq*>(cq_local_write_flush->Get());
+      break;
+    case Write_Local_Compact:
+      cq = static_cast<ibv_cq*>(cq_local_write_compact->Get());
+      break;
+    default:
+      cq = send_cq ? channel.send_cq : channel.recv_cq;
+  }
+  assert(cq != nullptr);
+  return cq;
+}
+// The overloads below keep the string-keyed interface for the control path;
+// they resolve the channel on every call.
+int RDMA_Manager::RDMA_Read(ibv_mr* remote_mr, ibv_mr* local_mr,
+                            size_t msg_size, const std::string& q_id,
+                            size_t send_flag, int poll_num) {
+  return RDMA_Read(remote_mr, local_mr, msg_size, Resolve_Channel(q_id),
+                   send_flag, poll_num);
+}
+int RDMA_Manager::RDMA_Read_Batch(ibv_mr* remote_mrs, ibv_mr* local_mrs,
+                                  const size_t* msg_sizes, size_t num,
+                                  const std::string& q_id) {
+  return RDMA_Read_Batch(remote_mrs, local_mrs, msg_sizes, num,
+                         Resolve_Channel(q_id));
+}
+int RDMA_Manager::RDMA_Write(ibv_mr* remote_mr, ibv_mr* local_mr,
+                             size_t msg_size, const std::string& q_id,
+                             size_t send_flag, int poll_num) {
+  return RDMA_Write(remote_mr, local_mr, msg_size, Resolve_Channel(q_id),
+                    send_flag, poll_num);
+}
+int RDMA_Manager::RDMA_Write(void* addr, uint32_t rkey, ibv_mr* local_mr,
+                             size_t msg_size, const std::string& q_id,
+                             size_t send_flag, int poll_num) {
+  return RDMA_Write(addr, rkey, local_mr, msg_size, Resolve_Channel(q_id),
+                    send_flag, poll_num);
+}
+int RDMA_Manager::poll_completion(ibv_wc* wc_p, int num_entries,
+                                  const std::string& q_id, bool send_cq) {
+  return poll_completion(wc_p, num_entries, Resolve_Channel(q_id), send_cq);
+}
+int RDMA_Manager::try_poll_this_thread_completions(ibv_wc* wc_p,
+                                                   int num_entries,
+                                                   const std::string& q_id,
+                                                   bool send_cq) {
+  return try_poll_this_thread_completions(wc_p, num_entries,
+                                          Resolve_Channel(q_id), send_cq);
+}
+int RDMA_Manager::post_send(ibv_mr* mr, const std::string& q_id, size_t size) {
+  return post_send(mr, Resolve_Channel(q_id), size);
+}
+int RDMA_Manager::post_send(ibv_mr** mr_list, size_t sge_size,
+                            const std::string& q_id) {
+  return post_send(mr_list, sge_size, Resolve_Channel(q_id));
+}
+int RDMA_Manager::post_receive(ibv_mr* mr, const std::string& q_id,
+                               size_t size) {
+  return post_receive(mr, Resolve_Channel(q_id), size);
+}
+int RDMA_Manager::post_receive(ibv_mr** mr_list, size_t sge_size,
+                               const std::string& q_id) {
+  return post_receive(mr_list, sge_size, Resolve_Channel(q_id));
+}
+
 // return 0 means success
-  int RDMA_Manager::RDMA_Read(ibv_mr* remote_mr, ibv_mr* local_mr,
-                            size_t msg_size, std::string q_id, size_t send_flag,
-                            int poll_num) {
+int RDMA_Manager::RDMA_Read(ibv_mr* remote_mr, ibv_mr* local_mr,
+                            size_t msg_size, const RDMA_Channel& channel,
+                            size_t send_flag, int poll_num) {
 //#ifdef GETANALYSIS
 //  auto start = std::chrono::high_resolution_clock::now();
 //#endif
+  if (channel.type == Read_Local && poll_num == 1) {
+    // Go through the id-matched path so that a blocking read never swallows
+    // the completion of an asynchronous read posted earlier by this thread.
+    return Wait_RDMA_Read(RDMA_Read_Async(remote_mr, local_mr, msg_size));
+  }
   struct ibv_send_wr sr;
   struct ibv_sge sge;
   struct ibv_send_wr* bad_wr = NULL;
@@ -1274,31 +1464,12 @@ End of socket operations
   // start = std::chrono::steady_clock::now();
   //  auto stop = std::chrono::high_resolution_clock::now();
   //  auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start); std::printf("rdma read  send prepare for (%zu), time elapse : (%ld)\n", msg_size, duration.count()); start = std::chrono::high_resolution_clock::now();
-  if (q_id == "read_local"){
-    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_read->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(q_id);
-      qp = static_cast<ibv_qp*>(qp_local_read->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-  }else if (q_id == "write_local"){
-    assert(false);// Never comes to here
-    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(q_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-  } else {
-    std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-    rc = ibv_post_send(res->qp_map.at(q_id), &sr, &bad_wr);
-    l.unlock();
-  }
+  rc = ibv_post_send(Channel_QP(channel), &sr, &bad_wr);
   //    std::cout << " " << msg_size << "time elapse :" <<  << std::endl;
   //  start = std::chrono::high_resolution_clock::now();
 
   if (rc) {
-    fprintf(stderr, "failed to post SR %s \n", q_id.c_str());
+    fprintf(stderr, "failed to post SR on channel %d\n", channel.type);
     exit(1);
 
   } else {
@@ -1313,11 +1484,11 @@ End of socket operations
     //  auto start = std::chrono::high_resolution_clock::now();
     //  while(std::chrono::high_resolution_clock::now
     //  ()-start < std::chrono::nanoseconds(msg_size+200000));
-    rc = poll_completion(wc, poll_num, q_id, true);
+    rc = poll_completion(wc, poll_num, channel, true);
     if (rc != 0) {
       std::cout << "RDMA Read Failed" << std::endl;
-      std::cout << "q id is" << q_id << std::endl;
-      fprintf(stdout, "QP number=0x%x\n", res->qp_map[q_id]->qp_num);
+      std::cout << "channel type is " << channel.type << std::endl;
+      fprintf(stdout, "QP number=0x%x\n", Channel_QP(channel)->qp_num);
     }
     delete[] wc;
   }
@@ -1334,8 +1505,207 @@ End of socket operations
 //#endif
   return rc;
 }
+Async_Read_State* RDMA_Manager::Get_Async_Read_State() {
+  Async_Read_State* state =
+      static_cast<Async_Read_State*>(local_read_async_state->Get());
+  if (state == nullptr) {
+    state = new Async_Read_State();
+    local_read_async_state->Reset(state);
+  }
+  return state;
+}
+void RDMA_Manager::Reap_Read_Completions(Async_Read_State* state, bool block) {
+  ibv_cq* cq = static_cast<ibv_cq*>(cq_local_read->Get());
+  assert(cq != nullptr);
+  ibv_wc wc[16];
+  int poll_result;
+  do {
+    poll_result = ibv_poll_cq(cq, 16, wc);
+  } while (block && poll_result == 0);
+  if (poll_result < 0) {
+    fprintf(stderr, "poll CQ failed\n");
+    return;
+  }
+  for (int i = 0; i < poll_result; i++) {
+    if (wc[i].status != IBV_WC_SUCCESS) {
+      fprintf(stderr,
+              "read %lu got bad completion with status: 0x%x, vendor syndrome: 0x%x\n",
+              wc[i].wr_id, wc[i].status, wc[i].vendor_err);
+      assert(false);
+    }
+    state->completed[wc[i].wr_id] = wc[i].status == IBV_WC_SUCCESS ? 0 : 1;
+  }
+}
+uint64_t RDMA_Manager::RDMA_Read_Async(ibv_mr* remote_mr, ibv_mr* local_mr,
+                                       size_t msg_size) {
+  Async_Read_State* state = Get_Async_Read_State();
+  struct ibv_send_wr sr;
+  struct ibv_sge sge;
+  struct ibv_send_wr* bad_wr = NULL;
+  memset(&sge, 0, sizeof(sge));
+  sge.addr = (uintptr_t)local_mr->addr;
+  sge.length = msg_size;
+  sge.lkey = local_mr->lkey;
+  memset(&sr, 0, sizeof(sr));
+  sr.next = NULL;
+  sr.wr_id = state->next_wr_id++;
+  sr.sg_list = &sge;
+  sr.num_sge = 1;
+  sr.opcode = IBV_WR_RDMA_READ;
+  sr.send_flags = IBV_SEND_SIGNALED;
+  sr.wr.rdma.remote_addr = reinterpret_cast<uint64_t>(remote_mr->addr);
+  sr.wr.rdma.rkey = remote_mr->rkey;
+  if (ibv_post_send(Channel_QP(kReadLocal), &sr, &bad_wr)) {
+    fprintf(stderr, "failed to post SR read_local\n");
+    exit(1);
+  }
+  return sr.wr_id;
+}
+bool RDMA_Manager::RDMA_Read_Done(uint64_t wr_id) {
+  Async_Read_State* state = Get_Async_Read_State();
+  if (state->completed.find(wr_id) == state->completed.end()) {
+    Reap_Read_Completions(state, false);
+  }
+  return state->completed.find(wr_id) != state->completed.end();
+}
+int RDMA_Manager::Wait_RDMA_Read(uint64_t wr_id) {
+  Async_Read_State* state = Get_Async_Read_State();
+  auto iter = state->completed.find(wr_id);
+  while (iter == state->completed.end()) {
+    Reap_Read_Completions(state, true);
+    iter = state->completed.find(wr_id);
+  }
+  int rc = iter->second;
+  state->completed.erase(iter);
+  if (rc != 0) {
+    std::cout << "RDMA Read Failed" << std::endl;
+  }
+  return rc;
+}
+int RDMA_Manager::RDMA_Read_Batch(ibv_mr* remote_mrs, ibv_mr* local_mrs,
+                                  const size_t* msg_sizes, size_t num,
+                                  const RDMA_Channel& channel) {
+  // Every kMaxChainLength-th read is signaled.  A chunk keeps its send queue
+  // slots until its signaled tail completes.  At most kMaxChunksInFlight
+  // chunks are posted at once, so a large batch stays well inside max_send_wr
+  // (2500).  That leaves room for the asynchronous reads already on the queue
+  // pair.
+  static const size_t kMaxChainLength = 64;
+  static const size_t kMaxChunksInFlight = 16;
+  if (num == 0) return 0;
+  std::vector<ibv_send_wr> srs(num);
+  std::vector<ibv_sge> sges(num);
+  // On the thread-local read queue pair the chunk tails take ids from the
+  // async read counter, so that asynchronous reads outstanding on this
+  // thread keep their completions.
+  Async_Read_State* state =
+      channel.type == Read_Local ? Get_Async_Read_State() : nullptr;
+  std::vector<uint64_t> tails;
+  for (size_t i = 0; i < num; i++) {
+    memset(&sges[i], 0, sizeof(ibv_sge));
+    sges[i].addr = (uintptr_t)local_mrs[i].addr;
+    sges[i].length = msg_sizes[i];
+    sges[i].lkey = local_mrs[i].lkey;
+    memset(&srs[i], 0, sizeof(ibv_send_wr));
+    srs[i].wr_id = i;
+    srs[i].sg_list = &sges[i];
+    srs[i].num_sge = 1;
+    srs[i].opcode = IBV_WR_RDMA_READ;
+    srs[i].wr.rdma.remote_addr = reinterpret_cast<uint64_t>(remote_mrs[i].addr);
+    srs[i].wr.rdma.rkey = remote_mrs[i].rkey;
+    if ((i + 1) % kMaxChainLength == 0 || i + 1 == num) {
+      srs[i].send_flags = IBV_SEND_SIGNALED;
+      srs[i].next = NULL;
+      if (state != nullptr) {
+        srs[i].wr_id = state->next_wr_id++;
+      }
+      tails.push_back(srs[i].wr_id);
+    } else {
+      srs[i].next = &srs[i + 1];
+    }
+  }
+  ibv_qp* qp = Channel_QP(channel);
+  ibv_wc wc;
+  int rc = 0;
+  // Chunks complete in the order they were posted, so waiting for the oldest
+  // one frees the slots for the next.
+  size_t posted = 0;
+  size_t completed = 0;
+  while (completed < tails.size()) {
+    if (posted < tails.size() && posted - completed < kMaxChunksInFlight) {
+      struct ibv_send_wr* bad_wr = NULL;
+      if (ibv_post_send(qp, &srs[posted * kMaxChainLength], &bad_wr)) {
+        fprintf(stderr, "failed to post batched SR on channel %d\n",
+                channel.type);
+        exit(1);
+      }
+      posted++;
+      continue;
+    }
+    if (state != nullptr) {
+      rc |= Wait_RDMA_Read(tails[completed]);
+    } else {
+      rc |= poll_completion(&wc, 1, channel, true);
+    }
+    completed++;
+  }
+  if (rc != 0) {
+    std::cout << "RDMA Batch Read Failed" << std::endl;
+    std::cout << "channel type is " << channel.type << std::endl;
+  }
+  return rc;
+}
+int RDMA_Manager::RDMA_Write_Batch(ibv_mr* remote_mrs, ibv_mr* local_mrs,
+                                   const size_t* msg_sizes, size_t num,
+                                   const RDMA_Channel& channel,
+                                   size_t send_flag, int poll_num) {
+  // Same chain length as RDMA_Read_Batch, for the same reason.
+  static const size_t kMaxChainLength = 64;
+  if (num == 0) return 0;
+  std::vector<ibv_send_wr> srs(num);
+  std::vector<ibv_sge> sges(num);
+  for (size_t i = 0; i < num; i++) {
+    memset(&sges[i], 0, sizeof(ibv_sge));
+    sges[i].addr = (uintptr_t)local_mrs[i].addr;
+    sges[i].length = msg_sizes[i];
+    sges[i].lkey = local_mrs[i].lkey;
+    memset(&srs[i], 0, sizeof(ibv_send_wr));
+    srs[i].wr_id = 0;
+    srs[i].sg_list = &sges[i];
+    srs[i].num_sge = 1;
+    srs[i].opcode = IBV_WR_RDMA_WRITE;
+    srs[i].wr.rdma.remote_addr = reinterpret_cast<uint64_t>(remote_mrs[i].addr);
+    srs[i].wr.rdma.rkey = remote_mrs[i].rkey;
+    if ((i + 1) % kMaxChainLength == 0 || i + 1 == num) {
+      if (send_flag != 0) srs[i].send_flags = send_flag;
+      srs[i].next = NULL;
+    } else {
+      srs[i].next = &srs[i + 1];
+    }
+  }
+  ibv_qp* qp = Channel_QP(channel);
+  int rc = 0;
+  for (size_t start = 0; start < num; start += kMaxChainLength) {
+    struct ibv_send_wr* bad_wr = NULL;
+    rc = ibv_post_send(qp, &srs[start], &bad_wr);
+    if (rc) {
+      fprintf(stderr, "failed to post batched SR on channel %d\n", channel.type);
+      exit(1);
+    }
+  }
+  if (poll_num != 0) {
+    ibv_wc* wc = new ibv_wc[poll_num]();
+    rc = poll_completion(wc, poll_num, channel, true);
+    if (rc != 0) {
+      std::cout << "RDMA Batch Write Failed" << std::endl;
+      std::cout << "channel type is " << channel.type << std::endl;
+    }
+    delete[] wc;
+  }
+  return rc;
+}
 int RDMA_Manager::RDMA_Write(ibv_mr* remote_mr, ibv_mr* local_mr,
-                             size_t msg_size, std::string q_id,
+                             size_t msg_size, const RDMA_Channel& channel,
                              size_t send_flag, int poll_num) {
   //  auto start = std::chrono::high_resolution_clock::now();
   struct ibv_send_wr sr;
@@ -1363,33 +1733,7 @@ int RDMA_Manager::RDMA_Write(ibv_mr* remote_mr, ibv_mr* local_mr,
   //  auto stop = std::chrono::high_resolution_clock::now();
   //  auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start); printf("RDMA Write send preparation size: %zu elapse: %ld\n", msg_size, duration.count()); start = std::chrono::high_resolution_clock::now();
 
-  if (q_id == "read_local"){
-    assert(false);// Never comes to here
-    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_read->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(q_id);
-      qp = static_cast<ibv_qp*>(qp_local_read->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-  }else if (q_id == "write_local_flush"){
-    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(q_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-  }else if (q_id == "write_local_compact"){
-    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_compact->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(q_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_compact->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-  } else {
-    std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-    rc = ibv_post_send(res->qp_map.at(q_id), &sr, &bad_wr);
-    l.unlock();
-  }
+  rc = ibv_post_send(Channel_QP(channel), &sr, &bad_wr);
 
   //  start = std::chrono::high_resolution_clock::now();
   if (rc) fprintf(stderr, "failed to post SR, return is %d\n", rc);
@@ -1402,11 +1746,11 @@ int RDMA_Manager::RDMA_Write(ibv_mr* remote_mr, ibv_mr* local_mr,
     //  auto start = std::chrono::high_resolution_clock::now();
     //  while(std::chrono::high_resolution_clock::now()-start < std::chrono::nanoseconds(msg_size+200000));
     // wait until the job complete.
-    rc = poll_completion(wc, poll_num, q_id, true);
+    rc = poll_completion(wc, poll_num, channel, true);
     if (rc != 0) {
       std::cout << "RDMA Write Failed" << std::endl;
-      std::cout << "q id is" << q_id << std::endl;
-      fprintf(stdout, "QP number=0x%x\n", res->qp_map[q_id]->qp_num);
+      std::cout << "channel type is " << channel.type << std::endl;
+      fprintf(stdout, "QP number=0x%x\n", Channel_QP(channel)->qp_num);
     }
     delete[] wc;
   }
@@ -1415,7 +1759,7 @@ int RDMA_Manager::RDMA_Write(ibv_mr* remote_mr, ibv_mr* local_mr,
   return rc;
 }
 int RDMA_Manager::RDMA_Write(void* addr, uint32_t rkey, ibv_mr* local_mr, size_t msg_size,
-                             std::string q_id, size_t send_flag, int poll_num) {
+                             const RDMA_Channel& channel, size_t send_flag, int poll_num) {
     //  auto start = std::chrono::high_resolution_clock::now();
     struct ibv_send_wr sr;
     struct ibv_sge sge;
@@ -1442,33 +1786,7 @@ int RDMA_Manager::RDMA_Write(void* addr, uint32_t rkey, ibv_mr* local_mr, size_t
     //  auto stop = std::chrono::high_resolution_clock::now();
     //  auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start); printf("RDMA Write send preparation size: %zu elapse: %ld\n", msg_size, duration.count()); start = std::chrono::high_resolution_clock::now();
 
-    if (q_id == "read_local"){
-      assert(false);// Never comes to here
-      ibv_qp* qp = static_cast<ibv_qp*>(qp_local_read->Get());
-      if (qp == NULL) {
-        Remote_Query_Pair_Connection(q_id);
-        qp = static_cast<ibv_qp*>(qp_local_read->Get());
-      }
-      rc = ibv_post_send(qp, &sr, &bad_wr);
-    }else if (q_id == "write_local_flush"){
-      ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-      if (qp == NULL) {
-        Remote_Query_Pair_Connection(q_id);
-        qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-      }
-      rc = ibv_post_send(qp, &sr, &bad_wr);
-    }else if (q_id == "write_local_compact"){
-      ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_compact->Get());
-      if (qp == NULL) {
-        Remote_Query_Pair_Connection(q_id);
-        qp = static_cast<ibv_qp*>(qp_local_write_compact->Get());
-      }
-      rc = ibv_post_send(qp, &sr, &bad_wr);
-    } else {
-      std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-      rc = ibv_post_send(res->qp_map.at(q_id), &sr, &bad_wr);
-      l.unlock();
-    }
+    rc = ibv_post_send(Channel_QP(channel), &sr, &bad_wr);
 
     //  start = std::chrono::high_resolution_clock::now();
     if (rc) fprintf(stderr, "failed to post SR, return is %d\n", rc);
@@ -1481,11 +1799,11 @@ int RDMA_Manager::RDMA_Write(void* addr, uint32_t rkey, ibv_mr* local_mr, size_t
       //  auto start = std::chrono::high_resolution_clock::now();
       //  while(std::chrono::high_resolution_clock::now()-start < std::chrono::nanoseconds(msg_size+200000));
       // wait until the job complete.
-      rc = poll_completion(wc, poll_num, q_id, true);
+      rc = poll_completion(wc, poll_num, channel, true);
       if (rc != 0) {
         std::cout << "RDMA Write Failed" << std::endl;
-        std::cout << "q id is" << q_id << std::endl;
-        fprintf(stdout, "QP number=0x%x\n", res->qp_map[q_id]->qp_num);
+        std::cout << "channel type is " << channel.type << std::endl;
+        fprintf(stdout, "QP number=0x%x\n", Channel_QP(channel)->qp_num);
       }else{
         DEBUG("RDMA write successfully\n");
       }
@@ -1548,7 +1866,7 @@ int RDMA_Manager::RDMA_Write(void* addr, uint32_t rkey, ibv_mr* local_mr, size_t
 //  return rc;
 //}
 
-int RDMA_Manager::post_send(ibv_mr* mr, std::string q_id, size_t size) {
+int RDMA_Manager::post_send(ibv_mr* mr, const RDMA_Channel& channel, size_t size) {
   struct ibv_send_wr sr;
   struct ibv_sge sge;
   struct ibv_send_wr* bad_wr = NULL;
@@ -1585,33 +1903,7 @@ int RDMA_Manager::post_send(ibv_mr* mr, std::string q_id, size_t size) {
 //    rc = ibv_post_send(res->qp_map["main"], &sr, &bad_wr);
 //  else
 //    rc = ibv_post_send(res->qp_map[qp_id], &sr, &bad_wr);
-  if (q_id == "read_local"){
-    assert(false);// Never comes to here
-    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_read->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(q_id);
-      qp = static_cast<ibv_qp*>(qp_local_read->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-  }else if (q_id == "write_local_flush"){
-    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(q_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-  }else if (q_id == "write_local_compact"){
-    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_compact->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(q_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_compact->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-  } else {
-    std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-    rc = ibv_post_send(res->qp_map.at(q_id), &sr, &bad_wr);
-    l.unlock();
-  }
+  rc = ibv_post_send(Channel_QP(channel), &sr, &bad_wr);
 #ifndef NDEBUG
   if (rc)
     fprintf(stderr, "failed to post SR\n");
@@ -1622,7 +1914,7 @@ int RDMA_Manager::post_send(ibv_mr* mr, std::string q_id, size_t size) {
   return rc;
 }
 int RDMA_Manager::post_send(ibv_mr** mr_list, size_t sge_size,
-                            std::string q_id) {
+                            const RDMA_Channel& channel) {
   struct ibv_send_wr sr;
   struct ibv_sge sge[sge_size];
   struct ibv_send_wr* bad_wr = NULL;
@@ -1662,33 +1954,7 @@ int RDMA_Manager::post_send(ibv_mr** mr_list, size_t sge_size,
 //    rc = ibv_post_send(res->qp_map["main"], &sr, &bad_wr);
 //  else
 //    rc = ibv_post_send(res->qp_map[qp_id], &sr, &bad_wr);
-  if (q_id == "read_local"){
-    assert(false);// Never comes to here
-    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_read->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(q_id);
-      qp = static_cast<ibv_qp*>(qp_local_read->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-  }else if (q_id == "write_local_flush"){
-    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(q_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-  }else if (q_id == "write_local_compact"){
-    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_compact->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(q_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_compact->Get());
-    }
-    rc = ibv_post_send(qp, &sr, &bad_wr);
-  } else {
-    std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-    rc = ibv_post_send(res->qp_map.at(q_id), &sr, &bad_wr);
-    l.unlock();
-  }
+  rc = ibv_post_send(Channel_QP(channel), &sr, &bad_wr);
 #ifndef NDEBUG
   if (rc)
     fprintf(stderr, "failed to post SR\n");
@@ -1699,7 +1965,7 @@ int RDMA_Manager::post_send(ibv_mr** mr_list, size_t sge_size,
   return rc;
 }
 int RDMA_Manager::post_receive(ibv_mr** mr_list, size_t sge_size,
-                               std::string q_id) {
+                               const RDMA_Channel& channel) {
   struct ibv_recv_wr rr;
   struct ibv_sge sge[sge_size];
   struct ibv_recv_wr* bad_wr;
@@ -1734,33 +2000,7 @@ int RDMA_Manager::post_receive(ibv_mr** mr_list, size_t sge_size,
 //    rc = ibv_post_recv(res->qp_map["main"], &rr, &bad_wr);
 //  else
 //    rc = ibv_post_recv(res->qp_map[qp_id], &rr, &bad_wr);
-  if (q_id == "read_local"){
-    assert(false);// Never comes to here
-    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_read->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(q_id);
-      qp = static_cast<ibv_qp*>(qp_local_read->Get());
-    }
-    rc = ibv_post_recv(qp, &rr, &bad_wr);
-  }else if (q_id == "write_local_flush"){
-    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(q_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-    }
-    rc = ibv_post_recv(qp, &rr, &bad_wr);
-  }else if (q_id == "write_local_compact"){
-    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_compact->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(q_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_compact->Get());
-    }
-    rc = ibv_post_recv(qp, &rr, &bad_wr);
-  } else {
-    std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-    rc = ibv_post_recv(res->qp_map.at(q_id), &rr, &bad_wr);
-    l.unlock();
-  }
+  rc = ibv_post_recv(Channel_QP(channel), &rr, &bad_wr);
   if (rc)
     fprintf(stderr, "failed to post RR\n");
   else
@@ -1768,7 +2008,7 @@ int RDMA_Manager::post_receive(ibv_mr** mr_list, size_t sge_size,
   return rc;
 }
 
-int RDMA_Manager::post_receive(ibv_mr* mr, std::string q_id, size_t size) {
+int RDMA_Manager::post_receive(ibv_mr* mr, const RDMA_Channel& channel, size_t size) {
   struct ibv_recv_wr rr;
   struct ibv_sge sge;
   struct ibv_recv_wr* bad_wr;
@@ -1801,33 +2041,7 @@ int RDMA_Manager::post_receive(ibv_mr* mr, std::string q_id, size_t size) {
 //    rc = ibv_post_recv(res->qp_map["main"], &rr, &bad_wr);
 //  else
 //    rc = ibv_post_recv(res->qp_map[q_id], &rr, &bad_wr);
-  if (q_id == "read_local"){
-    assert(false);// Never comes to here
-    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_read->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(q_id);
-      qp = static_cast<ibv_qp*>(qp_local_read->Get());
-    }
-    rc = ibv_post_recv(qp, &rr, &bad_wr);
-  }else if (q_id == "write_local_flush"){
-    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(q_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-    }
-    rc = ibv_post_recv(qp, &rr, &bad_wr);
-  }else if (q_id == "write_local_compact"){
-    ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_compact->Get());
-    if (qp == NULL) {
-      Remote_Query_Pair_Connection(q_id);
-      qp = static_cast<ibv_qp*>(qp_local_write_compact->Get());
-    }
-    rc = ibv_post_recv(qp, &rr, &bad_wr);
-  } else {
-    std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-    rc = ibv_post_recv(res->qp_map.at(q_id), &rr, &bad_wr);
-    l.unlock();
-  }
+  rc = ibv_post_recv(Channel_QP(channel), &rr, &bad_wr);
   if (rc)
     fprintf(stderr, "failed to post RR\n");
   else
@@ -1853,7 +2067,7 @@ int RDMA_Manager::post_receive(ibv_mr* mr, std::string q_id, size_t size) {
 *
 ******************************************************************************/
 int RDMA_Manager::poll_completion(ibv_wc* wc_p, int num_entries,
-                                  std::string q_id, bool send_cq) {
+                                  const RDMA_Channel& channel, bool send_cq) {
   // unsigned long start_time_msec;
   // unsigned long cur_time_msec;
   // struct timeval cur_time;
@@ -1864,28 +2078,7 @@ int RDMA_Manager::poll_completion(ibv_wc* wc_p, int num_entries,
   /* poll the completion for a while before giving up of doing it .. */
   // gettimeofday(&cur_time, NULL);
   // start_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
-  std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-  if (q_id == "write_local_flush"){
-    cq = static_cast<ibv_cq*>(cq_local_write_flush->Get());
-    assert(cq != nullptr);
-  }else if (q_id == "write_local_compact"){
-    cq = static_cast<ibv_cq*>(cq_local_write_compact->Get());
-    assert(cq != nullptr);
-
-  }else if (q_id == "read_local"){
-    cq = static_cast<ibv_cq*>(cq_local_read->Get());
-    assert(cq != nullptr);
-
-  }
-  else{
-//    assert(res->cq_map.contains());
-    if (send_cq)
-      cq = res->cq_map.at(q_id).first;
-    else
-      cq = res->cq_map.at(q_id).second;
-    assert(cq != nullptr);
-  }
-  l.unlock();
+  cq = Channel_CQ(channel, send_cq);
   do {
     poll_result = ibv_poll_cq(cq, num_entries, &wc_p[poll_num]);
     if (poll_result < 0)
@@ -1925,7 +2118,7 @@ int RDMA_Manager::poll_completion(ibv_wc* wc_p, int num_entries,
 }
 int RDMA_Manager::try_poll_this_thread_completions(ibv_wc* wc_p,
                                                    int num_entries,
-                                                   std::string q_id,
+                                                   const RDMA_Channel& channel,
                                                    bool send_cq) {
   int poll_result = 0;
   int poll_num = 0;
@@ -1933,24 +2126,7 @@ int RDMA_Manager::try_poll_this_thread_completions(ibv_wc* wc_p,
   /* poll the completion for a while before giving up of doing it .. */
   // gettimeofday(&cur_time, NULL);
   // start_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
-  if (q_id == "write_local_flush"){
-    cq = static_cast<ibv_cq*>(cq_local_write_flush->Get());
-    assert(cq != nullptr);
-  }else if(q_id == "write_local_compact"){
-    cq = static_cast<ibv_cq*>(cq_local_write_compact->Get());
-    assert(cq != nullptr);
-  }else if (q_id == "read_local"){
-    cq = static_cast<ibv_cq*>(cq_local_read->Get());
-    assert(cq != nullptr);
-
-  }
-  else{
-    if (send_cq)
-      cq = res->cq_map.at(q_id).first;
-    else
-      cq = res->cq_map.at(q_id).second;
-    assert(cq != nullptr);
-  }
+  cq = Channel_CQ(channel, send_cq);
 
   poll_result = ibv_poll_cq(cq, num_entries, &wc_p[poll_num]);
 #ifndef NDEBUG
@@ -2228,6 +2404,18 @@ void RDMA_Manager::Allocate_Local_RDMA_Slot(ibv_mr& mr_input,
   // allocate the RDMA slot is seperate into two situation, read and write.
   size_t chunk_size;
   chunk_size = name_to_size.at(pool_name);
+  Local_Slot_Cache* cache = Get_Local_Slot_Cache();
+  auto cached = cache->pools.find(pool_name);
+  if (cached != cache->pools.end() && !cached->second.empty()) {
+    Local_Slot_Cache::Slot slot = cached->second.back();
+    cached->second.pop_back();
+    slot.region->unpark_memory_slot(slot.index);
+    mr_input = *(slot.region->get_mr_ori());
+    mr_input.addr = static_cast<void*>(static_cast<char*>(mr_input.addr) +
+                                        slot.index * chunk_size);
+    mr_input.length = chunk_size;
+    return;
+  }
   if (name_to_mem_pool.at(pool_name).empty()) {
     std::unique_lock<std::shared_mutex> mem_write_lock(local_mem_mutex);
     if (name_to_mem_pool.at(pool_name).empty()) {
@@ -2287,6 +2475,60 @@ void RDMA_Manager::Allocate_Local_RDMA_Slot(ibv_mr& mr_input,
     return;
   }
 }
+// Per thread, keep at most this many freed slots of one pool, and at most
+// kLocalSlotCacheBytes worth of them.
+static const size_t kLocalSlotCacheSlots = 64;
+static const size_t kLocalSlotCacheBytes = 1024 * 1024;
+Local_Slot_Cache* RDMA_Manager::Get_Local_Slot_Cache() {
+  Local_Slot_Cache* cache =
+      static_cast<Local_Slot_Cache*>(local_slot_cache->Get());
+  if (cache == nullptr) {
+    cache = new Local_Slot_Cache();
+    local_slot_cache->Reset(cache);
+  }
+  return cache;
+}
+In_Use_Array* RDMA_Manager::Find_Slot(std::map<void*, In_Use_Array>& bitmap,
+                                      void* p, int* index) {
+  auto mr_iter = bitmap.upper_bound(p);
+  if (mr_iter == bitmap.begin()) {
+    return nullptr;
+  }
+  mr_iter--;
+  size_t buff_offset =
+      static_cast<char*>(p) - static_cast<char*>(mr_iter->first);
+  if (buff_offset >= mr_iter->second.get_mr_ori()->length) {
+    return nullptr;
+  }
+  assert(buff_offset % mr_iter->second.get_chunk_size() == 0);
+  *index = static_cast<int>(buff_offset / mr_iter->second.get_chunk_size());
+  return &mr_iter->second;
+}
+bool RDMA_Manager::Release_Local_Slot(const std::string& pool_name,
+                                      In_Use_Array* region, int index) {
+  if (!region->is_in_use(index) || region->is_parked(index)) {
+    // Freed twice: the slot is already back in the bitmap or in some
+    // thread's cache.
+    assert(false);
+    return false;
+  }
+  size_t limit = std::min(kLocalSlotCacheSlots,
+                          kLocalSlotCacheBytes / region->get_chunk_size());
+  if (limit > 0) {
+    std::vector<Local_Slot_Cache::Slot>& slots =
+        Get_Local_Slot_Cache()->pools[pool_name];
+    if (slots.size() < limit) {
+      if (!region->park_memory_slot(index)) {
+        // Another thread parked it in the meantime.
+        assert(false);
+        return false;
+      }
+      slots.push_back({region, index});
+      return true;
+    }
+  }
+  return region->deallocate_memory_slot(index);
+}
 // Remeber to delete the mr because it was created be new, otherwise memory leak.
 bool RDMA_Manager::Deallocate_Local_RDMA_Slot(ibv_mr* mr, ibv_mr* map_pointer,
                                               std::string buffer_type) {
@@ -2295,89 +2537,32 @@ bool RDMA_Manager::Deallocate_Local_RDMA_Slot(ibv_mr* mr, ibv_mr* map_pointer,
   size_t chunksize = name_to_size.at(buffer_type);
   assert(buff_offset % chunksize == 0);
   std::shared_lock<std::shared_mutex> read_lock(local_mem_mutex);
-  return name_to_mem_pool.at(buffer_type)
-      .at(map_pointer->addr)
-      .deallocate_memory_slot(buff_offset / chunksize);
+  In_Use_Array* region =
+      &name_to_mem_pool.at(buffer_type).at(map_pointer->addr);
+  read_lock.unlock();
+  return Release_Local_Slot(buffer_type, region, buff_offset / chunksize);
 }
 bool RDMA_Manager::Deallocate_Local_RDMA_Slot(void* p, const std::string& buff_type) {
   std::shared_lock<std::shared_mutex> read_lock(local_mem_mutex);
-  std::map<void*, In_Use_Array> Bitmap;
-  Bitmap = name_to_mem_pool.at(buff_type);
-  auto mr_iter = Bitmap.upper_bound(p);
-  if (mr_iter == Bitmap.begin()) {
+  int index;
+  In_Use_Array* region = Find_Slot(name_to_mem_pool.at(buff_type), p, &index);
+  read_lock.unlock();
+  if (region == nullptr) {
     return false;
-  } else if (mr_iter == Bitmap.end()) {
-    mr_iter--;
-    size_t buff_offset =
-        static_cast<char*>(p) - static_cast<char*>(mr_iter->first);
-    //      assert(buff_offset>=0);
-    if (buff_offset < mr_iter->second.get_mr_ori()->length){
-      assert(buff_offset % mr_iter->second.get_chunk_size() == 0);
-      bool status = mr_iter->second.deallocate_memory_slot(
-          buff_offset / mr_iter->second.get_chunk_size());
-      assert(status);
-      return status;
-    }
-    else
-      return false;
-  } else {
-    mr_iter--;
-    size_t buff_offset =
-        static_cast<char*>(p) - static_cast<char*>(mr_iter->first);
-    //      assert(buff_offset>=0);
-    if (buff_offset < mr_iter->second.get_mr_ori()->length){
-      assert(buff_offset % mr_iter->second.get_chunk_size() == 0);
-
-      bool status = mr_iter->second.deallocate_memory_slot(
-          buff_offset / mr_iter->second.get_chunk_size());
-      assert(status);
-      return status;
-    }
-    else
-      return false;
-
   }
-  return false;
+  return Release_Local_Slot(buff_type, region, index);
 }
 bool RDMA_Manager::Deallocate_Remote_RDMA_Slot(void* p) {
   DEBUG_arg("Delete Remote pointer %p", p);
   std::shared_lock<std::shared_mutex> read_lock(remote_mem_mutex);
-  std::map<void*, In_Use_Array>* Bitmap;
-  Bitmap = Remote_Mem_Bitmap;
-  auto mr_iter = Bitmap->upper_bound(p);
-  if (mr_iter == Bitmap->begin()) {
+  int index;
+  In_Use_Array* region = Find_Slot(*Remote_Mem_Bitmap, p, &index);
+  if (region == nullptr) {
     return false;
-  } else if (mr_iter == Bitmap->end()) {
-    mr_iter--;
-    size_t buff_offset =
-        static_cast<char*>(p) - static_cast<char*>(mr_iter->first);
-    //      assert(buff_offset>=0);
-    if (buff_offset < mr_iter->second.get_mr_ori()->length){
-      assert(buff_offset % mr_iter->second.get_chunk_size() == 0);
-      bool status = mr_iter->second.deallocate_memory_slot(
-          buff_offset / mr_iter->second.get_chunk_size());
-      assert(status);
-      return status;
-    }
-    else
-      return false;
-  } else {
-    mr_iter--;
-    size_t buff_offset =
-        static_cast<char*>(p) - static_cast<char*>(mr_iter->first);
-    //      assert(buff_offset>=0);
-    if (buff_offset < mr_iter->second.get_mr_ori()->length){
-      assert(buff_offset % mr_iter->second.get_chunk_size() == 0);
-      bool status = mr_iter->second.deallocate_memory_slot(
-          buff_offset / mr_iter->second.get_chunk_size());
-      assert(status);
-      return status;
-    }else{
-      return false;
-    }
-
   }
-  return false;
+  bool status = region->deallocate_memory_slot(index);
+  assert(status);
+  return status;
 }
 // bool RDMA_Manager::Deallocate_Remote_RDMA_Slot(SST_Metadata* sst_meta)  {
 //
@@ -2581,7 +2766,6 @@ void RDMA_Manager::fs_serialization(
     size_t chunk_size_net = htonl(chunk_size);
     memcpy(temp, &chunk_size_net, sizeof(size_t));
     temp = temp + sizeof(size_t);
-    std::atomic<bool>* in_use = iter.second.get_inuse_table();
     auto mr = iter.second.get_mr_ori();
     p = mr->context;
     // TODO: It can not be changed into net stream.
@@ -2603,7 +2787,7 @@ void RDMA_Manager::fs_serialization(
     memcpy(temp, &length_mr_net, sizeof(size_t));
     temp = temp + sizeof(size_t);
     for (size_t i = 0; i < element_size; i++) {
-      bool bit_temp = in_use[i];
+      bool bit_temp = iter.second.is_in_use(i);
       memcpy(temp, &bit_temp, sizeof(bool));
       temp = temp + sizeof(bool);
     }
@@ -2750,7 +2934,7 @@ void RDMA_Manager::fs_deserilization(
     memcpy(&chunk_size_net, temp, sizeof(size_t));
     size_t chunk_size = htonl(chunk_size_net);
     temp = temp + sizeof(size_t);
-    auto* in_use = new std::atomic<bool>[element_size];
+    auto* in_use = new bool[element_size];
 
     void* context_p = nullptr;
     // TODO: It can not be changed into net stream.
@@ -2784,14 +2968,18 @@ void RDMA_Manager::fs_deserilization(
     }
 
     mr_deserialization(temp, size, mr_inuse);
-    In_Use_Array in_use_array(element_size, chunk_size, mr_inuse, in_use);
+    In_Use_Array in_use_array(element_size, chunk_size, mr_inuse);
+    for (size_t j = 0; j < element_size; j++) {
+      if (in_use[j]) in_use_array.mark_in_use(j);
+    }
+    delete[] in_use;
     remote_mem_bitmap.insert({p_key, in_use_array});
   }
   auto stop = std::chrono::high_resolution_clock::now();
   auto duration =
       std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
   printf("fs pure deserialization time elapse: %ld\n", duration.count());
-  ibv_dereg_mr(local_mr);
+  Deregister_MR(local_mr);
   free(buff);
 }
 
@@ -78,6 +78,9 @@ struct registered_qp_config {
 } __attribute__((packed));
 struct install_versionedit {
   bool trival;
+  // The serialized edit, buffer_size bytes, follows the request in the same
+  // message (RDMA_Message::payload) instead of being RDMA written later.
+  bool payload_inline;
   size_t buffer_size;
   size_t version_id;
   uint8_t check_byte;
@@ -126,6 +129,13 @@ struct RDMA_Request {
 //  Options opt;
 } __attribute__((packed));
 
+// What a receive buffer holds: a request, optionally followed by a small
+// payload that travels in the same SEND.
+struct RDMA_Message {
+  RDMA_Request request;
+  char payload[4096 - sizeof(RDMA_Request)];
+} __attribute__((packed));
+
 struct RDMA_Reply {
 //  RDMA_Command_Type command;
   RDMA_Reply_Content content;
@@ -159,61 +169,148 @@ struct atomwrapper {
   }
 };
 
+// Slot bitmap for one registered memory region that is carved into
+// element_size_ chunks of chunk_size_ bytes. Slots are packed 64 to a word
+// and claimed with a find-first-zero plus compare-and-swap, starting from a
+// hint cursor (the word that last had room or last got a slot back) instead
+// of slot 0. free_slots_ never undercounts, so a full region is skipped
+// without touching its bitmap. Copies share the same bitmap.
 class In_Use_Array {
  public:
   In_Use_Array(size_t size, size_t chunk_size, ibv_mr* mr_ori)
-      : element_size_(size), chunk_size_(chunk_size), mr_ori_(mr_ori) {
-    in_use_ = new std::atomic<bool>[element_size_];
-    for (size_t i = 0; i < element_size_; ++i) {
-      in_use_[i] = false;
-    }
-  }
-  In_Use_Array(size_t size, size_t chunk_size, ibv_mr* mr_ori,
-               std::atomic<bool>* in_use)
       : element_size_(size),
         chunk_size_(chunk_size),
-        in_use_(in_use),
+        bitmap_(std::make_shared<Slot_Bitmap>(size)),
         mr_ori_(mr_ori) {}
   int allocate_memory_slot() {
-    for (int i = 0; i < static_cast<int>(element_size_); ++i) {
-      //      auto start = std::chrono::high_resolution_clock::now();
-      bool temp = in_use_[i];
-      if (temp == false) {
-        //        auto stop = std::chrono::high_resolution_clock::now();
-        //        auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start); std::printf("Compare and swap time duration is %ld \n", duration.count());
-        if (in_use_[i].compare_exchange_strong(temp, true)) {
-          //          std::cout << "chunk" <<i << "was changed to true" << std::endl;
-
-          return i;  // find the empty slot then return the index for the slot
+    Slot_Bitmap* b = bitmap_.get();
+    if (b->free_slots.load(std::memory_order_relaxed) == 0) {
+      return -1;  // Not find the empty memory chunk.
+    }
+    size_t word = b->hint.load(std::memory_order_relaxed);
+    for (size_t n = 0; n < b->word_num; ++n, ++word) {
+      if (word >= b->word_num) word = 0;
+      uint64_t bits = b->words[word].load(std::memory_order_relaxed);
+      while (bits != ~uint64_t{0}) {
+        int bit = __builtin_ctzll(~bits);
+        uint64_t claimed = bits | (uint64_t{1} << bit);
+        if (b->words[word].compare_exchange_weak(bits, claimed,
+                                                 std::memory_order_acquire,
+                                                 std::memory_order_relaxed)) {
+          b->free_slots.fetch_sub(1, std::memory_order_relaxed);
+          size_t next = claimed == ~uint64_t{0} ? word + 1 : word;
+          b->hint.store(next == b->word_num ? 0 : next,
+                        std::memory_order_relaxed);
+          // find the empty slot then return the index for the slot
+          return static_cast<int>(word * 64 + bit);
         }
-        //        else
-        //          std::cout << "Compare and swap fail" << "i equals" << i  << "type is" << type_ << std::endl;
       }
     }
     return -1;  // Not find the empty memory chunk.
   }
   bool deallocate_memory_slot(int index) {
-    bool temp = true;
-    assert(in_use_[index] == true);
     assert(index < element_size_);
-    //    std::cout << "chunk" <<index << "was changed to false" << std::endl;
-    while (!in_use_[index].compare_exchange_strong(temp, false));
+    Slot_Bitmap* b = bitmap_.get();
+    size_t word = index / 64;
+    uint64_t mask = uint64_t{1} << (index % 64);
+    // Count the slot as free before it can be claimed again, so that
+    // free_slots stays an upper bound for the allocators reading it.
+    b->free_slots.fetch_add(1, std::memory_order_relaxed);
+    uint64_t prev = b->words[word].fetch_and(~mask, std::memory_order_release);
+    assert(prev & mask);
+    if (!(prev & mask)) {
+      // Freed twice.
+      b->free_slots.fetch_sub(1, std::memory_order_relaxed);
+      return false;
+    }
+    b->hint.store(word, std::memory_order_relaxed);
     return true;
   }
+  // A slot parked in a Local_Slot_Cache stays taken in the bitmap and gets
+  // its parked bit instead. Returns false if the slot is already parked.
+  bool park_memory_slot(int index) {
+    uint64_t mask = uint64_t{1} << (index % 64);
+    return !(bitmap_->parked[index / 64].fetch_or(mask) & mask);
+  }
+  void unpark_memory_slot(int index) {
+    uint64_t mask = uint64_t{1} << (index % 64);
+    uint64_t prev = bitmap_->parked[index / 64].fetch_and(~mask);
+    assert(prev & mask);
+    (void)prev;
+  }
+  bool is_parked(size_t index) {
+    return (bitmap_->parked[index / 64].load(std::memory_order_relaxed) >>
+            (index % 64)) & 1;
+  }
+  bool is_in_use(size_t index) {
+    return (bitmap_->words[index / 64].load(std::memory_order_relaxed) >>
+            (index % 64)) & 1;
+  }
+  // Mark a slot as used without searching, e.g. when restoring a bitmap.
+  void mark_in_use(size_t index) {
+    uint64_t mask = uint64_t{1} << (index % 64);
+    if (!(bitmap_->words[index / 64].fetch_or(mask) & mask)) {
+      bitmap_->free_slots.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+  bool full() {
+    return bitmap_->free_slots.load(std::memory_order_relaxed) == 0;
+  }
   size_t get_chunk_size() { return chunk_size_; }
   ibv_mr* get_mr_ori() { return mr_ori_; }
   size_t get_element_size() { return element_size_; }
-  std::atomic<bool>* get_inuse_table() { return in_use_; }
-  //  void deserialization(char*& temp, int& size){
-  //
-  //
-  //  }
+
  private:
+  struct Slot_Bitmap {
+    explicit Slot_Bitmap(size_t size)
+        : word_num((size + 63) / 64),
+          words(new std::atomic<uint64_t>[word_num]),
+          parked(new std::atomic<uint64_t>[word_num]),
+          hint(0),
+          free_slots(size) {
+      for (size_t i = 0; i < word_num; ++i) {
+        words[i].store(0, std::memory_order_relaxed);
+        parked[i].store(0, std::memory_order_relaxed);
+      }
+      // The bits past the last slot are permanently taken.
+      if (size % 64 != 0) {
+        words[word_num - 1].store(~uint64_t{0} << (size % 64),
+                                  std::memory_order_relaxed);
+      }
+    }
+    ~Slot_Bitmap() {
+      delete[] words;
+      delete[] parked;
+    }
+    const size_t word_num;
+    std::atomic<uint64_t>* const words;
+    // Slots sitting in a Local_Slot_Cache, see park_memory_slot().
+    std::atomic<uint64_t>* const parked;
+    std::atomic<size_t> hint;
+    std::atomic<size_t> free_slots;
+  };
   size_t element_size_;
   size_t chunk_size_;
-  std::atomic<bool>* in_use_;
+  std::shared_ptr<Slot_Bitmap> bitmap_;
   ibv_mr* mr_ori_;
-  //  int type_;
+};
+// Per-thread cache of local slots freed by this thread, keyed by pool name.
+// Allocate_Local_RDMA_Slot takes from it before going to the bitmaps, and
+// anything left over goes back to the bitmaps when the thread exits.
+struct Local_Slot_Cache {
+  struct Slot {
+    In_Use_Array* region;
+    int index;
+  };
+  std::unordered_map<std::string, std::vector<Slot>> pools;
+  ~Local_Slot_Cache() {
+    for (auto& pool : pools) {
+      for (auto& slot : pool.second) {
+        slot.region->unpark_memory_slot(slot.index);
+        slot.region->deallocate_memory_slot(slot.index);
+      }
+    }
+  }
 };
 /* structure of system resources */
 struct resources {
@@ -280,6 +377,36 @@ struct IBV_Deleter {
 //};
 // QP_Deleter qpdeleter;
 // CQ_Deleter cqdeleter;
+// A queue pair to post verbs on. The *_Local channels are per-thread queue
+// pairs that are connected on first use; a Named_Channel carries the queue
+// pair and completion queues of a qp_map entry, looked up once by
+// RDMA_Manager::Resolve_Channel(). Posting on a channel needs no string
+// compare, map lookup or lock.
+enum Channel_Type : uint8_t {
+  Read_Local,
+  Write_Local_Flush,
+  Write_Local_Compact,
+  Named_Channel
+};
+struct RDMA_Channel {
+  Channel_Type type;
+  ibv_qp* qp;
+  ibv_cq* send_cq;
+  ibv_cq* recv_cq;  // nullptr unless the queue pair has a separate recv CQ
+};
+static const RDMA_Channel kReadLocal = {Read_Local, nullptr, nullptr, nullptr};
+static const RDMA_Channel kWriteLocalFlush = {Write_Local_Flush, nullptr,
+                                              nullptr, nullptr};
+static const RDMA_Channel kWriteLocalCompact = {Write_Local_Compact, nullptr,
+                                                nullptr, nullptr};
+// Per-thread bookkeeping for the asynchronous reads posted on the
+// thread-local "read_local" queue pair. Work request ids are handed out from
+// next_wr_id; completions reaped while waiting for another request are parked
+// in "completed" (id -> 0 on success, 1 on failure) until someone asks.
+struct Async_Read_State {
+  uint64_t next_wr_id = 1;
+  std::unordered_map<uint64_t, int> completed;
+};
 class Memory_Node_Keeper;
 class RDMA_Manager {
 
@@ -326,16 +453,55 @@ class RDMA_Manager {
   bool Remote_Query_Pair_Connection(
       std::string& qp_id);  // Only called by client.
 
+  // Map a queue pair id ("main", "read_local", ...) to a channel. Resolve
+  // once and keep the result; the string overloads below resolve per call.
+  RDMA_Channel Resolve_Channel(const std::string& q_id);
+  int RDMA_Read(ibv_mr* remote_mr, ibv_mr* local_mr, size_t msg_size,
+                const RDMA_Channel& channel, size_t send_flag, int poll_num);
   int RDMA_Read(ibv_mr* remote_mr, ibv_mr* local_mr, size_t msg_size,
-                std::string q_id, size_t send_flag, int poll_num);
+                const std::string& q_id, size_t send_flag, int poll_num);
+  // Asynchronous one-sided reads on this thread's "read_local" queue pair.
+  // RDMA_Read_Async posts a signaled read and returns its work request id,
+  // RDMA_Read_Done checks for its completion without blocking and
+  // Wait_RDMA_Read blocks until it completes (0 on success). Completions are
+  // matched by id, so several reads may be outstanding and retired in any
+  // order. An id is only meaningful on the thread that posted it.
+  uint64_t RDMA_Read_Async(ibv_mr* remote_mr, ibv_mr* local_mr,
+                           size_t msg_size);
+  bool RDMA_Read_Done(uint64_t wr_id);
+  int Wait_RDMA_Read(uint64_t wr_id);
+  // Post "num" RDMA reads as chained work requests and wait for all of them.
+  // Only the last request of every chunk is signaled; on a reliable connection
+  // its completion implies all the earlier reads of the chunk have landed.
+  int RDMA_Read_Batch(ibv_mr* remote_mrs, ibv_mr* local_mrs,
+                      const size_t* msg_sizes, size_t num,
+                      const RDMA_Channel& channel);
+  int RDMA_Read_Batch(ibv_mr* remote_mrs, ibv_mr* local_mrs,
+                      const size_t* msg_sizes, size_t num,
+                      const std::string& q_id);
+  int RDMA_Write(ibv_mr* remote_mr, ibv_mr* local_mr, size_t msg_size,
+                 const RDMA_Channel& channel, size_t send_flag, int poll_num);
+  // Post "num" RDMA writes as chained work requests, so the whole batch rings
+  // the doorbell once per chunk of up to 64 requests instead of once per
+  // write. With send_flag == IBV_SEND_SIGNALED only the last request of every
+  // chunk is signaled, i.e. there are (num + 63) / 64 completions of which
+  // poll_num are waited for before returning.
+  int RDMA_Write_Batch(ibv_mr* remote_mrs, ibv_mr* local_mrs,
+                       const size_t* msg_sizes, size_t num,
+                       const RDMA_Channel& channel, size_t send_flag,
+                       int poll_num);
   int RDMA_Write(ibv_mr* remote_mr, ibv_mr* local_mr, size_t msg_size,
-                 std::string q_id, size_t send_flag, int poll_num);
+                 const std::string& q_id, size_t send_flag, int poll_num);
   int RDMA_Write(void* addr, uint32_t rkey, ibv_mr* local_mr, size_t msg_size,
-                 std::string q_id, size_t send_flag, int poll_num);
+                 const RDMA_Channel& channel, size_t send_flag, int poll_num);
+  int RDMA_Write(void* addr, uint32_t rkey, ibv_mr* local_mr, size_t msg_size,
+                 const std::string& q_id, size_t send_flag, int poll_num);
   // the coder need to figure out whether the queue pair has two seperated queue,
   // if not, only send_cq==true is a valid option.
   // For a thread-local queue pair, the send_cq does not matter.
-  int poll_completion(ibv_wc* wc_p, int num_entries, std::string q_id,
+  int poll_completion(ibv_wc* wc_p, int num_entries,
+                      const RDMA_Channel& channel, bool send_cq);
+  int poll_completion(ibv_wc* wc_p, int num_entries, const std::string& q_id,
                       bool send_cq);
   bool Deallocate_Local_RDMA_Slot(ibv_mr* mr, ibv_mr* map_pointer,
                                   std::string buffer_type);
@@ -355,7 +521,10 @@ class RDMA_Manager {
   void mr_serialization(char*& temp, size_t& size, ibv_mr* mr);
   void mr_deserialization(char*& temp, size_t& size, ibv_mr*& mr);
   int try_poll_this_thread_completions(ibv_wc* wc_p, int num_entries,
-                                       std::string q_id, bool send_cq);
+                                       const RDMA_Channel& channel,
+                                       bool send_cq);
+  int try_poll_this_thread_completions(ibv_wc* wc_p, int num_entries,
+                                       const std::string& q_id, bool send_cq);
   void fs_serialization(
       char*& buff, size_t& size, std::string& db_name,
       std::unordered_map<std::string, SST_Metadata*>& file_to_sst_meta,
@@ -399,6 +568,8 @@ class RDMA_Manager {
   ThreadLocalPtr* qp_local_read;
   ThreadLocalPtr* cq_local_read;
   ThreadLocalPtr* local_read_qp_info;
+  ThreadLocalPtr* local_read_async_state;
+  ThreadLocalPtr* local_slot_cache;
   //  thread_local static std::unique_ptr<ibv_qp, QP_Deleter> qp_local_write_flush;
   //  thread_local static std::unique_ptr<ibv_cq, CQ_Deleter> cq_local_write_flush;
   std::unordered_map<std::string, std::map<void*, In_Use_Array>>
@@ -408,10 +579,6 @@ class RDMA_Manager {
   uint8_t node_id;
   std::unordered_map<std::string, ibv_mr*> comm_thread_recv_mrs;
   std::unordered_map<std::string, int> comm_thread_buffer;
-#ifdef PROCESSANALYSIS
-  static std::atomic<uint64_t> RDMAReadTimeElapseSum;
-  static std::atomic<uint64_t> ReadCount;
-#endif
   //  std::unordered_map<std::string, ibv_mr*> fs_image;
   //  std::unordered_map<std::string, ibv_mr*> log_image;
   //  std::unique_ptr<ibv_mr, IBV_Deleter> log_image_mr;
@@ -420,7 +587,11 @@ class RDMA_Manager {
   // use thread local qp and cq instead of map, this could be lock free.
   //  static __thread std::string thread_id;
   template <typename T>
-  int post_send(ibv_mr* mr, std::string q_id = "main"){
+  int post_send(ibv_mr* mr, const std::string& q_id = "main") {
+    return post_send<T>(mr, Resolve_Channel(q_id));
+  }
+  template <typename T>
+  int post_send(ibv_mr* mr, const RDMA_Channel& channel){
     struct ibv_send_wr sr;
     struct ibv_sge sge;
     struct ibv_send_wr* bad_wr = NULL;
@@ -459,33 +630,7 @@ class RDMA_Manager {
 //      rc = ibv_post_send(res->qp_map["main"], &sr, &bad_wr);
 //    else
 //      rc = ibv_post_send(res->qp_map[qp_id], &sr, &bad_wr);
-    if (q_id == "read_local"){
-      assert(false);// Never comes to here
-      ibv_qp* qp = static_cast<ibv_qp*>(qp_local_read->Get());
-      if (qp == NULL) {
-        Remote_Query_Pair_Connection(q_id);
-        qp = static_cast<ibv_qp*>(qp_local_read->Get());
-      }
-      rc = ibv_post_send(qp, &sr, &bad_wr);
-    }else if (q_id == "write_local_flush"){
-      ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-      if (qp == NULL) {
-        Remote_Query_Pair_Connection(q_id);
-        qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-      }
-      rc = ibv_post_send(qp, &sr, &bad_wr);
-    }else if (q_id == "write_local_compact"){
-      ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_compact->Get());
-      if (qp == NULL) {
-        Remote_Query_Pair_Connection(q_id);
-        qp = static_cast<ibv_qp*>(qp_local_write_compact->Get());
-      }
-      rc = ibv_post_send(qp, &sr, &bad_wr);
-    } else {
-      std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-      rc = ibv_post_send(res->qp_map.at(q_id), &sr, &bad_wr);
-      l.unlock();
-    }
+    rc = ibv_post_send(Channel_QP(channel), &sr, &bad_wr);
 //    if (rc)
 //      fprintf(stderr, "failed to post SR\n");
 //    else {
@@ -506,10 +651,28 @@ class RDMA_Manager {
   int sock_sync_data(int sock, int xfer_size, char* local_data,
                      char* remote_data);
 
-  int post_send(ibv_mr* mr, std::string q_id = "main", size_t size = 0);
+  int post_send(ibv_mr* mr, const RDMA_Channel& channel, size_t size);
+  int post_send(ibv_mr* mr, const std::string& q_id = "main", size_t size = 0);
   //  int post_receives(int len);
 
-  int post_receive(ibv_mr* mr, std::string q_id = "main", size_t size = 0);
+  int post_receive(ibv_mr* mr, const RDMA_Channel& channel, size_t size);
+  int post_receive(ibv_mr* mr, const std::string& q_id = "main",
+                   size_t size = 0);
+
+  ibv_qp* Channel_QP(const RDMA_Channel& channel);
+  ibv_cq* Channel_CQ(const RDMA_Channel& channel, bool send_cq);
+  Async_Read_State* Get_Async_Read_State();
+  // Reap whatever the thread-local read CQ holds into "state"; if "block",
+  // spin until at least one completion arrives.
+  void Reap_Read_Completions(Async_Read_State* state, bool block);
+  Local_Slot_Cache* Get_Local_Slot_Cache();
+  // Locate the region of "bitmap" that "p" falls into and the slot index of
+  // "p" in it. Returns nullptr if "p" is outside every region.
+  static In_Use_Array* Find_Slot(std::map<void*, In_Use_Array>& bitmap,
+                                 void* p, int* index);
+  // Give a local slot back, through this thread's slot cache when it has room.
+  bool Release_Local_Slot(const std::string& pool_name, In_Use_Array* region,
+                          int index);
 
   int resources_create();
   int modify_qp_to_reset(ibv_qp* qp);
@@ -526,10 +689,19 @@ class RDMA_Manager {
   void print_config(void);
   void usage(const char* argv0);
 
-  int post_receive(ibv_mr** mr_list, size_t sge_size, std::string q_id);
-  int post_send(ibv_mr** mr_list, size_t sge_size, std::string q_id);
+  int post_receive(ibv_mr** mr_list, size_t sge_size,
+                   const RDMA_Channel& channel);
+  int post_receive(ibv_mr** mr_list, size_t sge_size,
+                   const std::string& q_id);
+  int post_send(ibv_mr** mr_list, size_t sge_size,
+                const RDMA_Channel& channel);
+  int post_send(ibv_mr** mr_list, size_t sge_size, const std::string& q_id);
+  template <typename T>
+  int post_receive(ibv_mr* mr, const std::string& q_id = "main") {
+    return post_receive<T>(mr, Resolve_Channel(q_id));
+  }
   template <typename T>
-  int post_receive(ibv_mr* mr, std::string q_id = "main"){
+  int post_receive(ibv_mr* mr, const RDMA_Channel& channel){
     struct ibv_recv_wr rr;
     struct ibv_sge sge;
     struct ibv_recv_wr* bad_wr;
@@ -562,33 +734,7 @@ class RDMA_Manager {
 //      rc = ibv_post_recv(res->qp_map["main"], &rr, &bad_wr);
 //    else
 //      rc = ibv_post_recv(res->qp_map[qp_id], &rr, &bad_wr);
-    if (q_id == "read_local"){
-      assert(false);// Never comes to here
-      ibv_qp* qp = static_cast<ibv_qp*>(qp_local_read->Get());
-      if (qp == NULL) {
-        Remote_Query_Pair_Connection(q_id);
-        qp = static_cast<ibv_qp*>(qp_local_read->Get());
-      }
-      rc = ibv_post_recv(qp, &rr, &bad_wr);
-    }else if (q_id == "write_local_flush"){
-      ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-      if (qp == NULL) {
-        Remote_Query_Pair_Connection(q_id);
-        qp = static_cast<ibv_qp*>(qp_local_write_flush->Get());
-      }
-      rc = ibv_post_recv(qp, &rr, &bad_wr);
-    }else if (q_id == "write_local_compact"){
-      ibv_qp* qp = static_cast<ibv_qp*>(qp_local_write_compact->Get());
-      if (qp == NULL) {
-        Remote_Query_Pair_Connection(q_id);
-        qp = static_cast<ibv_qp*>(qp_local_write_compact->Get());
-      }
-      rc = ibv_post_recv(qp, &rr, &bad_wr);
-    } else {
-      std::shared_lock<std::shared_mutex> l(qp_cq_map_mutex);
-      rc = ibv_post_recv(res->qp_map.at(q_id), &rr, &bad_wr);
-      l.unlock();
-    }
+    rc = ibv_post_recv(Channel_QP(channel), &rr, &bad_wr);
 //    if (rc)
 //#ifndef NDEBUG
 //      fprintf(stderr, "failed to post RR\n");
@@ -0,0 +1,329 @@
+// Copyright (c) 2011 The TimberSaw Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/rdma_loopback.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace TimberSaw {
+
+namespace {
+
+struct Loopback_CQ {
+  ibv_cq cq;
+  std::mutex mu;
+  std::deque<ibv_wc> entries;
+};
+
+struct Posted_Recv {
+  uint64_t wr_id;
+  std::vector<ibv_sge> sges;
+};
+
+// Queue pairs and completion queues are never freed, only retired, because
+// the other side may still hold a pointer to them; there are only a handful
+// per thread.
+struct Loopback_QP {
+  ibv_qp qp;
+  Loopback_CQ* send_cq;
+  Loopback_CQ* recv_cq;
+  bool sq_sig_all;
+  std::atomic<Loopback_QP*> peer{nullptr};
+  std::atomic<bool> dead{false};
+  std::mutex mu;  // protects recvs and unmatched
+  std::deque<Posted_Recv> recvs;
+  // Sends that arrived before a receive was posted for them.
+  std::deque<std::string> unmatched;
+};
+
+std::mutex registry_mutex;
+std::unordered_map<uint32_t, Loopback_QP*> registry;
+std::atomic<uint32_t> next_qp_num{1};
+std::atomic<uint32_t> next_key{1};
+
+Loopback_QP* From(ibv_qp* qp) { return static_cast<Loopback_QP*>(qp->qp_context); }
+Loopback_CQ* From(ibv_cq* cq) { return static_cast<Loopback_CQ*>(cq->cq_context); }
+
+void Push_Completion(Loopback_CQ* cq, const ibv_wc& wc) {
+  std::lock_guard<std::mutex> l(cq->mu);
+  cq->entries.push_back(wc);
+}
+
+size_t Total_Length(const ibv_sge* sges, int num_sge) {
+  size_t total = 0;
+  for (int i = 0; i < num_sge; i++) total += sges[i].length;
+  return total;
+}
+
+// Copy the gather list of "wr" to "dst". The final byte is stored after a
+// release fence so that a reader spinning on it sees the rest of the data.
+void Gather_To(const ibv_send_wr* wr, char* dst) {
+  int last = wr->num_sge - 1;
+  while (last >= 0 && wr->sg_list[last].length == 0) last--;
+  for (int i = 0; i <= last; i++) {
+    const char* src = reinterpret_cast<const char*>(wr->sg_list[i].addr);
+    size_t len = wr->sg_list[i].length;
+    if (i < last) {
+      memcpy(dst, src, len);
+    } else {
+      memcpy(dst, src, len - 1);
+      std::atomic_thread_fence(std::memory_order_release);
+      reinterpret_cast<volatile char*>(dst)[len - 1] = src[len - 1];
+    }
+    dst += len;
+  }
+}
+
+// Copy "len" bytes from "src" into a scatter list. Returns false if the
+// list is too short.
+bool Scatter_From(const char* src, size_t len, const ibv_sge* sges,
+                  int num_sge) {
+  if (Total_Length(sges, num_sge) < len) return false;
+  for (int i = 0; i < num_sge && len > 0; i++) {
+    size_t n = std::min<size_t>(sges[i].length, len);
+    memcpy(reinterpret_cast<char*>(sges[i].addr), src, n);
+    src += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Complete a posted receive of "qp" with "payload". REQUIRES: qp->mu held.
+void Complete_Recv(Loopback_QP* qp, const Posted_Recv& recv,
+                   const std::string& payload) {
+  ibv_wc wc;
+  memset(&wc, 0, sizeof(wc));
+  wc.wr_id = recv.wr_id;
+  wc.opcode = IBV_WC_RECV;
+  wc.qp_num = qp->qp.qp_num;
+  wc.byte_len = payload.size();
+  wc.status = Scatter_From(payload.data(), payload.size(), recv.sges.data(),
+                           recv.sges.size())
+                  ? IBV_WC_SUCCESS
+                  : IBV_WC_LOC_LEN_ERR;
+  Push_Completion(qp->recv_cq, wc);
+}
+
+void Deliver_Send(Loopback_QP* peer, std::string payload) {
+  std::lock_guard<std::mutex> l(peer->mu);
+  if (peer->recvs.empty()) {
+    peer->unmatched.push_back(std::move(payload));
+    return;
+  }
+  Posted_Recv recv = std::move(peer->recvs.front());
+  peer->recvs.pop_front();
+  Complete_Recv(peer, recv, payload);
+}
+
+int Post_Send(ibv_qp* ibqp, ibv_send_wr* wr, ibv_send_wr** bad_wr) {
+  Loopback_QP* qp = From(ibqp);
+  Loopback_QP* peer = qp->peer.load(std::memory_order_acquire);
+  for (; wr != nullptr; wr = wr->next) {
+    ibv_wc wc;
+    memset(&wc, 0, sizeof(wc));
+    wc.wr_id = wr->wr_id;
+    wc.qp_num = ibqp->qp_num;
+    wc.status = IBV_WC_SUCCESS;
+    size_t len = Total_Length(wr->sg_list, wr->num_sge);
+    if (peer == nullptr || peer->dead.load(std::memory_order_acquire)) {
+      wc.status = IBV_WC_RETRY_EXC_ERR;
+    } else {
+      switch (wr->opcode) {
+        case IBV_WR_RDMA_WRITE:
+          wc.opcode = IBV_WC_RDMA_WRITE;
+          Gather_To(wr, reinterpret_cast<char*>(wr->wr.rdma.remote_addr));
+          break;
+        case IBV_WR_RDMA_READ:
+          wc.opcode = IBV_WC_RDMA_READ;
+          wc.byte_len = len;
+          Scatter_From(reinterpret_cast<const char*>(wr->wr.rdma.remote_addr),
+                       len, wr->sg_list, wr->num_sge);
+          break;
+        case IBV_WR_SEND: {
+          wc.opcode = IBV_WC_SEND;
+          std::string payload(len, '\0');
+          Gather_To(wr, &payload[0]);
+          Deliver_Send(peer, std::move(payload));
+          break;
+        }
+        default:
+          *bad_wr = wr;
+          return EINVAL;
+      }
+    }
+    if (wc.status != IBV_WC_SUCCESS || qp->sq_sig_all ||
+        (wr->send_flags & IBV_SEND_SIGNALED)) {
+      Push_Completion(qp->send_cq, wc);
+    }
+  }
+  return 0;
+}
+
+int Post_Recv(ibv_qp* ibqp, ibv_recv_wr* wr, ibv_recv_wr** bad_wr) {
+  Loopback_QP* qp = From(ibqp);
+  std::lock_guard<std::mutex> l(qp->mu);
+  for (; wr != nullptr; wr = wr->next) {
+    Posted_Recv recv;
+    recv.wr_id = wr->wr_id;
+    recv.sges.assign(wr->sg_list, wr->sg_list + wr->num_sge);
+    if (!qp->unmatched.empty()) {
+      Complete_Recv(qp, recv, qp->unmatched.front());
+      qp->unmatched.pop_front();
+    } else {
+      qp->recvs.push_back(std::move(recv));
+    }
+  }
+  return 0;
+}
+
+int Poll_CQ(ibv_cq* ibcq, int num_entries, ibv_wc* wc) {
+  Loopback_CQ* cq = From(ibcq);
+  std::lock_guard<std::mutex> l(cq->mu);
+  int n = 0;
+  while (n < num_entries && !cq->entries.empty()) {
+    wc[n++] = cq->entries.front();
+    cq->entries.pop_front();
+  }
+  return n;
+}
+
+ibv_context* Loopback_Context() {
+  static ibv_context* context = [] {
+    auto* c = new ibv_context();
+    memset(c, 0, sizeof(*c));
+    c->ops.post_send = &Post_Send;
+    c->ops.post_recv = &Post_Recv;
+    c->ops.poll_cq = &Poll_CQ;
+    pthread_mutex_init(&c->mutex, nullptr);
+    return c;
+  }();
+  return context;
+}
+
+}  // namespace
+
+bool Loopback_Device::Enabled() {
+  static const bool enabled = std::getenv("TIMBERSAW_RDMA_LOOPBACK") != nullptr;
+  return enabled;
+}
+
+bool Loopback_Device::Is_Loopback(ibv_context* context) {
+  return context != nullptr && context == Loopback_Context();
+}
+
+ibv_context* Loopback_Device::Open() { return Loopback_Context(); }
+
+void Loopback_Device::Query_Port(ibv_port_attr* port_attr) {
+  memset(port_attr, 0, sizeof(*port_attr));
+  port_attr->state = IBV_PORT_ACTIVE;
+  port_attr->max_mtu = IBV_MTU_4096;
+  port_attr->active_mtu = IBV_MTU_4096;
+}
+
+void Loopback_Device::Query_Device(ibv_device_attr* device_attr) {
+  memset(device_attr, 0, sizeof(*device_attr));
+  device_attr->max_qp = 1 << 20;
+  device_attr->max_cq = 1 << 20;
+  device_attr->max_mr = 1 << 20;
+  device_attr->max_mr_size = ~uint64_t{0};
+  device_attr->max_qp_wr = 1 << 20;
+  device_attr->max_sge = 1 << 10;
+}
+
+ibv_pd* Loopback_Device::Alloc_PD(ibv_context* context) {
+  auto* pd = new ibv_pd();
+  pd->context = context;
+  return pd;
+}
+
+void Loopback_Device::Dealloc_PD(ibv_pd* pd) { delete pd; }
+
+ibv_cq* Loopback_Device::Create_CQ(ibv_context* context, int cqe) {
+  auto* cq = new Loopback_CQ();
+  memset(&cq->cq, 0, sizeof(cq->cq));
+  cq->cq.context = context;
+  cq->cq.cq_context = cq;
+  cq->cq.cqe = cqe;
+  return &cq->cq;
+}
+
+void Loopback_Device::Destroy_CQ(ibv_cq* cq) {
+  // Retired rather than freed, see Loopback_QP.
+  (void)cq;
+}
+
+ibv_qp* Loopback_Device::Create_QP(ibv_pd* pd, ibv_qp_init_attr* qp_init_attr) {
+  auto* qp = new Loopback_QP();
+  memset(&qp->qp, 0, sizeof(qp->qp));
+  qp->qp.context = pd->context;
+  qp->qp.qp_context = qp;
+  qp->qp.pd = pd;
+  qp->qp.send_cq = qp_init_attr->send_cq;
+  qp->qp.recv_cq = qp_init_attr->recv_cq;
+  qp->qp.qp_type = qp_init_attr->qp_type;
+  qp->qp.state = IBV_QPS_RESET;
+  qp->qp.qp_num = next_qp_num.fetch_add(1);
+  qp->send_cq = From(qp_init_attr->send_cq);
+  qp->recv_cq = From(qp_init_attr->recv_cq);
+  qp->sq_sig_all = qp_init_attr->sq_sig_all != 0;
+  std::lock_guard<std::mutex> l(registry_mutex);
+  registry[qp->qp.qp_num] = qp;
+  return &qp->qp;
+}
+
+void Loopback_Device::Destroy_QP(ibv_qp* ibqp) {
+  Loopback_QP* qp = From(ibqp);
+  qp->dead.store(true, std::memory_order_release);
+  std::lock_guard<std::mutex> l(registry_mutex);
+  registry.erase(ibqp->qp_num);
+}
+
+int Loopback_Device::Reset_QP(ibv_qp* ibqp) {
+  Loopback_QP* qp = From(ibqp);
+  qp->peer.store(nullptr, std::memory_order_release);
+  std::lock_guard<std::mutex> l(qp->mu);
+  qp->recvs.clear();
+  qp->unmatched.clear();
+  ibqp->state = IBV_QPS_RESET;
+  return 0;
+}
+
+int Loopback_Device::Connect_QP(ibv_qp* ibqp, uint32_t remote_qpn) {
+  Loopback_QP* peer;
+  {
+    std::lock_guard<std::mutex> l(registry_mutex);
+    auto it = registry.find(remote_qpn);
+    if (it == registry.end()) return ENOENT;
+    peer = it->second;
+  }
+  From(ibqp)->peer.store(peer, std::memory_order_release);
+  ibqp->state = IBV_QPS_RTS;
+  return 0;
+}
+
+ibv_mr* Loopback_Device::Reg_MR(ibv_pd* pd, void* addr, size_t length,
+                                int access) {
+  (void)access;
+  auto* mr = new ibv_mr();
+  mr->context = pd->context;
+  mr->pd = pd;
+  mr->addr = addr;
+  mr->length = length;
+  mr->lkey = next_key.fetch_add(1);
+  mr->rkey = mr->lkey;
+  return mr;
+}
+
+void Loopback_Device::Dereg_MR(ibv_mr* mr) { delete mr; }
+
+}  // namespace TimberSaw
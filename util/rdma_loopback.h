@@ -0,0 +1,60 @@
+// Copyright (c) 2011 The TimberSaw Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A software stand-in for an RDMA NIC, so that the compute node and the
+// memory node can run as two threads of one process without any ibverbs
+// device. Every object it hands out is a real ibv_* struct whose context
+// points at a fake ibv_context, so the inline data-path verbs
+// (ibv_post_send, ibv_post_recv, ibv_poll_cq) work on it unchanged; only the
+// control-path calls (device open, QP/CQ/MR creation and destruction, QP
+// state changes) have to be routed here explicitly, see Is_Loopback().
+//
+// One-sided reads and writes are memcpy()s between the two sides, which
+// share an address space, and sends are matched against the receives posted
+// on the connected queue pair. The last byte of every write lands after the
+// rest of it, as with a NIC, since pollers spin on a trailing flag.
+//
+// Enabled by setting TIMBERSAW_RDMA_LOOPBACK in the environment of both
+// roles. Remote keys are not checked.
+
+#ifndef STORAGE_TimberSaw_UTIL_RDMA_LOOPBACK_H_
+#define STORAGE_TimberSaw_UTIL_RDMA_LOOPBACK_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <infiniband/verbs.h>
+
+namespace TimberSaw {
+
+class Loopback_Device {
+ public:
+  // True if TIMBERSAW_RDMA_LOOPBACK is set.
+  static bool Enabled();
+  // True if "context" is the loopback device, i.e. objects created from it
+  // must be managed through this class rather than libibverbs.
+  static bool Is_Loopback(ibv_context* context);
+
+  static ibv_context* Open();
+  static void Query_Port(ibv_port_attr* port_attr);
+  static void Query_Device(ibv_device_attr* device_attr);
+  static ibv_pd* Alloc_PD(ibv_context* context);
+  static void Dealloc_PD(ibv_pd* pd);
+
+  static ibv_cq* Create_CQ(ibv_context* context, int cqe);
+  static void Destroy_CQ(ibv_cq* cq);
+  static ibv_qp* Create_QP(ibv_pd* pd, ibv_qp_init_attr* qp_init_attr);
+  static void Destroy_QP(ibv_qp* qp);
+  // Stand-ins for the RESET and RTR transitions; INIT and RTS need nothing.
+  // Connect_QP pairs "qp" with the queue pair numbered "remote_qpn".
+  static int Reset_QP(ibv_qp* qp);
+  static int Connect_QP(ibv_qp* qp, uint32_t remote_qpn);
+
+  static ibv_mr* Reg_MR(ibv_pd* pd, void* addr, size_t length, int access);
+  static void Dereg_MR(ibv_mr* mr);
+};
+
+}  // namespace TimberSaw
+
+#endif  // STORAGE_TimberSaw_UTIL_RDMA_LOOPBACK_H_
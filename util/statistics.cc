@@ -0,0 +1,158 @@
+// Copyright (c) 2011 The TimberSaw Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "TimberSaw/statistics.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <mutex>
+
+#include "port/port.h"
+#include "util/core_local.h"
+#include "util/histogram.h"
+
+namespace TimberSaw {
+
+Statistics::~Statistics() = default;
+
+namespace {
+
+const char* const kTickerNames[TICKER_ENUM_MAX] = {
+    "TimberSaw.block.cache.hit",
+    "TimberSaw.block.cache.miss",
+    "TimberSaw.bloom.filter.useful",
+    "TimberSaw.bloom.filter.checked",
+    "TimberSaw.memtable.hit",
+    "TimberSaw.memtable.miss",
+    "TimberSaw.row.cache.hit",
+    "TimberSaw.row.cache.miss",
+    "TimberSaw.number.keys.written",
+    "TimberSaw.number.keys.read",
+    "TimberSaw.number.keys.found",
+    "TimberSaw.bytes.written",
+    "TimberSaw.bytes.read",
+    "TimberSaw.rdma.block.reads",
+    "TimberSaw.rdma.block.read.bytes",
+};
+
+const char* const kHistogramNames[HISTOGRAM_ENUM_MAX] = {
+    "TimberSaw.db.get.nanos",
+    "TimberSaw.db.write.nanos",
+    "TimberSaw.db.multiget.nanos",
+    "TimberSaw.table.get.nanos",
+    "TimberSaw.index.seek.nanos",
+    "TimberSaw.data.block.seek.nanos",
+    "TimberSaw.rdma.block.read.nanos",
+};
+
+class StatisticsImpl : public Statistics {
+ public:
+  StatisticsImpl() = default;
+  ~StatisticsImpl() override = default;
+
+  void RecordTick(uint32_t ticker_type, uint64_t count) override {
+    assert(ticker_type < TICKER_ENUM_MAX);
+    per_core_.Access()->tickers[ticker_type].fetch_add(
+        count, std::memory_order_relaxed);
+  }
+
+  void MeasureTime(uint32_t histogram_type, uint64_t nanos) override {
+    assert(histogram_type < HISTOGRAM_ENUM_MAX);
+    CoreData* data = per_core_.Access();
+    std::lock_guard<std::mutex> lck(data->histogram_mutex);
+    data->histograms[histogram_type].Add(static_cast<double>(nanos));
+  }
+
+  uint64_t GetTickerCount(uint32_t ticker_type) const override {
+    assert(ticker_type < TICKER_ENUM_MAX);
+    uint64_t sum = 0;
+    for (size_t core = 0; core < per_core_.Size(); core++) {
+      sum += per_core_.AccessAtCore(core)->tickers[ticker_type].load(
+          std::memory_order_relaxed);
+    }
+    return sum;
+  }
+
+  std::string GetHistogramString(uint32_t histogram_type) const override {
+    Histogram merged = MergedHistogram(histogram_type);
+    if (merged.Count() == 0) {
+      return "count 0";
+    }
+    char buf[200];
+    std::snprintf(buf, sizeof(buf),
+                  "count %.0f avg %.1f p50 %.1f p99 %.1f p99.9 %.1f",
+                  merged.Count(), merged.Average(), merged.Median(),
+                  merged.Percentile(99.0), merged.Percentile(99.9));
+    return buf;
+  }
+
+  void Reset() override {
+    for (size_t core = 0; core < per_core_.Size(); core++) {
+      CoreData* data = per_core_.AccessAtCore(core);
+      for (auto& ticker : data->tickers) {
+        ticker.store(0, std::memory_order_relaxed);
+      }
+      std::lock_guard<std::mutex> lck(data->histogram_mutex);
+      for (auto& histogram : data->histograms) {
+        histogram.Clear();
+      }
+    }
+  }
+
+  std::string ToString() const override {
+    std::string r;
+    char buf[200];
+    for (uint32_t t = 0; t < TICKER_ENUM_MAX; t++) {
+      std::snprintf(buf, sizeof(buf), "%s COUNT : %llu\n", kTickerNames[t],
+                    static_cast<unsigned long long>(GetTickerCount(t)));
+      r.append(buf);
+    }
+    for (uint32_t h = 0; h < HISTOGRAM_ENUM_MAX; h++) {
+      r.append(kHistogramNames[h]);
+      r.append(" ");
+      r.append(GetHistogramString(h));
+      r.append("\n");
+    }
+    return r;
+  }
+
+ private:
+  // Padded to a cache line so that cores do not share counters.
+  struct alignas(CACHE_LINE_SIZE) CoreData {
+    CoreData() {
+      for (auto& ticker : tickers) {
+        ticker.store(0, std::memory_order_relaxed);
+      }
+      for (auto& histogram : histograms) {
+        histogram.Clear();
+      }
+    }
+
+    std::atomic<uint64_t> tickers[TICKER_ENUM_MAX];
+    // Only contended when a thread migrates mid-update or a reader merges.
+    std::mutex histogram_mutex;
+    Histogram histograms[HISTOGRAM_ENUM_MAX];
+  };
+
+  Histogram MergedHistogram(uint32_t histogram_type) const {
+    assert(histogram_type < HISTOGRAM_ENUM_MAX);
+    Histogram merged;
+    merged.Clear();
+    for (size_t core = 0; core < per_core_.Size(); core++) {
+      CoreData* data = per_core_.AccessAtCore(core);
+      std::lock_guard<std::mutex> lck(data->histogram_mutex);
+      merged.Merge(data->histograms[histogram_type]);
+    }
+    return merged;
+  }
+
+  CoreLocalArray<CoreData> per_core_;
+};
+
+}  // namespace
+
+Statistics* NewStatistics() { return new StatisticsImpl(); }
+
+}  // namespace TimberSaw
@@ -0,0 +1,60 @@
+// Copyright (c) 2011 The TimberSaw Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// Helpers for recording into an optional Statistics object. Every call site
+// passes options.statistics straight through; a null pointer costs a branch.
+
+#ifndef STORAGE_TimberSaw_UTIL_STATISTICS_H_
+#define STORAGE_TimberSaw_UTIL_STATISTICS_H_
+
+#include <chrono>
+#include <cstdint>
+
+#include "TimberSaw/statistics.h"
+
+namespace TimberSaw {
+
+inline void RecordTick(Statistics* statistics, uint32_t ticker_type,
+                       uint64_t count = 1) {
+  if (statistics != nullptr) {
+    statistics->RecordTick(ticker_type, count);
+  }
+}
+
+// Records the time between its construction and destruction (or Stop()) in
+// a histogram. Does not read the clock if "statistics" is null.
+class StopWatch {
+ public:
+  StopWatch(Statistics* statistics, uint32_t histogram_type)
+      : statistics_(statistics), histogram_type_(histogram_type) {
+    if (statistics_ != nullptr) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  StopWatch(const StopWatch&) = delete;
+  StopWatch& operator=(const StopWatch&) = delete;
+
+  ~StopWatch() { Stop(); }
+
+  void Stop() {
+    if (statistics_ != nullptr) {
+      auto elapsed = std::chrono::steady_clock::now() - start_;
+      statistics_->MeasureTime(
+          histogram_type_,
+          std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+              .count());
+      statistics_ = nullptr;
+    }
+  }
+
+ private:
+  Statistics* statistics_;
+  const uint32_t histogram_type_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace TimberSaw
+
+#endif  // STORAGE_TimberSaw_UTIL_STATISTICS_H_